@@ -1,6 +1,14 @@
 #version 330 core
 
-out vec4 FragColor;
+// Lighting conditions shaded by one pass, each into its own color
+// attachment. They share the G-buffer fetch, the position reconstruction
+// and the shadow tests; only the light loop runs per condition.
+#ifndef CONDITIONS
+#define CONDITIONS 1
+#endif
+#define MAX_CONDITIONS 8
+
+layout(location = 0) out vec4 FragColor[CONDITIONS];
 
 in vec2 TexCoords;
 
@@ -14,6 +22,15 @@ uniform sampler2D gShadowDepth;
 uniform sampler2D gShadowMask1;
 uniform sampler2D gShadowDepth1;
 
+// Point lights in view space, two texels each: position and outer radius,
+// color and inner radius. Every condition has its own range of lights
+// whose first two may cast the shadows of gShadowDepth and gShadowDepth1.
+// gTileRanges holds the (offset, count) of every screen tile and condition
+// in gTileLights, the indices of the lights that can reach the tile.
+uniform samplerBuffer gLights;
+uniform usamplerBuffer gTileRanges;
+uniform usamplerBuffer gTileLights;
+
 float depth;
 vec3 vPosition;
 vec3 vTransformedNormal;
@@ -22,26 +39,61 @@ vec4 vPosLightSpace;
 vec4 vPosLightSpace1;
 float mask;
 
+// Render mode. A permutation is compiled with these defined as true or
+// false so that the branches it does not take are removed; without them
+// this is the uber-shader reading the mode from uniforms.
+#ifndef USE_LIGHTING
 uniform int uUseLighting;
+#define USE_LIGHTING (uUseLighting != 0)
+#endif
+#ifndef USE_SHADOW
+uniform int uUseShadow; 
+#define USE_SHADOW (uUseShadow != 0)
+#endif
+#ifndef SHOW_DEPTH
 uniform int uShowDepth;
+#define SHOW_DEPTH (uShowDepth != 0)
+#endif
+#ifndef SHOW_NORMALS
 uniform int uShowNormals;
+#define SHOW_NORMALS (uShowNormals != 0)
+#endif
+#ifndef SHOW_POSITION
 uniform int uShowPosition;
+#define SHOW_POSITION (uShowPosition != 0)
+#endif
 uniform int uPerspectiveProjection;
-uniform int uUseShadow; 
 
-uniform mat4 uMVMatrix;
-uniform mat4 uPMatrix;
-uniform mat4 uInvVMatrix;
-uniform mat4 uInvPMatrix;
-uniform mat3 uNMatrix;
-uniform mat4 lightSpaceMatrix;
-uniform mat4 lightSpaceMatrix1;
-
-uniform vec3 uAmbientColor;
-uniform vec3 uPointLightingLocation;
-uniform vec3 uPointLightingColor;
-uniform vec3 uPointLightingLocation1;
-uniform vec3 uPointLightingColor1;
+// camera and lights of the frame, uploaded with one buffer update; must
+// match struct FrameUniforms in deferred_renderer.h
+layout(std140) uniform FrameUniforms {
+	mat4 uMVMatrix;
+	mat4 uPMatrix;
+	mat4 uInvVMatrix;
+	mat4 uInvPMatrix;
+	mat3 uNMatrix;
+	mat4 lightSpaceMatrix;
+	mat4 lightSpaceMatrix1;
+
+	vec3 uAmbientColor;
+	ivec4 uLightGrid; // tile size, tiles per row, tiles per condition
+	ivec4 uConditions[MAX_CONDITIONS]; // first light, shadow casting bits
+};
+
+// normal of the G-buffer; packed G-buffers store unit normals octahedral-
+// encoded in the two snorm components of an RG16_SNORM texture
+vec3 SampleNormal(){
+#ifdef OCTAHEDRAL_NORMALS
+	vec2 e = texture(gNormal, TexCoords).rg;
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	float t = max(-n.z, 0.0);
+	n.x += n.x >= 0.0 ? -t : t;
+	n.y += n.y >= 0.0 ? -t : t;
+	return normalize(n);
+#else
+	return texture(gNormal, TexCoords).rgb;
+#endif
+}
 
 vec3 ViewPosFromDepth(float depth){
 	float z = depth * 2.0 - 1.0;
@@ -91,6 +143,18 @@ float ShadowCalculation(vec4 fragPosLightSpace, sampler2D gShadowMask, sampler2D
 	return shadow;
 }
 
+// diffuse and specular light of one point light, faded out over its radii
+vec3 PointLighting(int light, vec3 surface_normal, vec3 eye_direction){
+	vec4 location = texelFetch(gLights, 2 * light);
+	vec4 color = texelFetch(gLights, 2 * light + 1);
+	vec3 light_direction = normalize(location.xyz - vPosition.xyz);
+	vec3 diffuse = vDiffuseColor.xyz * color.rgb * max(dot(surface_normal, light_direction), 0.0);
+	vec3 specular = color.rgb * pow( max( dot( reflect( -light_direction, surface_normal ), eye_direction ), 0.0 ), 100.0 );
+	float light_distance = length( vPosition.xyz - location.xyz );
+	float attenuation = 1.0 - smoothstep( color.a, location.w, light_distance );
+	return attenuation * diffuse + attenuation * specular;
+}
+
 void main()
 {
 	// backgroundColor
@@ -100,72 +164,72 @@ void main()
 	// vec3 vPosition = (uMVMatrix * vec4( texture(gPosition, TexCoords).rgb, 1.0 )).xyz;
 	depth = texture(gDepth, TexCoords).r;
 	vPosition = ViewPosFromDepth(depth);
-	vTransformedNormal = texture(gNormal, TexCoords).rgb;
+	if (USE_LIGHTING || SHOW_NORMALS)
+		vTransformedNormal = SampleNormal();
 	vDiffuseColor = texture(gDiffuseColor, TexCoords).rgba;
 	mask = texture(gMask, TexCoords).r;
-	vPosLightSpace = lightSpaceMatrix * uInvVMatrix * vec4(vPosition, 1.0);
-	vPosLightSpace1 = lightSpaceMatrix1 * uInvVMatrix * vec4(vPosition, 1.0);
+	if ((USE_LIGHTING && USE_SHADOW) || SHOW_POSITION)
+		vPosLightSpace = lightSpaceMatrix * uInvVMatrix * vec4(vPosition, 1.0);
+	if (USE_LIGHTING && USE_SHADOW)
+		vPosLightSpace1 = lightSpaceMatrix1 * uInvVMatrix * vec4(vPosition, 1.0);
 
 	//FragColor = vec4(TexCoords * 2.0 - 1.0, depth * 2 - 1, 1.0);
 
 	// calculate lighting as usual 
 	vec3 ambient = vDiffuseColor.rgb * uAmbientColor;
-	vec3 color = ambient;
-
-	if (uUseLighting){
-		vec3 light_direction = normalize(uPointLightingLocation - vPosition.xyz);
-		vec3 light_direction1 = normalize(uPointLightingLocation1 - vPosition.xyz);
-		vec3 eye_direction = normalize(-vPosition.xyz);
-		vec3 surface_normal = normalize(vTransformedNormal);
-
-		vec3 diffuse = vDiffuseColor.xyz * uPointLightingColor * max(dot(surface_normal, light_direction), 0.0);
-		vec3 diffuse1 = vDiffuseColor.xyz * uPointLightingColor1 * max(dot(surface_normal, light_direction1), 0.0);
-		vec3 specular  = uPointLightingColor  * pow( max( dot( reflect( -light_direction,  surface_normal ), eye_direction ), 0.0 ), 100.0 );
-		vec3 specular1 = uPointLightingColor1 * pow( max( dot( reflect( -light_direction1, surface_normal ), eye_direction ), 0.0 ), 100.0 );
-		float light_outer_radius  = 20.0;
-		float light_inner_radius  = 0.0;
-		float light_outer_radius1 = 20.0;
-		float light_inner_radius1 = 0.0;
-		float light_distance  = length( vPosition.xyz - uPointLightingLocation  );
-		float light_distance1 = length( vPosition.xyz - uPointLightingLocation1 );
-		float attenuation     = 1.0 - smoothstep( light_inner_radius,  light_outer_radius,  light_distance  );
-		float attenuation1    = 1.0 - smoothstep( light_inner_radius1, light_outer_radius1, light_distance1 );
-		diffuse   = attenuation  * diffuse;
-		diffuse1  = attenuation1 * diffuse1;
-		specular  = attenuation  * specular;
-		specular1 = attenuation1 * specular1;
-		if (uUseShadow){
-			// calculate shadow 
-			float shadow = ShadowCalculation(vPosLightSpace, gShadowMask, gShadowDepth, light_direction); 
-			float shadow1 = ShadowCalculation(vPosLightSpace1, gShadowMask1, gShadowDepth1, light_direction1); 
-			color = ambient + (1.0 - shadow) * (diffuse + specular) + (1.0 - shadow1) * (diffuse1 + specular1);
-			//color = vec3(1 - shadow1);
-		} else {
-			color = ambient + diffuse + diffuse1 + specular + specular1;
-		}
-	}
-	//FragColor = mask * vec4(color, 1.0);
-	FragColor = mask * vec4(color, vDiffuseColor.a) + (1 - mask) * bgColor;
-
-	if ( uShowDepth ) {
-		// FragColor = mix( vec4( 1.0 ), vec4( vec3( 0.0 ), 1.0 ), smoothstep( 0.1, 1.0, fog_coord ) );
-		//FragColor = vDiffuseColor;
-		//float shadowDepth = texture(gShadowDepth1, TexCoords).r;
-		//FragColor = vec4( vec3(shadowDepth), 1.0 );
-		//float shadowMask = texture(gShadowMask1, TexCoords).r;
-		FragColor = vec4( vec3(depth), 1.0 );
+	vec3 eye_direction = normalize(-vPosition.xyz);
+	vec3 surface_normal = normalize(vTransformedNormal);
+	ivec2 tile = ivec2(gl_FragCoord.xy) / uLightGrid.x;
+	int tile_index = tile.y * uLightGrid.y + tile.x;
+
+	// the shadow casters sit at the same place in every condition
+	float shadow = 0.0;
+	float shadow1 = 0.0;
+	if (USE_LIGHTING && USE_SHADOW){
+		// calculate shadow 
+		vec3 light_direction = normalize(texelFetch(gLights, 2 * uConditions[0].x).xyz - vPosition.xyz);
+		vec3 light_direction1 = normalize(texelFetch(gLights, 2 * uConditions[0].x + 2).xyz - vPosition.xyz);
+		shadow = ShadowCalculation(vPosLightSpace, gShadowMask, gShadowDepth, light_direction);
+		shadow1 = ShadowCalculation(vPosLightSpace1, gShadowMask1, gShadowDepth1, light_direction1);
 	}
-	if (uShowNormals) {
-		vec3 nTN      = normalize(vTransformedNormal);
-		FragColor = vec4(nTN * 0.5 + 0.5, 1.0) * mask;
-		
-		//FragColor = vec4(vec3((length(vTransformedNormal))), 1.0);
-		//if (mask == 0)
-		//	FragColor = vec4(1.0);
-	}
-	if (uShowPosition) {
-		//vec3 nP       = vPosition.xyz;
-		vec3 nP = vPosLightSpace.xyz;
-		FragColor  = mask * vec4(nP , 1.0);
+
+	for (int c = 0; c < CONDITIONS; c++) {
+		vec3 color = ambient;
+		if (USE_LIGHTING){
+			// only the lights whose radius reaches this tile
+			uvec2 range = texelFetch(gTileRanges, c * uLightGrid.z + tile_index).rg;
+			for (uint k = 0u; k < range.y; k++) {
+				int light = int(texelFetch(gTileLights, int(range.x + k)).r);
+				vec3 lighting = PointLighting(light, surface_normal, eye_direction);
+				int caster = light - uConditions[c].x;
+				if (USE_SHADOW && caster < 2 && (uConditions[c].y & (1 << caster)) != 0)
+					lighting = (1.0 - (caster == 0 ? shadow : shadow1)) * lighting;
+				color += lighting;
+			}
+		}
+		//FragColor = mask * vec4(color, 1.0);
+		FragColor[c] = mask * vec4(color, vDiffuseColor.a) + (1 - mask) * bgColor;
+
+		if (SHOW_DEPTH) {
+			// FragColor = mix( vec4( 1.0 ), vec4( vec3( 0.0 ), 1.0 ), smoothstep( 0.1, 1.0, fog_coord ) );
+			//FragColor = vDiffuseColor;
+			//float shadowDepth = texture(gShadowDepth1, TexCoords).r;
+			//FragColor = vec4( vec3(shadowDepth), 1.0 );
+			//float shadowMask = texture(gShadowMask1, TexCoords).r;
+			FragColor[c] = vec4( vec3(depth), 1.0 );
+		}
+		if (SHOW_NORMALS) {
+			vec3 nTN      = normalize(vTransformedNormal);
+			FragColor[c] = vec4(nTN * 0.5 + 0.5, 1.0) * mask;
+			
+			//FragColor = vec4(vec3((length(vTransformedNormal))), 1.0);
+			//if (mask == 0)
+			//	FragColor = vec4(1.0);
+		}
+		if (SHOW_POSITION) {
+			//vec3 nP       = vPosition.xyz;
+			vec3 nP = vPosLightSpace.xyz;
+			FragColor[c]  = mask * vec4(nP , 1.0);
+		}
 	}
 }
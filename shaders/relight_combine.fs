@@ -0,0 +1,43 @@
+#version 330 core
+
+// Final color of deferred_shading.fs from the cached light terms: the
+// ambient light plus, for every light of the pixel's tile, the light's
+// color times its term, shadowed by the cached visibility.
+out vec4 FragColor;
+
+in vec2 TexCoords;
+
+uniform sampler2D gViewPosition;
+uniform sampler2D gVisibility;
+uniform sampler2D gDiffuseColor;
+uniform sampler2DArray gTerms;
+uniform samplerBuffer gLights;
+uniform usamplerBuffer gTileRanges;
+uniform usamplerBuffer gTileLights;
+
+uniform vec3 uAmbientColor;
+uniform ivec2 uLightGrid; // tile size, tiles per row
+uniform int uShadowCasters; // bit k: light k casts its shadow
+
+void main()
+{
+	// backgroundColor
+	vec4 bgColor = vec4(1.0, 1.0, 1.0, 0.0);
+
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	float mask = texelFetch(gViewPosition, pixel, 0).w;
+	vec2 visibility = texelFetch(gVisibility, pixel, 0).rg;
+	vec4 vDiffuseColor = texture(gDiffuseColor, TexCoords).rgba;
+
+	vec3 color = vDiffuseColor.rgb * uAmbientColor;
+	ivec2 tile = pixel / uLightGrid.x;
+	uvec2 range = texelFetch(gTileRanges, tile.y * uLightGrid.y + tile.x).rg;
+	for (uint k = 0u; k < range.y; k++) {
+		int light = int(texelFetch(gTileLights, int(range.x + k)).r);
+		vec3 lighting = texelFetch(gLights, 2 * light + 1).rgb * texelFetch(gTerms, ivec3(pixel, light), 0).rgb;
+		if (light < 2 && (uShadowCasters & (1 << light)) != 0)
+			lighting = visibility[light] * lighting;
+		color += lighting;
+	}
+	FragColor = mask * vec4(color, vDiffuseColor.a) + (1 - mask) * bgColor;
+}
@@ -0,0 +1,32 @@
+#version 330 core
+
+// Light uLight of deferred_shading.fs at unit color: attenuated diffuse
+// and specular light, before shadowing. Relighting scales it by the
+// light's color.
+out vec4 Term;
+
+in vec2 TexCoords;
+
+uniform sampler2D gViewPosition;
+uniform sampler2D gViewNormal;
+uniform sampler2D gDiffuseColor;
+uniform samplerBuffer gLights;
+uniform int uLight;
+
+void main()
+{
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	vec3 vPosition = texelFetch(gViewPosition, pixel, 0).xyz;
+	vec3 surface_normal = texelFetch(gViewNormal, pixel, 0).xyz;
+	vec4 vDiffuseColor = texture(gDiffuseColor, TexCoords).rgba;
+	vec3 eye_direction = normalize(-vPosition.xyz);
+
+	vec4 location = texelFetch(gLights, 2 * uLight);
+	vec4 radii = texelFetch(gLights, 2 * uLight + 1);
+	vec3 light_direction = normalize(location.xyz - vPosition.xyz);
+	vec3 diffuse = vDiffuseColor.xyz * max(dot(surface_normal, light_direction), 0.0);
+	float specular = pow( max( dot( reflect( -light_direction, surface_normal ), eye_direction ), 0.0 ), 100.0 );
+	float light_distance = length( vPosition.xyz - location.xyz );
+	float attenuation = 1.0 - smoothstep( radii.a, location.w, light_distance );
+	Term = vec4(attenuation * diffuse + attenuation * specular, 0.0);
+}
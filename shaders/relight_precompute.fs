@@ -0,0 +1,101 @@
+#version 330 core
+
+// Light-invariant part of deferred_shading.fs: the view-space position and
+// mask, the normalized normal and the visibility from both shadow casting
+// lights. Relighting reads these instead of the G-buffer.
+layout(location = 0) out vec4 ViewPosition; // position, mask
+layout(location = 1) out vec4 ViewNormal;
+layout(location = 2) out vec4 Visibility; // 1 - shadow of light 0 and 1
+
+in vec2 TexCoords;
+
+uniform sampler2D gNormal;
+uniform sampler2D gMask;
+uniform sampler2D gDepth;
+uniform sampler2D gShadowMask;
+uniform sampler2D gShadowDepth;
+uniform sampler2D gShadowMask1;
+uniform sampler2D gShadowDepth1;
+
+uniform mat4 uInvVMatrix;
+uniform mat4 uInvPMatrix;
+uniform mat4 lightSpaceMatrix;
+uniform mat4 lightSpaceMatrix1;
+uniform vec3 uLightLocation; // view space
+uniform vec3 uLightLocation1;
+uniform int uUseShadow;
+
+vec3 vPosition;
+vec3 vTransformedNormal;
+float mask;
+
+// normal of the G-buffer; packed G-buffers store unit normals octahedral-
+// encoded in the two snorm components of an RG16_SNORM texture
+vec3 SampleNormal(){
+#ifdef OCTAHEDRAL_NORMALS
+	vec2 e = texture(gNormal, TexCoords).rg;
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	float t = max(-n.z, 0.0);
+	n.x += n.x >= 0.0 ? -t : t;
+	n.y += n.y >= 0.0 ? -t : t;
+	return normalize(n);
+#else
+	return texture(gNormal, TexCoords).rgb;
+#endif
+}
+
+vec3 ViewPosFromDepth(float depth){
+	float z = depth * 2.0 - 1.0;
+
+	vec4 clipSpacePosition = vec4(TexCoords * 2.0 - 1.0, z, 1.0);
+	vec4 viewSpacePosition = uInvPMatrix * clipSpacePosition;
+
+	// Perspective division
+    viewSpacePosition /= viewSpacePosition.w;
+
+	return viewSpacePosition.xyz;
+}
+
+float ShadowCalculation(vec4 fragPosLightSpace, sampler2D gShadowMask, sampler2D shadowMap, vec3 lightDir){
+	// perform perspective divide
+	vec3 projCoords = fragPosLightSpace.xyz / fragPosLightSpace.w;
+	// transform to [0,1] range
+    projCoords = projCoords * 0.5 + 0.5;
+	// get closest depth value from light's perspective (using [0,1] range fragPosLight as coords)
+	float closestDepth = texture(shadowMap, projCoords.xy).r;
+	if (mask < 0.5)
+		closestDepth = 1.0;
+	// get depth of current fragment from light's perspective
+	float currentDepth = projCoords.z;
+	// calculate bias (based on depth map resolution and slope)
+	vec3 normal = normalize(vTransformedNormal);
+	float bias = max(0.05 * (1.0 - dot(normal, lightDir)), 0.005);
+	// check whether current frag pos is in shadow
+	float shadow = currentDepth - bias > closestDepth  ? 1.0 : 0.0;
+
+	// keep the shadow at 0.0 when outside the far_plane region of the light's frustum.
+    if(projCoords.z > 1.0)
+		shadow = 0.0;
+
+	return shadow;
+}
+
+void main()
+{
+	float depth = texture(gDepth, TexCoords).r;
+	vPosition = ViewPosFromDepth(depth);
+	vTransformedNormal = SampleNormal();
+	mask = texture(gMask, TexCoords).r;
+
+	ViewPosition = vec4(vPosition, mask);
+	ViewNormal = vec4(normalize(vTransformedNormal), 0.0);
+	Visibility = vec4(1.0);
+	if (uUseShadow != 0) {
+		vec4 vPosLightSpace = lightSpaceMatrix * uInvVMatrix * vec4(vPosition, 1.0);
+		vec4 vPosLightSpace1 = lightSpaceMatrix1 * uInvVMatrix * vec4(vPosition, 1.0);
+		vec3 light_direction = normalize(uLightLocation - vPosition.xyz);
+		vec3 light_direction1 = normalize(uLightLocation1 - vPosition.xyz);
+		Visibility.r = 1.0 - ShadowCalculation(vPosLightSpace, gShadowMask, gShadowDepth, light_direction);
+		Visibility.g = 1.0 - ShadowCalculation(vPosLightSpace1, gShadowMask1, gShadowDepth1, light_direction1);
+	}
+}
@@ -0,0 +1,408 @@
+#pragma comment(lib,"glfw3.lib")
+#define _USE_MATH_DEFINES
+#include "context.h"
+
+#include "gbuffer.h"
+#include "light_set.h"
+#include "deferred_renderer.h"
+#include "image_writer.h"
+#include "synthetic_gbuffer.h"
+#include "json.h"
+
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <functional>
+#include <thread>
+#include <filesystem>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// the initial window size, frames take the resolution of their datasets
+const unsigned int SCR_WIDTH = 256;
+const unsigned int SCR_HEIGHT = 256;
+
+// What is measured and how often: every stage runs warmup times untimed,
+// then repetitions times timed.
+struct BenchmarkOptions
+{
+	vector<SyntheticScene> scenes = { SYNTHETIC_SPHERES, SYNTHETIC_ISOSURFACE };
+	vector<unsigned int> sizes = { 256, 1024, 2048 };
+	SyntheticOptions synthetic;
+	unsigned int warmup = 2;
+	unsigned int repetitions = 10;
+	bool gl = true, cpu = true;
+	bool headless = false;
+	unsigned int threads = 0; // of the CPU engine, 0: all cores
+	RenderSettings settings;
+	ImageWriterOptions image;
+	string dataDirectory = "synthetic";
+};
+
+// the times of one stage in milliseconds
+struct StageTimes
+{
+	string name;
+	vector<double> ms;
+};
+
+// the stages measured on one synthetic view
+struct BenchmarkResult
+{
+	SyntheticOptions view;
+	float coverage = 0.0f;
+	uintmax_t fileBytes = 0;
+	size_t encodedBytes = 0;
+	vector<StageTimes> stages;
+};
+
+// run stage warmup + repetitions times, timing the repetitions; false if it
+// failed once
+// ------------------------------------------------------------------------
+bool timeStage(const BenchmarkOptions &options, const string &name, const function<bool()> &stage, vector<StageTimes> &stages)
+{
+	for (unsigned int i = 0; i < options.warmup; i++) {
+		if (!stage())
+			return false;
+	}
+	StageTimes times{ name, vector<double>() };
+	for (unsigned int i = 0; i < options.repetitions; i++) {
+		auto start = chrono::steady_clock::now();
+		if (!stage())
+			return false;
+		times.ms.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+	}
+	stages.push_back(times);
+	return true;
+}
+
+// the p-th percentile (0-100) of sorted times, nearest rank
+// ------------------------------------------------------------------------
+double percentile(const vector<double> &sorted, double p)
+{
+	if (sorted.empty())
+		return 0.0;
+	size_t rank = (size_t)ceil(p / 100.0 * sorted.size());
+	return sorted[min(max(rank, (size_t)1), sorted.size()) - 1];
+}
+
+// Generate the synthetic view of options into the data directory, unless a
+// file with its parameters in the name is there already; returns its path.
+// ------------------------------------------------------------------------
+string syntheticFile(const BenchmarkOptions &options, const SyntheticOptions &view, ThreadPool &pool, float &coverage)
+{
+	ostringstream name;
+	name << "synthetic_" << syntheticSceneName(view.scene) << "_" << view.size << "_c" << view.coverage << "_s" << view.seed;
+	if (view.scene == SYNTHETIC_SPHERES)
+		name << "_n" << view.spheres;
+	else
+		name << "_r" << view.roughness;
+	name << ".h5";
+	fs::path path = fs::path(options.dataDirectory) / name.str();
+	std::error_code ec;
+	fs::create_directories(options.dataDirectory, ec);
+
+	SyntheticGBuffer gbuffer;
+	if (fs::exists(path, ec)) {
+		coverage = NAN;
+		return path.string();
+	}
+	auto start = chrono::steady_clock::now();
+	generateSyntheticGBuffer(view, gbuffer, pool);
+	if (!writeSyntheticGBuffer(path.string(), gbuffer, view.theta, view.phi))
+		return "";
+	coverage = gbuffer.coverage;
+	printf("generated %s, coverage %.3f, in %.1f s\n", path.string().c_str(), coverage,
+		chrono::duration<double>(chrono::steady_clock::now() - start).count());
+	return path.string();
+}
+
+// Time every stage of the render pipeline on one view: reading its
+// datasets with cold handle and dataset caches, uploading the textures,
+// the lighting pass, reading the frame back and encoding it, and shading
+// it with the CPU engine. GL stages end with glFinish. ctx is null without
+// the GL engine.
+// ------------------------------------------------------------------------
+bool benchmarkView(const BenchmarkOptions &options, const string &path, RenderContext* ctx, BenchmarkResult &result)
+{
+	LightSet lights;
+	if (!lights.setShadowFile(path))
+		return false;
+	LightingCondition condition = lights.defaultCondition(options.settings.useShadow != 0);
+	unsigned int channels = options.settings.channels();
+	std::error_code ec;
+	result.fileBytes = fs::file_size(path, ec);
+
+	GBuffer gbuffer;
+	bool ok = timeStage(options, "load", [&] {
+		{
+			std::lock_guard<std::mutex> lock(hdf5Mutex());
+			hdf5Handles().clear();
+		}
+		DatasetCache datasets;
+		gbuffer = GBuffer();
+		return loadGBuffer(datasets, channels, path, lights.shadowFile, gbuffer);
+	}, result.stages);
+	if (!ok)
+		return false;
+	if (isnan(result.coverage) && gbuffer.mask && gbuffer.mask->floats()) {
+		const float* mask = gbuffer.mask->floats();
+		result.coverage = (float)count(mask, mask + gbuffer.mask->count(), 1.0f) / gbuffer.mask->count();
+	}
+
+	RgbImage image;
+	image.width = gbuffer.width;
+	image.height = gbuffer.height;
+	image.pixels.resize((size_t)gbuffer.width * gbuffer.height * 3);
+	if (ctx) {
+		DatasetCache datasets;
+		DeferredRenderer renderer(*ctx, options.settings, datasets);
+		ok = timeStage(options, "upload", [&] {
+			renderer.textures().clear();
+			bool prepared = renderer.prepare(gbuffer, lights, 1);
+			glFinish();
+			return prepared;
+		}, result.stages);
+		ok = ok && timeStage(options, "shade", [&] {
+			bool drawn = renderer.draw(gbuffer, lights, &condition, 1, options.settings.uberShader);
+			glFinish();
+			return drawn;
+		}, result.stages);
+		ok = ok && timeStage(options, "readback", [&] {
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, renderer.framebuffer());
+			glReadBuffer(GL_COLOR_ATTACHMENT0);
+			glPixelStorei(GL_PACK_ALIGNMENT, 1);
+			glReadPixels(0, 0, image.width, image.height, GL_RGB, GL_UNSIGNED_BYTE, image.pixels.data());
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+			return glGetError() == GL_NO_ERROR;
+		}, result.stages);
+		if (!ok)
+			return false;
+	}
+	if (options.cpu) {
+		CpuDeferredRenderer renderer(options.settings, options.threads);
+		ok = timeStage(options, "shade_cpu", [&] {
+			return renderer.render(gbuffer, lights, condition, image);
+		}, result.stages);
+		if (!ok)
+			return false;
+	}
+
+	ImageEncoder encoder(options.image);
+	vector<unsigned char> encoded;
+	ok = timeStage(options, "encode", [&] {
+		return encoder.encode(image.pixels.data(), image.width, image.height, encoded);
+	}, result.stages);
+	result.encodedBytes = encoded.size();
+	return ok;
+}
+
+// the statistics of one stage as a JSON object
+// ------------------------------------------------------------------------
+string stageJson(const StageTimes &stage)
+{
+	vector<double> sorted = stage.ms;
+	sort(sorted.begin(), sorted.end());
+	double sum = 0.0;
+	for (double ms : sorted)
+		sum += ms;
+	ostringstream out;
+	out.precision(6);
+	out << "{\"mean\":" << (sorted.empty() ? 0.0 : sum / sorted.size()) << ",\"min\":" << percentile(sorted, 0)
+		<< ",\"p50\":" << percentile(sorted, 50) << ",\"p90\":" << percentile(sorted, 90)
+		<< ",\"p99\":" << percentile(sorted, 99) << ",\"max\":" << percentile(sorted, 100) << ",\"samples\":[";
+	for (size_t i = 0; i < stage.ms.size(); i++)
+		out << (i ? "," : "") << stage.ms[i];
+	out << "]}";
+	return out.str();
+}
+
+// all results as one JSON document, to be compared across releases
+// ------------------------------------------------------------------------
+string resultsJson(const BenchmarkOptions &options, const string &renderer, const vector<BenchmarkResult> &results)
+{
+	ostringstream out;
+	out << "{\n  \"version\": 1,\n  \"renderer\": " << jsonQuote(renderer)
+		<< ",\n  \"cores\": " << thread::hardware_concurrency()
+		<< ",\n  \"warmup\": " << options.warmup << ",\n  \"repetitions\": " << options.repetitions
+		<< ",\n  \"format\": " << jsonQuote(imageFormatName(options.image.format)) << ",\n  \"png_level\": " << options.image.level
+		<< ",\n  \"lighting\": " << options.settings.useLighting << ",\n  \"shadow\": " << options.settings.useShadow
+		<< ",\n  \"results\": [";
+	for (size_t i = 0; i < results.size(); i++) {
+		const BenchmarkResult &result = results[i];
+		out << (i ? "," : "") << "\n    {\"scene\": " << jsonQuote(syntheticSceneName(result.view.scene))
+			<< ", \"width\": " << result.view.size << ", \"height\": " << result.view.size
+			<< ", \"coverage\": " << result.coverage << ", \"file_bytes\": " << result.fileBytes
+			<< ", \"encoded_bytes\": " << result.encodedBytes << ",\n     \"stages\": {";
+		for (size_t s = 0; s < result.stages.size(); s++)
+			out << (s ? "," : "") << "\n       " << jsonQuote(result.stages[s].name) << ": " << stageJson(result.stages[s]);
+		out << "}}";
+	}
+	out << "\n  ]\n}\n";
+	return out.str();
+}
+
+// a comma-separated list of numbers
+// ------------------------------------------------------------------------
+vector<unsigned int> parseSizes(const string &list)
+{
+	vector<unsigned int> sizes;
+	istringstream fields(list);
+	string field;
+	while (getline(fields, field, ',')) {
+		int size = atoi(field.c_str());
+		if (size > 0)
+			sizes.push_back((unsigned int)size);
+	}
+	return sizes;
+}
+
+// Usage: benchmark [--headless] [--engine gl|cpu|both] [--threads <n>]
+//                  [--scenes spheres,isosurface] [--sizes 256,1024,...]
+//                  [--coverage <0-1>] [--spheres <n>] [--roughness <r>] [--seed <n>]
+//                  [--warmup <n>] [--repetitions <n>] [--shadow] [--uber-shader]
+//                  [--format png|ppm|qoi|raw] [--png-level <0-9>] [--encode-threads <n>]
+//                  [--data <dir>] [-o <results.json>]
+// Generates synthetic G-buffers, a field of spheres or a noisy isosurface
+// covering about --coverage of the view, at every size from --sizes (256 to
+// 8192 squared), writes them as HDF5 files with the datasets of the MPAS
+// files to --data (default "synthetic", kept for later runs) and times the
+// stages of the render pipeline on each: load, upload, shade, readback and
+// encode, and shade_cpu with the CPU engine. Every stage runs --warmup
+// times (default 2), then --repetitions times (default 10). A table of
+// medians goes to the console, the mean, percentiles and samples of every
+// stage to -o (default benchmark.json).
+int main(int argc, char **argv)
+{
+	BenchmarkOptions options;
+	string output = "benchmark.json";
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "--headless")
+			options.headless = true;
+		else if (arg == "--engine" && i + 1 < argc) {
+			string engine = argv[++i];
+			options.gl = engine != "cpu";
+			options.cpu = engine != "gl";
+		}
+		else if (arg == "--threads" && i + 1 < argc)
+			options.threads = (unsigned int)max(atoi(argv[++i]), 0);
+		else if (arg == "--scenes" && i + 1 < argc) {
+			options.scenes.clear();
+			istringstream fields(argv[++i]);
+			string field;
+			while (getline(fields, field, ',')) {
+				SyntheticScene scene;
+				if (!parseSyntheticScene(field, scene)) {
+					std::cout << "ERROR::BENCHMARK::UNKNOWN_SCENE " << field << std::endl;
+					return -1;
+				}
+				options.scenes.push_back(scene);
+			}
+		}
+		else if (arg == "--sizes" && i + 1 < argc)
+			options.sizes = parseSizes(argv[++i]);
+		else if (arg == "--coverage" && i + 1 < argc)
+			options.synthetic.coverage = (float)min(max(atof(argv[++i]), 0.0), 1.0);
+		else if (arg == "--spheres" && i + 1 < argc)
+			options.synthetic.spheres = (unsigned int)max(atoi(argv[++i]), 1);
+		else if (arg == "--roughness" && i + 1 < argc)
+			options.synthetic.roughness = (float)min(max(atof(argv[++i]), 0.0), 0.9);
+		else if (arg == "--seed" && i + 1 < argc)
+			options.synthetic.seed = (unsigned int)atoi(argv[++i]);
+		else if (arg == "--warmup" && i + 1 < argc)
+			options.warmup = (unsigned int)max(atoi(argv[++i]), 0);
+		else if (arg == "--repetitions" && i + 1 < argc)
+			options.repetitions = (unsigned int)max(atoi(argv[++i]), 1);
+		else if (arg == "--shadow")
+			options.settings.useShadow = 1;
+		else if (arg == "--uber-shader")
+			options.settings.uberShader = true;
+		else if (arg == "--format" && i + 1 < argc) {
+			if (!parseImageFormat(argv[++i], options.image.format)) {
+				std::cout << "ERROR::IMAGE::UNKNOWN_FORMAT " << argv[i] << std::endl;
+				return -1;
+			}
+		}
+		else if (arg == "--png-level" && i + 1 < argc)
+			options.image.level = min(max(atoi(argv[++i]), 0), 9);
+		else if (arg == "--encode-threads" && i + 1 < argc)
+			options.image.threads = (unsigned int)max(atoi(argv[++i]), 1);
+		else if (arg == "--data" && i + 1 < argc)
+			options.dataDirectory = argv[++i];
+		else if (arg == "-o" && i + 1 < argc)
+			output = argv[++i];
+		else {
+			std::cout << "Usage: " << argv[0] << " [--headless] [--engine gl|cpu|both] [--threads <n>] [--scenes spheres,isosurface] [--sizes 256,1024,...] [--coverage <0-1>] [--spheres <n>] [--roughness <r>] [--seed <n>] [--warmup <n>] [--repetitions <n>] [--shadow] [--uber-shader] [--format png|ppm|qoi|raw] [--png-level <0-9>] [--encode-threads <n>] [--data <dir>] [-o <results.json>]" << std::endl;
+			return -1;
+		}
+	}
+	options.sizes.erase(remove_if(options.sizes.begin(), options.sizes.end(),
+		[](unsigned int size) { return size < 256 || size > 8192; }), options.sizes.end());
+	if (options.sizes.empty() || options.scenes.empty()) {
+		std::cout << "ERROR::BENCHMARK::NO_SIZES sizes must be 256 to 8192" << std::endl;
+		return -1;
+	}
+
+	RenderContext ctx;
+	string renderer = "cpu";
+	if (options.gl) {
+		if (!createRenderContext(ctx, options.headless, SCR_WIDTH, SCR_HEIGHT)) {
+			destroyRenderContext(ctx);
+			return -1;
+		}
+		renderer = (const char*)glGetString(GL_RENDERER);
+	}
+
+	ThreadPool pool;
+	vector<BenchmarkResult> results;
+	int failed = 0;
+	printf("%-12s %6s %8s", "scene", "size", "coverage");
+	const char* columns[] = { "load", "upload", "shade", "readback", "shade_cpu", "encode" };
+	for (const char* column : columns)
+		printf(" %10s", column);
+	printf("   (median ms)\n");
+	for (SyntheticScene scene : options.scenes) {
+		for (unsigned int size : options.sizes) {
+			BenchmarkResult result;
+			result.view = options.synthetic;
+			result.view.scene = scene;
+			result.view.size = size;
+			string path = syntheticFile(options, result.view, pool, result.coverage);
+			if (path.empty() || !benchmarkView(options, path, options.gl ? &ctx : nullptr, result)) {
+				std::cout << "Failed to benchmark " << syntheticSceneName(scene) << " " << size << std::endl;
+				failed++;
+				continue;
+			}
+			printf("%-12s %6u %8.3f", syntheticSceneName(scene), size, result.coverage);
+			for (const char* column : columns) {
+				auto it = find_if(result.stages.begin(), result.stages.end(), [&](const StageTimes &stage) { return stage.name == column; });
+				if (it == result.stages.end()) {
+					printf(" %10s", "-");
+					continue;
+				}
+				vector<double> sorted = it->ms;
+				sort(sorted.begin(), sorted.end());
+				printf(" %10.3f", percentile(sorted, 50));
+			}
+			printf("\n");
+			results.push_back(result);
+		}
+	}
+	if (options.gl)
+		destroyRenderContext(ctx);
+
+	ofstream json(output);
+	json << resultsJson(options, renderer, results);
+	if (!json) {
+		std::cout << "ERROR::BENCHMARK::CANNOT_WRITE " << output << std::endl;
+		return -1;
+	}
+	std::cout << "Results written to " << output << std::endl;
+	return failed == 0 ? 0 : 1;
+}
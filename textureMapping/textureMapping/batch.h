@@ -0,0 +1,307 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+#include <memory>
+#include <cmath>
+#include <unordered_map>
+
+#include "json.h"
+#include "light_set.h"
+
+namespace fs = std::filesystem;
+
+// One input G-buffer file and the image it is rendered to. A JSON manifest
+// may also give the angles it was rendered from, the shadow caster of
+// light 2 and point lights added to the scene lights.
+struct RenderJob
+{
+	std::string input;
+	std::string output;
+	float theta = NAN, phi = NAN; // degrees, NaN to read them from the file
+	std::string shadow; // empty for the shadow caster of the command line
+	float shadowTheta = NAN, shadowPhi = NAN;
+	std::shared_ptr<const std::vector<PointLight> > lights; // shared by the jobs of a manifest
+};
+
+// match a file name against a pattern containing '*' and '?' wildcards
+// ------------------------------------------------------------------------
+inline bool wildcardMatch(const char* pattern, const char* name)
+{
+	const char* star = nullptr;
+	const char* resume = nullptr;
+	while (*name)
+	{
+		if (*pattern == '?' || *pattern == *name)
+		{
+			pattern++;
+			name++;
+		}
+		else if (*pattern == '*')
+		{
+			star = pattern++;
+			resume = name;
+		}
+		else if (star)
+		{
+			pattern = star + 1;
+			name = ++resume;
+		}
+		else
+			return false;
+	}
+	while (*pattern == '*')
+		pattern++;
+	return *pattern == '\0';
+}
+
+inline bool hasWildcard(const std::string &s)
+{
+	return s.find_first_of("*?") != std::string::npos;
+}
+
+// output image for an input file: <outputDir>/<input stem>.png
+// ------------------------------------------------------------------------
+inline std::string outputPathFor(const std::string &input, const std::string &outputDir)
+{
+	fs::path out = outputDir.empty() ? fs::path(".") : fs::path(outputDir);
+	out /= fs::path(input).stem();
+	out += ".png";
+	return out.string();
+}
+
+// all files in a directory whose name matches the pattern, sorted by name
+// ------------------------------------------------------------------------
+inline void listDirectory(const fs::path &dir, const std::string &pattern, std::vector<std::string> &files)
+{
+	std::error_code ec;
+	std::vector<std::string> found;
+	for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec))
+	{
+		if (!it->is_regular_file(ec))
+			continue;
+		std::string name = it->path().filename().string();
+		if (wildcardMatch(pattern.c_str(), name.c_str()))
+			found.push_back(it->path().string());
+	}
+	if (ec)
+		std::cout << "ERROR::BATCH::CANNOT_LIST_DIRECTORY " << dir.string() << std::endl;
+	std::sort(found.begin(), found.end());
+	files.insert(files.end(), found.begin(), found.end());
+}
+
+// manifest file: one input per line, optionally followed by an output path.
+// Empty lines and lines starting with '#' are ignored; relative inputs are
+// resolved against the manifest's directory.
+// ------------------------------------------------------------------------
+inline void readManifest(const std::string &manifestPath, const std::string &outputDir, std::vector<RenderJob> &jobs)
+{
+	std::ifstream manifest(manifestPath);
+	if (!manifest)
+	{
+		std::cout << "ERROR::BATCH::MANIFEST_NOT_SUCCESFULLY_READ " << manifestPath << std::endl;
+		return;
+	}
+	fs::path base = fs::path(manifestPath).parent_path();
+	std::string line;
+	while (std::getline(manifest, line))
+	{
+		std::istringstream fields(line);
+		std::string input, output;
+		if (!(fields >> input) || input[0] == '#')
+			continue;
+		fields >> output;
+		fs::path inputPath(input);
+		if (inputPath.is_relative())
+			inputPath = base / inputPath;
+		RenderJob job;
+		job.input = inputPath.string();
+		job.output = output.empty() ? outputPathFor(job.input, outputDir) : output;
+		jobs.push_back(job);
+	}
+}
+
+// a path of a manifest, relative paths resolved against its directory
+// ------------------------------------------------------------------------
+inline std::string resolvePath(const fs::path &base, const std::string &path)
+{
+	fs::path p(path);
+	return (p.is_relative() ? base / p : p).string();
+}
+
+// a view or shadow caster of a JSON manifest: a file name, or an object with
+// "input" and optionally "theta" and "phi" in degrees
+// ------------------------------------------------------------------------
+inline bool readManifestView(const JsonValue &value, const fs::path &base, std::string &input, float &theta, float &phi)
+{
+	if (value.type == JsonValue::JSON_STRING)
+		input = value.text;
+	else if (value.type == JsonValue::JSON_OBJECT)
+	{
+		input = value.stringOr("input", "");
+		theta = (float)value.numberOr("theta", NAN);
+		phi = (float)value.numberOr("phi", NAN);
+	}
+	if (input.empty())
+		return false;
+	input = resolvePath(base, input);
+	return true;
+}
+
+// A JSON manifest: {"views": [...], "shadow": ..., "lights": [...]}. Every
+// view is a file name or an object with "input" and optionally "output",
+// "theta" and "phi" in degrees, which take precedence over what the file
+// records, and "shadow" and "lights" replacing those of the manifest. The
+// shadow caster is a file name or an object with "input", "theta" and
+// "phi"; lights are arrays of x, y, z, r, g, b[, outer[, inner]] in world
+// space, added to those of --lights. Relative inputs are resolved against
+// the manifest's directory.
+// ------------------------------------------------------------------------
+inline void readJsonManifest(const std::string &manifestPath, const std::string &outputDir, std::vector<RenderJob> &jobs)
+{
+	std::ifstream manifest(manifestPath);
+	std::stringstream text;
+	text << manifest.rdbuf();
+	JsonValue root;
+	if (!manifest || !JsonParser(text.str()).parse(root) || root.type != JsonValue::JSON_OBJECT)
+	{
+		std::cout << "ERROR::BATCH::MANIFEST_NOT_SUCCESFULLY_READ " << manifestPath << std::endl;
+		return;
+	}
+	fs::path base = fs::path(manifestPath).parent_path();
+
+	RenderJob shared;
+	std::vector<PointLight> lights;
+	const JsonValue* shadow = root.find("shadow");
+	const JsonValue* lightArray = root.find("lights");
+	if ((shadow && !readManifestView(*shadow, base, shared.shadow, shared.shadowTheta, shared.shadowPhi))
+		|| (lightArray && !parseJsonLights(*lightArray, lights)))
+	{
+		std::cout << "ERROR::BATCH::CANNOT_PARSE_MANIFEST " << manifestPath << std::endl;
+		return;
+	}
+	if (!lights.empty())
+		shared.lights = std::make_shared<const std::vector<PointLight> >(lights);
+
+	const JsonValue* views = root.find("views");
+	for (size_t i = 0; views && i < views->items.size(); i++)
+	{
+		const JsonValue &view = views->items[i];
+		RenderJob job = shared;
+		bool ok = readManifestView(view, base, job.input, job.theta, job.phi);
+		if (ok && view.type == JsonValue::JSON_OBJECT)
+		{
+			job.output = view.stringOr("output", "");
+			if (const JsonValue* viewShadow = view.find("shadow"))
+			{
+				job.shadowTheta = job.shadowPhi = NAN;
+				ok = readManifestView(*viewShadow, base, job.shadow, job.shadowTheta, job.shadowPhi);
+			}
+			if (const JsonValue* viewLights = view.find("lights"))
+			{
+				std::vector<PointLight> own;
+				ok = ok && parseJsonLights(*viewLights, own);
+				job.lights = std::make_shared<const std::vector<PointLight> >(own);
+			}
+		}
+		if (!ok)
+		{
+			std::cout << "ERROR::BATCH::CANNOT_PARSE_MANIFEST " << manifestPath << " view " << i << std::endl;
+			continue;
+		}
+		if (job.output.empty())
+			job.output = outputPathFor(job.input, outputDir);
+		jobs.push_back(job);
+	}
+}
+
+// Expand the command line inputs into render jobs. Every argument may be an
+// HDF5 or packed G-buffer file, a directory (all *.h5, then all *.gbp
+// inside it), a glob such as "views/MPAS_*.h5", a manifest file listing
+// one input per line, or a JSON manifest (.json). Outputs are named after
+// the input's stem only, so inputs of the same name in different
+// directories would overwrite each other's image; false if any two jobs
+// write the same output.
+// ------------------------------------------------------------------------
+inline bool collectRenderJobs(const std::vector<std::string> &args, const std::string &outputDir, std::vector<RenderJob> &jobs)
+{
+	jobs.clear();
+	for (const std::string &arg : args)
+	{
+		std::vector<std::string> files;
+		std::error_code ec;
+		if (hasWildcard(arg))
+		{
+			fs::path p(arg);
+			fs::path dir = p.has_parent_path() ? p.parent_path() : fs::path(".");
+			listDirectory(dir, p.filename().string(), files);
+		}
+		else if (fs::is_directory(arg, ec))
+		{
+			listDirectory(arg, "*.h5", files);
+			listDirectory(arg, "*.gbp", files);
+		}
+		else if (fs::path(arg).extension() == ".h5" || fs::path(arg).extension() == ".gbp")
+			files.push_back(arg);
+		else if (fs::path(arg).extension() == ".json")
+		{
+			readJsonManifest(arg, outputDir, jobs);
+			continue;
+		}
+		else
+		{
+			readManifest(arg, outputDir, jobs);
+			continue;
+		}
+
+		for (const std::string &file : files)
+		{
+			RenderJob job;
+			job.input = file;
+			job.output = outputPathFor(file, outputDir);
+			jobs.push_back(job);
+		}
+	}
+
+	std::unordered_map<std::string, const RenderJob*> outputs;
+	bool unique = true;
+	for (const RenderJob &job : jobs)
+	{
+		auto added = outputs.emplace(fs::path(job.output).lexically_normal().string(), &job);
+		if (!added.second)
+		{
+			std::cout << "ERROR::BATCH::DUPLICATE_OUTPUT " << job.output << " for " << added.first->second->input << " and " << job.input << std::endl;
+			unique = false;
+		}
+	}
+	return unique;
+}
+
+// Order jobs so that those sharing a shadow caster, and within them those
+// reading the same input, follow each other, while the cache still holds
+// their datasets; otherwise keep the order they were given in.
+// ------------------------------------------------------------------------
+inline void groupJobs(std::vector<RenderJob> &jobs)
+{
+	std::unordered_map<std::string, size_t> shadows, inputs;
+	for (const RenderJob &job : jobs)
+	{
+		shadows.emplace(job.shadow, shadows.size());
+		inputs.emplace(job.input, inputs.size());
+	}
+	std::stable_sort(jobs.begin(), jobs.end(), [&](const RenderJob &a, const RenderJob &b)
+	{
+		size_t shadowA = shadows[a.shadow], shadowB = shadows[b.shadow];
+		if (shadowA != shadowB)
+			return shadowA < shadowB;
+		return inputs[a.input] < inputs[b.input];
+	});
+}
+
+#endif
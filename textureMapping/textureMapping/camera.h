@@ -0,0 +1,103 @@
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#define _USE_MATH_DEFINES
+#include <cmath>
+
+#include <GL/glm/glm.hpp>
+#include <GL/glm/gtc/matrix_transform.hpp>
+
+// projection matrix of a width x height view
+// ------------------------------------------------------------------------
+inline glm::mat4 projectionMatrix(unsigned int width, unsigned int height, bool perspective = true)
+{
+	float near = 1.79f;
+	float far = 2.81f;
+	float fov_r = 30.0f;
+
+	if (perspective) {
+		// Resulting perspective matrix, FOV in radians, aspect ratio, near, and far clipping plane.
+		return glm::perspective(fov_r, (float)width / (float)height, near, far);
+	}
+	else {
+		// The goal is to have the object be about the same size in the window
+		// during orthographic project as it is during perspective projection.
+
+		float a = (float)width / (float)height;
+		float h = 2 * (25 * std::tan(fov_r / 2)); // Window aspect ratio.
+		float w = h * a; // Knowing the new window height size, get the new window width size based on the aspect ratio.
+
+		// The canvas' origin is the upper left corner. To the right is the positive x-axis.
+		// Going down is the positive y-axis.
+
+		// Any object at the world origin would appear at the upper left hand corner.
+		// Shift the origin to the middle of the screen.
+
+		// Also, invert the y-axis as WebgL's positive y-axis points up while the canvas' positive
+		// y-axis points down the screen.
+
+		//           (0,O)------------------------(w,0)
+		//               |                        |
+		//               |                        |
+		//               |                        |
+		//           (0,h)------------------------(w,h)
+		//
+		//  (-(w/2),(h/2))------------------------((w/2),(h/2))
+		//               |                        |
+		//               |         (0,0)          |gbo
+		//               |                        |
+		// (-(w/2),-(h/2))------------------------((w/2),-(h/2))
+
+		// Resulting perspective matrix, left, right, bottom, top, near, and far clipping plane.
+		return glm::ortho(-(w / 2),
+			(w / 2),
+			-(h / 2),
+			(h / 2),
+			near,
+			far);
+	}
+}
+
+// The camera of a view: on a sphere of radius dist around the origin at
+// the angles the view was rendered from, looking at the origin.
+struct Camera
+{
+	float dist = 2.3f;
+	bool perspective = true;
+
+	glm::vec3 direction, up, center, eye;
+	glm::mat4 view, model, mvMatrix;
+	glm::mat4 pMatrix;
+
+	// place the camera at theta and phi (radians) for a width x height view
+	// ------------------------------------------------------------------------
+	void orbit(float theta, float phi, unsigned int width, unsigned int height)
+	{
+		pMatrix = projectionMatrix(width, height, perspective);
+
+		// Move to the 3D space origin.
+		mvMatrix = glm::mat4(1.0f);
+
+		// transform
+		direction = glm::vec3(std::sin(theta) * std::cos(phi) * dist, std::sin(theta) * std::sin(phi) * dist, std::cos(theta) * dist);
+		up = glm::vec3(std::sin(theta - M_PI / 2) * std::cos(phi), std::sin(theta - M_PI / 2) * std::sin(phi), std::cos(theta - M_PI / 2));
+		center = glm::vec3(0.0f, 0.0f, 0.0f);
+		eye = center + direction;
+
+		view = glm::lookAt(eye, center, up);
+		model = glm::mat4(1.0f);
+
+		mvMatrix = view * model;
+	}
+
+	glm::mat4 invVMatrix() const { return glm::inverse(view); }
+	glm::mat4 invPMatrix() const { return glm::inverse(pMatrix); }
+
+	// the normal matrix of the model-view transform
+	glm::mat3 normalMatrix() const
+	{
+		return glm::transpose(glm::inverse(glm::mat3(mvMatrix)));
+	}
+};
+
+#endif
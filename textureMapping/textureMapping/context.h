@@ -0,0 +1,181 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+// Headless rendering uses a surfaceless EGL context (Mesa llvmpipe works
+// without a GPU or an X server). Windows has no EGL, so there the headless
+// path falls back to an invisible GLFW window.
+#ifndef _WIN32
+#define USE_EGL
+#define EGL_NO_X11
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#include <string>
+#include <iostream>
+
+struct RenderContext
+{
+	bool headless = false;
+	GLFWwindow* window = nullptr;
+	GLADloadproc getProcAddress = nullptr; // for entry points beyond GL 3.3
+#ifdef USE_EGL
+	EGLDisplay display = EGL_NO_DISPLAY;
+	EGLContext context = EGL_NO_CONTEXT;
+#endif
+};
+
+// glfw: whenever the window size changed (by OS or user resize) this callback function executes
+// ---------------------------------------------------------------------------------------------
+inline void framebuffer_size_callback(GLFWwindow* window, int width, int height)
+{
+	// make sure the viewport matches the new window dimensions; note that width and
+	// height will be significantly larger than specified on retina displays.
+	glViewport(0, 0, width, height);
+}
+
+#ifdef USE_EGL
+// pick a display that needs no window system: Mesa's surfaceless platform,
+// then the first EGL device, then whatever the default display is
+// ------------------------------------------------------------------------
+inline EGLDisplay getHeadlessDisplay()
+{
+	PFNEGLGETPLATFORMDISPLAYEXTPROC eglGetPlatformDisplayEXT =
+		(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	const char* extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	if (eglGetPlatformDisplayEXT && extensions) {
+		std::string ext = extensions;
+		if (ext.find("EGL_MESA_platform_surfaceless") != std::string::npos) {
+			EGLDisplay display = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+			if (display != EGL_NO_DISPLAY)
+				return display;
+		}
+		PFNEGLQUERYDEVICESEXTPROC eglQueryDevicesEXT =
+			(PFNEGLQUERYDEVICESEXTPROC)eglGetProcAddress("eglQueryDevicesEXT");
+		if (eglQueryDevicesEXT && ext.find("EGL_EXT_platform_device") != std::string::npos) {
+			EGLDeviceEXT device;
+			EGLint count = 0;
+			if (eglQueryDevicesEXT(1, &device, &count) && count > 0)
+				return eglGetPlatformDisplayEXT(EGL_PLATFORM_DEVICE_EXT, device, NULL);
+		}
+	}
+	return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+inline bool createHeadlessContext(RenderContext &ctx)
+{
+	ctx.display = getHeadlessDisplay();
+	EGLint major, minor;
+	if (ctx.display == EGL_NO_DISPLAY || !eglInitialize(ctx.display, &major, &minor)) {
+		std::cout << "Failed to initialize EGL" << std::endl;
+		return false;
+	}
+	if (!eglBindAPI(EGL_OPENGL_API)) {
+		std::cout << "EGL does not support desktop OpenGL" << std::endl;
+		return false;
+	}
+
+	// no surface is ever created, everything is drawn into framebuffer objects
+	const EGLint configAttribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+	EGLConfig config = NULL;
+	EGLint numConfigs = 0;
+	eglChooseConfig(ctx.display, configAttribs, &config, 1, &numConfigs);
+
+	const EGLint contextAttribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 3,
+		EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+	ctx.context = eglCreateContext(ctx.display, numConfigs > 0 ? config : (EGLConfig)0, EGL_NO_CONTEXT, contextAttribs);
+	if (ctx.context == EGL_NO_CONTEXT) {
+		std::cout << "Failed to create EGL context" << std::endl;
+		return false;
+	}
+	if (!eglMakeCurrent(ctx.display, EGL_NO_SURFACE, EGL_NO_SURFACE, ctx.context)) {
+		std::cout << "Failed to make EGL context current (EGL_KHR_surfaceless_context missing?)" << std::endl;
+		return false;
+	}
+	return true;
+}
+#endif
+
+// create an OpenGL 3.3 core context and load GLAD; headless contexts have
+// no default framebuffer, so all rendering must target an FBO
+// ------------------------------------------------------------------------
+inline bool createRenderContext(RenderContext &ctx, bool headless, unsigned int width, unsigned int height)
+{
+	ctx.headless = headless;
+#ifdef USE_EGL
+	if (headless) {
+		if (!createHeadlessContext(ctx))
+			return false;
+		ctx.getProcAddress = (GLADloadproc)eglGetProcAddress;
+		if (!gladLoadGLLoader(ctx.getProcAddress)) {
+			std::cout << "Failed to initialize GLAD" << std::endl;
+			return false;
+		}
+		return true;
+	}
+#endif
+
+	// glfw: initialize and configure
+	// ------------------------------
+	if (!glfwInit()) {
+		std::cout << "Failed to initialize GLFW" << std::endl;
+		return false;
+	}
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	if (headless)
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
+#ifdef __APPLE__
+	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE); // uncomment this statement to fix compilation on OS X
+#endif
+
+	// glfw window creation
+	// --------------------
+	ctx.window = glfwCreateWindow(width, height, "textureMapping", NULL, NULL);
+	if (ctx.window == NULL)
+	{
+		std::cout << "Failed to create GLFW window" << std::endl;
+		glfwTerminate();
+		return false;
+	}
+	glfwMakeContextCurrent(ctx.window);
+	glfwSetFramebufferSizeCallback(ctx.window, framebuffer_size_callback);
+
+	// glad: load all OpenGL function pointers
+	// ---------------------------------------
+	ctx.getProcAddress = (GLADloadproc)glfwGetProcAddress;
+	if (!gladLoadGLLoader(ctx.getProcAddress))
+	{
+		std::cout << "Failed to initialize GLAD" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+inline void destroyRenderContext(RenderContext &ctx)
+{
+#ifdef USE_EGL
+	if (ctx.context != EGL_NO_CONTEXT) {
+		eglMakeCurrent(ctx.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		eglDestroyContext(ctx.display, ctx.context);
+		eglTerminate(ctx.display);
+		ctx.context = EGL_NO_CONTEXT;
+		return;
+	}
+#endif
+	// glfw: terminate, clearing all previously allocated GLFW resources.
+	// ------------------------------------------------------------------
+	glfwTerminate();
+	ctx.window = nullptr;
+}
+
+#endif
@@ -0,0 +1,376 @@
+#ifndef CPU_SHADING_H
+#define CPU_SHADING_H
+
+#include <GL/glm/glm.hpp>
+
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+#include "thread_pool.h"
+#include "light_culling.h"
+#include "half.h"
+
+// Software implementation of shaders/deferred_shading.fs for machines
+// without a GPU. Pixels are shaded a SIMD vector at a time (8 lanes with
+// AVX2, 4 with SSE2, scalar otherwise) and tiles of rows are spread over a
+// thread pool. The texture formats of the GL path are emulated (depth as
+// R16F, mask as R8, output as RGBA8) so both engines produce the same image
+// up to floating point differences between the GPU and the CPU.
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CPU_SHADING_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CPU_SHADING_SSE2
+#endif
+
+// SIMD float vector; comparisons return lane masks that are only meant to
+// be consumed by select()
+// ------------------------------------------------------------------------
+#if defined(CPU_SHADING_AVX2)
+struct vfloat
+{
+	__m256 v;
+	static const int width = 8;
+	vfloat() {}
+	vfloat(__m256 x) : v(x) {}
+	vfloat(float x) : v(_mm256_set1_ps(x)) {}
+	static vfloat load(const float* p) { return _mm256_loadu_ps(p); }
+	void store(float* p) const { _mm256_storeu_ps(p, v); }
+	static vfloat ramp() { return _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f); }
+};
+inline vfloat operator+(vfloat a, vfloat b) { return _mm256_add_ps(a.v, b.v); }
+inline vfloat operator-(vfloat a, vfloat b) { return _mm256_sub_ps(a.v, b.v); }
+inline vfloat operator*(vfloat a, vfloat b) { return _mm256_mul_ps(a.v, b.v); }
+inline vfloat operator/(vfloat a, vfloat b) { return _mm256_div_ps(a.v, b.v); }
+inline vfloat operator<(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline vfloat operator>(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline vfloat vmin(vfloat a, vfloat b) { return _mm256_min_ps(a.v, b.v); }
+inline vfloat vmax(vfloat a, vfloat b) { return _mm256_max_ps(a.v, b.v); }
+inline vfloat vsqrt(vfloat a) { return _mm256_sqrt_ps(a.v); }
+inline vfloat select(vfloat mask, vfloat a, vfloat b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+#elif defined(CPU_SHADING_SSE2)
+struct vfloat
+{
+	__m128 v;
+	static const int width = 4;
+	vfloat() {}
+	vfloat(__m128 x) : v(x) {}
+	vfloat(float x) : v(_mm_set1_ps(x)) {}
+	static vfloat load(const float* p) { return _mm_loadu_ps(p); }
+	void store(float* p) const { _mm_storeu_ps(p, v); }
+	static vfloat ramp() { return _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f); }
+};
+inline vfloat operator+(vfloat a, vfloat b) { return _mm_add_ps(a.v, b.v); }
+inline vfloat operator-(vfloat a, vfloat b) { return _mm_sub_ps(a.v, b.v); }
+inline vfloat operator*(vfloat a, vfloat b) { return _mm_mul_ps(a.v, b.v); }
+inline vfloat operator/(vfloat a, vfloat b) { return _mm_div_ps(a.v, b.v); }
+inline vfloat operator<(vfloat a, vfloat b) { return _mm_cmplt_ps(a.v, b.v); }
+inline vfloat operator>(vfloat a, vfloat b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline vfloat vmin(vfloat a, vfloat b) { return _mm_min_ps(a.v, b.v); }
+inline vfloat vmax(vfloat a, vfloat b) { return _mm_max_ps(a.v, b.v); }
+inline vfloat vsqrt(vfloat a) { return _mm_sqrt_ps(a.v); }
+inline vfloat select(vfloat mask, vfloat a, vfloat b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+#else
+struct vfloat
+{
+	float v;
+	static const int width = 1;
+	vfloat() {}
+	vfloat(float x) : v(x) {}
+	static vfloat load(const float* p) { return *p; }
+	void store(float* p) const { *p = v; }
+	static vfloat ramp() { return 0.0f; }
+};
+inline vfloat operator+(vfloat a, vfloat b) { return a.v + b.v; }
+inline vfloat operator-(vfloat a, vfloat b) { return a.v - b.v; }
+inline vfloat operator*(vfloat a, vfloat b) { return a.v * b.v; }
+inline vfloat operator/(vfloat a, vfloat b) { return a.v / b.v; }
+inline vfloat operator<(vfloat a, vfloat b) { return a.v < b.v ? 1.0f : 0.0f; }
+inline vfloat operator>(vfloat a, vfloat b) { return a.v > b.v ? 1.0f : 0.0f; }
+// same NaN behaviour as minps/maxps: the second operand is returned
+inline vfloat vmin(vfloat a, vfloat b) { return a.v < b.v ? a.v : b.v; }
+inline vfloat vmax(vfloat a, vfloat b) { return a.v > b.v ? a.v : b.v; }
+inline vfloat vsqrt(vfloat a) { return std::sqrt(a.v); }
+inline vfloat select(vfloat mask, vfloat a, vfloat b) { return mask.v != 0.0f ? a : b; }
+#endif
+
+struct vvec3
+{
+	vfloat x, y, z;
+};
+
+inline vfloat dot(const vvec3 &a, const vvec3 &b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+inline vfloat length(const vvec3 &a) { return vsqrt(dot(a, a)); }
+inline vvec3 normalize(const vvec3 &a)
+{
+	vfloat inv = vfloat(1.0f) / length(a);
+	return { a.x * inv, a.y * inv, a.z * inv };
+}
+inline vvec3 operator-(const vvec3 &a, const vvec3 &b) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+inline vfloat clamp01(vfloat x) { return vmin(vmax(x, 0.0f), 1.0f); }
+inline vfloat smoothstep(vfloat edge0, vfloat edge1, vfloat x)
+{
+	vfloat t = clamp01((x - edge0) / (edge1 - edge0));
+	return t * t * (vfloat(3.0f) - vfloat(2.0f) * t);
+}
+// x^100 by repeated squaring: x^64 * x^32 * x^4
+inline vfloat pow100(vfloat x)
+{
+	vfloat x2 = x * x, x4 = x2 * x2, x8 = x4 * x4, x16 = x8 * x8, x32 = x16 * x16;
+	return x32 * x32 * x32 * x4;
+}
+
+// G-buffer arrays as read from HDF5; rows are stored bottom-up like the
+// textures they would be uploaded to. Shadow maps are depth only because
+// ShadowCalculation() tests the view's own mask.
+struct CpuGBuffer
+{
+	unsigned int width = 0, height = 0;
+	const float* normal = nullptr; // 3 floats per pixel, may be null when unlit
+	const float* mask = nullptr;
+	const float* depth = nullptr;
+	unsigned int shadowWidth = 0, shadowHeight = 0;
+	const float* shadowDepth = nullptr;
+	unsigned int shadowWidth1 = 0, shadowHeight1 = 0;
+	const float* shadowDepth1 = nullptr;
+};
+
+// uniforms of deferred_shading.fs; the light-space matrices already include
+// uInvVMatrix
+struct CpuShadingParams
+{
+	glm::mat4 invPMatrix;
+	glm::mat4 lightSpaceMatrix, lightSpaceMatrix1;
+	glm::vec3 ambientColor = glm::vec3(0.0f); // uAmbientColor is only set when lit
+	std::vector<PointLight> lights; // lights 0 and 1 cast the two shadows
+	unsigned int shadowCasters = 3; // bit k: light k casts its shadow
+	LightGrid grid; // built from lights; its tiles span whole lane groups
+	int useLighting = 1, useShadow = 0;
+	int showDepth = 0, showNormals = 0, showPosition = 0;
+};
+
+class CpuShadingEngine
+{
+public:
+	static const unsigned int TILE_ROWS = 8;
+
+	explicit CpuShadingEngine(unsigned int threads = 0) : pool(threads)
+	{
+		// a shaded value goes through an RGBA8 framebuffer, is read back as
+		// float and truncated to a byte again; precompute that round trip
+		for (int k = 0; k < 256; k++)
+			readbackByte[k] = (unsigned char)(std::min((k / 255.0f) * 255.0f, 255.0f));
+	}
+
+	unsigned int threads() const
+	{
+		return pool.size();
+	}
+
+	// shade the G-buffer into an 8-bit RGB image with the row order of
+	// glReadPixels
+	// ------------------------------------------------------------------------
+	void shade(const CpuGBuffer &g, const CpuShadingParams &p, unsigned char* rgb)
+	{
+		size_t tiles = (g.height + TILE_ROWS - 1) / TILE_ROWS;
+		pool.parallelFor(tiles, [&](size_t tile) {
+			unsigned int padded = (g.width + vfloat::width - 1) / vfloat::width * vfloat::width;
+			std::vector<float> rows(padded * 9);
+			unsigned int end = std::min<unsigned int>((unsigned int)(tile + 1) * TILE_ROWS, g.height);
+			for (unsigned int j = (unsigned int)tile * TILE_ROWS; j < end; j++)
+				shadeRow(g, p, j, padded, rows.data(), rgb + (size_t)j * g.width * 3);
+		});
+	}
+
+private:
+	ThreadPool pool;
+	unsigned char readbackByte[256];
+
+	// nearest texel of a GL_REPEAT shadow map, as stored in R16F
+	static float sampleShadow(const float* map, unsigned int w, unsigned int h, float u, float v)
+	{
+		if (!std::isfinite(u) || !std::isfinite(v))
+			return roundToHalf(map[0]);
+		u -= std::floor(u);
+		v -= std::floor(v);
+		unsigned int x = std::min((unsigned int)(u * w), w - 1);
+		unsigned int y = std::min((unsigned int)(v * h), h - 1);
+		return roundToHalf(map[(size_t)y * w + x]);
+	}
+
+	unsigned char toByte(float c) const
+	{
+		// RGBA8 conversion: clamp, scale and round; NaN becomes 0
+		int k = c > 0.0f ? (int)(std::min(c, 1.0f) * 255.0f + 0.5f) : 0;
+		return readbackByte[k];
+	}
+
+	// ShadowCalculation() for one lane group
+	static vfloat shadowFactor(const vfloat ls[4], const float* map, unsigned int w, unsigned int h,
+		vfloat mask, const vvec3 &normal, const vvec3 &lightDir)
+	{
+		// perform perspective divide and transform to [0,1] range
+		vfloat px = ls[0] / ls[3] * 0.5f + 0.5f;
+		vfloat py = ls[1] / ls[3] * 0.5f + 0.5f;
+		vfloat currentDepth = ls[2] / ls[3] * 0.5f + 0.5f;
+
+		float u[vfloat::width], v[vfloat::width], closest[vfloat::width];
+		px.store(u);
+		py.store(v);
+		for (int l = 0; l < vfloat::width; l++)
+			closest[l] = sampleShadow(map, w, h, u[l], v[l]);
+		vfloat closestDepth = select(mask < 0.5f, vfloat(1.0f), vfloat::load(closest));
+
+		vfloat bias = vmax(vfloat(0.05f) * (vfloat(1.0f) - dot(normal, lightDir)), 0.005f);
+		vfloat shadow = select(currentDepth - bias > closestDepth, vfloat(1.0f), vfloat(0.0f));
+		// keep the shadow at 0.0 when outside the far_plane region of the light's frustum.
+		return select(currentDepth > 1.0f, vfloat(0.0f), shadow);
+	}
+
+	static void transform(const glm::mat4 &m, const vfloat in[4], vfloat out[4])
+	{
+		for (int r = 0; r < 4; r++)
+			out[r] = in[0] * m[0][r] + in[1] * m[1][r] + in[2] * m[2][r] + in[3] * m[3][r];
+	}
+
+	void shadeRow(const CpuGBuffer &g, const CpuShadingParams &p, unsigned int j, unsigned int padded, float* rows, unsigned char* out) const
+	{
+		float* depthRow = rows;
+		float* maskRow = rows + padded;
+		float* nx = rows + padded * 2;
+		float* ny = rows + padded * 3;
+		float* nz = rows + padded * 4;
+		float* outR = rows + padded * 5;
+		float* outG = rows + padded * 6;
+		float* outB = rows + padded * 7;
+
+		// Fetch the row in texture precision and split the normals into
+		// planes. GL_LINEAR sampling at a texel center still weights the
+		// texels to the right and above (GL_REPEAT) with 0, so a NaN there
+		// turns the sample into NaN; reproduce that for depth and normals.
+		const unsigned int j1 = (j + 1) % g.height;
+		const float* d = g.depth + (size_t)j * g.width;
+		const float* d1 = g.depth + (size_t)j1 * g.width;
+		const float* m = g.mask + (size_t)j * g.width;
+		const float nan = std::numeric_limits<float>::quiet_NaN();
+		for (unsigned int i = 0; i < g.width; i++) {
+			unsigned int i1 = i + 1 < g.width ? i + 1 : 0;
+			bool depthNaN = std::isnan(d[i1]) || std::isnan(d1[i]) || std::isnan(d1[i1]);
+			depthRow[i] = depthNaN ? nan : roundToHalf(d[i]);
+			maskRow[i] = std::floor(std::min(std::max(m[i], 0.0f), 1.0f) * 255.0f + 0.5f) / 255.0f;
+		}
+		if (g.normal) {
+			const float* n = g.normal + (size_t)j * g.width * 3;
+			const float* n1 = g.normal + (size_t)j1 * g.width * 3;
+			for (unsigned int i = 0; i < g.width; i++) {
+				unsigned int i1 = i + 1 < g.width ? i + 1 : 0;
+				bool normalNaN = std::isnan(n[i1 * 3] + n[i1 * 3 + 1] + n[i1 * 3 + 2])
+					|| std::isnan(n1[i * 3] + n1[i * 3 + 1] + n1[i * 3 + 2])
+					|| std::isnan(n1[i1 * 3] + n1[i1 * 3 + 1] + n1[i1 * 3 + 2]);
+				nx[i] = normalNaN ? nan : n[i * 3 + 0];
+				ny[i] = normalNaN ? nan : n[i * 3 + 1];
+				nz[i] = normalNaN ? nan : n[i * 3 + 2];
+			}
+		}
+		else {
+			// normals were not loaded because nothing reads them
+			std::fill(nx, nx + g.width, 0.0f);
+			std::fill(ny, ny + g.width, 0.0f);
+			std::fill(nz, nz + g.width, 1.0f);
+		}
+		for (unsigned int i = g.width; i < padded; i++) {
+			depthRow[i] = maskRow[i] = 0.0f;
+			nx[i] = ny[i] = 0.0f;
+			nz[i] = 1.0f;
+		}
+
+		const float invW = 1.0f / g.width;
+		const vfloat clipY = ((j + 0.5f) / g.height) * 2.0f - 1.0f;
+		const bool needLightSpace = p.showPosition || (p.useLighting && p.useShadow);
+
+		for (unsigned int i = 0; i < padded; i += vfloat::width) {
+			vfloat depth = vfloat::load(depthRow + i);
+			vfloat mask = vfloat::load(maskRow + i);
+			vvec3 normal = { vfloat::load(nx + i), vfloat::load(ny + i), vfloat::load(nz + i) };
+
+			// ViewPosFromDepth()
+			vfloat clip[4] = { (vfloat::ramp() + (float)i + 0.5f) * invW * 2.0f - 1.0f, clipY, depth * 2.0f - 1.0f, 1.0f };
+			vfloat view[4];
+			transform(p.invPMatrix, clip, view);
+			vvec3 position = { view[0] / view[3], view[1] / view[3], view[2] / view[3] };
+
+			vfloat ls[4], ls1[4];
+			if (needLightSpace) {
+				vfloat world[4] = { position.x, position.y, position.z, 1.0f };
+				transform(p.lightSpaceMatrix, world, ls);
+				transform(p.lightSpaceMatrix1, world, ls1);
+			}
+
+			// calculate lighting as usual; the diffuse color is white
+			vfloat r = p.ambientColor.x, gr = p.ambientColor.y, b = p.ambientColor.z;
+			if (p.useLighting) {
+				vvec3 eyeDir = normalize({ vfloat(0.0f) - position.x, vfloat(0.0f) - position.y, vfloat(0.0f) - position.z });
+				vvec3 surfaceNormal = normalize(normal);
+
+				unsigned int count;
+				const uint32_t* tileLights = p.grid.tileLights(i, j, count);
+				for (unsigned int k = 0; k < count; k++) {
+					const PointLight &light = p.lights[tileLights[k]];
+					vvec3 toLight = vvec3{ light.position.x, light.position.y, light.position.z } - position;
+					vvec3 lightDir = normalize(toLight);
+					vfloat nDotL = dot(surfaceNormal, lightDir);
+					// reflect(-L, N) = 2 * dot(N, L) * N - L
+					vvec3 reflected = { vfloat(2.0f) * nDotL * surfaceNormal.x - lightDir.x, vfloat(2.0f) * nDotL * surfaceNormal.y - lightDir.y, vfloat(2.0f) * nDotL * surfaceNormal.z - lightDir.z };
+					vfloat attenuation = vfloat(1.0f) - smoothstep(light.innerRadius, light.outerRadius, length(toLight));
+					vfloat term = attenuation * (vmax(nDotL, 0.0f) + pow100(vmax(dot(reflected, eyeDir), 0.0f)));
+
+					if (p.useShadow && tileLights[k] < 2 && ((p.shadowCasters >> tileLights[k]) & 1)) {
+						vfloat shadow = tileLights[k] == 0
+							? shadowFactor(ls, g.shadowDepth, g.shadowWidth, g.shadowHeight, mask, surfaceNormal, lightDir)
+							: shadowFactor(ls1, g.shadowDepth1, g.shadowWidth1, g.shadowHeight1, mask, surfaceNormal, lightDir);
+						term = (vfloat(1.0f) - shadow) * term;
+					}
+					r = r + term * light.color.x;
+					gr = gr + term * light.color.y;
+					b = b + term * light.color.z;
+				}
+			}
+			// mask * color + (1 - mask) * background, the background is white
+			vfloat background = vfloat(1.0f) - mask;
+			r = mask * r + background;
+			gr = mask * gr + background;
+			b = mask * b + background;
+
+			if (p.showDepth) {
+				r = gr = b = depth;
+			}
+			if (p.showNormals) {
+				vvec3 nTN = normalize(normal);
+				r = (nTN.x * 0.5f + 0.5f) * mask;
+				gr = (nTN.y * 0.5f + 0.5f) * mask;
+				b = (nTN.z * 0.5f + 0.5f) * mask;
+			}
+			if (p.showPosition) {
+				r = mask * ls[0];
+				gr = mask * ls[1];
+				b = mask * ls[2];
+			}
+			r.store(outR + i);
+			gr.store(outG + i);
+			b.store(outB + i);
+		}
+
+		for (unsigned int i = 0; i < g.width; i++) {
+			out[i * 3 + 0] = toByte(outR[i]);
+			out[i * 3 + 1] = toByte(outG[i]);
+			out[i * 3 + 2] = toByte(outB[i]);
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,841 @@
+#ifndef DEFERRED_RENDERER_H
+#define DEFERRED_RENDERER_H
+
+#include "context.h"
+
+#include <GL/glm/glm.hpp>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <iostream>
+#include <algorithm>
+
+#include "shader.h"
+#include "shader_variants.h"
+#include "program_cache.h"
+#include "camera.h"
+#include "light_set.h"
+#include "light_culling.h"
+#include "gbuffer.h"
+#include "gbuffer_cache.h"
+#include "cpu_shading.h"
+#include "relight.h"
+#include "readback.h"
+#include "gpu_timer.h"
+#include "pipeline.h"
+#include "image_writer.h"
+
+// What and how a renderer draws: the render mode, which is compiled into
+// the lighting pass, and where its shaders come from.
+struct RenderSettings
+{
+	// Use lighting?
+	int useLighting = 1;
+
+	// Use shadow?
+	int useShadow = 0;
+
+	// Render different buffers.
+	int showDepth = 0;
+	int showNormals = 0;
+	int showPosition = 0;
+
+	// Perspective or orthographic projection?
+	bool perspective = true;
+
+	// Cull lights per screen tile? Otherwise every pixel loops over all lights.
+	bool lightCulling = true;
+
+	// Shade lit frames from cached light terms, recomputing only what changed
+	// between the lighting conditions of a view?
+	bool relighting = false;
+
+	// Branch on the render mode uniforms at run time instead of compiling a
+	// permutation of the lighting pass for it?
+	bool uberShader = false;
+
+	std::string shaderDirectory = "../../shaders";
+
+	// Directory of linked shader program binaries, empty to always compile;
+	// by default the per-user cache, never the working directory.
+	std::string shaderCacheDirectory = defaultShaderCacheDirectory();
+
+	// G-buffer channels the shader configuration reads
+	unsigned int channels() const
+	{
+		return deferredShadingChannels(useLighting != 0, useShadow != 0, showNormals != 0);
+	}
+
+	// can the frames of the render mode be relit from cached terms? The
+	// debug views and unlit frames need the full lighting pass.
+	bool relightable() const
+	{
+		return relighting && useLighting == 1 && !showDepth && !showNormals && !showPosition;
+	}
+
+	// #defines of the deferred_shading.fs permutation for the render mode, or
+	// none for the uber-shader that branches on uniforms; the count of
+	// conditions and the normal encoding are compiled in either way
+	// ------------------------------------------------------------------------
+	std::string lightingPassDefines(bool uber, size_t conditions = 1, bool octahedral = false) const
+	{
+		std::string defines = conditions > 1 ? "#define CONDITIONS " + std::to_string(conditions) + "\n" : "";
+		if (octahedral)
+			defines += "#define OCTAHEDRAL_NORMALS\n";
+		if (uber)
+			return defines;
+		auto define = [](const char* name, bool value) {
+			return std::string("#define ") + name + (value ? " true\n" : " false\n");
+		};
+		return defines + define("USE_LIGHTING", useLighting != 0) + define("USE_SHADOW", useShadow != 0)
+			+ define("SHOW_DEPTH", showDepth != 0) + define("SHOW_NORMALS", showNormals != 0) + define("SHOW_POSITION", showPosition != 0);
+	}
+};
+
+// lighting conditions one pass of the lighting pass can shade at most
+const unsigned int MAX_CONDITIONS = 8;
+
+// framebuffer the lighting pass renders into; read back instead of GL_BACK
+struct OutputTarget
+{
+	unsigned int outBuffer;
+	unsigned int gOutput[MAX_CONDITIONS]; // one color buffer per lighting condition
+	unsigned int outputs; // color buffers drawn to
+	unsigned int allocated; // color buffers with storage of the current size
+	unsigned int width, height; // size of gOutput, 0 until the first frame
+};
+
+// std140 layout of the FrameUniforms block of deferred_shading.fs; a vec3
+// and every column of a mat3 take 16 bytes
+struct FrameUniforms
+{
+	glm::mat4 uMVMatrix, uPMatrix, uInvVMatrix, uInvPMatrix;
+	glm::vec4 uNMatrix[3];
+	glm::mat4 lightSpaceMatrix, lightSpaceMatrix1;
+	glm::vec4 uAmbientColor;
+	glm::ivec4 uLightGrid; // tile size, tiles per row, tiles per condition
+	glm::ivec4 uConditions[MAX_CONDITIONS]; // first light, shadow casting bits
+};
+
+const unsigned int FRAME_UNIFORMS_BINDING = 0;
+
+// texture buffers of the light list: lights, tile ranges, tile light indices
+enum LightBuffer { LIGHT_LIST, LIGHT_TILE_RANGES, LIGHT_TILE_INDICES, LIGHT_BUFFER_COUNT };
+
+// per-frame state of the lighting pass outside the G-buffer: the locations
+// of its flag uniforms, the buffer behind FrameUniforms and the culled
+// light list with its texture buffers
+struct LightingUniforms
+{
+	GLint useLighting, useShadow, showDepth, showNormals, showPosition, perspectiveProjection;
+	unsigned int frameBuffer;
+	unsigned int lightBuffers[LIGHT_BUFFER_COUNT], lightTextures[LIGHT_BUFFER_COUNT];
+	LightGrid grid;
+};
+
+// camera matrices of a view in the FrameUniforms block
+// ------------------------------------------------------------------------
+inline void setMatrixUniforms(const Camera &camera, FrameUniforms &uniforms)
+{
+	// Pass the vertex shader the projection matrix and the model-view matrix.
+	uniforms.uPMatrix = camera.pMatrix;
+	uniforms.uMVMatrix = camera.mvMatrix;
+
+	// inverse of view matrix
+	uniforms.uInvVMatrix = camera.invVMatrix();
+
+	// inverse of projection matrix
+	uniforms.uInvPMatrix = camera.invPMatrix();
+
+	// Pass the vertex normal matrix to the shader so it can compute the lighting calculations.
+	glm::mat3 normalMatrix = camera.normalMatrix();
+	for (int column = 0; column < 3; column++)
+		uniforms.uNMatrix[column] = glm::vec4(normalMatrix[column], 0.0f);
+}
+
+// resolve the flag uniforms of a lighting pass program; a permutation
+// compiles its flags in and has none of them (-1)
+// ------------------------------------------------------------------------
+inline void resolveLightingUniforms(Shader &shader, LightingUniforms &uniforms)
+{
+	uniforms.useLighting = shader.location("uUseLighting");
+	uniforms.useShadow = shader.location("uUseShadow");
+	uniforms.showDepth = shader.location("uShowDepth");
+	uniforms.showNormals = shader.location("uShowNormals");
+	uniforms.showPosition = shader.location("uShowPosition");
+	uniforms.perspectiveProjection = shader.location("uPerspectiveProjection");
+}
+
+// create the buffer of the FrameUniforms block and the light list
+// ------------------------------------------------------------------------
+inline void createLightingUniforms(LightingUniforms &uniforms)
+{
+	uniforms = LightingUniforms();
+	glGenBuffers(1, &uniforms.frameBuffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, uniforms.frameBuffer);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UNIFORMS_BINDING, uniforms.frameBuffer);
+
+	const GLenum formats[LIGHT_BUFFER_COUNT] = { GL_RGBA32F, GL_RG32UI, GL_R32UI };
+	glGenBuffers(LIGHT_BUFFER_COUNT, uniforms.lightBuffers);
+	glGenTextures(LIGHT_BUFFER_COUNT, uniforms.lightTextures);
+	for (int i = 0; i < LIGHT_BUFFER_COUNT; i++) {
+		glBindBuffer(GL_TEXTURE_BUFFER, uniforms.lightBuffers[i]);
+		glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+		glBindTexture(GL_TEXTURE_BUFFER, uniforms.lightTextures[i]);
+		glTexBuffer(GL_TEXTURE_BUFFER, formats[i], uniforms.lightBuffers[i]);
+	}
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+}
+
+// upload the lights and their tile lists built in uniforms.grid
+// ------------------------------------------------------------------------
+inline void uploadLights(LightingUniforms &uniforms, const std::vector<PointLight> &lights)
+{
+	const void* data[LIGHT_BUFFER_COUNT] = { lights.data(), uniforms.grid.ranges.data(), uniforms.grid.indices.data() };
+	size_t bytes[LIGHT_BUFFER_COUNT] = { lights.size() * sizeof(PointLight), uniforms.grid.ranges.size() * sizeof(uint32_t), uniforms.grid.indices.size() * sizeof(uint32_t) };
+	for (int i = 0; i < LIGHT_BUFFER_COUNT; i++) {
+		// orphan the old storage; texture buffers must not be empty
+		glBindBuffer(GL_TEXTURE_BUFFER, uniforms.lightBuffers[i]);
+		glBufferData(GL_TEXTURE_BUFFER, std::max(bytes[i], (size_t)16), NULL, GL_STREAM_DRAW);
+		if (bytes[i] > 0)
+			glBufferSubData(GL_TEXTURE_BUFFER, 0, bytes[i], data[i]);
+	}
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+// sampler units and uniform block binding, run once per lighting pass
+// program
+// ------------------------------------------------------------------------
+inline void configureLightingPass(Shader &shader)
+{
+	shader.setInt("gPosition", 0);
+	shader.setInt("gNormal", 1);
+	shader.setInt("gDiffuseColor", 2);
+	shader.setInt("gMask", 3);
+	shader.setInt("gDepth", 4);
+	shader.setInt("gShadowMask", 5);
+	shader.setInt("gShadowDepth", 6);
+	shader.setInt("gShadowMask1", 7);
+	shader.setInt("gShadowDepth1", 8);
+	shader.setInt("gLights", 9);
+	shader.setInt("gTileRanges", 10);
+	shader.setInt("gTileLights", 11);
+	if (!shader.bindUniformBlock("FrameUniforms", FRAME_UNIFORMS_BINDING))
+		std::cout << "ERROR::SHADER::UNIFORM_BLOCK_NOT_FOUND FrameUniforms" << std::endl;
+}
+
+inline void deleteLightingUniforms(LightingUniforms &uniforms)
+{
+	glDeleteBuffers(1, &uniforms.frameBuffer);
+	glDeleteTextures(LIGHT_BUFFER_COUNT, uniforms.lightTextures);
+	glDeleteBuffers(LIGHT_BUFFER_COUNT, uniforms.lightBuffers);
+}
+
+// The output is RGBA8 like a default back buffer, so the values read back
+// are quantized exactly as before. Its storage is allocated by
+// resizeOutputTarget() once the size of the first frame is known.
+// ------------------------------------------------------------------------
+inline void createOutputTarget(OutputTarget &target)
+{
+	target = OutputTarget();
+	glGenFramebuffers(1, &target.outBuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, target.outBuffer);
+	// shaded color buffers, one per lighting condition of a pass
+	glGenTextures(MAX_CONDITIONS, target.gOutput);
+	for (unsigned int k = 0; k < MAX_CONDITIONS; k++) {
+		glBindTexture(GL_TEXTURE_2D, target.gOutput[k]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	}
+
+	// tell OpenGL which color attachments we'll use (of this framebuffer) for rendering
+	glDrawBuffer(GL_COLOR_ATTACHMENT0);
+	target.outputs = 1;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// draw into the first outputs color buffers; they are reallocated when a
+// frame differs in size from the last, and a buffer once allocated stays
+// attached so that passes with different counts do not reallocate
+// ------------------------------------------------------------------------
+inline bool resizeOutputTarget(OutputTarget &target, unsigned int width, unsigned int height, unsigned int outputs = 1)
+{
+	if (target.width == width && target.height == height && target.outputs == outputs && target.allocated >= outputs)
+		return true;
+	if (target.width != width || target.height != height)
+		target.allocated = 0;
+	glBindFramebuffer(GL_FRAMEBUFFER, target.outBuffer);
+	for (unsigned int k = target.allocated; k < outputs; k++) {
+		glBindTexture(GL_TEXTURE_2D, target.gOutput[k]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + k, GL_TEXTURE_2D, target.gOutput[k], 0);
+	}
+	target.allocated = std::max(target.allocated, outputs);
+	GLenum attachments[MAX_CONDITIONS];
+	for (unsigned int k = 0; k < outputs; k++)
+		attachments[k] = GL_COLOR_ATTACHMENT0 + k;
+	glDrawBuffers(outputs, attachments);
+	target.outputs = outputs;
+
+	//finally check if framebuffer is complete
+	bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	if (!complete) {
+		std::cout << "Framebuffer not complete!" << std::endl;
+		target.width = target.height = 0;
+		target.allocated = 0;
+		return false;
+	}
+	target.width = width;
+	target.height = height;
+	return true;
+}
+
+inline void deleteOutputTarget(OutputTarget &target)
+{
+	glDeleteFramebuffers(1, &target.outBuffer);
+	glDeleteTextures(MAX_CONDITIONS, target.gOutput);
+}
+
+// number of lighting conditions one pass can write, limited by the color
+// attachments and draw buffers of the context
+// ------------------------------------------------------------------------
+inline unsigned int conditionsPerPass()
+{
+	GLint drawBuffers = 1, attachments = 1;
+	glGetIntegerv(GL_MAX_DRAW_BUFFERS, &drawBuffers);
+	glGetIntegerv(GL_MAX_COLOR_ATTACHMENTS, &attachments);
+	return std::max(1u, std::min(MAX_CONDITIONS, (unsigned int)std::min(drawBuffers, attachments)));
+}
+
+// texture format of a G-buffer channel
+// ------------------------------------------------------------------------
+inline void channelFormat(const ChannelDataset &dataset, GLint &internalFormat, GLenum &format)
+{
+	format = dataset.components == 3 ? GL_RGB : GL_RED;
+	if (dataset.components == 3)
+		internalFormat = GL_RGB32F;
+	else if (dataset.channel == CHANNEL_DEPTH || dataset.channel == CHANNEL_SHADOW_DEPTH)
+		internalFormat = GL_R16F;
+	else
+		internalFormat = GL_RED;
+}
+
+// Deferred shading of G-buffers through one OpenGL context: the lighting
+// pass and its permutations, the texture cache, the output framebuffer and
+// the readback ring, all owned by the renderer, so several renderers can
+// work side by side, each with a context of its own. The context must be
+// current on the calling thread for the renderer's whole life.
+class DeferredRenderer
+{
+public:
+	DeferredRenderer(RenderContext &ctx, const RenderSettings &settings, DatasetCache &datasets, unsigned int readbackDepth = 2)
+		: ctx(ctx), mode(settings), programCache(settings.shaderCacheDirectory, ctx.getProcAddress),
+		lightingPasses(settings.shaderDirectory + "/deferred_shading.vs", settings.shaderDirectory + "/deferred_shading.fs", &programCache, configureLightingPass),
+		cache(datasets), readback(readbackDepth)
+	{
+		createLightingUniforms(uniforms);
+		perPass = conditionsPerPass();
+		if (mode.relightable())
+			relighter.reset(new Relighter(mode.shaderDirectory, &programCache, mode.lightCulling));
+
+		// the diffuse color is constant white for every view, so a single texel
+		// serves any resolution
+		glGenTextures(1, &gDiffuseColor);
+		glBindTexture(GL_TEXTURE_2D, gDiffuseColor);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		float white[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_FLOAT, white);
+
+		// shadow maps are sampled without filtering, the cached depth texture
+		// itself is linear for the G-buffer
+		glGenSamplers(1, &shadowSampler);
+		glSamplerParameteri(shadowSampler, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glSamplerParameteri(shadowSampler, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+		createOutputTarget(target);
+	}
+
+	~DeferredRenderer()
+	{
+		gpuTimers.collect(true);
+		gpuTimers.clear();
+		cache.clear();
+		readback.clear();
+		glDeleteTextures(1, &gDiffuseColor);
+		glDeleteSamplers(1, &shadowSampler);
+		deleteOutputTarget(target);
+		deleteLightingUniforms(uniforms);
+		lightingPasses.clear();
+		relighter.reset();
+		if (quadVAO != 0) {
+			glDeleteVertexArrays(1, &quadVAO);
+			glDeleteBuffers(1, &quadVBO);
+		}
+	}
+
+	DeferredRenderer(const DeferredRenderer&) = delete;
+	DeferredRenderer& operator=(const DeferredRenderer&) = delete;
+
+	// The render mode; it may change between frames, the lighting pass
+	// permutation follows. Relighting is set up by the constructor.
+	RenderSettings &settings() { return mode; }
+
+	// Do the shaders of the render mode build? Compiles the lighting pass for
+	// one condition, so a missing or broken shader directory shows before the
+	// first frame instead of as blank images; render() fails on a permutation
+	// that does not build either way.
+	// ------------------------------------------------------------------------
+	bool linked()
+	{
+		if (relighter)
+			return relighter->linked();
+		return lightingPasses.get(mode.lightingPassDefines(mode.uberShader)).linked;
+	}
+
+	TextureCache &textures() { return cache; }
+	const LightGrid &lightGrid() const { return uniforms.grid; }
+	Relighter* relighting() { return relighter.get(); }
+	const Camera &camera() const { return view; }
+
+	// Render one loaded G-buffer under every lighting condition and queue
+	// the readbacks, condition c as frame index * conditions + c; the images
+	// reach emit once their transfer finished. Up to conditionsPerPass()
+	// conditions share one pass over the G-buffer.
+	// ------------------------------------------------------------------------
+	bool render(size_t index, GBuffer &gbuffer, const LightSet &lights, const std::vector<LightingCondition> &conditions, const EmitFrame<RgbImage> &emit)
+	{
+		gpuTimers.collect(false);
+		if (relighter) {
+			// one condition at a time, each from the terms the previous one left
+			if (!prepare(gbuffer, lights, 1))
+				return false;
+			if (ctx.window)
+				processInput();
+			glBindFramebuffer(GL_FRAMEBUFFER, target.outBuffer);
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, target.outBuffer);
+			glReadBuffer(GL_COLOR_ATTACHMENT0);
+			for (size_t c = 0; c < conditions.size(); c++) {
+				bool relit;
+				{
+					ProfileScope scope("relight");
+					GpuTimerScope timer(gpuTimers, "relight");
+					relit = relight(gbuffer, lights, conditions[c], c == 0);
+				}
+				if (!relit)
+					return false;
+				GpuTimerScope timer(gpuTimers, "readback");
+				readback.read(index * conditions.size() + c, gbuffer.width, gbuffer.height, emit);
+			}
+		}
+		for (size_t first = 0; first < conditions.size() && !relighter; first += perPass) {
+			size_t count = std::min((size_t)perPass, conditions.size() - first);
+			if (!draw(gbuffer, lights, &conditions[first], count, mode.uberShader))
+				return false;
+
+			// The target is RGBA8, so reading GL_RGB/GL_UNSIGNED_BYTE returns the
+			// stored bytes; the former float readback scaled by 255 and truncated
+			// gave the same values at five times the transfer size.
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, target.outBuffer);
+			for (size_t c = 0; c < count; c++) {
+				glReadBuffer(GL_COLOR_ATTACHMENT0 + (GLenum)c);
+				GpuTimerScope timer(gpuTimers, "readback");
+				readback.read(index * conditions.size() + first + c, gbuffer.width, gbuffer.height, emit);
+			}
+		}
+
+		if (ctx.window) {
+			// show the frame, under the last condition, in the window as well
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+			glBlitFramebuffer(0, 0, gbuffer.width, gbuffer.height, 0, 0, gbuffer.width, gbuffer.height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+			// glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
+			// -------------------------------------------------------------------------------
+			glfwSwapBuffers(ctx.window);
+			glfwPollEvents();
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		return true;
+	}
+
+	// emit the frames whose readback is still outstanding
+	void flush(const EmitFrame<RgbImage> &emit)
+	{
+		readback.flush(emit);
+		gpuTimers.collect(true);
+	}
+
+	// frames rendered but lost in their readback, which are never emitted
+	size_t readbackFailures() const { return readback.failures(); }
+
+	// set up the camera of one loaded G-buffer, size the target for outputs
+	// color buffers and bind the textures of the G-buffer and the shadow
+	// caster of lights
+	// ------------------------------------------------------------------------
+	bool prepare(GBuffer &gbuffer, const LightSet &lights, unsigned int outputs)
+	{
+		view.perspective = mode.perspective;
+		view.orbit(gbuffer.theta, gbuffer.phi, gbuffer.width, gbuffer.height);
+		if (!resizeOutputTarget(target, gbuffer.width, gbuffer.height, outputs))
+			return false;
+
+		// the loader already read the datasets, so only the textures that are
+		// not cached yet are uploaded
+		unsigned int channels = mode.channels();
+		GpuTimerScope timer(gpuTimers, "upload");
+		CachedFile file(gbuffer.source);
+		if (!bindViewTextures(file, channels, gbuffer))
+			return false;
+
+		// light 0 is placed at the camera, so its shadow map is the view itself
+		// and shares the G-buffer's textures; light 1's hits across frames
+		CachedFile shadowFile(lights.shadowFile);
+		GBufferTextures &textures = gbuffer.textures;
+		if (!bindShadowTextures(file, channels, gbuffer.depth, textures.gShadowMask, textures.gShadowDepth)
+			|| !bindShadowTextures(shadowFile, channels, gbuffer.shadowDepth1, textures.gShadowMask1, textures.gShadowDepth1))
+			return false;
+		return true;
+	}
+
+	// draw the lighting pass of one loaded G-buffer into the target, under
+	// count lighting conditions at once; condition k goes to color buffer k,
+	// with the uber-shader or the render mode's permutation
+	// ------------------------------------------------------------------------
+	bool draw(GBuffer &gbuffer, const LightSet &lights, const LightingCondition* conditions, size_t count, bool uber)
+	{
+		Shader &shaderLightingPass = lightingPasses.get(mode.lightingPassDefines(uber, count, gbuffer.octahedralNormals()));
+		if (!shaderLightingPass.linked)
+			return false;
+		if (&shaderLightingPass != resolved) {
+			resolveLightingUniforms(shaderLightingPass, uniforms);
+			resolved = &shaderLightingPass;
+		}
+		if (!prepare(gbuffer, lights, (unsigned int)count))
+			return false;
+		ProfileScope scope("lighting");
+
+		// input
+		// -----
+		if (ctx.window)
+			processInput();
+
+		// render
+		// ------
+
+		glBindFramebuffer(GL_FRAMEBUFFER, target.outBuffer);
+		glViewport(0, 0, gbuffer.width, gbuffer.height);
+		glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+		shaderLightingPass.use();
+
+		// Let the fragment shader know that perspective projection is being used.
+		if (mode.perspective) {
+			shaderLightingPass.setInt(uniforms.perspectiveProjection, 1);
+		}
+		else {
+			shaderLightingPass.setInt(uniforms.perspectiveProjection, 0);
+		}
+
+		shaderLightingPass.setInt(uniforms.showDepth, mode.showDepth);
+		shaderLightingPass.setInt(uniforms.showNormals, mode.showNormals);
+		shaderLightingPass.setInt(uniforms.showPosition, mode.showPosition);
+
+		// camera and lights go to the FrameUniforms block; what an unlit frame
+		// does not set stays zero
+		FrameUniforms frameUniforms = FrameUniforms();
+		setMatrixUniforms(view, frameUniforms);
+
+		// Disable alpha blending.
+		glDisable(GL_BLEND);
+		if (mode.useLighting == 1) {
+			// Pass the lighting parameters to the fragment shader.
+			// Global ambient color.
+			frameUniforms.uAmbientColor = glm::vec4(lights.ambient, 0.0f);
+
+			// the lights of all conditions follow each other in one list; every
+			// screen tile gets those of each condition that can reach its surface
+			std::vector<PointLight> placed;
+			glm::mat4 lightSpaceMatrix, lightSpaceMatrix1;
+			uniforms.grid.setView(gbuffer.depth->floats(), gbuffer.mask->floats(), gbuffer.width, gbuffer.height, view.invPMatrix(), mode.lightCulling);
+			for (size_t c = 0; c < count; c++) {
+				size_t first = placed.size();
+				lights.place(view, gbuffer.shadowWidth1, gbuffer.shadowHeight1, conditions[c], placed, lightSpaceMatrix, lightSpaceMatrix1);
+				uniforms.grid.addLights(placed, first, mode.lightCulling);
+				frameUniforms.uConditions[c] = glm::ivec4((int)first, (int)conditions[c].shadowCasters, 0, 0);
+			}
+			uploadLights(uniforms, placed);
+			frameUniforms.uLightGrid = glm::ivec4(uniforms.grid.tileSize, uniforms.grid.tilesX, (int)uniforms.grid.tileCount(), 0);
+
+			shaderLightingPass.setInt(uniforms.useShadow, mode.useShadow);
+
+			if (mode.useShadow) {
+				frameUniforms.lightSpaceMatrix = lightSpaceMatrix;
+				frameUniforms.lightSpaceMatrix1 = lightSpaceMatrix1;
+			}
+		}
+		glBindBuffer(GL_UNIFORM_BUFFER, uniforms.frameBuffer);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &frameUniforms);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+		// Bind texture; the G-buffer is sampled with and without lighting
+		const GBufferTextures &textures = gbuffer.textures;
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, textures.gPosition);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, textures.gNormal);
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_2D, gDiffuseColor);
+		glActiveTexture(GL_TEXTURE3);
+		glBindTexture(GL_TEXTURE_2D, textures.gMask);
+		glActiveTexture(GL_TEXTURE4);
+		glBindTexture(GL_TEXTURE_2D, textures.gDepth);
+		if (mode.useLighting == 1 && mode.useShadow) {
+			glActiveTexture(GL_TEXTURE5);
+			glBindTexture(GL_TEXTURE_2D, textures.gShadowMask);
+			glActiveTexture(GL_TEXTURE6);
+			glBindTexture(GL_TEXTURE_2D, textures.gShadowDepth);
+			glBindSampler(6, shadowSampler);
+			glActiveTexture(GL_TEXTURE7);
+			glBindTexture(GL_TEXTURE_2D, textures.gShadowMask1);
+			glActiveTexture(GL_TEXTURE8);
+			glBindTexture(GL_TEXTURE_2D, textures.gShadowDepth1);
+			glBindSampler(8, shadowSampler);
+		}
+		glActiveTexture(GL_TEXTURE9);
+		glBindTexture(GL_TEXTURE_BUFFER, uniforms.lightTextures[LIGHT_LIST]);
+		glActiveTexture(GL_TEXTURE10);
+		glBindTexture(GL_TEXTURE_BUFFER, uniforms.lightTextures[LIGHT_TILE_RANGES]);
+		glActiveTexture(GL_TEXTURE11);
+		glBindTexture(GL_TEXTURE_BUFFER, uniforms.lightTextures[LIGHT_TILE_INDICES]);
+
+		shaderLightingPass.setInt(uniforms.useLighting, mode.useLighting);
+
+		// render container
+		GpuTimerScope timer(gpuTimers, "lighting");
+		drawQuad();
+		return true;
+	}
+
+	// relight the view prepared by prepare() into the bound framebuffer under
+	// one condition; the first condition of a view replaces the relighter's
+	// view, later ones only change its lights
+	// ------------------------------------------------------------------------
+	bool relight(GBuffer &gbuffer, const LightSet &lights, const LightingCondition &condition, bool newView)
+	{
+		std::vector<PointLight> placed;
+		glm::mat4 lightSpaceMatrix, lightSpaceMatrix1;
+		lights.place(view, gbuffer.shadowWidth1, gbuffer.shadowHeight1, condition, placed, lightSpaceMatrix, lightSpaceMatrix1);
+		if (newView) {
+			const GBufferTextures &textures = gbuffer.textures;
+			RelightView relit;
+			relit.width = gbuffer.width;
+			relit.height = gbuffer.height;
+			relit.gNormal = textures.gNormal;
+			relit.gMask = textures.gMask;
+			relit.gDepth = textures.gDepth;
+			relit.gDiffuseColor = gDiffuseColor;
+			relit.gShadowMask = textures.gShadowMask;
+			relit.gShadowDepth = textures.gShadowDepth;
+			relit.gShadowMask1 = textures.gShadowMask1;
+			relit.gShadowDepth1 = textures.gShadowDepth1;
+			relit.shadowSampler = shadowSampler;
+			relit.depth = gbuffer.depth->floats();
+			relit.mask = gbuffer.mask->floats();
+			relit.invVMatrix = view.invVMatrix();
+			relit.invPMatrix = view.invPMatrix();
+			relit.lightSpaceMatrix = lightSpaceMatrix;
+			relit.lightSpaceMatrix1 = lightSpaceMatrix1;
+			relit.useShadow = mode.useShadow != 0;
+			relit.octahedralNormals = gbuffer.octahedralNormals();
+			relighter->setView(relit);
+		}
+		relighter->setLights(placed, condition.shadowCasters);
+		relighter->setAmbient(lights.ambient);
+		return relighter->render();
+	}
+
+	// the framebuffer the lighting pass draws into
+	unsigned int framebuffer() const { return target.outBuffer; }
+
+private:
+	// look up the view channels selected in channels in the texture cache,
+	// uploading missing textures from the datasets of gbuffer; datasets
+	// nothing samples are never opened
+	// ------------------------------------------------------------------------
+	bool bindViewTextures(CachedFile &file, unsigned int channels, GBuffer &gbuffer)
+	{
+		for (const ChannelDataset &dataset : VIEW_DATASETS) {
+			if (!(channels & dataset.channel))
+				continue;
+			GLint internalFormat;
+			GLenum format;
+			channelFormat(dataset, internalFormat, format);
+			unsigned int texture = cache.get(file, dataset.name, internalFormat, format, gbuffer.channel(dataset.channel));
+			if (texture == 0)
+				return false;
+			switch (dataset.channel) {
+			case CHANNEL_POSITION: gbuffer.textures.gPosition = texture; break;
+			case CHANNEL_NORMAL: gbuffer.textures.gNormal = texture; break;
+			case CHANNEL_MASK: gbuffer.textures.gMask = texture; break;
+			default: gbuffer.textures.gDepth = texture; break;
+			}
+		}
+		return true;
+	}
+
+	// look up the shadow channels selected in channels of a shadow caster; a
+	// depth map already loaded may be passed in depth
+	// ------------------------------------------------------------------------
+	bool bindShadowTextures(CachedFile &file, unsigned int channels, const DatasetCache::Data &depth, unsigned int &maskTexture, unsigned int &depthTexture)
+	{
+		for (const ChannelDataset &dataset : SHADOW_DATASETS) {
+			if (!(channels & dataset.channel))
+				continue;
+			GLint internalFormat;
+			GLenum format;
+			channelFormat(dataset, internalFormat, format);
+			unsigned int texture = cache.get(file, dataset.name, internalFormat, format,
+				dataset.channel == CHANNEL_SHADOW_DEPTH ? depth : DatasetCache::Data());
+			if (texture == 0)
+				return false;
+			if (dataset.channel == CHANNEL_SHADOW_MASK)
+				maskTexture = texture;
+			else
+				depthTexture = texture;
+		}
+		return true;
+	}
+
+	// process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
+	// ---------------------------------------------------------------------------------------------------------
+	void processInput()
+	{
+		if (glfwGetKey(ctx.window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
+			glfwSetWindowShouldClose(ctx.window, true);
+	}
+
+	// drawQuad() renders a 1x1 XY quad in NDC
+	// -----------------------------------------
+	void drawQuad()
+	{
+		if (quadVAO == 0) {
+			float quadVertices[] = {
+				// positions        // texture Coords
+				-1.0f,  1.0f, 0.0f, 0.0f, 1.0f,
+				-1.0f, -1.0f, 0.0f, 0.0f, 0.0f,
+				 1.0f,  1.0f, 0.0f, 1.0f, 1.0f,
+				 1.0f, -1.0f, 0.0f, 1.0f, 0.0f,
+			};
+			// set up plane VAO
+			glGenVertexArrays(1, &quadVAO);
+			glGenBuffers(1, &quadVBO);
+			glBindVertexArray(quadVAO);
+			glBindBuffer(GL_ARRAY_BUFFER, quadVBO);
+			glBufferData(GL_ARRAY_BUFFER, sizeof(quadVertices), &quadVertices, GL_STATIC_DRAW);
+			glEnableVertexAttribArray(0);
+			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
+			glEnableVertexAttribArray(1);
+			glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
+		}
+		glBindVertexArray(quadVAO);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		glBindVertexArray(0);
+	}
+
+	RenderContext &ctx;
+	RenderSettings mode;
+	ProgramBinaryCache programCache;
+	ShaderVariants lightingPasses;
+	Shader* resolved = nullptr; // program whose uniforms are in uniforms
+	LightingUniforms uniforms;
+	std::unique_ptr<Relighter> relighter;
+	TextureCache cache;
+	unsigned int gDiffuseColor = 0;
+	unsigned int shadowSampler = 0; // nearest filtering for the shadow depth slots
+	OutputTarget target;
+	ReadbackRing readback;
+	GpuTimers gpuTimers; // stages timed while the profiler is enabled
+	unsigned int perPass = 1;
+	unsigned int quadVAO = 0, quadVBO = 0;
+	Camera view; // of the G-buffer being drawn
+};
+
+// Deferred shading of G-buffers on the CPU, no GL context involved; see
+// cpu_shading.h. One renderer shades one frame at a time.
+class CpuDeferredRenderer
+{
+public:
+	explicit CpuDeferredRenderer(const RenderSettings &settings, unsigned int threads = 0) : mode(settings), engine(threads) {}
+
+	RenderSettings &settings() { return mode; }
+
+	// shade one loaded G-buffer under a lighting condition into image
+	// ------------------------------------------------------------------------
+	bool render(const GBuffer &frame, const LightSet &lights, const LightingCondition &condition, RgbImage &image)
+	{
+		Camera camera;
+		camera.perspective = mode.perspective;
+		camera.orbit(frame.theta, frame.phi, frame.width, frame.height);
+
+		CpuGBuffer gbuffer;
+		gbuffer.width = frame.width;
+		gbuffer.height = frame.height;
+		gbuffer.normal = frame.normal ? frame.normal->floats() : nullptr;
+		// normals of packed files are only kept as texels
+		std::vector<float> normals;
+		if (frame.normal && !frame.normal->floats()) {
+			decodePackedTexels(*frame.normal, normals);
+			gbuffer.normal = normals.data();
+		}
+		gbuffer.mask = frame.mask->floats();
+		gbuffer.depth = frame.depth->floats();
+		// light 0 is placed at the camera, so its shadow map is the view's own depth
+		gbuffer.shadowWidth = frame.width;
+		gbuffer.shadowHeight = frame.height;
+		gbuffer.shadowDepth = frame.depth->floats();
+		gbuffer.shadowWidth1 = frame.shadowWidth1;
+		gbuffer.shadowHeight1 = frame.shadowHeight1;
+		gbuffer.shadowDepth1 = frame.shadowDepth1 ? frame.shadowDepth1->floats() : nullptr;
+
+		CpuShadingParams params;
+		params.invPMatrix = camera.invPMatrix();
+		params.useLighting = mode.useLighting;
+		params.useShadow = mode.useShadow;
+		params.showDepth = mode.showDepth;
+		params.showNormals = mode.showNormals;
+		params.showPosition = mode.showPosition;
+		params.lightSpaceMatrix = glm::mat4(0.0f);
+		params.lightSpaceMatrix1 = glm::mat4(0.0f);
+		if (mode.useLighting == 1) {
+			glm::mat4 lightSpaceMatrix, lightSpaceMatrix1;
+			lights.place(camera, frame.shadowWidth1, frame.shadowHeight1, condition, params.lights, lightSpaceMatrix, lightSpaceMatrix1);
+			params.shadowCasters = condition.shadowCasters;
+			params.grid.build(params.lights, frame.depth->floats(), frame.mask->floats(), frame.width, frame.height, params.invPMatrix, mode.lightCulling);
+			params.ambientColor = lights.ambient;
+			if (mode.useShadow) {
+				glm::mat4 invVMatrix = camera.invVMatrix();
+				params.lightSpaceMatrix = lightSpaceMatrix * invVMatrix;
+				params.lightSpaceMatrix1 = lightSpaceMatrix1 * invVMatrix;
+			}
+		}
+
+		image.width = frame.width;
+		image.height = frame.height;
+		image.pixels.resize((size_t)frame.width * frame.height * 3);
+		ProfileScope scope("shade");
+		engine.shade(gbuffer, params, image.pixels.data());
+		return true;
+	}
+
+private:
+	RenderSettings mode;
+	CpuShadingEngine engine;
+};
+
+#endif
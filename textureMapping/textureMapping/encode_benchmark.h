@@ -0,0 +1,87 @@
+#ifndef ENCODE_BENCHMARK_H
+#define ENCODE_BENCHMARK_H
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+
+#include "image_writer.h"
+
+// stb's PNG writer as the reference; defined by the stb_image_write
+// implementation in main.cpp but not declared in its header
+extern "C" unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len);
+
+// repeat encode() for at least the given time; returns MB/s of raw RGB input
+// ------------------------------------------------------------------------
+template <typename Encode>
+double measureEncoder(size_t inputBytes, double seconds, Encode encode)
+{
+	encode(); // warm up allocations
+	int runs = 0;
+	auto start = std::chrono::steady_clock::now();
+	double elapsed = 0.0;
+	do {
+		encode();
+		runs++;
+		elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	} while (elapsed < seconds);
+	return inputBytes * (double)runs / elapsed / 1e6;
+}
+
+// print throughput and compressed size of every output format and of the
+// PNG level/filter/thread combinations for one image
+// ------------------------------------------------------------------------
+inline void runEncodeBenchmark(const std::vector<unsigned char> &rgb, unsigned int width, unsigned int height, double seconds = 0.5)
+{
+	size_t inputBytes = (size_t)width * height * 3;
+	unsigned int cores = std::thread::hardware_concurrency();
+	if (cores == 0)
+		cores = 1;
+
+	printf("%ux%u RGB, %u cores\n", width, height, cores);
+	printf("%-28s %10s %10s\n", "encoder", "MB/s", "size %");
+
+	int stbSize = 0;
+	double stbRate = measureEncoder(inputBytes, seconds, [&] {
+		unsigned char* png = stbi_write_png_to_mem(rgb.data(), width * 3, width, height, 3, &stbSize);
+		free(png);
+	});
+	printf("%-28s %10.1f %10.2f\n", "stb png (level 8)", stbRate, 100.0 * stbSize / inputBytes);
+
+	struct Case { const char* name; ImageFormat format; int level; PngFilter filter; };
+	const Case cases[] = {
+		{ "raw", IMAGE_RAW, 0, PNG_FILTER_NONE },
+		{ "ppm", IMAGE_PPM, 0, PNG_FILTER_NONE },
+		{ "qoi", IMAGE_QOI, 0, PNG_FILTER_NONE },
+		{ "png store", IMAGE_PNG, 0, PNG_FILTER_NONE },
+		{ "png level 1 up", IMAGE_PNG, 1, PNG_FILTER_UP },
+		{ "png level 1 adaptive", IMAGE_PNG, 1, PNG_FILTER_ADAPTIVE },
+		{ "png level 6 adaptive", IMAGE_PNG, 6, PNG_FILTER_ADAPTIVE },
+		{ "png level 9 adaptive", IMAGE_PNG, 9, PNG_FILTER_ADAPTIVE },
+	};
+	for (const Case &c : cases) {
+		std::vector<unsigned int> threadCounts = { 1 };
+		if (c.format == IMAGE_PNG && cores > 1)
+			threadCounts.push_back(cores);
+		for (unsigned int threads : threadCounts) {
+			ImageWriterOptions options;
+			options.format = c.format;
+			options.level = c.level;
+			options.filter = c.filter;
+			options.threads = threads;
+			ImageEncoder encoder(options);
+			std::vector<unsigned char> out;
+			double rate = measureEncoder(inputBytes, seconds, [&] {
+				encoder.encode(rgb.data(), width, height, out);
+			});
+			std::string name = c.name;
+			if (c.format == IMAGE_PNG)
+				name += ", " + std::to_string(threads) + (threads == 1 ? " thread" : " threads");
+			printf("%-28s %10.1f %10.2f\n", name.c_str(), rate, 100.0 * out.size() / inputBytes);
+		}
+	}
+}
+
+#endif
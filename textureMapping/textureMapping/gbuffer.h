@@ -0,0 +1,148 @@
+#ifndef GBUFFER_H
+#define GBUFFER_H
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <iostream>
+
+#include "camera.h"
+#include "gbuffer_channels.h"
+#include "gbuffer_cache.h"
+#include "gbuffer_memory.h"
+#include "view_metadata.h"
+
+// G-buffer textures bound for a view, all from the texture cache; channels
+// the shader does not need stay 0.
+struct GBufferTextures
+{
+	unsigned int gPosition = 0, gNormal = 0, gMask = 0, gDepth = 0;
+	unsigned int gShadowMask = 0, gShadowDepth = 0, gShadowMask1 = 0, gShadowDepth1 = 0;
+};
+
+// One view: its angles, resolution and the arrays of its datasets,
+// prepared by a loader thread, and the textures a renderer bound for it.
+// The resolution comes from the datasets themselves.
+struct GBuffer
+{
+	std::string source; // file or memory the arrays came from; keys their textures
+	float theta = 0.0f, phi = 0.0f; // radians
+	unsigned int width = 0, height = 0;
+	unsigned int shadowWidth1 = 0, shadowHeight1 = 0; // of the shadow caster of light 2
+	DatasetCache::Data position, normal, mask, depth, shadowDepth1;
+	GBufferTextures textures;
+
+	// dataset of a view channel
+	// ------------------------------------------------------------------------
+	DatasetCache::Data &channel(GBufferChannel channel)
+	{
+		switch (channel) {
+		case CHANNEL_POSITION: return position;
+		case CHANNEL_NORMAL: return normal;
+		case CHANNEL_MASK: return mask;
+		default: return depth;
+		}
+	}
+
+	// are the normals octahedral-encoded texels of a packed file?
+	bool octahedralNormals() const
+	{
+		return normal && normal->packed.internalFormat == GL_RG16_SNORM;
+	}
+};
+
+// pull the depth of the shadow caster file into gbuffer if channels cast
+// its shadow
+// ------------------------------------------------------------------------
+inline bool loadShadowCaster(DatasetCache &cache, unsigned int channels, const std::string &shadowFile, GBuffer &gbuffer)
+{
+	gbuffer.shadowWidth1 = gbuffer.width;
+	gbuffer.shadowHeight1 = gbuffer.height;
+	if (channels & CHANNEL_SHADOW_DEPTH) {
+		CachedFile file(shadowFile);
+		gbuffer.shadowDepth1 = cache.get(file, "depth", 1);
+		if (!gbuffer.shadowDepth1)
+			return false;
+		gbuffer.shadowWidth1 = gbuffer.shadowDepth1->width;
+		gbuffer.shadowHeight1 = gbuffer.shadowDepth1->height;
+	}
+	return true;
+}
+
+// Read the view angles of a file, unless the caller already set them in
+// gbuffer, and pull the datasets of channels into the cache; all of them
+// must have the same resolution. Safe on loader threads, it does not touch
+// GL.
+// ------------------------------------------------------------------------
+inline bool loadGBuffer(DatasetCache &cache, unsigned int channels, const std::string &path, const std::string &shadowFile, GBuffer &gbuffer,
+	bool anglesKnown = false)
+{
+	gbuffer.source = path;
+	if (!anglesKnown) {
+		ViewMetadata view;
+		if (!readViewMetadata(path, view))
+			return false;
+		gbuffer.theta = view.theta;
+		gbuffer.phi = view.phi;
+	}
+
+	CachedFile file(path);
+	for (const ChannelDataset &dataset : VIEW_DATASETS) {
+		if (!(channels & dataset.channel))
+			continue;
+		DatasetCache::Data data = cache.get(file, dataset.name, dataset.components);
+		if (!data)
+			return false;
+		if (gbuffer.width == 0) {
+			gbuffer.width = data->width;
+			gbuffer.height = data->height;
+		}
+		else if (data->width != gbuffer.width || data->height != gbuffer.height) {
+			std::cout << "ERROR::HDF5::RESOLUTION_MISMATCH " << path << " " << dataset.name << std::endl;
+			return false;
+		}
+		gbuffer.channel(dataset.channel) = data;
+	}
+	return loadShadowCaster(cache, channels, shadowFile, gbuffer);
+}
+
+// Take a G-buffer from memory instead of a file, the datasets of channels
+// pointing into it; owner keeps the memory alive, null if the caller does.
+// Its textures are uploaded again on every render, the memory may hold the
+// next time step by then. The shadow caster still comes from its file.
+// ------------------------------------------------------------------------
+inline bool loadMemoryGBuffer(DatasetCache &cache, unsigned int channels, const GBufferArrays &arrays, std::shared_ptr<const void> owner,
+	const std::string &shadowFile, GBuffer &gbuffer, const std::string &name = "memory")
+{
+	static std::atomic<size_t> serial{ 0 };
+	gbuffer.source = name + "#" + std::to_string(serial++);
+	gbuffer.theta = (float)(arrays.theta * M_PI / 180);
+	gbuffer.phi = (float)(arrays.phi * M_PI / 180);
+	gbuffer.width = arrays.width;
+	gbuffer.height = arrays.height;
+	for (const ChannelDataset &dataset : VIEW_DATASETS) {
+		if (!(channels & dataset.channel))
+			continue;
+		gbuffer.channel(dataset.channel) = memoryDataset(arrays, memoryArray(dataset.channel), owner);
+		if (!gbuffer.channel(dataset.channel)) {
+			std::cout << "ERROR::MEMORY::MISSING_ARRAY " << dataset.name << std::endl;
+			return false;
+		}
+	}
+	return loadShadowCaster(cache, channels, shadowFile, gbuffer);
+}
+
+// load a G-buffer a producer left in the shared memory segment name
+// ------------------------------------------------------------------------
+inline bool loadSharedGBuffer(DatasetCache &cache, unsigned int channels, const std::string &name, const std::string &shadowFile, GBuffer &gbuffer)
+{
+	std::shared_ptr<SharedMemory> segment = std::make_shared<SharedMemory>(name);
+	if (!segment->data()) {
+		std::cout << "ERROR::MEMORY::SEGMENT_NOT_SUCCESFULLY_OPENED " << name << std::endl;
+		return false;
+	}
+	GBufferArrays arrays;
+	return sharedGBufferArrays(*segment, arrays) && loadMemoryGBuffer(cache, channels, arrays, segment, shadowFile, gbuffer, "shm:" + name);
+}
+
+#endif
@@ -0,0 +1,492 @@
+#ifndef GBUFFER_CACHE_H
+#define GBUFFER_CACHE_H
+
+#include <glad/glad.h>
+
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <iostream>
+#include <filesystem>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#include "hdf5.h"
+#include "hdf5_chunks.h"
+#include "hdf5_handles.h"
+#include "packed_gbuffer.h"
+#include "profiler.h"
+
+// texels of a packed file that are uploaded as they are; the file stays
+// mapped as long as they are referenced
+struct PackedTexels
+{
+	std::shared_ptr<const MappedFile> file;
+	const PackedChannel* channel = nullptr; // in the header of file
+	const void* data = nullptr;
+	GLint internalFormat = 0;
+	GLenum format = 0, type = 0;
+};
+
+// a float dataset seen as an image of width x height pixels. The floats
+// are either read into values or, for datasets stored in place as native
+// floats, used straight from a mapping of the file. Datasets of packed
+// files carry their texels and have no floats where no CPU code needs them
+// (normals).
+struct Dataset
+{
+	unsigned int width = 0, height = 0, components = 1;
+	std::vector<float> values;
+	std::shared_ptr<const void> owner; // keeps mapped alive: a file mapping or shared memory
+	const float* mapped = nullptr;
+	PackedTexels packed;
+
+	// the floats of the dataset, null if it has none
+	const float* floats() const
+	{
+		return mapped ? mapped : (values.empty() ? nullptr : values.data());
+	}
+
+	size_t count() const { return (size_t)width * height * components; }
+};
+
+// Resolution of a dataset with components floats per pixel. 2-D and 3-D
+// datasets are (height, width[, components]); 1-D datasets, and 2-D ones of
+// shape (pixels, components), carry no shape and are taken to be square.
+// ------------------------------------------------------------------------
+inline bool datasetResolution(const OpenDataset &dset, const char* name, unsigned int components, unsigned int &width, unsigned int &height)
+{
+	int ndims = dset.ndims;
+	const hsize_t* dims = dset.dims;
+	bool ok = ndims >= 1 && ndims <= 3;
+	if (ok && (ndims == 1 || (ndims == 2 && components > 1 && dims[1] == components))) {
+		hsize_t pixels = dims[0];
+		if (ndims == 1) {
+			pixels = dims[0] / components;
+			ok = pixels * components == dims[0];
+		}
+		hsize_t side = (hsize_t)(std::sqrt((double)pixels) + 0.5);
+		ok = ok && side * side == pixels;
+		width = height = (unsigned int)side;
+	}
+	else if (ok) {
+		height = (unsigned int)dims[0];
+		width = (unsigned int)dims[1];
+		ok = ndims == 2 ? components == 1 : dims[2] == components;
+	}
+	if (!ok || width == 0 || height == 0) {
+		std::cout << "ERROR::HDF5::CANNOT_INFER_RESOLUTION " << name << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// read a dataset of a packed file: the texels of normals, depth and
+// mask in their upload formats, and the floats of everything but normals
+// for light culling and the CPU engine, in place if stored as floats
+// ------------------------------------------------------------------------
+inline bool readPackedDataset(const std::shared_ptr<const MappedFile> &file, const char* name, unsigned int components, Dataset &dataset)
+{
+	const PackedHeader &header = *(const PackedHeader*)file->data();
+	const PackedChannel* channel = findPackedChannel(header, name);
+	if (!channel || channel->components != components) {
+		std::cout << "ERROR::PACKED::DATASET_NOT_FOUND " << name << std::endl;
+		return false;
+	}
+	dataset.width = header.width;
+	dataset.height = header.height;
+	dataset.components = components;
+	const unsigned char* data = file->data() + channel->offset;
+	if (channel->encoding == PACKED_OCT16)
+		dataset.packed = PackedTexels{ file, channel, data, GL_RG16_SNORM, GL_RG, GL_SHORT };
+	else if (channel->encoding == PACKED_HALF && components == 1)
+		dataset.packed = PackedTexels{ file, channel, data, GL_R16F, GL_RED, GL_HALF_FLOAT };
+	else if (channel->encoding == PACKED_UNORM8 && components == 1)
+		dataset.packed = PackedTexels{ file, channel, data, GL_R8, GL_RED, GL_UNSIGNED_BYTE };
+	if (channel->encoding == PACKED_FLOAT32) {
+		dataset.owner = file;
+		dataset.mapped = (const float*)data;
+	}
+	else if (channel->encoding != PACKED_OCT16) {
+		dataset.values.resize(dataset.count());
+		decodePackedChannel(header, *channel, data, dataset.values.data());
+	}
+	return true;
+}
+
+// expand the packed texels of a dataset to floats, e.g. the normals a
+// packed file only keeps as texels
+// ------------------------------------------------------------------------
+inline void decodePackedTexels(const Dataset &dataset, std::vector<float> &values)
+{
+	const PackedHeader &header = *(const PackedHeader*)dataset.packed.file->data();
+	values.resize(dataset.count());
+	decodePackedChannel(header, *dataset.packed.channel, (const unsigned char*)dataset.packed.data, values.data());
+}
+
+// Fill the NaN normals of a float dataset as packing does (fillNormal);
+// floats used in place are copied first, the file or memory they come
+// from is never written.
+// ------------------------------------------------------------------------
+inline void fillDatasetNormals(Dataset &dataset)
+{
+	const float* floats = dataset.floats();
+	if (!floats || dataset.components != 3)
+		return;
+	if (std::none_of(floats, floats + dataset.count(), [](float v) { return std::isnan(v); }))
+		return;
+	if (dataset.mapped) {
+		dataset.values.assign(floats, floats + dataset.count());
+		dataset.mapped = nullptr;
+		dataset.owner.reset();
+	}
+	fillNanNormals(dataset.values.data(), dataset.width, dataset.height);
+}
+
+// A G-buffer file whose datasets are looked up in the caches. The HDF5
+// file is only opened when a lookup misses and stays open in the handle
+// cache, so a frame whose datasets are all cached never touches the disk
+// beyond a stat(). Packed files (.gbp)
+// are mapped instead; HDF5 files are mapped as well once a dataset can be
+// used in place.
+class CachedFile
+{
+public:
+	explicit CachedFile(const std::string &path) : path(path)
+	{
+		packed = std::filesystem::path(path).extension() == ".gbp";
+		// the same file reached through different relative paths shares entries
+		std::error_code ec;
+		std::filesystem::path absolute = std::filesystem::absolute(path, ec);
+		name = ec ? path : absolute.lexically_normal().string();
+		std::filesystem::file_time_type time = std::filesystem::last_write_time(path, ec);
+		stamp = ec ? -1 : (long long)time.time_since_epoch().count();
+	}
+
+	CachedFile(const CachedFile&) = delete;
+	CachedFile& operator=(const CachedFile&) = delete;
+
+	// cache key of a dataset: path, dataset name and modification time, so
+	// rewriting a file invalidates its entries
+	std::string key(const char* dataset) const
+	{
+		return name + '\n' + dataset + '\n' + std::to_string(stamp);
+	}
+
+	// an open dataset of the HDF5 file, null if the file or the dataset
+	// cannot be opened; call with the HDF5 lock held
+	const OpenDataset* dataset(Hdf5Handles &handles, const char* datasetName)
+	{
+		if (failed)
+			return nullptr;
+		return handles.dataset(name + '\n' + std::to_string(stamp), path, datasetName, &failed);
+	}
+
+	// a numeric attribute of the HDF5 file's root group; call with the HDF5
+	// lock held
+	bool attribute(Hdf5Handles &handles, const char* attributeName, double &value)
+	{
+		return !failed && !packed && handles.attribute(name + '\n' + std::to_string(stamp), path, attributeName, value);
+	}
+
+	// the mapping of the file, null if it cannot be mapped; packed files are
+	// validated, and an invalid one fails the file
+	std::shared_ptr<const MappedFile> mapping()
+	{
+		if (!mappedFile && !failed && !unmappable) {
+			std::shared_ptr<const MappedFile> mapped = std::make_shared<MappedFile>(path);
+			if (!mapped->data() && packed)
+				std::cout << "ERROR::PACKED::FILE_NOT_SUCCESFULLY_OPENED " << path << std::endl;
+			if (mapped->data() && (!packed || packedHeader(*mapped, path)))
+				mappedFile = mapped;
+			else if (packed)
+				failed = true;
+			else
+				unmappable = true;
+		}
+		return mappedFile;
+	}
+
+	const std::string path;
+	bool packed;
+
+private:
+	std::shared_ptr<const MappedFile> mappedFile;
+	std::string name;
+	long long stamp;
+	bool failed = false;
+	bool unmappable = false; // HDF5 files are read with H5Dread instead
+};
+
+// Read a whole float dataset of a file and its resolution through the
+// open handles. A dataset stored in place is not read at all, its floats
+// are used from a mapping of the file. Chunked datasets filtered with shuffle and deflate are
+// read chunk by chunk and decompressed on the decompression pool after the
+// HDF5 lock is released.
+// ------------------------------------------------------------------------
+inline bool readDataset(Hdf5Handles &handles, CachedFile &file, const char* name, unsigned int components, Dataset &dataset)
+{
+	ChunkedRead chunks;
+	{
+		std::lock_guard<std::mutex> lock(hdf5Mutex());
+		const OpenDataset* dset = file.dataset(handles, name);
+		if (!dset || !datasetResolution(*dset, name, components, dataset.width, dataset.height))
+			return false;
+		dataset.components = components;
+		size_t bytes = dataset.count() * sizeof(float);
+		bool inPlace = dset->inPlaceOffset >= 0 && dset->storageBytes == bytes;
+		std::shared_ptr<const MappedFile> mapped = inPlace ? file.mapping() : nullptr;
+		if (mapped && (unsigned long long)dset->inPlaceOffset + bytes <= mapped->size()) {
+			handles.countMapped(bytes);
+			dataset.owner = mapped;
+			dataset.mapped = (const float*)(mapped->data() + dset->inPlaceOffset);
+			return true;
+		}
+		ProfileScope scope("H5Dread");
+		dataset.values.resize(dataset.count());
+		int direct = readChunks(dset->id, chunks);
+		herr_t status = direct < 0 ? -1 : 0;
+		if (direct == 0)
+			status = H5Dread(dset->id, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, dataset.values.data());
+		for (const ChunkedRead::Chunk &chunk : chunks.chunks)
+			handles.countRead(chunk.bytes.size());
+		if (direct == 0)
+			handles.countRead((size_t)dset->storageBytes);
+		if (status < 0) {
+			std::cout << "ERROR::HDF5::DATASET_NOT_SUCCESFULLY_READ " << name << std::endl;
+			return false;
+		}
+		if (direct == 0)
+			return true;
+	}
+	ProfileScope scope("decompress");
+	if (!decodeChunks(chunks, dataset.values.data(), decompressionPool())) {
+		std::cout << "ERROR::HDF5::CHUNK_NOT_SUCCESFULLY_DECOMPRESSED " << name << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Decoded datasets, least recently used entries are dropped once the total
+// size exceeds the budget. Entries are shared, so a dropped dataset stays
+// valid for whoever still holds it. Lookups may come from several loader
+// threads; a CachedFile itself is only used by one thread at a time.
+class DatasetCache
+{
+public:
+	typedef std::shared_ptr<const Dataset> Data;
+
+	explicit DatasetCache(size_t maxBytes = 64 << 20) : maxBytes(maxBytes) {}
+
+	// the dataset with components floats per pixel, read on a miss; null if
+	// it cannot be read
+	// ------------------------------------------------------------------------
+	Data get(CachedFile &file, const char* name, unsigned int components)
+	{
+		std::string key = file.key(name);
+		std::unique_lock<std::mutex> lock(mutex);
+		auto it = entries.find(key);
+		if (it != entries.end() && it->second.data->components == components) {
+			hitCount++;
+			order.splice(order.begin(), order, it->second.position);
+			return it->second.data;
+		}
+		missCount++;
+
+		// read without holding the cache, hits for other files go on meanwhile
+		lock.unlock();
+		std::shared_ptr<Dataset> data = std::make_shared<Dataset>();
+		if (file.packed) {
+			std::shared_ptr<const MappedFile> mapping = file.mapping();
+			if (!mapping || !readPackedDataset(mapping, name, components, *data))
+				return Data();
+		}
+		else {
+			if (!readDataset(hdf5Handles(), file, name, components, *data))
+				return Data();
+			if (strcmp(name, "normal") == 0)
+				fillDatasetNormals(*data);
+		}
+		lock.lock();
+
+		it = entries.find(key);
+		if (it != entries.end())
+			erase(it);
+		order.push_front(key);
+		entries[key] = Entry{ data, order.begin() };
+		bytes += size(*data);
+		while (bytes > maxBytes && entries.size() > 1)
+			erase(entries.find(order.back()));
+		return data;
+	}
+
+	size_t hits() const { return hitCount; }
+	size_t misses() const { return missCount; }
+
+private:
+	struct Entry
+	{
+		Data data;
+		std::list<std::string>::iterator position;
+	};
+
+	// floats held by an entry; mapped ones count as well, they occupy the
+	// page cache instead of the heap
+	static size_t size(const Dataset &data)
+	{
+		return data.floats() ? data.count() * sizeof(float) : 0;
+	}
+
+	void erase(std::unordered_map<std::string, Entry>::iterator it)
+	{
+		bytes -= size(*it->second.data);
+		order.erase(it->second.position);
+		entries.erase(it);
+	}
+
+	std::mutex mutex;
+	size_t maxBytes;
+	size_t bytes = 0;
+	size_t hitCount = 0, missCount = 0;
+	std::unordered_map<std::string, Entry> entries;
+	std::list<std::string> order; // most recently used first
+};
+
+// GL textures of datasets, keyed like the datasets plus the texture
+// format. Textures are created with GL_LINEAR filtering; slots that need
+// another filter bind a sampler object, so the primary depth and the shadow
+// map of a light at the camera share one texture. Least recently used
+// textures are deleted once their estimated size exceeds the budget, but
+// the newest MIN_ENTRIES always stay so that all textures of one frame are
+// alive while it is drawn. An evicted texture is reused for the next upload
+// of the same format and size.
+class TextureCache
+{
+public:
+	static const size_t MIN_ENTRIES = 8;
+
+	TextureCache(DatasetCache &datasets, size_t maxBytes = (size_t)512 << 20) : datasets(datasets), maxBytes(maxBytes) {}
+
+	~TextureCache()
+	{
+		clear();
+	}
+
+	TextureCache(const TextureCache&) = delete;
+	TextureCache& operator=(const TextureCache&) = delete;
+
+	// texture holding the dataset, uploaded on a miss from data if given or
+	// else through the dataset cache; 0 if it cannot be read
+	// ------------------------------------------------------------------------
+	unsigned int get(CachedFile &file, const char* name, GLint internalFormat, GLenum format, DatasetCache::Data data = DatasetCache::Data())
+	{
+		std::string key = file.key(name) + '\n' + std::to_string(internalFormat);
+		auto it = entries.find(key);
+		if (it != entries.end()) {
+			hitCount++;
+			order.splice(order.begin(), order, it->second.position);
+			return it->second.texture;
+		}
+		missCount++;
+
+		unsigned int components = format == GL_RGB ? 3 : (format == GL_RGBA ? 4 : 1);
+		if (!data)
+			data = datasets.get(file, name, components);
+		if (!data)
+			return 0;
+		unsigned int width = data->width, height = data->height;
+		// packed texels keep their own format; the key stays the requested one
+		const void* pixels = data->floats();
+		GLenum type = GL_FLOAT;
+		if (data->packed.data) {
+			pixels = data->packed.data;
+			internalFormat = data->packed.internalFormat;
+			format = data->packed.format;
+			type = data->packed.type;
+		}
+		size_t size = (size_t)width * height * texelBytes(internalFormat);
+
+		ProfileScope scope("upload");
+		unsigned int texture = 0;
+		while (!entries.empty() && (bytes + size > maxBytes && entries.size() >= MIN_ENTRIES)) {
+			auto victim = entries.find(order.back());
+			if (texture == 0 && victim->second.internalFormat == internalFormat && victim->second.width == width && victim->second.height == height) {
+				texture = victim->second.texture;
+				victim->second.texture = 0;
+			}
+			erase(victim);
+		}
+		// rows of packed texels are tightly packed
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		if (texture == 0) {
+			glGenTextures(1, &texture);
+			glBindTexture(GL_TEXTURE_2D, texture);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, pixels);
+		}
+		else {
+			glBindTexture(GL_TEXTURE_2D, texture);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, type, pixels);
+		}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+		order.push_front(key);
+		entries[key] = Entry{ texture, internalFormat, width, height, size, order.begin() };
+		bytes += size;
+		return texture;
+	}
+
+	// delete all textures; call while the context is still current
+	void clear()
+	{
+		while (!entries.empty())
+			erase(entries.begin());
+	}
+
+	size_t hits() const { return hitCount; }
+	size_t misses() const { return missCount; }
+
+private:
+	struct Entry
+	{
+		unsigned int texture;
+		GLint internalFormat;
+		unsigned int width, height;
+		size_t size;
+		std::list<std::string>::iterator position;
+	};
+
+	static size_t texelBytes(GLint internalFormat)
+	{
+		switch (internalFormat) {
+		case GL_RGB32F: return 12;
+		case GL_RGBA32F: return 16;
+		case GL_R16F: return 2;
+		case GL_RED: case GL_R8: return 1;
+		default: return 4;
+		}
+	}
+
+	void erase(std::unordered_map<std::string, Entry>::iterator it)
+	{
+		if (it->second.texture)
+			glDeleteTextures(1, &it->second.texture);
+		bytes -= it->second.size;
+		order.erase(it->second.position);
+		entries.erase(it);
+	}
+
+	DatasetCache &datasets;
+	size_t maxBytes;
+	size_t bytes = 0;
+	size_t hitCount = 0, missCount = 0;
+	std::unordered_map<std::string, Entry> entries;
+	std::list<std::string> order; // most recently used first
+};
+
+#endif
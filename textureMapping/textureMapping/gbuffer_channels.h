@@ -0,0 +1,55 @@
+#ifndef GBUFFER_CHANNELS_H
+#define GBUFFER_CHANNELS_H
+
+// Datasets of an MPAS G-buffer file. A render configuration declares the
+// channels its shader actually samples and the loaders only open and read
+// those.
+enum GBufferChannel
+{
+	CHANNEL_POSITION = 1 << 0,
+	CHANNEL_NORMAL = 1 << 1,
+	CHANNEL_DEPTH = 1 << 2,
+	CHANNEL_MASK = 1 << 3,
+	CHANNEL_SHADOW_DEPTH = 1 << 4, // depth of a shadow caster's view
+	CHANNEL_SHADOW_MASK = 1 << 5, // mask of a shadow caster's view
+};
+
+struct ChannelDataset
+{
+	GBufferChannel channel;
+	const char* name;
+	unsigned int components;
+};
+
+// datasets read from the rendered view
+const ChannelDataset VIEW_DATASETS[] = {
+	{ CHANNEL_POSITION, "position", 3 },
+	{ CHANNEL_NORMAL, "normal", 3 },
+	{ CHANNEL_MASK, "mask", 1 },
+	{ CHANNEL_DEPTH, "depth", 1 },
+};
+
+// datasets read from the view of a shadow-casting light
+const ChannelDataset SHADOW_DATASETS[] = {
+	{ CHANNEL_SHADOW_MASK, "mask", 1 },
+	{ CHANNEL_SHADOW_DEPTH, "depth", 1 },
+};
+
+// Channels shaders/deferred_shading.fs depends on for a configuration:
+// - position is reconstructed from depth in ViewPosFromDepth(), gPosition is
+//   never sampled
+// - normals only reach the output through lighting or uShowNormals
+// - ShadowCalculation() reads the caster's depth but tests the view's own
+//   mask, so gShadowMask is never needed
+// ------------------------------------------------------------------------
+inline unsigned int deferredShadingChannels(bool useLighting, bool useShadow, bool showNormals)
+{
+	unsigned int channels = CHANNEL_DEPTH | CHANNEL_MASK;
+	if (useLighting || showNormals)
+		channels |= CHANNEL_NORMAL;
+	if (useLighting && useShadow)
+		channels |= CHANNEL_SHADOW_DEPTH;
+	return channels;
+}
+
+#endif
@@ -0,0 +1,286 @@
+#ifndef GBUFFER_MEMORY_H
+#define GBUFFER_MEMORY_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <iostream>
+#include <cstring>
+#include <cstdint>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "gbuffer_channels.h"
+#include "gbuffer_cache.h"
+
+// Arrays of a G-buffer handed over in memory, e.g. by a running simulation,
+// instead of in an MPAS file; they hold the floats of the file's datasets.
+enum MemoryArray { MEMORY_POSITION, MEMORY_NORMAL, MEMORY_DEPTH, MEMORY_MASK, MEMORY_ARRAYS };
+
+// A G-buffer in the caller's memory. Arrays are row-major float32, bottom
+// row first like the HDF5 datasets and the textures they are uploaded to,
+// with 3 components for position and normal and 1 for depth and mask.
+struct GBufferArrays
+{
+	unsigned int width = 0, height = 0;
+	float theta = 0.0f, phi = 0.0f; // view angles in degrees, as in MPAS file names
+	const float* arrays[MEMORY_ARRAYS] = {}; // null if absent
+	size_t rowStrides[MEMORY_ARRAYS] = {}; // bytes between rows, 0 if tightly packed
+};
+
+const char SHARED_GBUFFER_MAGIC[4] = { 'G', 'B', 'S', 'M' };
+const uint32_t SHARED_GBUFFER_VERSION = 1;
+
+// Header at the start of a shared memory G-buffer; offsets are in bytes
+// from the start of the segment. The producer must not change the segment
+// while a render of it is pending.
+struct SharedGBufferHeader
+{
+	char magic[4]; // SHARED_GBUFFER_MAGIC
+	uint32_t version; // SHARED_GBUFFER_VERSION
+	uint32_t width, height;
+	float theta, phi; // degrees
+	uint64_t offsets[MEMORY_ARRAYS]; // 0 if absent
+	uint64_t rowStrides[MEMORY_ARRAYS]; // 0 if tightly packed
+};
+
+// components per pixel of an array
+inline unsigned int memoryComponents(MemoryArray array)
+{
+	return array == MEMORY_POSITION || array == MEMORY_NORMAL ? 3 : 1;
+}
+
+// the array holding a view channel
+inline MemoryArray memoryArray(GBufferChannel channel)
+{
+	switch (channel) {
+	case CHANNEL_POSITION: return MEMORY_POSITION;
+	case CHANNEL_NORMAL: return MEMORY_NORMAL;
+	case CHANNEL_MASK: return MEMORY_MASK;
+	default: return MEMORY_DEPTH;
+	}
+}
+
+// A named shared memory segment (POSIX shm_open, a named file mapping on
+// Windows), opened read-only or created for writing; empty if that fails.
+// A created segment is removed again when its creator is destroyed.
+class SharedMemory
+{
+public:
+	// open an existing segment for reading
+	// ------------------------------------------------------------------------
+	explicit SharedMemory(const std::string &name) : name(name)
+	{
+#ifdef _WIN32
+		HANDLE mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name.c_str());
+		if (!mapping)
+			return;
+		bytes = (unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		MEMORY_BASIC_INFORMATION info;
+		if (bytes && VirtualQuery(bytes, &info, sizeof(info)))
+			length = info.RegionSize;
+		CloseHandle(mapping);
+#else
+		int segment = shm_open(name.c_str(), O_RDONLY, 0);
+		if (segment < 0)
+			return;
+		struct stat status;
+		if (fstat(segment, &status) == 0 && status.st_size > 0) {
+			void* view = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_SHARED, segment, 0);
+			if (view != MAP_FAILED) {
+				bytes = (unsigned char*)view;
+				length = (size_t)status.st_size;
+			}
+		}
+		close(segment);
+#endif
+	}
+
+	// create a segment of size bytes, replacing one of the same name
+	// ------------------------------------------------------------------------
+	SharedMemory(const std::string &name, size_t size) : name(name), created(true)
+	{
+#ifdef _WIN32
+		mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, name.c_str());
+		if (!mapping)
+			return;
+		bytes = (unsigned char*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+		if (bytes)
+			length = size;
+#else
+		shm_unlink(name.c_str());
+		int segment = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (segment < 0)
+			return;
+		if (ftruncate(segment, (off_t)size) == 0) {
+			void* view = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, segment, 0);
+			if (view != MAP_FAILED) {
+				bytes = (unsigned char*)view;
+				length = size;
+			}
+		}
+		close(segment);
+#endif
+	}
+
+	~SharedMemory()
+	{
+		if (bytes) {
+#ifdef _WIN32
+			UnmapViewOfFile(bytes);
+#else
+			munmap(bytes, length);
+#endif
+		}
+#ifdef _WIN32
+		// the segment goes away with its last handle
+		if (mapping)
+			CloseHandle(mapping);
+#else
+		if (created)
+			shm_unlink(name.c_str());
+#endif
+	}
+
+	SharedMemory(const SharedMemory&) = delete;
+	SharedMemory& operator=(const SharedMemory&) = delete;
+
+	const unsigned char* data() const { return bytes; }
+	unsigned char* writable() { return created ? bytes : nullptr; } // null unless created
+	size_t size() const { return length; }
+
+	const std::string name;
+
+private:
+	unsigned char* bytes = nullptr;
+	size_t length = 0;
+	bool created = false;
+#ifdef _WIN32
+	HANDLE mapping = NULL;
+#endif
+};
+
+// bytes of a shared G-buffer of the given size with every array, tightly packed
+// ------------------------------------------------------------------------
+inline size_t sharedGBufferSize(unsigned int width, unsigned int height)
+{
+	return sizeof(SharedGBufferHeader) + (size_t)width * height * (3 + 3 + 1 + 1) * sizeof(float);
+}
+
+// Write the header and the arrays of a G-buffer into a created segment of at
+// least sharedGBufferSize bytes, tightly packed; for producers.
+// ------------------------------------------------------------------------
+inline bool writeSharedGBuffer(SharedMemory &segment, const GBufferArrays &gbuffer)
+{
+	unsigned char* bytes = segment.writable();
+	if (!bytes || segment.size() < sharedGBufferSize(gbuffer.width, gbuffer.height))
+		return false;
+	SharedGBufferHeader header = SharedGBufferHeader();
+	memcpy(header.magic, SHARED_GBUFFER_MAGIC, sizeof(header.magic));
+	header.version = SHARED_GBUFFER_VERSION;
+	header.width = gbuffer.width;
+	header.height = gbuffer.height;
+	header.theta = gbuffer.theta;
+	header.phi = gbuffer.phi;
+	size_t offset = sizeof(SharedGBufferHeader);
+	for (int a = 0; a < MEMORY_ARRAYS; a++) {
+		if (!gbuffer.arrays[a])
+			continue;
+		size_t rowBytes = (size_t)gbuffer.width * memoryComponents((MemoryArray)a) * sizeof(float);
+		size_t stride = gbuffer.rowStrides[a] ? gbuffer.rowStrides[a] : rowBytes;
+		for (unsigned int y = 0; y < gbuffer.height; y++)
+			memcpy(bytes + offset + y * rowBytes, (const unsigned char*)gbuffer.arrays[a] + y * stride, rowBytes);
+		header.offsets[a] = offset;
+		offset += rowBytes * gbuffer.height;
+	}
+	memcpy(bytes, &header, sizeof(header));
+	return true;
+}
+
+// Check the header of a shared G-buffer and point arrays into the segment;
+// false if the segment does not hold a valid one.
+// ------------------------------------------------------------------------
+inline bool sharedGBufferArrays(const SharedMemory &segment, GBufferArrays &gbuffer)
+{
+	const SharedGBufferHeader* header = (const SharedGBufferHeader*)segment.data();
+	if (!header || segment.size() < sizeof(SharedGBufferHeader) || memcmp(header->magic, SHARED_GBUFFER_MAGIC, sizeof(header->magic)) != 0) {
+		std::cout << "ERROR::MEMORY::NOT_A_SHARED_GBUFFER " << segment.name << std::endl;
+		return false;
+	}
+	if (header->version != SHARED_GBUFFER_VERSION || header->width == 0 || header->height == 0
+		|| header->width > 16384 || header->height > 16384) {
+		std::cout << "ERROR::MEMORY::UNSUPPORTED_SHARED_GBUFFER " << segment.name << std::endl;
+		return false;
+	}
+	gbuffer.width = header->width;
+	gbuffer.height = header->height;
+	gbuffer.theta = header->theta;
+	gbuffer.phi = header->phi;
+	for (int a = 0; a < MEMORY_ARRAYS; a++) {
+		gbuffer.arrays[a] = nullptr;
+		gbuffer.rowStrides[a] = 0;
+		uint64_t offset = header->offsets[a];
+		if (offset == 0)
+			continue;
+		uint64_t rowBytes = (uint64_t)header->width * memoryComponents((MemoryArray)a) * sizeof(float);
+		uint64_t stride = header->rowStrides[a] ? header->rowStrides[a] : rowBytes;
+		// the last row ends at offset + stride * (height - 1) + rowBytes; every
+		// term is checked against what is left of the segment, as any sum of
+		// them could wrap around
+		uint64_t size = segment.size();
+		if (offset % sizeof(float) != 0 || stride % sizeof(float) != 0 || stride < rowBytes
+			|| offset > size || rowBytes > size - offset
+			|| (header->height > 1 && stride > (size - offset - rowBytes) / (header->height - 1))) {
+			std::cout << "ERROR::MEMORY::ARRAY_OUT_OF_BOUNDS " << segment.name << std::endl;
+			return false;
+		}
+		gbuffer.arrays[a] = (const float*)(segment.data() + offset);
+		gbuffer.rowStrides[a] = (size_t)stride;
+	}
+	return true;
+}
+
+// The dataset of one array, null if it is absent. Tightly packed arrays are
+// used in place, kept alive by owner (null for memory the caller keeps);
+// rows with padding are copied, as are normals with NaN to be filled like
+// those of files.
+// ------------------------------------------------------------------------
+inline DatasetCache::Data memoryDataset(const GBufferArrays &gbuffer, MemoryArray array, std::shared_ptr<const void> owner)
+{
+	const float* floats = gbuffer.arrays[array];
+	if (!floats)
+		return nullptr;
+	std::shared_ptr<Dataset> dataset = std::make_shared<Dataset>();
+	dataset->width = gbuffer.width;
+	dataset->height = gbuffer.height;
+	dataset->components = memoryComponents(array);
+	size_t rowFloats = (size_t)gbuffer.width * dataset->components;
+	size_t stride = gbuffer.rowStrides[array];
+	if (stride == 0 || stride == rowFloats * sizeof(float)) {
+		dataset->owner = owner;
+		dataset->mapped = floats;
+	}
+	else {
+		dataset->values.resize(dataset->count());
+		for (unsigned int y = 0; y < gbuffer.height; y++)
+			memcpy(&dataset->values[y * rowFloats], (const unsigned char*)floats + y * stride, rowFloats * sizeof(float));
+	}
+	if (array == MEMORY_NORMAL)
+		fillDatasetNormals(*dataset);
+	return dataset;
+}
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef GPU_TIMER_H
+#define GPU_TIMER_H
+
+#include <glad/glad.h>
+
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+#include "profiler.h"
+
+// GL_TIME_ELAPSED queries around the GPU stages of a context, handed to the
+// profiler once their results are available, so timing never stalls the
+// frame pipeline. Timer queries cannot nest: a stage begun while another
+// one is timed is not timed. Elapsed times have no position on the
+// timeline; in the trace a GPU stage starts when it was issued or when the
+// GPU stage before it ended, whichever is later. Nothing is queried while
+// the profiler is disabled.
+class GpuTimers
+{
+public:
+	GpuTimers() {}
+
+	~GpuTimers()
+	{
+		clear();
+	}
+
+	GpuTimers(const GpuTimers&) = delete;
+	GpuTimers& operator=(const GpuTimers&) = delete;
+
+	// start timing a stage of the current frame; false if it is not timed
+	// ------------------------------------------------------------------------
+	bool begin(const char* name)
+	{
+		if (timing || !profiler().enabled())
+			return false;
+		unsigned int query;
+		if (idle.empty())
+			glGenQueries(1, &query);
+		else {
+			query = idle.back();
+			idle.pop_back();
+		}
+		glBeginQuery(GL_TIME_ELAPSED, query);
+		pending.push_back(Query{ query, name, profileFrame(), profiler().now() });
+		timing = true;
+		return true;
+	}
+
+	void end()
+	{
+		glEndQuery(GL_TIME_ELAPSED);
+		timing = false;
+	}
+
+	// hand the finished queries to the profiler, in the order they were
+	// issued; with wait, all of them
+	// ------------------------------------------------------------------------
+	void collect(bool wait)
+	{
+		while (!pending.empty() && !(timing && pending.size() == 1)) {
+			Query &query = pending.front();
+			if (!wait) {
+				GLint available = 0;
+				glGetQueryObjectiv(query.id, GL_QUERY_RESULT_AVAILABLE, &available);
+				if (!available)
+					break;
+			}
+			GLuint64 elapsed = 0;
+			glGetQueryObjectui64v(query.id, GL_QUERY_RESULT, &elapsed);
+			double start = std::max(query.issued, gpuTime), duration = elapsed / 1000.0;
+			gpuTime = start + duration;
+			profiler().add(query.name, PROFILE_GPU, query.frame, start, duration);
+			idle.push_back(query.id);
+			pending.pop_front();
+		}
+	}
+
+	// delete the queries; call while the context is still current
+	void clear()
+	{
+		for (const Query &query : pending)
+			idle.push_back(query.id);
+		pending.clear();
+		if (!idle.empty())
+			glDeleteQueries((GLsizei)idle.size(), idle.data());
+		idle.clear();
+		timing = false;
+	}
+
+private:
+	struct Query
+	{
+		unsigned int id;
+		const char* name;
+		size_t frame;
+		double issued; // profiler time begin() was called
+	};
+
+	std::deque<Query> pending; // oldest first
+	std::vector<unsigned int> idle;
+	bool timing = false;
+	double gpuTime = 0.0; // end of the last GPU stage on the timeline
+};
+
+// times the enclosing block as a GPU stage
+class GpuTimerScope
+{
+public:
+	GpuTimerScope(GpuTimers &timers, const char* name) : timers(timers), timed(timers.begin(name)) {}
+
+	~GpuTimerScope()
+	{
+		if (timed)
+			timers.end();
+	}
+
+	GpuTimerScope(const GpuTimerScope&) = delete;
+	GpuTimerScope& operator=(const GpuTimerScope&) = delete;
+
+private:
+	GpuTimers &timers;
+	bool timed;
+};
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef HALF_H
+#define HALF_H
+
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+
+// float <-> binary16 conversion (round to nearest even), used to reproduce
+// the precision of the GL_R16F depth textures and to store depth in packed
+// G-buffer files
+// ------------------------------------------------------------------------
+inline uint16_t floatToHalf(float f)
+{
+	uint32_t x;
+	std::memcpy(&x, &f, 4);
+	uint32_t sign = (x >> 16) & 0x8000;
+	uint32_t absx = x & 0x7fffffff;
+	if (absx >= 0x7f800000) // inf or nan
+		return (uint16_t)(sign | 0x7c00 | (absx > 0x7f800000 ? 0x200 : 0));
+	if (absx >= 0x477ff000) // rounds to inf
+		return (uint16_t)(sign | 0x7c00);
+	if (absx < 0x38800000) { // subnormal half
+		float a;
+		std::memcpy(&a, &absx, 4);
+		return (uint16_t)(sign | (uint32_t)std::nearbyint(a * 16777216.0f));
+	}
+	uint32_t mant = absx & 0x7fffff;
+	uint32_t h = (((absx >> 23) - 127 + 15) << 10) | (mant >> 13);
+	uint32_t rest = mant & 0x1fff;
+	if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+		h++;
+	return (uint16_t)(sign | h);
+}
+
+inline float halfToFloat(uint16_t h)
+{
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+	uint32_t exp = (h >> 10) & 0x1f;
+	uint32_t mant = h & 0x3ff;
+	if (exp == 0) {
+		float f = mant * (1.0f / 16777216.0f);
+		return sign ? -f : f;
+	}
+	uint32_t bits = exp == 31 ? (sign | 0x7f800000 | (mant << 13)) : (sign | ((exp - 15 + 127) << 23) | (mant << 13));
+	float f;
+	std::memcpy(&f, &bits, 4);
+	return f;
+}
+
+inline float roundToHalf(float f)
+{
+	return halfToFloat(floatToHalf(f));
+}
+
+#endif
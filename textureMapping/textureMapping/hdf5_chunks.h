@@ -0,0 +1,344 @@
+#ifndef HDF5_CHUNKS_H
+#define HDF5_CHUNKS_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <iostream>
+#include <filesystem>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+#include "hdf5.h"
+#include "zlib.h"
+#include "thread_pool.h"
+
+// The serial HDF5 library is not thread-safe, so every HDF5 call that may
+// run next to a loader thread holds this lock.
+inline std::mutex &hdf5Mutex()
+{
+	static std::mutex mutex;
+	return mutex;
+}
+
+// workers that decompress the chunks of datasets; loaders take turns
+inline ThreadPool &decompressionPool()
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+// The raw chunks of a chunked float dataset. They are read with
+// H5Dread_chunk while holding the HDF5 lock and decompressed afterwards,
+// so the filters run in parallel and beside the I/O of other loaders.
+// Shapes are padded to three dimensions with leading ones.
+struct ChunkedRead
+{
+	struct Filter
+	{
+		H5Z_filter_t id;
+		size_t elementSize; // shuffle only
+	};
+
+	struct Chunk
+	{
+		hsize_t offset[3];
+		uint32_t filterMask; // bit i set: filter i was skipped for this chunk
+		std::vector<unsigned char> bytes;
+	};
+
+	hsize_t dims[3] = { 1, 1, 1 };
+	hsize_t chunkDims[3] = { 1, 1, 1 };
+	std::vector<Filter> filters; // in the order they ran when writing
+	std::vector<Chunk> chunks;
+	float fill = 0.0f;
+	bool complete = true; // every chunk is allocated
+};
+
+// Read the raw chunks of a dataset of native floats. Returns 1 when read,
+// 0 when the dataset has to go through H5Dread instead (contiguous layout,
+// another type, a filter other than shuffle and deflate, or an HDF5 older
+// than 1.10.5) and -1 on error. Call with the HDF5 lock held.
+// ------------------------------------------------------------------------
+inline int readChunks(hid_t dset, ChunkedRead &read)
+{
+#if H5_VERSION_GE(1, 10, 5)
+	hid_t type = H5Dget_type(dset);
+	bool native = H5Tequal(type, H5T_NATIVE_FLOAT) > 0;
+	H5Tclose(type);
+	hid_t dcpl = H5Dget_create_plist(dset);
+	hid_t space = H5Dget_space(dset);
+	int rank = H5Sget_simple_extent_ndims(space);
+	bool chunked = native && rank >= 1 && rank <= 3 && H5Pget_layout(dcpl) == H5D_CHUNKED;
+	if (chunked) {
+		hsize_t dims[3], chunkDims[3];
+		H5Sget_simple_extent_dims(space, dims, NULL);
+		chunked = H5Pget_chunk(dcpl, rank, chunkDims) == rank;
+		for (int d = 0; d < rank; d++) {
+			read.dims[3 - rank + d] = dims[d];
+			read.chunkDims[3 - rank + d] = chunkDims[d];
+		}
+		int filters = H5Pget_nfilters(dcpl);
+		for (int i = 0; chunked && i < filters; i++) {
+			unsigned int flags, values[8];
+			size_t count = 8;
+			H5Z_filter_t id = H5Pget_filter2(dcpl, (unsigned int)i, &flags, &count, values, 0, NULL, NULL);
+			chunked = id == H5Z_FILTER_DEFLATE || id == H5Z_FILTER_SHUFFLE;
+			read.filters.push_back(ChunkedRead::Filter{ id, id == H5Z_FILTER_SHUFFLE && count > 0 ? values[0] : sizeof(float) });
+		}
+		if (chunked && H5Pget_fill_value(dcpl, H5T_NATIVE_FLOAT, &read.fill) < 0)
+			read.fill = 0.0f;
+	}
+	H5Pclose(dcpl);
+	if (!chunked) {
+		H5Sclose(space);
+		return 0;
+	}
+
+	// chunk queries want the dataspace itself, H5S_ALL is refused
+	hsize_t count = 0;
+	bool ok = H5Dget_num_chunks(dset, space, &count) >= 0;
+	hsize_t total = 1;
+	for (int d = 0; d < 3; d++)
+		total *= (read.dims[d] + read.chunkDims[d] - 1) / read.chunkDims[d];
+	read.complete = count == total;
+	read.chunks.resize((size_t)count);
+	for (hsize_t i = 0; ok && i < count; i++) {
+		ChunkedRead::Chunk &chunk = read.chunks[(size_t)i];
+		hsize_t offset[3] = { 0, 0, 0 }, size = 0;
+		haddr_t address;
+		unsigned int mask = 0;
+		if (H5Dget_chunk_info(dset, space, i, offset, &mask, &address, &size) < 0) {
+			ok = false;
+			break;
+		}
+		for (int d = 0; d < 3; d++)
+			chunk.offset[d] = d < 3 - rank ? 0 : offset[d - (3 - rank)];
+		chunk.bytes.resize((size_t)size);
+		chunk.filterMask = mask;
+		ok = H5Dread_chunk(dset, H5P_DEFAULT, offset, &chunk.filterMask, chunk.bytes.data()) >= 0;
+	}
+	H5Sclose(space);
+	return ok ? 1 : -1;
+#else
+	return 0;
+#endif
+}
+
+// undo the shuffle filter: byte b of element i was stored at b * n + i,
+// trailing bytes that make no whole element are kept as they are
+// ------------------------------------------------------------------------
+inline void unshuffle(const std::vector<unsigned char> &in, size_t elementSize, std::vector<unsigned char> &out)
+{
+	out.resize(in.size());
+	size_t n = elementSize > 1 ? in.size() / elementSize : 0;
+	for (size_t b = 0; b < elementSize && n > 0; b++) {
+		const unsigned char* plane = in.data() + b * n;
+		for (size_t i = 0; i < n; i++)
+			out[i * elementSize + b] = plane[i];
+	}
+	memcpy(out.data() + n * elementSize, in.data() + n * elementSize, in.size() - n * elementSize);
+}
+
+// Decompress the chunks on the pool and copy them to their place in
+// values, which holds the whole dataset.
+// ------------------------------------------------------------------------
+inline bool decodeChunks(const ChunkedRead &read, float* values, ThreadPool &pool)
+{
+	const hsize_t* dims = read.dims;
+	const hsize_t* chunkDims = read.chunkDims;
+	if (!read.complete)
+		std::fill(values, values + dims[0] * dims[1] * dims[2], read.fill);
+	size_t chunkBytes = (size_t)(chunkDims[0] * chunkDims[1] * chunkDims[2]) * sizeof(float);
+	std::atomic<bool> failed(false);
+	pool.parallelFor(read.chunks.size(), [&](size_t index) {
+		const ChunkedRead::Chunk &chunk = read.chunks[index];
+		std::vector<unsigned char> data = chunk.bytes, scratch;
+		for (size_t i = read.filters.size(); i-- > 0;) {
+			if (chunk.filterMask & (1u << i))
+				continue;
+			if (read.filters[i].id == H5Z_FILTER_DEFLATE) {
+				scratch.resize(chunkBytes);
+				uLongf length = (uLongf)chunkBytes;
+				if (uncompress(scratch.data(), &length, data.data(), (uLong)data.size()) != Z_OK || length != chunkBytes) {
+					failed = true;
+					return;
+				}
+			}
+			else
+				unshuffle(data, read.filters[i].elementSize, scratch);
+			data.swap(scratch);
+		}
+		if (data.size() != chunkBytes) {
+			failed = true;
+			return;
+		}
+
+		// edge chunks are stored whole; only the part inside the dataset is copied
+		const float* source = (const float*)data.data();
+		const hsize_t* offset = chunk.offset;
+		hsize_t rows0 = std::min(chunkDims[0], dims[0] - offset[0]);
+		hsize_t rows1 = std::min(chunkDims[1], dims[1] - offset[1]);
+		hsize_t run = std::min(chunkDims[2], dims[2] - offset[2]);
+		for (hsize_t i0 = 0; i0 < rows0; i0++) {
+			for (hsize_t i1 = 0; i1 < rows1; i1++) {
+				const float* from = source + (i0 * chunkDims[1] + i1) * chunkDims[2];
+				float* to = values + ((offset[0] + i0) * dims[1] + offset[1] + i1) * dims[2] + offset[2];
+				memcpy(to, from, (size_t)run * sizeof(float));
+			}
+		}
+	});
+	return !failed;
+}
+
+// layout of the datasets written by writeChunkedCopy
+struct ChunkOptions
+{
+	size_t chunkBytes = 64 << 10; // target size of an uncompressed chunk
+	int deflateLevel = 4; // 0 leaves chunks uncompressed
+	bool shuffle = true;
+};
+
+// copy one attribute of an object to another, used with H5Aiterate2
+// ------------------------------------------------------------------------
+inline herr_t copyAttribute(hid_t from, const char* name, const H5A_info_t*, void* target)
+{
+	hid_t to = *(const hid_t*)target;
+	hid_t attr = H5Aopen(from, name, H5P_DEFAULT);
+	if (attr < 0)
+		return -1;
+	hid_t type = H5Aget_type(attr);
+	hid_t space = H5Aget_space(attr);
+	hssize_t points = H5Sget_select_npoints(space);
+	std::vector<unsigned char> buffer((size_t)std::max<hssize_t>(points, 1) * H5Tget_size(type));
+	bool ok = H5Aread(attr, type, buffer.data()) >= 0;
+	if (ok) {
+		hid_t copy = H5Acreate2(to, name, type, space, H5P_DEFAULT, H5P_DEFAULT);
+		ok = copy >= 0 && H5Awrite(copy, type, buffer.data()) >= 0;
+		if (copy >= 0)
+			H5Aclose(copy);
+		// strings and sequences of variable length were allocated by the read
+		if (H5Tis_variable_str(type) > 0 || H5Tdetect_class(type, H5T_VLEN) > 0)
+			H5Dvlen_reclaim(type, space, H5P_DEFAULT, buffer.data());
+	}
+	H5Sclose(space);
+	H5Tclose(type);
+	H5Aclose(attr);
+	return ok ? 0 : -1;
+}
+
+// copy every attribute of one object to another
+inline bool copyAttributes(hid_t from, hid_t to)
+{
+	return H5Aiterate2(from, H5_INDEX_NAME, H5_ITER_INC, NULL, copyAttribute, &to) >= 0;
+}
+
+// Copy one dataset into a chunked dataset of the same type and shape. A
+// chunk holds whole slices of the first dimension and is about
+// options.chunkBytes large before compression.
+// ------------------------------------------------------------------------
+inline bool copyDatasetChunked(hid_t from, hid_t to, const char* name, const ChunkOptions &options)
+{
+	hid_t src = H5Dopen(from, name, H5P_DEFAULT);
+	if (src < 0)
+		return false;
+	hid_t type = H5Dget_type(src);
+	hid_t space = H5Dget_space(src);
+	int rank = H5Sget_simple_extent_ndims(space);
+	hsize_t dims[H5S_MAX_RANK];
+	H5Sget_simple_extent_dims(space, dims, NULL);
+	size_t elementSize = H5Tget_size(type);
+	hsize_t points = (hsize_t)H5Sget_simple_extent_npoints(space);
+	bool ok;
+	if (rank < 1 || points == 0 || H5Tis_variable_str(type) > 0 || H5Tdetect_class(type, H5T_VLEN) > 0) {
+		// nothing to chunk, the dataset is copied as it is
+		ok = H5Ocopy(from, name, to, name, H5P_DEFAULT, H5P_DEFAULT) >= 0;
+	}
+	else {
+		hsize_t chunkDims[H5S_MAX_RANK];
+		size_t sliceBytes = elementSize;
+		for (int d = 1; d < rank; d++) {
+			chunkDims[d] = dims[d];
+			sliceBytes *= (size_t)dims[d];
+		}
+		chunkDims[0] = std::min<hsize_t>(std::max<size_t>(options.chunkBytes / sliceBytes, 1), dims[0]);
+		hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+		H5Pset_chunk(dcpl, rank, chunkDims);
+		if (options.shuffle)
+			H5Pset_shuffle(dcpl);
+		if (options.deflateLevel > 0)
+			H5Pset_deflate(dcpl, (unsigned int)options.deflateLevel);
+
+		std::vector<unsigned char> buffer((size_t)points * elementSize);
+		hid_t dst = -1;
+		ok = H5Dread(src, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, buffer.data()) >= 0;
+		if (ok)
+			dst = H5Dcreate2(to, name, type, space, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+		ok = ok && dst >= 0 && H5Dwrite(dst, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, buffer.data()) >= 0;
+		ok = ok && copyAttributes(src, dst);
+		if (dst >= 0)
+			H5Dclose(dst);
+		H5Pclose(dcpl);
+	}
+	H5Sclose(space);
+	H5Tclose(type);
+	H5Dclose(src);
+	return ok;
+}
+
+// Rewrite an HDF5 file with every dataset of its root group chunked and
+// compressed (shuffle, then deflate), attributes included; groups and
+// other objects are copied as they are. The output is written under a
+// temporary name and renamed when complete.
+// ------------------------------------------------------------------------
+inline bool writeChunkedCopy(const std::string &input, const std::string &output, const ChunkOptions &options)
+{
+	std::lock_guard<std::mutex> lock(hdf5Mutex());
+	hid_t from = H5Fopen(input.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+	if (from < 0) {
+		std::cout << "ERROR::HDF5::FILE_NOT_SUCCESFULLY_OPENED " << input << std::endl;
+		return false;
+	}
+	std::string temporary = output + ".tmp";
+	hid_t to = H5Fcreate(temporary.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+	bool ok = to >= 0;
+	if (ok) {
+		hid_t fromRoot = H5Gopen(from, "/", H5P_DEFAULT), toRoot = H5Gopen(to, "/", H5P_DEFAULT);
+		ok = copyAttributes(fromRoot, toRoot);
+		H5G_info_t info;
+		ok = ok && H5Gget_info(fromRoot, &info) >= 0;
+		for (hsize_t i = 0; ok && i < info.nlinks; i++) {
+			char name[256];
+			if (H5Lget_name_by_idx(fromRoot, ".", H5_INDEX_NAME, H5_ITER_INC, i, name, sizeof(name), H5P_DEFAULT) < 0) {
+				ok = false;
+				break;
+			}
+			hid_t object = H5Oopen(fromRoot, name, H5P_DEFAULT);
+			bool dataset = object >= 0 && H5Iget_type(object) == H5I_DATASET;
+			if (object >= 0)
+				H5Oclose(object);
+			if (dataset)
+				ok = copyDatasetChunked(fromRoot, toRoot, name, options);
+			else
+				ok = H5Ocopy(fromRoot, name, toRoot, name, H5P_DEFAULT, H5P_DEFAULT) >= 0;
+		}
+		H5Gclose(toRoot);
+		H5Gclose(fromRoot);
+		ok = H5Fclose(to) >= 0 && ok;
+	}
+	H5Fclose(from);
+
+	std::error_code ec;
+	if (ok)
+		std::filesystem::rename(temporary, output, ec);
+	if (!ok || ec) {
+		std::filesystem::remove(temporary, ec);
+		std::cout << "ERROR::HDF5::FILE_NOT_SUCCESFULLY_WRITTEN " << output << std::endl;
+		return false;
+	}
+	return true;
+}
+
+#endif
@@ -0,0 +1,234 @@
+#ifndef HDF5_HANDLES_H
+#define HDF5_HANDLES_H
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <iostream>
+#include <filesystem>
+#include <algorithm>
+
+#include "hdf5.h"
+
+// tuning of the file-access property list every file is opened with
+struct Hdf5AccessOptions
+{
+	size_t metadataCacheBytes = 1 << 20; // initial size of the metadata cache
+	size_t sieveBytes = 256 << 10; // sieve buffer for partial contiguous reads
+	size_t coreBelow = 0; // files smaller than this are read whole with the core driver
+};
+
+// an open dataset and the metadata that is queried once when it is opened
+struct OpenDataset
+{
+	hid_t id = -1;
+	int ndims = 0;
+	hsize_t dims[3] = { 0, 0, 0 };
+	// file offset of the bytes of a contiguous, unfiltered dataset of
+	// native floats, which can be used where they are; -1 otherwise
+	long long inPlaceOffset = -1;
+	hsize_t storageBytes = 0;
+};
+
+// counters of a handle cache
+struct Hdf5HandleStats
+{
+	size_t fileHits = 0, fileMisses = 0;
+	size_t datasetHits = 0, datasetMisses = 0;
+	size_t bytesRead = 0; // through H5Dread, H5Dread_chunk and the core driver
+	size_t bytesMapped = 0; // used in place from file mappings
+};
+
+// Open HDF5 files and datasets, kept across frames and renders so that a
+// file that is read again, e.g. the shadow view or a file whose datasets
+// left the dataset cache, is not opened and parsed again. Files are keyed
+// like the cache entries, by path and modification time; the least recently
+// used file is closed, with its datasets, once more than maxFiles are open.
+// The serial library is not thread-safe, so every call must hold
+// hdf5Mutex(), and handles are only valid while it is held.
+class Hdf5Handles
+{
+public:
+	Hdf5Handles()
+	{
+		// the first HDF5 call initializes the library, which registers its
+		// shutdown before this object's destructor is registered
+		access = H5Pcreate(H5P_FILE_ACCESS);
+		core = H5Pcreate(H5P_FILE_ACCESS);
+		configure(maxFiles, options);
+	}
+
+	~Hdf5Handles()
+	{
+		clear();
+		H5Pclose(access);
+		H5Pclose(core);
+	}
+
+	Hdf5Handles(const Hdf5Handles&) = delete;
+	Hdf5Handles& operator=(const Hdf5Handles&) = delete;
+
+	// set the number of open files and the access properties of files opened
+	// from now on
+	// ------------------------------------------------------------------------
+	void configure(size_t files, const Hdf5AccessOptions &accessOptions)
+	{
+		maxFiles = std::max<size_t>(files, 1);
+		options = accessOptions;
+		while (entries.size() > maxFiles)
+			erase(entries.find(order.back()));
+		for (hid_t fapl : { access, core }) {
+			H5AC_cache_config_t config;
+			config.version = H5AC__CURR_CACHE_CONFIG_VERSION;
+			if (H5Pget_mdc_config(fapl, &config) >= 0) {
+				config.set_initial_size = true;
+				config.initial_size = options.metadataCacheBytes;
+				config.min_size = std::min(config.min_size, config.initial_size);
+				config.max_size = std::max(config.max_size, config.initial_size);
+				H5Pset_mdc_config(fapl, &config);
+			}
+			H5Pset_sieve_buf_size(fapl, options.sieveBytes);
+		}
+		H5Pset_fapl_core(core, 64 << 10, false);
+	}
+
+	// an open dataset of the file at path, null if there is none; fileFailed
+	// is set if the file itself cannot be opened
+	// ------------------------------------------------------------------------
+	const OpenDataset* dataset(const std::string &key, const std::string &path, const char* name, bool* fileFailed = nullptr)
+	{
+		File* entry = lookup(key, path);
+		if (!entry) {
+			if (fileFailed)
+				*fileFailed = true;
+			return nullptr;
+		}
+		auto it = entry->datasets.find(name);
+		if (it != entry->datasets.end()) {
+			counters.datasetHits++;
+			return &it->second;
+		}
+		counters.datasetMisses++;
+		hid_t id = H5Dopen(entry->id, name, H5P_DEFAULT);
+		if (id < 0) {
+			std::cout << "ERROR::HDF5::DATASET_NOT_FOUND " << name << std::endl;
+			return nullptr;
+		}
+		OpenDataset &dataset = entry->datasets[name];
+		dataset.id = id;
+		hid_t space = H5Dget_space(id);
+		dataset.ndims = H5Sget_simple_extent_ndims(space);
+		if (dataset.ndims >= 1 && dataset.ndims <= 3)
+			H5Sget_simple_extent_dims(space, dataset.dims, NULL);
+		H5Sclose(space);
+		dataset.storageBytes = H5Dget_storage_size(id);
+
+		hid_t dcpl = H5Dget_create_plist(id);
+		bool contiguous = H5Pget_layout(dcpl) == H5D_CONTIGUOUS && H5Pget_external_count(dcpl) == 0;
+		H5Pclose(dcpl);
+		hid_t type = H5Dget_type(id);
+		bool native = H5Tequal(type, H5T_NATIVE_FLOAT) > 0;
+		H5Tclose(type);
+		haddr_t offset = contiguous && native ? H5Dget_offset(id) : HADDR_UNDEF;
+		if (offset != HADDR_UNDEF && offset % alignof(float) == 0)
+			dataset.inPlaceOffset = (long long)offset;
+		return &dataset;
+	}
+
+	// a numeric scalar attribute of the root group of the file at path;
+	// false if the file cannot be opened or has no such attribute
+	// ------------------------------------------------------------------------
+	bool attribute(const std::string &key, const std::string &path, const char* name, double &value)
+	{
+		File* entry = lookup(key, path);
+		if (!entry || H5Aexists(entry->id, name) <= 0)
+			return false;
+		hid_t attr = H5Aopen(entry->id, name, H5P_DEFAULT);
+		if (attr < 0)
+			return false;
+		hid_t space = H5Aget_space(attr);
+		hid_t type = H5Aget_type(attr);
+		bool ok = H5Sget_simple_extent_npoints(space) == 1 && (H5Tget_class(type) == H5T_FLOAT || H5Tget_class(type) == H5T_INTEGER)
+			&& H5Aread(attr, H5T_NATIVE_DOUBLE, &value) >= 0;
+		H5Tclose(type);
+		H5Sclose(space);
+		H5Aclose(attr);
+		return ok;
+	}
+
+	// close all files
+	void clear()
+	{
+		while (!entries.empty())
+			erase(entries.begin());
+	}
+
+	void countRead(size_t bytes) { counters.bytesRead += bytes; }
+	void countMapped(size_t bytes) { counters.bytesMapped += bytes; }
+
+	const Hdf5HandleStats &stats() const { return counters; }
+
+private:
+	struct File
+	{
+		hid_t id;
+		std::unordered_map<std::string, OpenDataset> datasets;
+		std::list<std::string>::iterator position;
+	};
+
+	File* lookup(const std::string &key, const std::string &path)
+	{
+		auto it = entries.find(key);
+		if (it != entries.end()) {
+			// the datasets of one frame are one use of their file
+			if (order.front() != key)
+				counters.fileHits++;
+			order.splice(order.begin(), order, it->second.position);
+			return &it->second;
+		}
+		counters.fileMisses++;
+
+		std::error_code ec;
+		uintmax_t size = std::filesystem::file_size(path, ec);
+		bool whole = !ec && size < options.coreBelow;
+		hid_t id = H5Fopen(path.c_str(), H5F_ACC_RDONLY, whole ? core : access);
+		if (id < 0) {
+			std::cout << "ERROR::HDF5::FILE_NOT_SUCCESFULLY_OPENED " << path << std::endl;
+			return nullptr;
+		}
+		if (whole)
+			counters.bytesRead += (size_t)size;
+		while (entries.size() >= maxFiles)
+			erase(entries.find(order.back()));
+		order.push_front(key);
+		File &entry = entries[key];
+		entry.id = id;
+		entry.position = order.begin();
+		return &entry;
+	}
+
+	void erase(std::unordered_map<std::string, File>::iterator it)
+	{
+		for (auto &dataset : it->second.datasets)
+			H5Dclose(dataset.second.id);
+		H5Fclose(it->second.id);
+		order.erase(it->second.position);
+		entries.erase(it);
+	}
+
+	size_t maxFiles = 32;
+	Hdf5AccessOptions options;
+	hid_t access = -1, core = -1;
+	Hdf5HandleStats counters;
+	std::unordered_map<std::string, File> entries;
+	std::list<std::string> order; // most recently used first
+};
+
+// the handles shared by all dataset caches of the process
+inline Hdf5Handles &hdf5Handles()
+{
+	static Hdf5Handles handles;
+	return handles;
+}
+
+#endif
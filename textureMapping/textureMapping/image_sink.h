@@ -0,0 +1,64 @@
+#ifndef IMAGE_SINK_H
+#define IMAGE_SINK_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include "image_writer.h"
+#include "profiler.h"
+
+// Where rendered images go: encoded to files or into memory by the writer
+// threads of a pipeline. Every writer keeps one encoder per format it used,
+// each with its own strip compression threads, so writers never share
+// encoder state.
+class ImageSink
+{
+public:
+	explicit ImageSink(const ImageWriterOptions &options = ImageWriterOptions(), unsigned int writers = 1)
+		: options(options), encoders(std::max(writers, 1u)) {}
+
+	ImageSink(const ImageSink&) = delete;
+	ImageSink& operator=(const ImageSink&) = delete;
+
+	const ImageWriterOptions &settings() const { return options; }
+
+	// write an image to path in the sink's format
+	bool write(unsigned int writer, const std::string &path, const RgbImage &image)
+	{
+		return write(writer, path, image, options.format);
+	}
+
+	bool write(unsigned int writer, const std::string &path, const RgbImage &image, ImageFormat format)
+	{
+		ProfileScope scope("encode");
+		return encoder(writer, format).write(path, image.pixels.data(), image.width, image.height);
+	}
+
+	// encode an image into out
+	bool encode(unsigned int writer, const RgbImage &image, ImageFormat format, std::vector<unsigned char> &out)
+	{
+		ProfileScope scope("encode");
+		return encoder(writer, format).encode(image.pixels.data(), image.width, image.height, out);
+	}
+
+private:
+	ImageEncoder &encoder(unsigned int writer, ImageFormat format)
+	{
+		std::vector<std::unique_ptr<ImageEncoder> > &formats = encoders[writer];
+		if (formats.size() <= (size_t)format)
+			formats.resize((size_t)format + 1);
+		if (!formats[format]) {
+			ImageWriterOptions formatOptions = options;
+			formatOptions.format = format;
+			formats[format].reset(new ImageEncoder(formatOptions));
+		}
+		return *formats[format];
+	}
+
+	ImageWriterOptions options;
+	std::vector<std::vector<std::unique_ptr<ImageEncoder> > > encoders; // per writer, per format
+};
+
+#endif
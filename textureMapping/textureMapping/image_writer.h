@@ -0,0 +1,391 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "zlib.h"
+#include "thread_pool.h"
+
+enum ImageFormat
+{
+	IMAGE_PNG,
+	IMAGE_PPM, // binary P6
+	IMAGE_QOI, // https://qoiformat.org
+	IMAGE_RAW, // bare RGB bytes, no header
+};
+
+// PNG row filters; adaptive picks the one with the smallest sum of
+// absolute residuals per row like libpng and stb do
+enum PngFilter
+{
+	PNG_FILTER_NONE,
+	PNG_FILTER_SUB,
+	PNG_FILTER_UP,
+	PNG_FILTER_AVERAGE,
+	PNG_FILTER_PAETH,
+	PNG_FILTER_ADAPTIVE,
+};
+
+struct ImageWriterOptions
+{
+	ImageFormat format = IMAGE_PNG;
+	int level = 6; // zlib level, 0 stores the image uncompressed
+	PngFilter filter = PNG_FILTER_ADAPTIVE;
+	unsigned int stripRows = 64; // rows per independently compressed strip
+	unsigned int threads = 1; // threads compressing the strips of one image
+};
+
+// 8-bit RGB pixels of a rendered frame together with its size
+struct RgbImage
+{
+	unsigned int width = 0, height = 0;
+	std::vector<unsigned char> pixels;
+};
+
+inline bool parseImageFormat(const std::string &name, ImageFormat &format)
+{
+	if (name == "png") format = IMAGE_PNG;
+	else if (name == "ppm") format = IMAGE_PPM;
+	else if (name == "qoi") format = IMAGE_QOI;
+	else if (name == "raw") format = IMAGE_RAW;
+	else return false;
+	return true;
+}
+
+// the name parseImageFormat takes
+inline const char* imageFormatName(ImageFormat format)
+{
+	switch (format) {
+	case IMAGE_PPM: return "ppm";
+	case IMAGE_QOI: return "qoi";
+	case IMAGE_RAW: return "raw";
+	default: return "png";
+	}
+}
+
+inline bool parsePngFilter(const std::string &name, PngFilter &filter)
+{
+	const char* names[] = { "none", "sub", "up", "average", "paeth", "adaptive" };
+	for (int i = 0; i <= PNG_FILTER_ADAPTIVE; i++) {
+		if (name == names[i]) {
+			filter = (PngFilter)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+inline const char* imageExtension(ImageFormat format)
+{
+	switch (format) {
+	case IMAGE_PPM: return ".ppm";
+	case IMAGE_QOI: return ".qoi";
+	case IMAGE_RAW: return ".rgb";
+	default: return ".png";
+	}
+}
+
+// Encodes 8-bit RGB images, rows stored top to bottom. PNG image data is
+// filtered and deflated in strips of stripRows rows that are compressed in
+// parallel: every strip is a raw deflate stream primed with the last 32 KB
+// of the strip before it and ended with a sync flush, so the concatenation
+// is one valid zlib stream (the technique pigz uses). An encoder is meant
+// to be used by one thread at a time.
+class ImageEncoder
+{
+public:
+	explicit ImageEncoder(const ImageWriterOptions &options = ImageWriterOptions())
+		: options(options), pool(options.threads) {}
+
+	const ImageWriterOptions &settings() const
+	{
+		return options;
+	}
+
+	// encode into out; returns false if compression failed
+	// ------------------------------------------------------------------------
+	bool encode(const unsigned char* rgb, unsigned int width, unsigned int height, std::vector<unsigned char> &out)
+	{
+		out.clear();
+		switch (options.format) {
+		case IMAGE_PPM: {
+			std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+			out.assign(header.begin(), header.end());
+			out.insert(out.end(), rgb, rgb + (size_t)width * height * 3);
+			return true;
+		}
+		case IMAGE_RAW:
+			out.assign(rgb, rgb + (size_t)width * height * 3);
+			return true;
+		case IMAGE_QOI:
+			encodeQoi(rgb, width, height, out);
+			return true;
+		default:
+			return encodePng(rgb, width, height, out);
+		}
+	}
+
+	bool write(const std::string &path, const unsigned char* rgb, unsigned int width, unsigned int height)
+	{
+		if (!encode(rgb, width, height, buffer)) {
+			std::cout << "ERROR::IMAGE::NOT_SUCCESFULLY_ENCODED " << path << std::endl;
+			return false;
+		}
+		std::ofstream file(path, std::ios::binary);
+		file.write((const char*)buffer.data(), buffer.size());
+		if (!file) {
+			std::cout << "ERROR::IMAGE::NOT_SUCCESFULLY_WRITTEN " << path << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+private:
+	ImageWriterOptions options;
+	ThreadPool pool;
+	std::vector<unsigned char> buffer, filtered;
+	std::vector<std::vector<unsigned char> > strips;
+
+	static unsigned char paeth(int a, int b, int c)
+	{
+		int p = a + b - c;
+		int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+		if (pa <= pb && pa <= pc)
+			return (unsigned char)a;
+		return (unsigned char)(pb <= pc ? b : c);
+	}
+
+	// filter one row into out (filter type byte followed by the residuals)
+	static void filterRow(const unsigned char* row, const unsigned char* prior, size_t bytes, int type, unsigned char* out)
+	{
+		const size_t bpp = 3;
+		out[0] = (unsigned char)type;
+		out++;
+		if (!prior && (type == PNG_FILTER_UP || type == PNG_FILTER_PAETH)) {
+			// without a prior row up is none and paeth is sub
+			type = type == PNG_FILTER_UP ? PNG_FILTER_NONE : PNG_FILTER_SUB;
+		}
+		size_t i = 0;
+		switch (type) {
+		case PNG_FILTER_SUB:
+			for (; i < bpp && i < bytes; i++)
+				out[i] = row[i];
+			for (; i < bytes; i++)
+				out[i] = (unsigned char)(row[i] - row[i - bpp]);
+			break;
+		case PNG_FILTER_UP:
+			for (; i < bytes; i++)
+				out[i] = (unsigned char)(row[i] - prior[i]);
+			break;
+		case PNG_FILTER_AVERAGE:
+			for (; i < bpp && i < bytes; i++)
+				out[i] = (unsigned char)(row[i] - ((prior ? prior[i] : 0) >> 1));
+			for (; i < bytes; i++)
+				out[i] = (unsigned char)(row[i] - ((row[i - bpp] + (prior ? prior[i] : 0)) >> 1));
+			break;
+		case PNG_FILTER_PAETH:
+			for (; i < bpp && i < bytes; i++)
+				out[i] = (unsigned char)(row[i] - prior[i]);
+			for (; i < bytes; i++)
+				out[i] = (unsigned char)(row[i] - paeth(row[i - bpp], prior[i], prior[i - bpp]));
+			break;
+		default:
+			memcpy(out, row, bytes);
+			break;
+		}
+	}
+
+	static void filterRows(const unsigned char* rgb, unsigned int width, unsigned int first, unsigned int last, PngFilter filter, unsigned char* out)
+	{
+		size_t bytes = (size_t)width * 3;
+		std::vector<unsigned char> candidate(filter == PNG_FILTER_ADAPTIVE ? bytes + 1 : 0);
+		for (unsigned int y = first; y < last; y++) {
+			const unsigned char* row = rgb + y * bytes;
+			const unsigned char* prior = y > 0 ? row - bytes : nullptr;
+			unsigned char* dst = out + (size_t)y * (bytes + 1);
+			if (filter != PNG_FILTER_ADAPTIVE) {
+				filterRow(row, prior, bytes, filter, dst);
+				continue;
+			}
+			long best = -1;
+			for (int type = PNG_FILTER_NONE; type <= PNG_FILTER_PAETH; type++) {
+				filterRow(row, prior, bytes, type, candidate.data());
+				long sum = 0;
+				for (size_t i = 1; i <= bytes; i++)
+					sum += std::abs((int)(signed char)candidate[i]);
+				if (best < 0 || sum < best) {
+					best = sum;
+					memcpy(dst, candidate.data(), bytes + 1);
+				}
+			}
+		}
+	}
+
+	// deflate one strip as a raw stream; the last one finishes the stream
+	bool compressStrip(size_t begin, size_t end, bool last, std::vector<unsigned char> &out) const
+	{
+		z_stream stream;
+		memset(&stream, 0, sizeof(stream));
+		if (deflateInit2(&stream, options.level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			return false;
+		if (begin > 0) {
+			size_t dictionary = std::min<size_t>(begin, 32768);
+			deflateSetDictionary(&stream, filtered.data() + begin - dictionary, (uInt)dictionary);
+		}
+		out.resize(deflateBound(&stream, (uLong)(end - begin)) + 16);
+		stream.next_in = (Bytef*)(filtered.data() + begin);
+		stream.avail_in = (uInt)(end - begin);
+		stream.next_out = out.data();
+		stream.avail_out = (uInt)out.size();
+		int status = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+		out.resize(stream.total_out);
+		deflateEnd(&stream);
+		return last ? status == Z_STREAM_END : status == Z_OK;
+	}
+
+	static void putChunk(std::vector<unsigned char> &out, const char* type, const unsigned char* data, size_t length)
+	{
+		unsigned char header[8] = {
+			(unsigned char)(length >> 24), (unsigned char)(length >> 16), (unsigned char)(length >> 8), (unsigned char)length,
+			(unsigned char)type[0], (unsigned char)type[1], (unsigned char)type[2], (unsigned char)type[3]
+		};
+		out.insert(out.end(), header, header + 8);
+		if (length)
+			out.insert(out.end(), data, data + length);
+		uLong crc = crc32(0L, header + 4, 4);
+		if (length)
+			crc = crc32(crc, data, (uInt)length);
+		unsigned char trailer[4] = { (unsigned char)(crc >> 24), (unsigned char)(crc >> 16), (unsigned char)(crc >> 8), (unsigned char)crc };
+		out.insert(out.end(), trailer, trailer + 4);
+	}
+
+	bool encodePng(const unsigned char* rgb, unsigned int width, unsigned int height, std::vector<unsigned char> &out)
+	{
+		size_t rowBytes = (size_t)width * 3 + 1;
+		unsigned int stripRows = options.stripRows > 0 ? options.stripRows : height;
+		size_t stripCount = height > 0 ? (height + stripRows - 1) / stripRows : 0;
+		filtered.resize(rowBytes * height);
+		strips.resize(stripCount);
+
+		// filtering reads the unfiltered rows only, so strips are independent
+		PngFilter filter = options.filter;
+		pool.parallelFor(stripCount, [&](size_t s) {
+			unsigned int first = (unsigned int)s * stripRows;
+			filterRows(rgb, width, first, std::min(first + stripRows, height), filter, filtered.data());
+		});
+		std::vector<char> ok(stripCount, 0);
+		std::vector<uLong> checksums(stripCount);
+		pool.parallelFor(stripCount, [&](size_t s) {
+			size_t begin = s * stripRows * rowBytes;
+			size_t end = std::min((s + 1) * stripRows, (size_t)height) * rowBytes;
+			ok[s] = compressStrip(begin, end, s + 1 == stripCount, strips[s]);
+			checksums[s] = adler32(adler32(0L, Z_NULL, 0), filtered.data() + begin, (uInt)(end - begin));
+		});
+		if (std::find(ok.begin(), ok.end(), 0) != ok.end())
+			return false;
+
+		// zlib wrapper around the concatenated strips; FLEVEL only informs
+		std::vector<unsigned char> idat;
+		int level = options.level < 0 ? 6 : options.level;
+		unsigned char flevel = level < 2 ? 0 : (level < 6 ? 1 : (level == 6 ? 2 : 3));
+		unsigned char cmf = 0x78, flg = (unsigned char)(flevel << 6);
+		flg = (unsigned char)(flg + 31 - (cmf * 256 + flg) % 31);
+		idat.push_back(cmf);
+		idat.push_back(flg);
+		for (const std::vector<unsigned char> &strip : strips)
+			idat.insert(idat.end(), strip.begin(), strip.end());
+		uLong adler = adler32(0L, Z_NULL, 0);
+		for (size_t s = 0; s < stripCount; s++) {
+			size_t length = (std::min((s + 1) * stripRows, (size_t)height) - s * stripRows) * rowBytes;
+			adler = adler32_combine(adler, checksums[s], (z_off_t)length);
+		}
+		idat.push_back((unsigned char)(adler >> 24));
+		idat.push_back((unsigned char)(adler >> 16));
+		idat.push_back((unsigned char)(adler >> 8));
+		idat.push_back((unsigned char)adler);
+
+		static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+		out.insert(out.end(), signature, signature + 8);
+		unsigned char ihdr[13] = {
+			(unsigned char)(width >> 24), (unsigned char)(width >> 16), (unsigned char)(width >> 8), (unsigned char)width,
+			(unsigned char)(height >> 24), (unsigned char)(height >> 16), (unsigned char)(height >> 8), (unsigned char)height,
+			8, 2, 0, 0, 0 // 8 bit, truecolor, deflate, adaptive filtering, no interlace
+		};
+		putChunk(out, "IHDR", ihdr, sizeof(ihdr));
+		putChunk(out, "IDAT", idat.data(), idat.size());
+		putChunk(out, "IEND", nullptr, 0);
+		return true;
+	}
+
+	static void encodeQoi(const unsigned char* rgb, unsigned int width, unsigned int height, std::vector<unsigned char> &out)
+	{
+		const unsigned char header[14] = {
+			'q', 'o', 'i', 'f',
+			(unsigned char)(width >> 24), (unsigned char)(width >> 16), (unsigned char)(width >> 8), (unsigned char)width,
+			(unsigned char)(height >> 24), (unsigned char)(height >> 16), (unsigned char)(height >> 8), (unsigned char)height,
+			3, 0 // RGB, sRGB with linear alpha
+		};
+		out.reserve(sizeof(header) + (size_t)width * height * 4 + 8);
+		out.insert(out.end(), header, header + sizeof(header));
+
+		// the decoder starts with a zeroed index, alpha 0 included
+		unsigned char index[64][4];
+		memset(index, 0, sizeof(index));
+		unsigned char pr = 0, pg = 0, pb = 0; // previous pixel, alpha is always 255
+		int run = 0;
+		size_t pixels = (size_t)width * height;
+		for (size_t p = 0; p < pixels; p++) {
+			unsigned char r = rgb[p * 3], g = rgb[p * 3 + 1], b = rgb[p * 3 + 2];
+			if (r == pr && g == pg && b == pb) {
+				run++;
+				if (run == 62 || p + 1 == pixels) {
+					out.push_back((unsigned char)(0xc0 | (run - 1)));
+					run = 0;
+				}
+				continue;
+			}
+			if (run > 0) {
+				out.push_back((unsigned char)(0xc0 | (run - 1)));
+				run = 0;
+			}
+			int hash = (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+			if (index[hash][0] == r && index[hash][1] == g && index[hash][2] == b && index[hash][3] == 255) {
+				out.push_back((unsigned char)hash);
+			}
+			else {
+				index[hash][0] = r;
+				index[hash][1] = g;
+				index[hash][2] = b;
+				index[hash][3] = 255;
+				signed char dr = (signed char)(r - pr), dg = (signed char)(g - pg), db = (signed char)(b - pb);
+				signed char drg = (signed char)(dr - dg), dbg = (signed char)(db - dg);
+				if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2) {
+					out.push_back((unsigned char)(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+				}
+				else if (drg > -9 && drg < 8 && dg > -33 && dg < 32 && dbg > -9 && dbg < 8) {
+					out.push_back((unsigned char)(0x80 | (dg + 32)));
+					out.push_back((unsigned char)((drg + 8) << 4 | (dbg + 8)));
+				}
+				else {
+					out.push_back(0xfe);
+					out.push_back(r);
+					out.push_back(g);
+					out.push_back(b);
+				}
+			}
+			pr = r;
+			pg = g;
+			pb = b;
+		}
+		const unsigned char end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+		out.insert(out.end(), end, end + 8);
+	}
+};
+
+#endif
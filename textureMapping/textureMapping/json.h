@@ -0,0 +1,223 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+
+// A parsed JSON value. Objects keep their members in order; numbers are
+// doubles.
+struct JsonValue
+{
+	enum Type { JSON_NULL, JSON_BOOL, JSON_NUMBER, JSON_STRING, JSON_ARRAY, JSON_OBJECT };
+
+	Type type = JSON_NULL;
+	bool boolean = false;
+	double number = 0.0;
+	std::string text;
+	std::vector<JsonValue> items;
+	std::vector<std::pair<std::string, JsonValue> > members;
+
+	// member of an object, null if there is none
+	const JsonValue* find(const std::string &name) const
+	{
+		for (const auto &member : members) {
+			if (member.first == name)
+				return &member.second;
+		}
+		return nullptr;
+	}
+
+	double numberOr(const std::string &name, double fallback) const
+	{
+		const JsonValue* value = find(name);
+		return value && value->type == JSON_NUMBER ? value->number : fallback;
+	}
+
+	std::string stringOr(const std::string &name, const std::string &fallback) const
+	{
+		const JsonValue* value = find(name);
+		return value && value->type == JSON_STRING ? value->text : fallback;
+	}
+};
+
+// Parser for one JSON document, e.g. one line of the server protocol or a
+// manifest.
+class JsonParser
+{
+public:
+	explicit JsonParser(const std::string &text) : text(text) {}
+
+	// parse the whole text; false if it is not exactly one JSON value
+	// ------------------------------------------------------------------------
+	bool parse(JsonValue &value)
+	{
+		position = 0;
+		if (!parseValue(value, 0))
+			return false;
+		skipSpace();
+		return position == text.size();
+	}
+
+private:
+	static const int MAX_DEPTH = 32;
+
+	void skipSpace()
+	{
+		while (position < text.size() && strchr(" \t\r\n", text[position]))
+			position++;
+	}
+
+	bool literal(const char* word)
+	{
+		size_t length = strlen(word);
+		if (text.compare(position, length, word) != 0)
+			return false;
+		position += length;
+		return true;
+	}
+
+	bool parseValue(JsonValue &value, int depth)
+	{
+		skipSpace();
+		if (position >= text.size() || depth > MAX_DEPTH)
+			return false;
+		char c = text[position];
+		if (c == '{') {
+			value.type = JsonValue::JSON_OBJECT;
+			position++;
+			skipSpace();
+			if (position < text.size() && text[position] == '}') {
+				position++;
+				return true;
+			}
+			for (;;) {
+				std::pair<std::string, JsonValue> member;
+				skipSpace();
+				if (!parseString(member.first))
+					return false;
+				skipSpace();
+				if (position >= text.size() || text[position++] != ':' || !parseValue(member.second, depth + 1))
+					return false;
+				value.members.push_back(std::move(member));
+				skipSpace();
+				if (position < text.size() && text[position] == ',') {
+					position++;
+					continue;
+				}
+				return position < text.size() && text[position++] == '}';
+			}
+		}
+		if (c == '[') {
+			value.type = JsonValue::JSON_ARRAY;
+			position++;
+			skipSpace();
+			if (position < text.size() && text[position] == ']') {
+				position++;
+				return true;
+			}
+			for (;;) {
+				value.items.emplace_back();
+				if (!parseValue(value.items.back(), depth + 1))
+					return false;
+				skipSpace();
+				if (position < text.size() && text[position] == ',') {
+					position++;
+					continue;
+				}
+				return position < text.size() && text[position++] == ']';
+			}
+		}
+		if (c == '"') {
+			value.type = JsonValue::JSON_STRING;
+			return parseString(value.text);
+		}
+		if (literal("true") || literal("false")) {
+			value.type = JsonValue::JSON_BOOL;
+			value.boolean = c == 't';
+			return true;
+		}
+		if (literal("null")) {
+			value.type = JsonValue::JSON_NULL;
+			return true;
+		}
+		const char* start = text.c_str() + position;
+		char* end = nullptr;
+		value.number = strtod(start, &end);
+		if (end == start)
+			return false;
+		value.type = JsonValue::JSON_NUMBER;
+		position += end - start;
+		return true;
+	}
+
+	bool parseString(std::string &out)
+	{
+		if (position >= text.size() || text[position] != '"')
+			return false;
+		position++;
+		while (position < text.size()) {
+			char c = text[position++];
+			if (c == '"')
+				return true;
+			if (c != '\\') {
+				out += c;
+				continue;
+			}
+			if (position >= text.size())
+				return false;
+			char escape = text[position++];
+			const char* plain = strchr("\"\\/bfnrt", escape);
+			if (plain && escape != 'u') {
+				out += "\"\\/\b\f\n\r\t"[plain - "\"\\/bfnrt"];
+				continue;
+			}
+			if (escape != 'u' || position + 4 > text.size())
+				return false;
+			// code points of the basic plane as UTF-8
+			unsigned int code = (unsigned int)strtoul(text.substr(position, 4).c_str(), nullptr, 16);
+			position += 4;
+			if (code < 0x80)
+				out += (char)code;
+			else if (code < 0x800) {
+				out += (char)(0xC0 | (code >> 6));
+				out += (char)(0x80 | (code & 0x3F));
+			}
+			else {
+				out += (char)(0xE0 | (code >> 12));
+				out += (char)(0x80 | ((code >> 6) & 0x3F));
+				out += (char)(0x80 | (code & 0x3F));
+			}
+		}
+		return false;
+	}
+
+	const std::string &text;
+	size_t position = 0;
+};
+
+// a string as a JSON string literal
+// ------------------------------------------------------------------------
+inline std::string jsonQuote(const std::string &text)
+{
+	std::string out = "\"";
+	for (char c : text) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		}
+		else if ((unsigned char)c < 0x20) {
+			char escape[8];
+			snprintf(escape, sizeof(escape), "\\u%04x", (unsigned char)c);
+			out += escape;
+		}
+		else
+			out += c;
+	}
+	return out + "\"";
+}
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef LIGHT_CULLING_H
+#define LIGHT_CULLING_H
+
+#include <GL/glm/glm.hpp>
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+// A point light in view space. Its contribution fades from innerRadius to
+// zero at outerRadius, so it cannot reach anything farther away. The layout
+// is two RGBA32F texels of the light texture buffer in deferred_shading.fs.
+struct PointLight
+{
+	glm::vec3 position;
+	float outerRadius;
+	glm::vec3 color;
+	float innerRadius;
+};
+
+// Screen-space tiles with the lights that can reach each of them. The
+// surface seen through a tile lies between the smallest and largest depth
+// of its covered pixels, so a light is kept for the tile only if its outer
+// sphere touches the bounding box of that slab of the view frustum. Tiles
+// are counted from the bottom-left corner like gl_FragCoord; every tile
+// has an (offset, count) range into one shared index list. Several light
+// sets, e.g. lighting conditions of one view, can be culled against the
+// same tiles; their ranges follow each other set by set.
+class LightGrid
+{
+public:
+	static const unsigned int TILE_SIZE = 16;
+
+	unsigned int tileSize = TILE_SIZE;
+	unsigned int tilesX = 0, tilesY = 0;
+	std::vector<uint32_t> ranges; // offset and count per tile and set
+	std::vector<uint32_t> indices;
+
+	// Cull lights against the depth of a width x height view (rows stored
+	// bottom-up, pixels with mask 0 are background). With cull false every
+	// tile gets every light, which is the cost of a plain loop.
+	// ------------------------------------------------------------------------
+	void build(const std::vector<PointLight> &lights, const float* depth, const float* mask, unsigned int width, unsigned int height,
+		const glm::mat4 &invPMatrix, bool cull = true)
+	{
+		setView(depth, mask, width, height, invPMatrix, cull);
+		addLights(lights, 0, cull);
+	}
+
+	// compute the tile bounds of a view and drop all light sets
+	// ------------------------------------------------------------------------
+	void setView(const float* depth, const float* mask, unsigned int width, unsigned int height, const glm::mat4 &invPMatrix, bool cull = true)
+	{
+		tilesX = (width + tileSize - 1) / tileSize;
+		tilesY = (height + tileSize - 1) / tileSize;
+		size_t tiles = (size_t)tilesX * tilesY;
+		ranges.clear();
+		indices.clear();
+		boxMin.assign(tiles, glm::vec3(INFINITY));
+		boxMax.assign(tiles, glm::vec3(-INFINITY));
+		if (!cull)
+			return;
+
+		// depth range of the surface in every tile
+		std::vector<float> lo(tiles, 1.0f), hi(tiles, 0.0f);
+		for (unsigned int y = 0; y < height; y++) {
+			const float* d = depth + (size_t)y * width;
+			const float* m = mask + (size_t)y * width;
+			size_t row = (size_t)(y / tileSize) * tilesX;
+			for (unsigned int x = 0; x < width; x++) {
+				if (!(m[x] > 0.0f) || std::isnan(d[x]))
+					continue;
+				size_t tile = row + x / tileSize;
+				lo[tile] = std::min(lo[tile], d[x]);
+				hi[tile] = std::max(hi[tile], d[x]);
+			}
+		}
+		for (unsigned int ty = 0; ty < tilesY; ty++) {
+			for (unsigned int tx = 0; tx < tilesX; tx++) {
+				size_t tile = (size_t)ty * tilesX + tx;
+				if (lo[tile] <= hi[tile])
+					tileBounds(invPMatrix, tx, ty, width, height, lo[tile], hi[tile], boxMin[tile], boxMax[tile]);
+			}
+		}
+	}
+
+	// append the tile lists of a light set made of the lights from first on;
+	// indices refer to the whole list
+	// ------------------------------------------------------------------------
+	void addLights(const std::vector<PointLight> &lights, size_t first, bool cull = true)
+	{
+		size_t tiles = (size_t)tilesX * tilesY;
+		size_t base = ranges.size();
+		ranges.resize(base + tiles * 2);
+		for (size_t tile = 0; tile < tiles; tile++) {
+			ranges[base + tile * 2] = (uint32_t)indices.size();
+			for (size_t k = first; k < lights.size(); k++) {
+				if (cull) {
+					// empty tiles have an inverted box and keep no light
+					if (!(boxMin[tile].x <= boxMax[tile].x))
+						break;
+					glm::vec3 nearest = glm::clamp(lights[k].position, boxMin[tile], boxMax[tile]) - lights[k].position;
+					if (glm::dot(nearest, nearest) > lights[k].outerRadius * lights[k].outerRadius)
+						continue;
+				}
+				indices.push_back((uint32_t)k);
+			}
+			ranges[base + tile * 2 + 1] = (uint32_t)indices.size() - ranges[base + tile * 2];
+		}
+	}
+
+	// number of tiles of one light set
+	size_t tileCount() const { return (size_t)tilesX * tilesY; }
+
+	// lights of set of the tile holding pixel (x, y)
+	const uint32_t* tileLights(unsigned int x, unsigned int y, unsigned int &count, unsigned int set = 0) const
+	{
+		size_t tile = set * tileCount() + (size_t)std::min(y / tileSize, tilesY - 1) * tilesX + std::min(x / tileSize, tilesX - 1);
+		count = ranges[tile * 2 + 1];
+		return indices.data() + ranges[tile * 2];
+	}
+
+private:
+	std::vector<glm::vec3> boxMin, boxMax; // view-space bounds per tile
+
+	// view-space bounding box of the frustum slab of a tile between two
+	// depths; a projective map keeps the slab convex, so its eight corners
+	// bound it. The depths are widened by the precision of the R16F depth
+	// texture the shader reconstructs positions from.
+	void tileBounds(const glm::mat4 &invPMatrix, unsigned int tx, unsigned int ty, unsigned int width, unsigned int height,
+		float lo, float hi, glm::vec3 &lower, glm::vec3 &upper) const
+	{
+		const float margin = 1e-3f;
+		float x[2] = { (float)tx * tileSize, (float)std::min((tx + 1) * tileSize, width) };
+		float y[2] = { (float)ty * tileSize, (float)std::min((ty + 1) * tileSize, height) };
+		float z[2] = { lo - margin, hi + margin };
+		lower = glm::vec3(INFINITY);
+		upper = glm::vec3(-INFINITY);
+		for (int corner = 0; corner < 8; corner++) {
+			glm::vec4 clip(x[corner & 1] / width * 2.0f - 1.0f, y[(corner >> 1) & 1] / height * 2.0f - 1.0f, z[corner >> 2] * 2.0f - 1.0f, 1.0f);
+			glm::vec4 view = invPMatrix * clip;
+			glm::vec3 position = glm::vec3(view) / view.w;
+			lower = glm::min(lower, position);
+			upper = glm::max(upper, position);
+		}
+	}
+};
+
+#endif
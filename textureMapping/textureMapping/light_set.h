@@ -0,0 +1,211 @@
+#ifndef LIGHT_SET_H
+#define LIGHT_SET_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <filesystem>
+
+#include <GL/glm/glm.hpp>
+#include <GL/glm/gtc/matrix_transform.hpp>
+
+#include "camera.h"
+#include "json.h"
+#include "light_culling.h"
+#include "view_metadata.h"
+
+// One lighting setup of a view. The built-in lights keep their places, at
+// the camera and at the angles of the shadow caster file, since those are
+// the only positions with a shadow map; a condition sets their powers,
+// which of them cast shadows and the point lights added to them.
+struct LightingCondition
+{
+	std::string name; // appended to the output file name
+	float lightingPower, lightingPower1;
+	unsigned int shadowCasters; // bit 0: light at the camera, bit 1: light of the shadow caster
+	std::vector<PointLight> lights; // in world space
+};
+
+// The lights of a scene: two built-in lights, one at the camera and one at
+// the view of the shadow caster file, whose depth is the shadow map of
+// that light, point lights shared by every condition and the ambient color.
+struct LightSet
+{
+	// view whose depth and mask are used as the shadow map of point light 2
+	std::string shadowFile = "MPAS_000000_3.27890_20.000000_90.0000026563_100.0000018721.h5";
+	float casterTheta = M_PI / 2, casterPhi = M_PI / 2; // its view angles
+
+	// Lighting power of the built-in lights when no condition sets them.
+	float lightingPower = 0.5f;
+	float lightingPower1 = 0.0f;
+
+	// Point lights in world space added to the two built-in ones.
+	std::vector<PointLight> sceneLights;
+
+	// Base color used for the ambient, fog, and clear-to colors.
+	glm::vec3 ambient = glm::vec3(10.0 / 255.0, 10.0 / 255.0, 10.0 / 255.0);
+
+	LightSet()
+	{
+		// the default caster is named after its angles, no need to open it
+		float isoValue, BwsA;
+		parseViewName(shadowFile, casterTheta, casterPhi, isoValue, BwsA);
+	}
+
+	// take the shadow caster of light 2 from a file, at the given angles
+	// (degrees) or else the ones the file records
+	// ------------------------------------------------------------------------
+	bool setShadowFile(const std::string &path, float theta = NAN, float phi = NAN)
+	{
+		shadowFile = path;
+		ViewMetadata view;
+		if ((std::isnan(theta) || std::isnan(phi)) && !readViewMetadata(shadowFile, view))
+			return false;
+		casterTheta = std::isnan(theta) ? view.theta : viewAngle(theta);
+		casterPhi = std::isnan(phi) ? view.phi : viewAngle(phi);
+		return true;
+	}
+
+	// the condition of the default powers, shadowed by both lights or none
+	LightingCondition defaultCondition(bool shadows) const
+	{
+		return LightingCondition{ "", lightingPower, lightingPower1, shadows ? 3u : 0u, std::vector<PointLight>() };
+	}
+
+	// Place the point lights of a condition for a camera: light 1 sits at
+	// the camera, light 2 at the angles of the shadow caster, which was
+	// rendered at the given resolution, followed by the condition's lights
+	// and the scene lights. They are appended to lights in view space; the
+	// light-space matrices map world space to the clip space of the two
+	// shadow casting lights.
+	// ------------------------------------------------------------------------
+	void place(const Camera &camera, unsigned int shadowWidth1, unsigned int shadowHeight1, const LightingCondition &condition, std::vector<PointLight> &lights,
+		glm::mat4 &lightSpaceMatrix, glm::mat4 &lightSpaceMatrix1) const
+	{
+		// both built-in lights fade out over light_outer_radius = 20
+		const glm::mat4 &view = camera.view;
+
+		// Point light 1.
+		float point_light_dist = 2.3;
+		glm::vec3 point_light_direction = camera.direction / camera.dist * point_light_dist;
+		glm::vec3 point_light_position = camera.center + point_light_direction;
+		glm::vec3 light_pos = glm::vec3(view * glm::vec4(point_light_position.x, point_light_position.y, point_light_position.z, 1.0));
+		lights.push_back(PointLight{ light_pos, 20.0f, glm::vec3(condition.lightingPower), 0.0f });
+
+		// Point light 2.
+		float point_light_dist1 = 2.3;
+		float point_light_position_x1 = 0 + point_light_dist1 * std::cos(casterPhi) * std::sin(casterTheta);
+		float point_light_position_y1 = 0 + point_light_dist1 * std::sin(casterPhi) * std::sin(casterTheta);
+		float point_light_position_z1 = 0 + point_light_dist1 * std::cos(casterTheta);
+		glm::vec3 light_pos1 = glm::vec3(view * glm::vec4(point_light_position_x1, point_light_position_y1, point_light_position_z1, 1.0));
+		lights.push_back(PointLight{ light_pos1, 20.0f, glm::vec3(condition.lightingPower1), 0.0f });
+
+		auto addWorldLights = [&](const std::vector<PointLight> &added) {
+			for (PointLight light : added) {
+				light.position = glm::vec3(view * glm::vec4(light.position, 1.0f));
+				lights.push_back(light);
+			}
+		};
+		addWorldLights(condition.lights);
+		addWorldLights(sceneLights);
+
+		glm::mat4 lightProjection, lightView, lightView1;
+		lightProjection = camera.pMatrix;
+		lightView = view;
+		lightSpaceMatrix = lightProjection * lightView;
+
+		glm::vec3 point_light_up1 = glm::vec3(std::sin(casterTheta - M_PI / 2) * std::cos(casterPhi), std::sin(casterTheta - M_PI / 2) * std::sin(casterPhi), std::cos(casterTheta - M_PI / 2));
+		lightView1 = glm::lookAt(glm::vec3(point_light_position_x1, point_light_position_y1, point_light_position_z1), camera.center, point_light_up1);
+		lightSpaceMatrix1 = projectionMatrix(shadowWidth1, shadowHeight1, camera.perspective) * lightView1;
+	}
+};
+
+// Read extra point lights, one per line as "x y z r g b [outer [inner]]"
+// in world space; the radii default to those of the built-in lights. Empty
+// lines and lines starting with # are skipped.
+// ------------------------------------------------------------------------
+inline bool loadLights(const std::string &path, std::vector<PointLight> &lights)
+{
+	std::ifstream file(path);
+	if (!file) {
+		std::cout << "ERROR::LIGHTS::FILE_NOT_SUCCESFULLY_READ " << path << std::endl;
+		return false;
+	}
+	std::string line;
+	for (int number = 1; std::getline(file, line); number++) {
+		size_t first = line.find_first_not_of(" \t\r");
+		if (first == std::string::npos || line[first] == '#')
+			continue;
+		PointLight light{ glm::vec3(0.0f), 20.0f, glm::vec3(0.0f), 0.0f };
+		std::istringstream fields(line);
+		if (!(fields >> light.position.x >> light.position.y >> light.position.z >> light.color.r >> light.color.g >> light.color.b)) {
+			std::cout << "ERROR::LIGHTS::CANNOT_PARSE_LINE " << path << ":" << number << std::endl;
+			return false;
+		}
+		if (fields >> light.outerRadius)
+			fields >> light.innerRadius;
+		lights.push_back(light);
+	}
+	return true;
+}
+
+// Read point lights from a JSON array of arrays x, y, z, r, g, b[, outer[,
+// inner]] in world space, as server requests and manifests give them.
+// ------------------------------------------------------------------------
+inline bool parseJsonLights(const JsonValue &array, std::vector<PointLight> &lights)
+{
+	for (const JsonValue &fields : array.items) {
+		float v[8] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 20.0f, 0.0f };
+		for (size_t k = 0; k < fields.items.size() && k < 8; k++)
+			v[k] = (float)fields.items[k].number;
+		if (fields.items.size() < 6)
+			return false;
+		lights.push_back(PointLight{ glm::vec3(v[0], v[1], v[2]), v[6], glm::vec3(v[3], v[4], v[5]), v[7] });
+	}
+	return true;
+}
+
+// Read lighting conditions, one per line as
+// "name lighting_power lighting_power1 shadow_casters [lights file]", where
+// shadow_casters is none, 0, 1 or 0,1 and the optional file (relative to
+// this one) adds point lights as --lights does. Empty lines and lines
+// starting with # are skipped.
+// ------------------------------------------------------------------------
+inline bool loadConditions(const std::string &path, std::vector<LightingCondition> &conditions)
+{
+	std::ifstream file(path);
+	if (!file) {
+		std::cout << "ERROR::CONDITIONS::FILE_NOT_SUCCESFULLY_READ " << path << std::endl;
+		return false;
+	}
+	std::string line;
+	for (int number = 1; std::getline(file, line); number++) {
+		size_t first = line.find_first_not_of(" \t\r");
+		if (first == std::string::npos || line[first] == '#')
+			continue;
+		LightingCondition condition{ "", 0.0f, 0.0f, 0u, std::vector<PointLight>() };
+		std::string casters, lightsFile;
+		std::istringstream fields(line);
+		bool ok = (bool)(fields >> condition.name >> condition.lightingPower >> condition.lightingPower1 >> casters);
+		if (ok && casters != "none") {
+			for (char c : casters) {
+				if (c == '0' || c == '1')
+					condition.shadowCasters |= 1u << (c - '0');
+				else if (c != ',')
+					ok = false;
+			}
+		}
+		if (!ok) {
+			std::cout << "ERROR::CONDITIONS::CANNOT_PARSE_LINE " << path << ":" << number << std::endl;
+			return false;
+		}
+		if (fields >> lightsFile && !loadLights((std::filesystem::path(path).parent_path() / lightsFile).string(), condition.lights))
+			return false;
+		conditions.push_back(condition);
+	}
+	return true;
+}
+
+#endif
@@ -1,640 +1,1142 @@
 #pragma comment(lib,"glfw3.lib")
 #define _USE_MATH_DEFINES
-#include <glad/glad.h>
-#include <GLFW/glfw3.h>
+#include "context.h"
 
 #include <GL/glm/glm.hpp>
 #include <GL/glm/gtc/matrix_transform.hpp>
 #include <GL/glm/gtc/type_ptr.hpp>
 #include <GL/glm/gtx/transform2.hpp>
 
-#include "shader.h"
+#include "batch.h"
+#include "camera.h"
+#include "light_set.h"
+#include "gbuffer.h"
+#include "deferred_renderer.h"
+#include "image_sink.h"
+#include "pipeline.h"
+#include "render_server.h"
 
 #include <iostream>
 #include <algorithm>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <chrono>
+#include <memory>
+#include <fstream>
+#include <sstream>
 
-#include "hdf5.h"
 #define STBI_MSC_SECURE_CRT
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
+#include "image_writer.h"
+#include "encode_benchmark.h"
 
 using namespace std;
 
-void framebuffer_size_callback(GLFWwindow* window, int width, int height);
-void processInput(GLFWwindow *window);
-void renderQuad();
-
-// Perspective or orthographic projection?
-bool perspective_projection = true;
-
-// Base color used for the ambient, fog, and clear-to colors.
-glm::vec3 base_color(10.0 / 255.0, 10.0 / 255.0, 10.0 / 255.0);
-
-// settings
+// settings; the initial window size, frames take the resolution of their datasets
 const unsigned int SCR_WIDTH = 256;
 const unsigned int SCR_HEIGHT = 256;
-const unsigned int SHADOW_WIDTH = 256;
-const unsigned int SHADOW_HEIGHT = 256;
-
-glm::mat4 pMatrix;
-glm::mat4 inv_pMatrix;
-glm::mat4 mvMatrix;
-glm::mat4 inv_vMatrix;
-glm::mat3 normalMatrix;
-
-// Information related to the camera 
-float dist = 2.3;
-glm::vec3 direction;
-glm::vec3 up;
-glm::vec3 center;
-glm::vec3 eye;
-
-glm::mat4 view;
-glm::mat4 model;
-
-// Lighting power.
-float lighting_power = 0.5;
-float lighting_power1 = 0;
-
-// Used for time based animation.
-float time_last = 0;
-
-// Use lighting?
-int use_lighting = 1;
-
-// Use shadow?
-int use_shadow = 0;
-
-// Render different buffers.
-int show_depth = 0;
-int show_normals = 0;
-int show_position = 0;
-
-// Used to orbit the point lights.
-float point_light_theta = M_PI / 2;
-float point_light_phi = M_PI / 2;
-float point_light_theta_step = 0.39 / 2;
-float point_light_phi_step = 0.39;
-
-float point_light_theta1 = M_PI / 2;
-float point_light_phi1 = M_PI / 2;
-float point_light_theta_step1 = 0.3;
-float point_light_phi_step1 = 0.3;
-
-void setMatrixUniforms(Shader ourShader) {
-	// Pass the vertex shader the projection matrix and the model-view matrix.
-	ourShader.setMat4("uPMatrix", pMatrix);
-	ourShader.setMat4("uMVMatrix", mvMatrix);
-
-	// inverse of view matrix
-	inv_vMatrix = glm::inverse(view);
-	ourShader.setMat4("uInvVMatrix", inv_vMatrix);
-
-	// inverse of projection matrix 
-	inv_pMatrix = glm::inverse(pMatrix);
-	ourShader.setMat4("uInvPMatrix", inv_pMatrix);
-
-
-	// Pass the vertex normal matrix to the shader so it can compute the lighting calculations.
-	normalMatrix = glm::transpose(glm::inverse(glm::mat3(mvMatrix)));
-	ourShader.setMat3("uNMatrix", normalMatrix);
-}
 
-int main(int argc, char **argv)
+// Everything the command line sets about what is rendered and how it is
+// written: the render mode, the lights, the lighting conditions every view
+// is rendered under, each to its own image (empty for the single one of
+// the lights' powers), and the output format and compression.
+struct RenderOptions
 {
-	// glfw: initialize and configure
-	// ------------------------------
-	glfwInit();
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-
-#ifdef __APPLE__
-	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE); // uncomment this statement to fix compilation on OS X
-#endif
-
-	// glfw window creation
-	// --------------------
-	GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "textureMapping", NULL, NULL);
-	if (window == NULL)
+	RenderSettings settings;
+	LightSet lights;
+	vector<LightingCondition> conditions;
+	ImageWriterOptions image;
+
+	// the conditions every view is rendered under
+	vector<LightingCondition> activeConditions() const
 	{
-		std::cout << "Failed to create GLFW window" << std::endl;
-		glfwTerminate();
-		return -1;
+		return conditions.empty() ? vector<LightingCondition>{ lights.defaultCondition(settings.useShadow != 0) } : conditions;
 	}
-	glfwMakeContextCurrent(window);
-	glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+};
+
+int renderJobsGL(const vector<RenderJob> &jobs, bool headless, const PipelineOptions &pipeline, const RenderOptions &options);
+int benchmarkShaders(const RenderJob &job, bool headless, const RenderOptions &options, unsigned int frames);
+int benchmarkLights(const RenderJob &job, bool headless, const RenderOptions &options, unsigned int frames);
+int benchmarkRelight(const RenderJob &job, bool headless, const RenderOptions &options, unsigned int frames);
+int serveGL(RenderServer &server, bool headless, const PipelineOptions &pipeline, const RenderOptions &options, size_t batchSize);
+
+// one job per output image, frame i of jobs under condition c at
+// i * conditions + c; the condition name is appended to the file name
+// ------------------------------------------------------------------------
+vector<RenderJob> conditionJobs(const vector<RenderJob> &jobs, const vector<LightingCondition> &conditions)
+{
+	if (conditions.size() == 1 && conditions[0].name.empty())
+		return jobs;
+	vector<RenderJob> outputs;
+	for (const RenderJob &job : jobs) {
+		for (const LightingCondition &condition : conditions) {
+			fs::path output(job.output);
+			output.replace_filename(output.stem().string() + "_" + condition.name + output.extension().string());
+			RenderJob conditionJob = job;
+			conditionJob.output = output.string();
+			outputs.push_back(conditionJob);
+		}
+	}
+	return outputs;
+}
 
-	// glad: load all OpenGL function pointers
-	// ---------------------------------------
-	if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
-	{
-		std::cout << "Failed to initialize GLAD" << std::endl;
-		return -1;
+// The light sets jobs are rendered with, one per job: the lights of the
+// options, or for jobs of a manifest with a shadow caster or lights of
+// their own, a copy with those, shared by the jobs that have the same.
+// ------------------------------------------------------------------------
+bool jobLightSets(const vector<RenderJob> &jobs, const LightSet &lights, deque<LightSet> &sets, vector<const LightSet*> &jobSets)
+{
+	unordered_map<string, const LightSet*> shared;
+	jobSets.clear();
+	for (const RenderJob &job : jobs) {
+		if (job.shadow.empty() && !job.lights) {
+			jobSets.push_back(&lights);
+			continue;
+		}
+		ostringstream key;
+		key << job.shadow << '\n' << job.shadowTheta << '\n' << job.shadowPhi << '\n' << job.lights.get();
+		auto it = shared.find(key.str());
+		if (it == shared.end()) {
+			sets.push_back(lights);
+			LightSet &set = sets.back();
+			if (!job.shadow.empty() && !set.setShadowFile(job.shadow, job.shadowTheta, job.shadowPhi))
+				return false;
+			if (job.lights)
+				set.sceneLights.insert(set.sceneLights.end(), job.lights->begin(), job.lights->end());
+			it = shared.emplace(key.str(), &set).first;
+		}
+		jobSets.push_back(it->second);
 	}
+	return true;
+}
 
-	Shader shaderLightingPass("../../shaders/deferred_shading.vs", "../../shaders/deferred_shading.fs");
+// load the G-buffer of a job at the angles its manifest gives, if any,
+// telling which one failed
+// ------------------------------------------------------------------------
+bool loadJob(DatasetCache &cache, unsigned int channels, const LightSet &lights, const RenderJob &job, GBuffer &gbuffer)
+{
+	bool anglesKnown = !std::isnan(job.theta) && !std::isnan(job.phi);
+	if (anglesKnown) {
+		gbuffer.theta = viewAngle(job.theta);
+		gbuffer.phi = viewAngle(job.phi);
+	}
+	if (loadGBuffer(cache, channels, job.input, lights.shadowFile, gbuffer, anglesKnown)) {
+		if (!std::isnan(job.theta))
+			gbuffer.theta = viewAngle(job.theta);
+		if (!std::isnan(job.phi))
+			gbuffer.phi = viewAngle(job.phi);
+		return true;
+	}
+	std::cout << "Failed to load " << job.input << std::endl;
+	return false;
+}
 
-	// shader configuration
-	// --------------------
-	shaderLightingPass.use();
-	shaderLightingPass.setInt("gPosition", 0);
-	shaderLightingPass.setInt("gNormal", 1);
-	shaderLightingPass.setInt("gDiffuseColor", 2);
-	shaderLightingPass.setInt("gMask", 3);
-	shaderLightingPass.setInt("gDepth", 4);
-	shaderLightingPass.setInt("gShadowMask", 5);
-	shaderLightingPass.setInt("gShadowDepth", 6);
-	shaderLightingPass.setInt("gShadowMask1", 7);
-	shaderLightingPass.setInt("gShadowDepth1", 8);
+// print the hit rates of the HDF5 handle cache and the bytes it read, to
+// size it with --open-files
+// ------------------------------------------------------------------------
+void reportHdf5Handles()
+{
+	const Hdf5HandleStats &stats = hdf5Handles().stats();
+	printf("HDF5 handles: files %zu hits, %zu misses; datasets %zu hits, %zu misses; %.1f MB read, %.1f MB mapped\n",
+		stats.fileHits, stats.fileMisses, stats.datasetHits, stats.datasetMisses, stats.bytesRead / 1048576.0, stats.bytesMapped / 1048576.0);
+}
 
-	// create the projection matrix 
-	float near = 1.79f;
-	float far = 2.81f;
-	float fov_r = 30.0f;
+// print the time every stage took per frame and write the stages as a
+// Chrome trace to tracePath, if given
+// ------------------------------------------------------------------------
+bool reportProfile(const string &tracePath)
+{
+	profiler().report();
+	if (tracePath.empty())
+		return true;
+	if (!profiler().writeTrace(tracePath))
+		return false;
+	std::cout << "Trace written to " << tracePath << std::endl;
+	return true;
+}
 
-	if (perspective_projection) {
-		// Resulting perspective matrix, FOV in radians, aspect ratio, near, and far clipping plane.
-		pMatrix = glm::perspective(fov_r, (float)SCR_WIDTH / (float)SCR_HEIGHT, near, far);
+// render all jobs with the CPU engine
+// ------------------------------------------------------------------------
+int renderJobsCpu(const vector<RenderJob> &jobs, unsigned int threads, const PipelineOptions &pipeline, const RenderOptions &options)
+{
+	CpuDeferredRenderer renderer(options.settings, threads);
+	DatasetCache cache;
+	unsigned int channels = options.settings.channels();
+	ImageSink sink(options.image, pipeline.writers);
+	vector<LightingCondition> conditions = options.activeConditions();
+	vector<RenderJob> outputs = conditionJobs(jobs, conditions);
+	deque<LightSet> sets;
+	vector<const LightSet*> lights;
+	if (!jobLightSets(jobs, options.lights, sets, lights))
+		return (int)jobs.size();
+
+	int failed = runPipeline<GBuffer, RgbImage>(jobs.size(), pipeline,
+		[&](size_t i, GBuffer &gbuffer) {
+			return loadJob(cache, channels, *lights[i], jobs[i], gbuffer);
+		},
+		[&](size_t i, GBuffer &gbuffer, const EmitFrame<RgbImage> &emit) {
+			// the G-buffer is loaded once and shaded under every condition
+			for (size_t c = 0; c < conditions.size(); c++) {
+				RgbImage image;
+				renderer.render(gbuffer, *lights[i], conditions[c], image);
+				emit(i * conditions.size() + c, image);
+			}
+			return true;
+		},
+		[&](size_t i, RgbImage &image, unsigned int writer) {
+			return sink.write(writer, outputs[i].output, image);
+		});
+	if (jobs.size() > 1) {
+		std::cout << "Dataset cache: " << cache.hits() << " hits, " << cache.misses() << " misses" << std::endl;
+		reportHdf5Handles();
+	}
+	return failed;
+}
+
+// one render request of a server client
+struct ServerJob
+{
+	RenderJob job; // no output to return the image to the client
+	string shm; // shared memory segment holding the G-buffer instead of job.input
+	LightingCondition condition;
+	bool setTheta = false, setPhi = false;
+	float theta = 0.0f, phi = 0.0f; // radians, replacing those the file records
+	ImageFormat format = IMAGE_PNG;
+	string error; // why the job failed
+};
+
+// Read a render request: "input", or "shm" naming a shared memory segment
+// laid out as gbuffer_memory.h describes, and optionally "output",
+// "format", "theta" and "phi" in degrees, "condition" (the name of one
+// loaded with --conditions), "lighting_power", "lighting_power1",
+// "shadow_casters" as an array of 0 and 1, and "lights" as arrays of x, y,
+// z, r, g, b[, outer[, inner]] in world space. Shadows are only drawn if the server loads
+// shadow maps (--conditions with shadows).
+// ------------------------------------------------------------------------
+bool parseServerJob(const JsonValue &body, const RenderOptions &options, ServerJob &job)
+{
+	job.job.input = body.stringOr("input", "");
+	job.job.output = body.stringOr("output", "");
+	job.shm = body.stringOr("shm", "");
+	job.format = options.image.format;
+	if (!job.shm.empty())
+		job.job.input = "shm:" + job.shm;
+	if (job.job.input.empty()) {
+		job.error = "ERROR::SERVER::NO_INPUT";
+		return false;
+	}
+	if (body.find("format") && !parseImageFormat(body.stringOr("format", ""), job.format)) {
+		job.error = "ERROR::IMAGE::UNKNOWN_FORMAT";
+		return false;
+	}
+
+	job.condition = options.lights.defaultCondition(options.settings.useShadow != 0);
+	if (const JsonValue* name = body.find("condition")) {
+		auto it = find_if(options.conditions.begin(), options.conditions.end(),
+			[&](const LightingCondition &condition) { return condition.name == name->text; });
+		if (it == options.conditions.end()) {
+			job.error = "ERROR::CONDITIONS::UNKNOWN_CONDITION " + name->text;
+			return false;
+		}
+		job.condition = *it;
+	}
+	job.condition.lightingPower = (float)body.numberOr("lighting_power", job.condition.lightingPower);
+	job.condition.lightingPower1 = (float)body.numberOr("lighting_power1", job.condition.lightingPower1);
+	if (const JsonValue* casters = body.find("shadow_casters")) {
+		job.condition.shadowCasters = 0;
+		for (const JsonValue &caster : casters->items) {
+			if (caster.type == JsonValue::JSON_NUMBER && (caster.number == 0 || caster.number == 1))
+				job.condition.shadowCasters |= 1u << (int)caster.number;
+		}
+	}
+	if (const JsonValue* lights = body.find("lights")) {
+		job.condition.lights.clear();
+		if (!parseJsonLights(*lights, job.condition.lights)) {
+			job.error = "ERROR::LIGHTS::CANNOT_PARSE_LIGHT";
+			return false;
+		}
 	}
-	else {
-		// The goal is to have the object be about the same size in the window
-		// during orthographic project as it is during perspective projection.
-
-		float a = (float)SCR_WIDTH / (float)SCR_HEIGHT;
-		float h = 2 * (25 * tan(fov_r / 2)); // Window aspect ratio.
-		float w = h * a; // Knowing the new window height size, get the new window width size based on the aspect ratio.
-
-		// The canvas' origin is the upper left corner. To the right is the positive x-axis. 
-		// Going down is the positive y-axis.
-
-		// Any object at the world origin would appear at the upper left hand corner.
-		// Shift the origin to the middle of the screen.
-
-		// Also, invert the y-axis as WebgL's positive y-axis points up while the canvas' positive
-		// y-axis points down the screen.
-
-		//           (0,O)------------------------(w,0)
-		//               |                        |
-		//               |                        |
-		//               |                        |
-		//           (0,h)------------------------(w,h)
-		//
-		//  (-(w/2),(h/2))------------------------((w/2),(h/2))
-		//               |                        |
-		//               |         (0,0)          |gbo
-		//               |                        |
-		// (-(w/2),-(h/2))------------------------((w/2),-(h/2))
-
-		// Resulting perspective matrix, left, right, bottom, top, near, and far clipping plane.
-		pMatrix = glm::ortho(-(w / 2),
-			(w / 2),
-			-(h / 2),
-			(h / 2),
-			near,
-			far);
-	}
-
-	// load and create a texture 
-	// -------------------------	
-	unsigned int gPosition, gNormal, gMask, gDiffuseColor, gDepth, gShadowMask, gShadowDepth, gShadowMask1, gShadowDepth1;
-
-	char filename[1024];
-	sprintf(filename, argv[1]);
-	string filename_s = filename;
-	int last_dot = filename_s.rfind(".");
-	int last_dash = filename_s.rfind("_");
-	float phi = stof(filename_s.substr(last_dash + 1, last_dot - last_dash - 1));
-	phi = phi * M_PI / 180;
-	int second_last_dash = filename_s.rfind("_", last_dash - 1);
-	float theta = stof(filename_s.substr(second_last_dash + 1, last_dash - second_last_dash - 1));
-	theta = theta * M_PI / 180;
-	int third_last_dash = filename_s.rfind("_", second_last_dash - 1);
-	float isoValue = stof(filename_s.substr(third_last_dash + 1, second_last_dash - third_last_dash - 1));
-	int fourth_last_dash = filename_s.rfind("_", third_last_dash - 1);
-	float BwsA = stof(filename_s.substr(fourth_last_dash + 1, third_last_dash - fourth_last_dash - 1));
-
-	// Move to the 3D space origin.
-	mvMatrix = glm::mat4(1.0f);
-
-	// transform
-	direction = glm::vec3(sin(theta) * cos(phi) * dist, sin(theta) * sin(phi) * dist, cos(theta) * dist);
-	up = glm::vec3(sin(theta - M_PI / 2) * cos(phi), sin(theta - M_PI / 2) * sin(phi), cos(theta - M_PI / 2));
-	//direction = glm::vec3(0.0f, dist, 0.0f);
-	//up = glm::vec3(0.0f, 0.0f, 1.0f);
-	center = glm::vec3(0.0f, 0.0f, 0.0f);
-	eye = center + direction;
-
-	view = glm::lookAt(eye, center, up);
-	model = glm::mat4(1.0f);
-	//model *= glm::rotate(rotation_radians, glm::vec3(0.0f, 1.0f, 0.0f));
-
-	mvMatrix = view * model;
-
-	hid_t file, space3, space1, dset_position, dset_normal, dset_mask, dset_depth;
-	herr_t status;
-	hsize_t dims3[1] = { SCR_WIDTH * SCR_HEIGHT * 3 };
-	hsize_t dims1[1] = { SCR_WIDTH * SCR_HEIGHT };
-
-	// open file and dataset using the default properties
-	file = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
-	dset_position = H5Dopen(file, "position", H5P_DEFAULT);
-	dset_normal = H5Dopen(file, "normal", H5P_DEFAULT);
-	dset_depth = H5Dopen(file, "depth", H5P_DEFAULT);
-	dset_mask = H5Dopen(file, "mask", H5P_DEFAULT);
-
-	// read the data using default properties 
-	glGenTextures(1, &gPosition);
-	glBindTexture(GL_TEXTURE_2D, gPosition); // all upcoming GL_TEXTURE_2D operations now have effect on this texture object
-	// set texture filtering parameters
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	float* pBuffer = new float[SCR_WIDTH * SCR_HEIGHT * 3];
-	status = H5Dread(dset_position, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, pBuffer);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, SCR_WIDTH, SCR_HEIGHT, 0, GL_RGB, GL_FLOAT, pBuffer);
-
-	glGenTextures(1, &gNormal);
-	glBindTexture(GL_TEXTURE_2D, gNormal); // all upcoming GL_TEXTURE_2D operations now have effect on this texture object
-	// set texture filtering parameters
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	float* nBuffer = new float[SCR_WIDTH * SCR_HEIGHT * 3];
-	status = H5Dread(dset_normal, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, nBuffer);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, SCR_WIDTH, SCR_HEIGHT, 0, GL_RGB, GL_FLOAT, nBuffer);
-	
-	glGenTextures(1, &gMask);
-	glBindTexture(GL_TEXTURE_2D, gMask); // all upcoming GL_TEXTURE_2D operations now have effect on this texture object
-	// set texture filtering parameters
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	float* mBuffer = new float[SCR_WIDTH * SCR_HEIGHT];
-	status = H5Dread(dset_mask, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, mBuffer);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, SCR_WIDTH, SCR_HEIGHT, 0, GL_RED, GL_FLOAT, mBuffer);
-
-	glGenTextures(1, &gDepth);
-	glBindTexture(GL_TEXTURE_2D, gDepth); // all upcoming GL_TEXTURE_2D operations now have effect on this texture object
-	// set texture filtering parameters
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	float* dBuffer = new float[SCR_WIDTH * SCR_HEIGHT];
-	status = H5Dread(dset_depth, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, dBuffer);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_R16F, SCR_WIDTH, SCR_HEIGHT, 0, GL_RED, GL_FLOAT, dBuffer);
-
-	glGenTextures(1, &gDiffuseColor);
-	glBindTexture(GL_TEXTURE_2D, gDiffuseColor); // all upcoming GL_TEXTURE_2D operations now have effect on this texture object
-	// set texture filtering parameters
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	float* cBuffer = new float[SCR_WIDTH * SCR_HEIGHT * 4];
-	for (int i = 0; i < SCR_WIDTH * SCR_HEIGHT; i++) {
-		cBuffer[i * 4 + 0] = 1.0;
-		cBuffer[i * 4 + 1] = 1.0;
-		cBuffer[i * 4 + 2] = 1.0;
-		cBuffer[i * 4 + 3] = 1.0;
-	}		
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, SCR_WIDTH, SCR_HEIGHT, 0, GL_RGBA, GL_FLOAT, cBuffer);
-
-	char shadow_filename[1024];
-	sprintf(shadow_filename, "MPAS_000000_3.27890_20.000000_90.0000026563_100.0000018721.h5");
-	filename_s = shadow_filename;
-	last_dot = filename_s.rfind(".");
-	last_dash = filename_s.rfind("_");
-	point_light_phi1 = stof(filename_s.substr(last_dash + 1, last_dot - last_dash - 1));
-	point_light_phi1 = point_light_phi1 * M_PI / 180;
-	second_last_dash = filename_s.rfind("_", last_dash - 1);
-	point_light_theta1 = stof(filename_s.substr(second_last_dash + 1, last_dash - second_last_dash - 1));
-	point_light_theta1 = point_light_theta1 * M_PI / 180;
-
-	/*unsigned int outBuffer;
-	glGenFramebuffers(1, &outBuffer);
-	glBindFramebuffer(GL_FRAMEBUFFER, outBuffer);
-	unsigned int gOutput;
-	// position color buffer 
-	glGenTextures(1, &gOutput);
-	glBindTexture(GL_TEXTURE_2D, gOutput);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, SCR_WIDTH, SCR_HEIGHT, 0, GL_RGB, GL_FLOAT, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, gOutput, 0);
-	
-	// tell OpenGL which color attachments we'll use (of this framebuffer) for rendering
-	glDrawBuffer(GL_COLOR_ATTACHMENT0);
-
-	//finally check if framebuffer is complete
-	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-		std::cout << "Framebuffer not complete!" << std::endl;
-	}
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);*/
-
-	// render loop
-	// -----------
-	//while (!glfwWindowShouldClose(window))
-	{
-		// input
-		// -----
-		processInput(window);
 
-		// render
-		// ------
+	job.setTheta = body.find("theta") != nullptr;
+	job.setPhi = body.find("phi") != nullptr;
+	job.theta = (float)(body.numberOr("theta", 0.0) * M_PI / 180);
+	job.phi = (float)(body.numberOr("phi", 0.0) * M_PI / 180);
+	return true;
+}
 
-		glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+// encode the image of a job and write it to the job's output or send it
+// back with the reply
+// ------------------------------------------------------------------------
+bool replyServerJob(RenderServer &server, const ServerRequest &request, const ServerJob &job, const RgbImage &image, ImageSink &sink, unsigned int writer)
+{
+	vector<unsigned char> bytes;
+	if (job.job.output.empty() ? !sink.encode(writer, image, job.format, bytes) : !sink.write(writer, job.job.output, image, job.format)) {
+		server.fail(request, "ERROR::IMAGE::NOT_SUCCESFULLY_WRITTEN");
+		return false;
+	}
+	ostringstream fields;
+	fields << "\"width\":" << image.width << ",\"height\":" << image.height << ",\"format\":" << jsonQuote(imageFormatName(job.format));
+	if (!job.job.output.empty())
+		fields << ",\"output\":" << jsonQuote(job.job.output);
+	server.reply(request, true, fields.str(), job.job.output.empty() ? &bytes : nullptr);
+	return true;
+}
 
-		//glBindFramebuffer(GL_FRAMEBUFFER, outBuffer);
-		shaderLightingPass.use();
+// Take the requests of a server in batches of up to batchSize and run each
+// batch through the frame pipeline until the server is shut down; render
+// draws job i of the batch and emits its image as frame i. Returns the
+// number of failed jobs.
+// ------------------------------------------------------------------------
+int serveJobs(RenderServer &server, size_t batchSize, const PipelineOptions &pipeline, const RenderOptions &options, DatasetCache &datasets, unsigned int channels,
+	const function<bool(size_t, const ServerJob&, GBuffer&, const EmitFrame<RgbImage>&)> &render,
+	const function<void(const EmitFrame<RgbImage>&)> &drain = nullptr)
+{
+	// every writer keeps an encoder per format, its state is reused
+	ImageSink sink(options.image, pipeline.writers);
+	int failed = 0;
+	vector<ServerRequest> requests;
+	while (server.next(requests, batchSize)) {
+		vector<ServerJob> jobs;
+		vector<const ServerRequest*> pending;
+		for (const ServerRequest &request : requests) {
+			ServerJob job;
+			if (!parseServerJob(request.body, options, job)) {
+				server.fail(request, job.error);
+				failed++;
+				continue;
+			}
+			jobs.push_back(job);
+			pending.push_back(&request);
+		}
+		vector<char> replied(jobs.size(), 0);
+		failed += runPipeline<GBuffer, RgbImage>(jobs.size(), pipeline,
+			[&](size_t i, GBuffer &gbuffer) {
+				// angles the request gives need not be in the file
+				bool anglesKnown = jobs[i].setTheta && jobs[i].setPhi;
+				gbuffer.theta = jobs[i].theta;
+				gbuffer.phi = jobs[i].phi;
+				bool loaded = jobs[i].shm.empty() ? loadGBuffer(datasets, channels, jobs[i].job.input, options.lights.shadowFile, gbuffer, anglesKnown)
+					: loadSharedGBuffer(datasets, channels, jobs[i].shm, options.lights.shadowFile, gbuffer);
+				if (!loaded) {
+					jobs[i].error = "ERROR::SERVER::CANNOT_LOAD " + jobs[i].job.input;
+					return false;
+				}
+				if (jobs[i].setTheta)
+					gbuffer.theta = jobs[i].theta;
+				if (jobs[i].setPhi)
+					gbuffer.phi = jobs[i].phi;
+				return true;
+			},
+			[&](size_t i, GBuffer &gbuffer, const EmitFrame<RgbImage> &emit) {
+				if (render(i, jobs[i], gbuffer, emit))
+					return true;
+				jobs[i].error = "ERROR::SERVER::CANNOT_RENDER " + jobs[i].job.input;
+				return false;
+			},
+			[&](size_t i, RgbImage &image, unsigned int writer) {
+				replied[i] = 1;
+				return replyServerJob(server, *pending[i], jobs[i], image, sink, writer);
+			},
+			drain);
+		for (size_t i = 0; i < jobs.size(); i++) {
+			if (!replied[i])
+				server.fail(*pending[i], jobs[i].error.empty() ? "ERROR::SERVER::CANNOT_RENDER " + jobs[i].job.input : jobs[i].error);
+		}
+	}
+	return failed;
+}
 
-		// set lighting sources 
-		float time_now = glfwGetTime();
-		if (time_last != 0) {
-			float time_delta = (time_now - time_last);
+// serve render requests with the CPU engine
+// ------------------------------------------------------------------------
+int serveCpu(RenderServer &server, unsigned int threads, const PipelineOptions &pipeline, const RenderOptions &options, size_t batchSize)
+{
+	CpuDeferredRenderer renderer(options.settings, threads);
+	DatasetCache cache;
+	return serveJobs(server, batchSize, pipeline, options, cache, options.settings.channels(),
+		[&](size_t i, const ServerJob &job, GBuffer &gbuffer, const EmitFrame<RgbImage> &emit) {
+			RgbImage image;
+			renderer.render(gbuffer, options.lights, job.condition, image);
+			emit(i, image);
+			return true;
+		});
+}
 
-			if (use_lighting == 1) {
-				//point_light_theta += point_light_theta_step * time_delta;
-				//point_light_phi += point_light_phi_step * time_delta;
+// Shade one file with the CPU engine and time every output encoder on it,
+// at its own size and scaled up 8x (2048x2048 for the sample files).
+// ------------------------------------------------------------------------
+int benchmarkEncoders(const RenderJob &job, const RenderOptions &options)
+{
+	CpuDeferredRenderer renderer(options.settings);
+	DatasetCache cache;
+	GBuffer gbuffer;
+	if (!loadGBuffer(cache, options.settings.channels(), job.input, options.lights.shadowFile, gbuffer))
+		return -1;
+	RgbImage image;
+	renderer.render(gbuffer, options.lights, options.lights.defaultCondition(options.settings.useShadow != 0), image);
+	runEncodeBenchmark(image.pixels, image.width, image.height);
+
+	const unsigned int scale = 8;
+	unsigned int width = image.width * scale, height = image.height * scale;
+	vector<unsigned char> large((size_t)width * height * 3);
+	for (unsigned int y = 0; y < height; y++)
+		for (unsigned int x = 0; x < width; x++)
+			memcpy(&large[((size_t)y * width + x) * 3], &image.pixels[((size_t)(y / scale) * image.width + x / scale) * 3], 3);
+	runEncodeBenchmark(large, width, height);
+	return 0;
+}
 
-				//if (point_light_theta > (M_PI * 2)) point_light_theta = 0.0;
-				//if (point_light_phi > (M_PI * 2)) point_light_phi = 0.0;
+// largest channel difference, in 8-bit levels, between the CPU renders of a
+// view from its input and from its packed file that --pack-verify accepts;
+// octahedral normals and half depth shift a few pixels by one level
+const int PACK_VERIFY_TOLERANCE = 2;
 
-				//point_light_theta1 += point_light_theta_step1 * time_delta;
-				//point_light_phi1 += point_light_phi_step1 * time_delta;
+// Render a packed file and the input it was packed from with the CPU
+// engine; the largest channel difference, or -1 if either cannot be read.
+// ------------------------------------------------------------------------
+int comparePackedRender(CpuDeferredRenderer &renderer, const RenderOptions &options, const string &input, const string &packed)
+{
+	DatasetCache cache(0);
+	RgbImage images[2];
+	const string* paths[2] = { &input, &packed };
+	for (int k = 0; k < 2; k++) {
+		GBuffer gbuffer;
+		if (!loadGBuffer(cache, options.settings.channels(), *paths[k], options.lights.shadowFile, gbuffer))
+			return -1;
+		renderer.render(gbuffer, options.lights, options.lights.defaultCondition(options.settings.useShadow != 0), images[k]);
+	}
+	if (images[0].width != images[1].width || images[0].height != images[1].height)
+		return 255;
+	int difference = 0;
+	for (size_t i = 0; i < images[0].pixels.size(); i++)
+		difference = max(difference, abs((int)images[0].pixels[i] - (int)images[1].pixels[i]));
+	return difference;
+}
 
-				//if (point_light_theta1 > (M_PI * 2)) point_light_theta1 = 0.0;
-				//if (point_light_phi1 > (M_PI * 2)) point_light_phi1 = 0.0;
+// Convert the inputs to packed G-buffer files, <output dir>/<input stem>.gbp;
+// with verify, a file whose render differs from that of its input by more
+// than PACK_VERIFY_TOLERANCE counts as failed
+// ------------------------------------------------------------------------
+int packJobs(const vector<RenderJob> &jobs, const string &outputDir, const PackOptions &options, const RenderOptions* verify = nullptr)
+{
+	unique_ptr<CpuDeferredRenderer> renderer(verify ? new CpuDeferredRenderer(verify->settings) : nullptr);
+	int worst = 0;
+	DatasetCache cache(0);
+	int failed = 0;
+	uintmax_t inputBytes = 0, outputBytes = 0;
+	for (const RenderJob &job : jobs) {
+		CachedFile file(job.input);
+		DatasetCache::Data normal = cache.get(file, "normal", 3), depth = cache.get(file, "depth", 1), mask = cache.get(file, "mask", 1);
+		bool ok = normal && depth && mask;
+		if (ok && (normal->width != depth->width || normal->height != depth->height || mask->width != depth->width || mask->height != depth->height)) {
+			std::cout << "ERROR::HDF5::RESOLUTION_MISMATCH " << job.input << std::endl;
+			ok = false;
+		}
+		string output = fs::path(outputPathFor(job.input, outputDir)).replace_extension(".gbp").string();
+		if (ok) {
+			// repacking a packed file starts from its decoded normals
+			vector<float> normals;
+			if (normal->floats())
+				normals.assign(normal->floats(), normal->floats() + normal->count());
+			else
+				decodePackedTexels(*normal, normals);
+			ok = writePackedGBuffer(output, depth->width, depth->height, normals.data(), depth->floats(), mask->floats(), options);
+		}
+		if (ok && renderer) {
+			int difference = comparePackedRender(*renderer, *verify, job.input, output);
+			worst = max(worst, difference);
+			if (difference < 0 || difference > PACK_VERIFY_TOLERANCE) {
+				std::cout << "ERROR::PACKED::RENDER_MISMATCH " << output << " differs by " << difference << std::endl;
+				std::error_code ec;
+				fs::remove(output, ec);
+				ok = false;
 			}
 		}
+		if (!ok) {
+			std::cout << "Failed to pack " << job.input << std::endl;
+			failed++;
+			continue;
+		}
+		std::error_code ec;
+		inputBytes += fs::file_size(job.input, ec);
+		outputBytes += fs::file_size(output, ec);
+	}
+	printf("Packed %zu of %zu files, %.1f MB to %.1f MB\n", jobs.size() - failed, jobs.size(), inputBytes / 1048576.0, outputBytes / 1048576.0);
+	if (renderer)
+		printf("Packed renders differ from their inputs' by at most %d levels\n", worst);
+	return failed;
+}
+
+// Rewrite the HDF5 inputs into <output dir>/<input stem>.h5 with chunked,
+// shuffled and deflated datasets
+// ------------------------------------------------------------------------
+int rechunkJobs(const vector<RenderJob> &jobs, const string &outputDir, const ChunkOptions &options)
+{
+	int failed = 0;
+	uintmax_t inputBytes = 0, outputBytes = 0;
+	for (const RenderJob &job : jobs) {
+		string output = fs::path(outputPathFor(job.input, outputDir)).replace_extension(".h5").string();
+		std::error_code ec;
+		bool ok = true;
+		if (fs::equivalent(job.input, output, ec)) {
+			std::cout << "ERROR::HDF5::OUTPUT_IS_INPUT " << output << std::endl;
+			ok = false;
+		}
+		if (!ok || !writeChunkedCopy(job.input, output, options)) {
+			std::cout << "Failed to rechunk " << job.input << std::endl;
+			failed++;
+			continue;
+		}
+		inputBytes += fs::file_size(job.input, ec);
+		outputBytes += fs::file_size(output, ec);
+	}
+	printf("Rechunked %zu of %zu files, %.1f MB to %.1f MB\n", jobs.size() - failed, jobs.size(), inputBytes / 1048576.0, outputBytes / 1048576.0);
+	return failed;
+}
 
-		time_last = time_now;
+// print the command line syntax
+// ------------------------------------------------------------------------
+void printUsage(const char* program)
+{
+	std::cout << "Usage: " << program << " [--headless] [--engine gl|cpu] [--threads <n>] [--loaders <n>] [--writers <n>] [--prefetch <n>] [--readback <n>] [--format png|ppm|qoi|raw] [--png-level <0-9>] [--png-filter <filter>] [--encode-threads <n>] [--bench-encode] [--bench-shaders] [--bench-lights] [--bench-relight] [--uber-shader] [--shadow <file>] [--lights <file>] [--conditions <file>] [--relight] [--no-light-culling] [--pack] [--pack-depth half|float] [--pack-mask byte|bit] [--pack-verify] [--rechunk] [--chunk-kb <n>] [--deflate <0-9>] [--open-files <n>] [--core-below-kb <n>] [--serve <socket> [--batch <n>]] [--shader-cache <dir>|none] [--profile] [--trace <file.json>] [-o <output dir>] <file.h5 | file.gbp | directory | glob | manifest | manifest.json>..." << std::endl;
+}
 
-		// Let the fragment shader know that perspective projection is being used.
-		if (perspective_projection) {
-			shaderLightingPass.setInt("uPerspectiveProjection", 1);
+// Usage: textureMapping [--headless] [--engine gl|cpu] [--threads <n>]
+//                       [--loaders <n>] [--writers <n>] [--prefetch <n>] [--readback <n>]
+//                       [--format <f>] [--png-level <n>] [--png-filter <f>] [--encode-threads <n>]
+//                       [--bench-encode] [--bench-shaders] [--bench-lights] [--bench-relight]
+//                       [--uber-shader] [--shadow <file>] [--lights <file>] [--conditions <file>] [--relight]
+//                       [--no-light-culling] [--pack [--pack-depth half|float] [--pack-mask byte|bit]
+//                       [--pack-verify]]
+//                       [--rechunk [--chunk-kb <n>] [--deflate <0-9>]] [--open-files <n>]
+//                       [--core-below-kb <n>] [--serve <socket> [--batch <n>]]
+//                       [--shader-cache <dir>|none] [--profile] [--trace <file.json>]
+//                       [-o <output dir>] <input>...
+// A single .h5 input without -o keeps the original behaviour and writes
+// res.png. Otherwise every input (file, directory, glob or manifest) is
+// rendered through the same context, shader and textures to
+// <output dir>/<input stem>.png. View angles are read from the theta and
+// phi attributes of a file, or else its MPAS_..._<theta>_<phi> name; a JSON
+// manifest may give them, with the shadow caster and point lights of its
+// views, and its jobs are grouped by shadow caster and input. --shadow
+// replaces the default shadow caster of light 2. --headless renders without a window
+// through a surfaceless EGL context. --engine cpu shades on the CPU with
+// SIMD and a pool of --threads threads (default: all cores) and needs no
+// OpenGL at all. Reading, shading and PNG encoding run as a pipeline:
+// --loaders threads read the datasets of up to --prefetch files ahead while
+// the current one is shaded, and --writers threads encode the results.
+// The GL path reads frames back through a ring of --readback pixel buffer
+// objects (0: blocking glReadPixels). --format png|ppm|qoi|raw selects the
+// output format; PNGs are compressed with --png-level 0-9 and --png-filter
+// none|sub|up|average|paeth|adaptive, in row strips spread over
+// --encode-threads threads per writer. --bench-encode times all encoders
+// on the first input instead of rendering. Linked shader programs are kept
+// in --shader-cache (default the per-user cache directory, e.g.
+// ~/.cache/deferShader/shader_cache; none to always compile). The
+// lighting pass is compiled for the render mode unless --uber-shader asks
+// for the single program branching on uniforms; --bench-shaders times both
+// in every mode on the first input. --lights adds the point lights of a
+// file to the two built-in ones; every screen tile only shades the lights
+// that can reach it unless --no-light-culling is given. --bench-lights
+// times the lit pass on the first input with 2 to 1024 lights.
+// --conditions renders every input under each lighting condition of a
+// file to <output>_<condition>; the G-buffer is read once and up to
+// MAX_CONDITIONS conditions are shaded by one pass. --relight instead keeps
+// the light-invariant terms of each view and only redoes, per condition,
+// what its lights change; --bench-relight times that on the first input.
+// --pack converts the inputs to packed G-buffer files (.gbp) in the output
+// directory instead of rendering; they are read like HDF5 inputs, mapped
+// and uploaded without conversion. Depth is stored as half floats unless
+// --pack-depth float, the mask as bytes unless --pack-mask bit;
+// --pack-verify renders every packed file and its input with the CPU
+// engine and fails those differing by more than quantization. --rechunk
+// rewrites HDF5 inputs into the output directory with every dataset split
+// into chunks of about --chunk-kb KB (default 64), shuffled and deflated at
+// --deflate level (default 4, 0: uncompressed); chunked inputs are
+// decompressed chunk by chunk on all cores. Up to --open-files HDF5 files
+// (default 32) stay open with their datasets across frames; files smaller
+// than --core-below-kb KB are read whole at open with the core driver.
+// --serve keeps the context and caches warm and renders the jobs that
+// clients send as JSON lines over a Unix socket, --batch at a time (see
+// render_server.h); no inputs are needed then. --profile times the load,
+// render and write stage of every frame and the steps inside them, on the
+// CPU and with timer queries on the GPU, and prints the time per frame of
+// each at exit; --trace also writes them as a Chrome trace_event file.
+int main(int argc, char **argv)
+{
+	string output_dir;
+	bool headless = false;
+	bool cpu_engine = false;
+	unsigned int threads = 0;
+	bool bench_encode = false;
+	bool bench_shaders = false;
+	bool bench_lights = false;
+	bool bench_relight = false;
+	bool pack = false, pack_verify = false;
+	PackOptions pack_options;
+	bool rechunk = false;
+	ChunkOptions chunk_options;
+	size_t open_files = 32;
+	Hdf5AccessOptions access_options;
+	string serve_path;
+	size_t batch_size = 8;
+	string shadow_file;
+	bool profile = false;
+	string trace_path;
+	PipelineOptions options;
+	RenderOptions render_options;
+	vector<string> inputs;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "-o" && i + 1 < argc)
+			output_dir = argv[++i];
+		else if (arg == "--headless")
+			headless = true;
+		else if (arg == "--engine" && i + 1 < argc) {
+			string engine = argv[++i];
+			if (engine != "gl" && engine != "cpu") {
+				std::cout << "ERROR::ARGS::UNKNOWN_ENGINE " << engine << std::endl;
+				printUsage(argv[0]);
+				return -1;
+			}
+			cpu_engine = engine == "cpu";
 		}
-		else {
-			shaderLightingPass.setInt("uPerspectiveProjection", 0);
-		}
-
-		shaderLightingPass.setInt("uShowDepth", show_depth);
-		shaderLightingPass.setInt("uShowNormals", show_normals);
-		shaderLightingPass.setInt("uShowPosition", show_position);
-		setMatrixUniforms(shaderLightingPass);
-
-		// Disable alpha blending.
-		glDisable(GL_BLEND);
-		if (use_lighting == 1) {
-			// Pass the lighting parameters to the fragment shader.
-			// Global ambient color. 
-			shaderLightingPass.setVec3("uAmbientColor", base_color);
-
-			// Point light 1.
-			float point_light_dist = 2.3;
-			glm::vec3 point_light_direction = direction / dist * point_light_dist;
-			glm::vec3 point_light_position = center + point_light_direction;
-			glm::vec4 light_pos(point_light_position.x, point_light_position.y, point_light_position.z, 1.0);
-			light_pos = view * light_pos;
-
-			shaderLightingPass.setVec3("uPointLightingColor", lighting_power, lighting_power, lighting_power);
-			shaderLightingPass.setVec3("uPointLightingLocation", light_pos[0], light_pos[1], light_pos[2]);
-
-			// Point light 2.
-			float point_light_dist1 = 2.3;
-			float point_light_position_x1 = 0 + point_light_dist1 * cos(point_light_phi1) * sin(point_light_theta1);
-			float point_light_position_y1 = 0 + point_light_dist1 * sin(point_light_phi1) * sin(point_light_theta1);
-			float point_light_position_z1 = 0 + point_light_dist1 * cos(point_light_theta1);
-
-			glm::vec4 light_pos1(point_light_position_x1, point_light_position_y1, point_light_position_z1, 1.0);
-			light_pos1 = view * light_pos1;
-
-			shaderLightingPass.setVec3("uPointLightingColor1", lighting_power1, lighting_power1, lighting_power1);
-			shaderLightingPass.setVec3("uPointLightingLocation1", light_pos1[0], light_pos1[1], light_pos1[2]);
-
-			shaderLightingPass.setInt("uUseShadow", use_shadow);
-
-			if (use_shadow) {
-				glm::mat4 lightProjection, lightView, lightView1;
-				glm::mat4 lightSpaceMatrix, lightSpaceMatrix1;
-				lightProjection = pMatrix;
-				lightView = view;
-				lightSpaceMatrix = lightProjection * lightView;
-				
-				glm::vec3 point_light_up1 = glm::vec3(sin(point_light_theta1 - M_PI / 2) * cos(point_light_phi1), sin(point_light_theta1 - M_PI / 2) * sin(point_light_phi1), cos(point_light_theta1 - M_PI / 2));
-				lightView1 = glm::lookAt(glm::vec3(point_light_position_x1, point_light_position_y1, point_light_position_z1), center, point_light_up1);
-				lightSpaceMatrix1 = lightProjection * lightView1;
-
-				shaderLightingPass.setMat4("uMMatrix", model);
-				shaderLightingPass.setMat4("lightSpaceMatrix", lightSpaceMatrix);
-				shaderLightingPass.setMat4("lightSpaceMatrix1", lightSpaceMatrix1);
-
-				hid_t file_shadow, dset_shadow_mask, dset_shadow_depth;
-
-				// open file and dataset using the default properties, light 0
-				char filepath_shadow[1024];
-				sprintf(filepath_shadow, "%s", filename);
-
-				file_shadow = H5Fopen(filepath_shadow, H5F_ACC_RDONLY, H5P_DEFAULT);
-				dset_shadow_mask = H5Dopen(file_shadow, "mask", H5P_DEFAULT);
-				dset_shadow_depth = H5Dopen(file_shadow, "depth", H5P_DEFAULT);
-
-				// read the data using default properties, light 0
-				glGenTextures(1, &gShadowMask);
-				glBindTexture(GL_TEXTURE_2D, gShadowMask); // all upcoming GL_TEXTURE_2D operations now have effect on this texture object
-				// set texture filtering parameters
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-				float* mShadowBuffer = new float[SHADOW_WIDTH * SHADOW_HEIGHT];
-				status = H5Dread(dset_shadow_mask, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, mShadowBuffer);
-				glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, SHADOW_WIDTH, SHADOW_HEIGHT, 0, GL_RED, GL_FLOAT, mShadowBuffer);
-
-				glGenTextures(1, &gShadowDepth);
-				glBindTexture(GL_TEXTURE_2D, gShadowDepth); // all upcoming GL_TEXTURE_2D operations now have effect on this texture object
-				// set texture filtering parameters
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-				float* dShadowBuffer = new float[SHADOW_WIDTH * SHADOW_HEIGHT];
-				status = H5Dread(dset_shadow_depth, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, dShadowBuffer);
-				glTexImage2D(GL_TEXTURE_2D, 0, GL_R16F, SHADOW_WIDTH, SHADOW_HEIGHT, 0, GL_RED, GL_FLOAT, dShadowBuffer);
-
-				hid_t file_shadow1, dset_shadow_mask1, dset_shadow_depth1;
-
-				// open file and dataset using the default properties, light 1
-				char filepath_shadow1[1024];
-				sprintf(filepath_shadow1, "%s", shadow_filename);
-
-				file_shadow1 = H5Fopen(filepath_shadow1, H5F_ACC_RDONLY, H5P_DEFAULT);
-				dset_shadow_mask1 = H5Dopen(file_shadow1, "mask", H5P_DEFAULT);
-				dset_shadow_depth1 = H5Dopen(file_shadow1, "depth", H5P_DEFAULT);
-
-				// read the data using default properties, light 0
-				glGenTextures(1, &gShadowMask1);
-				glBindTexture(GL_TEXTURE_2D, gShadowMask1); // all upcoming GL_TEXTURE_2D operations now have effect on this texture object
-				// set texture filtering parameters
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-				float* mShadowBuffer1 = new float[SHADOW_WIDTH * SHADOW_HEIGHT];
-				status = H5Dread(dset_shadow_mask1, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, mShadowBuffer1);
-				glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, SHADOW_WIDTH, SHADOW_HEIGHT, 0, GL_RED, GL_FLOAT, mShadowBuffer1);
-
-				glGenTextures(1, &gShadowDepth1);
-				glBindTexture(GL_TEXTURE_2D, gShadowDepth1); // all upcoming GL_TEXTURE_2D operations now have effect on this texture object
-				// set texture filtering parameters
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-				float* dShadowBuffer1 = new float[SHADOW_WIDTH * SHADOW_HEIGHT];
-				status = H5Dread(dset_shadow_depth1, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, dShadowBuffer1);
-				glTexImage2D(GL_TEXTURE_2D, 0, GL_R16F, SHADOW_WIDTH, SHADOW_HEIGHT, 0, GL_RED, GL_FLOAT, dShadowBuffer1);
-
-				status = H5Dclose(dset_shadow_mask);
-				status = H5Dclose(dset_shadow_depth);
-				status = H5Dclose(dset_shadow_mask1);
-				status = H5Dclose(dset_shadow_depth1);
-				status = H5Fclose(file_shadow);
-				status = H5Fclose(file_shadow1);
-
-				delete mShadowBuffer;
-				delete mShadowBuffer1;
-				delete dShadowBuffer;
-				delete dShadowBuffer1;
+		else if (arg == "--threads" && i + 1 < argc)
+			threads = (unsigned int)atoi(argv[++i]);
+		else if (arg == "--loaders" && i + 1 < argc)
+			options.loaders = (unsigned int)atoi(argv[++i]);
+		else if (arg == "--writers" && i + 1 < argc)
+			options.writers = (unsigned int)atoi(argv[++i]);
+		else if (arg == "--prefetch" && i + 1 < argc)
+			options.depth = (unsigned int)atoi(argv[++i]);
+		else if (arg == "--readback" && i + 1 < argc)
+			options.readbackDepth = (unsigned int)atoi(argv[++i]);
+		else if (arg == "--format" && i + 1 < argc) {
+			if (!parseImageFormat(argv[++i], render_options.image.format)) {
+				std::cout << "ERROR::IMAGE::UNKNOWN_FORMAT " << argv[i] << std::endl;
+				return -1;
 			}
-			// Bind texture
-			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, gPosition);
-			glActiveTexture(GL_TEXTURE1);
-			glBindTexture(GL_TEXTURE_2D, gNormal);
-			glActiveTexture(GL_TEXTURE2);
-			glBindTexture(GL_TEXTURE_2D, gDiffuseColor);
-			glActiveTexture(GL_TEXTURE3);
-			glBindTexture(GL_TEXTURE_2D, gMask);
-			glActiveTexture(GL_TEXTURE4);
-			glBindTexture(GL_TEXTURE_2D, gDepth);
-			if (use_shadow) {
-				glActiveTexture(GL_TEXTURE5);
-				glBindTexture(GL_TEXTURE_2D, gShadowMask);
-				glActiveTexture(GL_TEXTURE6);
-				glBindTexture(GL_TEXTURE_2D, gShadowDepth);
-				glActiveTexture(GL_TEXTURE7);
-				glBindTexture(GL_TEXTURE_2D, gShadowMask1);
-				glActiveTexture(GL_TEXTURE8);
-				glBindTexture(GL_TEXTURE_2D, gShadowDepth1);
+		}
+		else if (arg == "--png-level" && i + 1 < argc)
+			render_options.image.level = min(max(atoi(argv[++i]), 0), 9);
+		else if (arg == "--png-filter" && i + 1 < argc) {
+			if (!parsePngFilter(argv[++i], render_options.image.filter)) {
+				std::cout << "ERROR::IMAGE::UNKNOWN_PNG_FILTER " << argv[i] << std::endl;
+				return -1;
 			}
 		}
+		else if (arg == "--encode-threads" && i + 1 < argc)
+			render_options.image.threads = (unsigned int)atoi(argv[++i]);
+		else if (arg == "--bench-encode")
+			bench_encode = true;
+		else if (arg == "--bench-shaders")
+			bench_shaders = true;
+		else if (arg == "--uber-shader")
+			render_options.settings.uberShader = true;
+		else if (arg == "--bench-lights")
+			bench_lights = true;
+		else if (arg == "--bench-relight")
+			bench_relight = true;
+		else if (arg == "--relight")
+			render_options.settings.relighting = true;
+		else if (arg == "--pack")
+			pack = true;
+		else if (arg == "--pack-verify")
+			pack_verify = true;
+		else if (arg == "--pack-depth" && i + 1 < argc) {
+			string encoding = argv[++i];
+			if (encoding == "half" || encoding == "float")
+				pack_options.depthEncoding = encoding == "half" ? PACKED_HALF : PACKED_FLOAT32;
+			else
+				std::cout << "ERROR::PACKED::UNKNOWN_DEPTH_ENCODING " << encoding << std::endl;
+		}
+		else if (arg == "--pack-mask" && i + 1 < argc) {
+			string encoding = argv[++i];
+			if (encoding == "byte" || encoding == "bit")
+				pack_options.maskEncoding = encoding == "byte" ? PACKED_UNORM8 : PACKED_BITS;
+			else
+				std::cout << "ERROR::PACKED::UNKNOWN_MASK_ENCODING " << encoding << std::endl;
+		}
+		else if (arg == "--rechunk")
+			rechunk = true;
+		else if (arg == "--chunk-kb" && i + 1 < argc)
+			chunk_options.chunkBytes = (size_t)max(atoi(argv[++i]), 1) << 10;
+		else if (arg == "--deflate" && i + 1 < argc)
+			chunk_options.deflateLevel = min(max(atoi(argv[++i]), 0), 9);
+		else if (arg == "--open-files" && i + 1 < argc)
+			open_files = (size_t)max(atoi(argv[++i]), 1);
+		else if (arg == "--core-below-kb" && i + 1 < argc)
+			access_options.coreBelow = (size_t)max(atoi(argv[++i]), 0) << 10;
+		else if (arg == "--serve" && i + 1 < argc)
+			serve_path = argv[++i];
+		else if (arg == "--batch" && i + 1 < argc)
+			batch_size = (size_t)max(atoi(argv[++i]), 1);
+		else if (arg == "--shadow" && i + 1 < argc)
+			shadow_file = argv[++i];
+		else if (arg == "--lights" && i + 1 < argc) {
+			if (!loadLights(argv[++i], render_options.lights.sceneLights))
+				return -1;
+		}
+		else if (arg == "--conditions" && i + 1 < argc) {
+			if (!loadConditions(argv[++i], render_options.conditions))
+				return -1;
+		}
+		else if (arg == "--no-light-culling")
+			render_options.settings.lightCulling = false;
+		else if (arg == "--profile")
+			profile = true;
+		else if (arg == "--trace" && i + 1 < argc)
+			trace_path = argv[++i];
+		else if (arg == "--shader-cache" && i + 1 < argc) {
+			render_options.settings.shaderCacheDirectory = argv[++i];
+			if (render_options.settings.shaderCacheDirectory == "none")
+				render_options.settings.shaderCacheDirectory.clear();
+		}
+		else if (arg.compare(0, 2, "--") == 0) {
+			// a misspelled option or one missing its value is no manifest
+			if (arg != "--help")
+				std::cout << "ERROR::ARGS::UNKNOWN_OPTION " << arg << std::endl;
+			printUsage(argv[0]);
+			return -1;
+		}
+		else
+			inputs.push_back(arg);
+	}
+	vector<RenderJob> jobs;
+	if (!collectRenderJobs(inputs, output_dir, jobs))
+		return -1;
+	groupJobs(jobs);
+	if (jobs.empty() && serve_path.empty()) {
+		printUsage(argv[0]);
+		return -1;
+	}
+	if (inputs.size() == 1 && jobs.size() == 1 && output_dir.empty() && inputs[0] == jobs[0].input)
+		jobs[0].output = "res.png";
+	if (render_options.image.format != IMAGE_PNG) {
+		for (RenderJob &job : jobs)
+			job.output = fs::path(job.output).replace_extension(imageExtension(render_options.image.format)).string();
+	}
+	if (!output_dir.empty()) {
+		std::error_code ec;
+		fs::create_directories(output_dir, ec);
+	}
+	{
+		std::lock_guard<std::mutex> lock(hdf5Mutex());
+		hdf5Handles().configure(open_files, access_options);
+	}
+	if (!shadow_file.empty() && !render_options.lights.setShadowFile(shadow_file))
+		return -1;
+	if (pack)
+		return packJobs(jobs, output_dir, pack_options, pack_verify ? &render_options : nullptr) == 0 ? 0 : 1;
+	if (rechunk)
+		return rechunkJobs(jobs, output_dir, chunk_options) == 0 ? 0 : 1;
+
+	// shadow maps are loaded and tested once any condition casts a shadow
+	for (const LightingCondition &condition : render_options.conditions) {
+		if (condition.shadowCasters != 0)
+			render_options.settings.useShadow = 1;
+	}
+
+	bool profiling = profile || !trace_path.empty();
+	if (profiling)
+		profiler().enable();
+
+	if (!serve_path.empty()) {
+		RenderServer server;
+		if (!server.listen(serve_path))
+			return -1;
+		std::cout << "Serving on " << serve_path << std::endl;
+		int failed = cpu_engine ? serveCpu(server, threads, options, render_options, batch_size) : serveGL(server, headless, options, render_options, batch_size);
+		if (failed < 0)
+			return -1;
+		RenderServerStats stats = server.stats();
+		printf("Served %zu jobs, %zu failed, in %zu batches; latency %.1f ms mean, %.1f ms max\n",
+			stats.completed + stats.failed, stats.failed, stats.batches, stats.meanLatency, stats.maxLatency);
+		if (profiling && !reportProfile(trace_path))
+			return 1;
+		return 0;
+	}
+	if (bench_encode)
+		return benchmarkEncoders(jobs[0], render_options);
+	if (bench_shaders)
+		return benchmarkShaders(jobs[0], headless, render_options, 200);
+	if (bench_lights)
+		return benchmarkLights(jobs[0], headless, render_options, 50);
+	if (bench_relight)
+		return benchmarkRelight(jobs[0], headless, render_options, 50);
+
+	auto start = std::chrono::steady_clock::now();
+	int failed = 0;
+	if (cpu_engine) {
+		failed = renderJobsCpu(jobs, threads, options, render_options);
+	}
+	else {
+		failed = renderJobsGL(jobs, headless, options, render_options);
+		if (failed < 0)
+			return -1;
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (jobs.size() > 1)
+		std::cout << "Rendered " << jobs.size() - failed << " of " << jobs.size() << " files in " << seconds << " s" << std::endl;
+	if (profiling && !reportProfile(trace_path))
+		return 1;
+	return failed == 0 ? 0 : 1;
+}
+
 
-		shaderLightingPass.setInt("uUseLighting", use_lighting);
-
-		// render container
-		renderQuad();
-
-		char imagename[1024];
-		sprintf(imagename, "res.png");
-		float* pBuffer = new float[SCR_WIDTH * SCR_HEIGHT * 4];
-		unsigned char* pImage = new unsigned char[SCR_WIDTH * SCR_HEIGHT * 3];
-		glReadBuffer(GL_BACK);
-		glReadPixels(0, 0, SCR_WIDTH, SCR_HEIGHT, GL_RGBA, GL_FLOAT, pBuffer);
-		
-		for (unsigned int j = 0; j < SCR_HEIGHT; j++) {
-			for (unsigned int k = 0; k < SCR_WIDTH; k++) {
-				int index = j * SCR_WIDTH + k;
-				pImage[index * 3 + 0] = unsigned char(min(pBuffer[index * 4 + 0] * 255, 255.0f));
-				pImage[index * 3 + 1] = unsigned char(min(pBuffer[index * 4 + 1] * 255, 255.0f));
-				pImage[index * 3 + 2] = unsigned char(min(pBuffer[index * 4 + 2] * 255, 255.0f));
+// render all jobs through one OpenGL context; returns the number of failed
+// jobs or -1 if the context or the shaders could not be set up
+// ------------------------------------------------------------------------
+int renderJobsGL(const vector<RenderJob> &jobs, bool headless, const PipelineOptions &pipeline, const RenderOptions &options)
+{
+	RenderContext ctx;
+	if (!createRenderContext(ctx, headless, SCR_WIDTH, SCR_HEIGHT)) {
+		destroyRenderContext(ctx);
+		return -1;
+	}
+
+	// only the datasets the shader configuration samples are read; they are
+	// shared between the G-buffer and shadow slots through the caches
+	vector<LightingCondition> conditions = options.activeConditions();
+	vector<RenderJob> outputs = conditionJobs(jobs, conditions);
+	deque<LightSet> sets;
+	vector<const LightSet*> lights;
+	if (!jobLightSets(jobs, options.lights, sets, lights)) {
+		destroyRenderContext(ctx);
+		return (int)jobs.size();
+	}
+	unsigned int channels = options.settings.channels();
+	DatasetCache datasets;
+	ImageSink sink(options.image, pipeline.writers);
+	int failed;
+	{
+		DeferredRenderer renderer(ctx, options.settings, datasets, pipeline.readbackDepth);
+		if (!renderer.linked()) {
+			// every frame would come out blank
+			std::cout << "ERROR::RENDERER::SHADERS_NOT_LINKED in " << options.settings.shaderDirectory << std::endl;
+			failed = -1;
+		}
+		else {
+			// render loop; GL stays on this thread, loading and encoding overlap
+			// --------------------------------------------------------------------
+			failed = runPipeline<GBuffer, RgbImage>(jobs.size(), pipeline,
+				[&](size_t i, GBuffer &gbuffer) {
+					return loadJob(datasets, channels, *lights[i], jobs[i], gbuffer);
+				},
+				[&](size_t i, GBuffer &gbuffer, const EmitFrame<RgbImage> &emit) {
+					if (renderer.render(i, gbuffer, *lights[i], conditions, emit))
+						return true;
+					std::cout << "Failed to render " << jobs[i].input << std::endl;
+					return false;
+				},
+				[&](size_t i, RgbImage &image, unsigned int writer) {
+					return sink.write(writer, outputs[i].output, image);
+				},
+				[&](const EmitFrame<RgbImage> &emit) {
+					renderer.flush(emit);
+				});
+			failed += (int)renderer.readbackFailures();
+
+			if (jobs.size() > 1) {
+				std::cout << "Texture cache: " << renderer.textures().hits() << " hits, " << renderer.textures().misses() << " misses" << std::endl;
+				reportHdf5Handles();
 			}
 		}
-		
-		stbi_write_png(imagename, SCR_WIDTH, SCR_HEIGHT, 3, pImage, SCR_WIDTH * 3);
-		//char filename_output[1024];
-		//sprintf(filename_output, "res.h5");
-		//hid_t file_output, dset_output;
-
-		//// Create a new file using the default properties 
-		//file = H5Fcreate(filename_output, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
-
-		//// Create dataspace.  Setting maximum size to NULL sets the maximum size to be the current size.
-		//space3 = H5Screate_simple(1, dims3, NULL);
-		//space1 = H5Screate_simple(1, dims1, NULL);	
-
-		//dset_output = H5Dcreate(file, "output", H5T_NATIVE_FLOAT, space3, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
-
-		//// write the data to the dataset
-		//float* oBuffer = new float[SCR_WIDTH * SCR_HEIGHT * 3];
-		//glReadBuffer(GL_COLOR_ATTACHMENT0);
-		//glReadPixels(0, 0, SCR_WIDTH, SCR_HEIGHT, GL_RGB, GL_FLOAT, oBuffer);
-		//status = H5Dwrite(dset_output, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, oBuffer);
-
-		//delete oBuffer;
-
-		//status = H5Dclose(dset_output);
-		//status = H5Sclose(space3);
-		//status = H5Fclose(file);
-		// glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
-		// -------------------------------------------------------------------------------
-		glfwSwapBuffers(window);
-		glfwPollEvents();
-	}
-
-	glDeleteTextures(1, &gPosition);
-	glDeleteTextures(1, &gNormal);
-	glDeleteTextures(1, &gDepth);
-	glDeleteTextures(1, &gMask);
-	glDeleteTextures(1, &gDiffuseColor);
-
-	status = H5Dclose(dset_position);
-	status = H5Dclose(dset_normal);
-	status = H5Dclose(dset_depth);
-	status = H5Dclose(dset_mask);
-	status = H5Fclose(file);
-
-	delete pBuffer;
-	delete nBuffer;
-	delete dBuffer;
-	delete mBuffer;
-	delete cBuffer;
-
-	// glfw: terminate, clearing all previously allocated GLFW resources.
-	// ------------------------------------------------------------------
-	glfwTerminate();
-	return 0;
+	}
+
+	destroyRenderContext(ctx);
+	return failed;
+}
+
+// serve render requests through one OpenGL context, which stays current
+// with its compiled shaders and caches between requests; returns the number
+// of failed jobs or -1 if the context or the shaders could not be set up
+// ------------------------------------------------------------------------
+int serveGL(RenderServer &server, bool headless, const PipelineOptions &pipeline, const RenderOptions &options, size_t batchSize)
+{
+	RenderContext ctx;
+	if (!createRenderContext(ctx, headless, SCR_WIDTH, SCR_HEIGHT)) {
+		destroyRenderContext(ctx);
+		return -1;
+	}
+
+	DatasetCache datasets;
+	int failed;
+	{
+		DeferredRenderer renderer(ctx, options.settings, datasets, pipeline.readbackDepth);
+		if (!renderer.linked()) {
+			std::cout << "ERROR::RENDERER::SHADERS_NOT_LINKED in " << options.settings.shaderDirectory << std::endl;
+			failed = -1;
+		}
+		else {
+			// every job has a condition of its own, so a pass shades one condition
+			failed = serveJobs(server, batchSize, pipeline, options, datasets, renderer.settings().channels(),
+				[&](size_t i, const ServerJob &job, GBuffer &gbuffer, const EmitFrame<RgbImage> &emit) {
+					return renderer.render(i, gbuffer, options.lights, vector<LightingCondition>{ job.condition }, emit);
+				},
+				[&](const EmitFrame<RgbImage> &emit) {
+					renderer.flush(emit);
+				});
+			// their clients got an error reply from serveJobs
+			failed += (int)renderer.readbackFailures();
+
+			std::cout << "Texture cache: " << renderer.textures().hits() << " hits, " << renderer.textures().misses() << " misses" << std::endl;
+			reportHdf5Handles();
+		}
+	}
+
+	destroyRenderContext(ctx);
+	return failed;
 }
 
-// renderQuad() renders a 1x1 XY quad in NDC
-// -----------------------------------------
-unsigned int quadVAO = 0;
-unsigned int quadVBO;
-void renderQuad() {
-	if (quadVAO == 0) {
-		float quadVertices[] = {
-			// positions        // texture Coords
-			-1.0f,  1.0f, 0.0f, 0.0f, 1.0f,
-			-1.0f, -1.0f, 0.0f, 0.0f, 0.0f,
-			 1.0f,  1.0f, 0.0f, 1.0f, 1.0f,
-			 1.0f, -1.0f, 0.0f, 1.0f, 0.0f,
+// Time the lighting pass on the first input in every render mode, once with
+// the uber-shader and once with the mode's permutation. Frames are drawn
+// back to back and finished with glFinish, nothing is read back.
+// ------------------------------------------------------------------------
+int benchmarkShaders(const RenderJob &job, bool headless, const RenderOptions &options, unsigned int frames)
+{
+	RenderContext ctx;
+	if (!createRenderContext(ctx, headless, SCR_WIDTH, SCR_HEIGHT)) {
+		destroyRenderContext(ctx);
+		return -1;
+	}
+	// programs are always compiled
+	RenderSettings settings = options.settings;
+	settings.relighting = false;
+	settings.shaderCacheDirectory.clear();
+
+	// load everything any mode samples
+	unsigned int channels = deferredShadingChannels(true, true, true);
+	DatasetCache datasets;
+	int result;
+	{
+		DeferredRenderer renderer(ctx, settings, datasets);
+		GBuffer gbuffer;
+		result = loadGBuffer(datasets, channels, job.input, options.lights.shadowFile, gbuffer) ? 0 : -1;
+
+		struct Mode { const char* name; int lighting, shadow, depth, normals, position; };
+		const Mode modes[] = {
+			{ "unlit", 0, 0, 0, 0, 0 },
+			{ "lit", 1, 0, 0, 0, 0 },
+			{ "lit + shadow", 1, 1, 0, 0, 0 },
+			{ "depth", 1, 0, 1, 0, 0 },
+			{ "normals", 1, 0, 0, 1, 0 },
+			{ "position", 1, 0, 0, 0, 1 },
 		};
-		// set up plane VAO 
-		glGenVertexArrays(1, &quadVAO);
-		glGenBuffers(1, &quadVBO);
-		glBindVertexArray(quadVAO);
-		glBindBuffer(GL_ARRAY_BUFFER, quadVBO);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(quadVertices), &quadVertices, GL_STATIC_DRAW);
-		glEnableVertexAttribArray(0);
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
-		glEnableVertexAttribArray(1);
-		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
-	}
-	glBindVertexArray(quadVAO);
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-	glBindVertexArray(0);
+		if (result == 0) {
+			printf("%ux%u, %u frames per mode\n", gbuffer.width, gbuffer.height, frames);
+			printf("%-16s %14s %14s %10s\n", "mode", "uber ms", "variant ms", "speedup");
+		}
+		for (const Mode &mode : modes) {
+			if (result != 0)
+				break;
+			RenderSettings &current = renderer.settings();
+			current.useLighting = mode.lighting;
+			current.useShadow = mode.shadow;
+			current.showDepth = mode.depth;
+			current.showNormals = mode.normals;
+			current.showPosition = mode.position;
+			LightingCondition condition = options.lights.defaultCondition(mode.shadow != 0);
+			double ms[2];
+			for (int uber = 1; uber >= 0; uber--) {
+				// warm up, which also uploads the textures
+				for (int i = 0; i < 3; i++)
+					renderer.draw(gbuffer, options.lights, &condition, 1, uber != 0);
+				glFinish();
+				auto start = std::chrono::steady_clock::now();
+				for (unsigned int i = 0; i < frames; i++)
+					renderer.draw(gbuffer, options.lights, &condition, 1, uber != 0);
+				glFinish();
+				ms[uber] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / max(frames, 1u);
+			}
+			printf("%-16s %14.3f %14.3f %9.2fx\n", mode.name, ms[1], ms[0], ms[1] / ms[0]);
+		}
+	}
+
+	destroyRenderContext(ctx);
+	return result;
+}
+
+// world positions of the covered pixels of a loaded view
+// ------------------------------------------------------------------------
+vector<glm::vec3> surfacePositions(const GBuffer &gbuffer)
+{
+	vector<glm::vec3> surface;
+	Camera camera;
+	camera.orbit(gbuffer.theta, gbuffer.phi, gbuffer.width, gbuffer.height);
+	glm::mat4 invPV = glm::inverse(camera.pMatrix * camera.view);
+	const float* depth = gbuffer.depth->floats();
+	const float* mask = gbuffer.mask->floats();
+	for (unsigned int y = 0; y < gbuffer.height; y++) {
+		for (unsigned int x = 0; x < gbuffer.width; x++) {
+			size_t k = (size_t)y * gbuffer.width + x;
+			if (!(mask[k] > 0.0f) || std::isnan(depth[k]))
+				continue;
+			glm::vec4 world = invPV * glm::vec4((x + 0.5f) / gbuffer.width * 2.0f - 1.0f, (y + 0.5f) / gbuffer.height * 2.0f - 1.0f, depth[k] * 2.0f - 1.0f, 1.0f);
+			surface.push_back(glm::vec3(world) / world.w);
+		}
+	}
+	return surface;
 }
 
-// process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
-// ---------------------------------------------------------------------------------------------------------
-void processInput(GLFWwindow *window)
+// count small world-space point lights scattered over a surface
+// ------------------------------------------------------------------------
+vector<PointLight> scatterLights(const vector<glm::vec3> &surface, unsigned int count)
 {
-	if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-		glfwSetWindowShouldClose(window, true);
+	vector<PointLight> lights;
+	for (unsigned int k = 0; k < count; k++) {
+		// lift the light slightly off the surface, away from the origin
+		glm::vec3 position = surface[(size_t)(k * 2654435761u) % surface.size()];
+		position += glm::normalize(position) * 0.02f;
+		lights.push_back(PointLight{ position, 0.15f, glm::vec3(0.2f), 0.0f });
+	}
+	return lights;
 }
 
-// glfw: whenever the window size changed (by OS or user resize) this callback function executes
-// ---------------------------------------------------------------------------------------------
-void framebuffer_size_callback(GLFWwindow* window, int width, int height)
+// Time the lit pass on the first input with 2 to 1024 point lights, with
+// and without tile culling. The extra lights are scattered over the
+// visible surface, each reaching a small patch of it. Light culling runs
+// on the CPU and is part of the time.
+// ------------------------------------------------------------------------
+int benchmarkLights(const RenderJob &job, bool headless, const RenderOptions &options, unsigned int frames)
 {
-	// make sure the viewport matches the new window dimensions; note that width and 
-	// height will be significantly larger than specified on retina displays.
-	glViewport(0, 0, width, height);
+	RenderContext ctx;
+	if (!createRenderContext(ctx, headless, SCR_WIDTH, SCR_HEIGHT)) {
+		destroyRenderContext(ctx);
+		return -1;
+	}
+	RenderSettings settings = options.settings;
+	settings.relighting = false;
+	settings.shaderCacheDirectory.clear();
+	settings.useLighting = 1;
+	settings.useShadow = settings.showDepth = settings.showNormals = settings.showPosition = 0;
+	LightSet lights = options.lights;
+
+	DatasetCache datasets;
+	int result;
+	{
+		DeferredRenderer renderer(ctx, settings, datasets);
+		GBuffer gbuffer;
+		result = loadGBuffer(datasets, settings.channels(), job.input, lights.shadowFile, gbuffer) ? 0 : -1;
+
+		vector<glm::vec3> surface;
+		if (result == 0) {
+			surface = surfacePositions(gbuffer);
+			if (surface.empty())
+				result = -1;
+		}
+
+		if (result == 0) {
+			printf("%ux%u, %u frames per light count\n", gbuffer.width, gbuffer.height, frames);
+			printf("%8s %14s %14s %12s %10s\n", "lights", "all ms", "culled ms", "lights/tile", "speedup");
+		}
+		for (unsigned int count = 2; count <= 1024 && result == 0; count *= 2) {
+			lights.sceneLights = scatterLights(surface, count - 2);
+			LightingCondition condition = lights.defaultCondition(false);
+			double ms[2];
+			size_t indices = 0;
+			for (int cull = 0; cull <= 1; cull++) {
+				renderer.settings().lightCulling = cull != 0;
+				for (int i = 0; i < 3; i++)
+					renderer.draw(gbuffer, lights, &condition, 1, settings.uberShader);
+				glFinish();
+				auto start = std::chrono::steady_clock::now();
+				for (unsigned int i = 0; i < frames; i++)
+					renderer.draw(gbuffer, lights, &condition, 1, settings.uberShader);
+				glFinish();
+				ms[cull] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / max(frames, 1u);
+				indices = renderer.lightGrid().indices.size();
+			}
+			// average number of lights a tile keeps
+			const LightGrid &grid = renderer.lightGrid();
+			double perTile = (double)indices / max((size_t)grid.tilesX * grid.tilesY, (size_t)1);
+			printf("%8u %14.3f %14.3f %12.1f %9.2fx\n", count, ms[0], ms[1], perTile, ms[0] / ms[1]);
+		}
+	}
+
+	destroyRenderContext(ctx);
+	return result;
+}
+
+// Time relighting the first input with shadows and 32 lights against the
+// full lit pass: from a new view, after a change of light colors only,
+// with one light moving every frame and with nothing changed.
+// ------------------------------------------------------------------------
+int benchmarkRelight(const RenderJob &job, bool headless, const RenderOptions &options, unsigned int frames)
+{
+	RenderContext ctx;
+	if (!createRenderContext(ctx, headless, SCR_WIDTH, SCR_HEIGHT)) {
+		destroyRenderContext(ctx);
+		return -1;
+	}
+	RenderSettings settings = options.settings;
+	settings.relighting = true;
+	settings.shaderCacheDirectory.clear();
+	settings.useLighting = settings.useShadow = 1;
+	settings.showDepth = settings.showNormals = settings.showPosition = 0;
+	LightSet lights = options.lights;
+
+	DatasetCache datasets;
+	int result;
+	{
+		DeferredRenderer renderer(ctx, settings, datasets);
+		Relighter &relighter = *renderer.relighting();
+		GBuffer gbuffer;
+		result = loadGBuffer(datasets, settings.channels(), job.input, lights.shadowFile, gbuffer) ? 0 : -1;
+
+		vector<glm::vec3> surface;
+		if (result == 0) {
+			surface = surfacePositions(gbuffer);
+			if (surface.empty())
+				result = -1;
+		}
+		if (result == 0)
+			lights.sceneLights = scatterLights(surface, 30);
+		LightingCondition condition = lights.defaultCondition(true), brighter = condition;
+		brighter.lightingPower *= 2.0f;
+		glm::vec3 start = lights.sceneLights.empty() ? glm::vec3(0.0f) : lights.sceneLights[0].position;
+
+		// every case prepares the frame like draw() does
+		auto relight = [&](const LightingCondition &lighting, bool newView) {
+			renderer.prepare(gbuffer, lights, 1);
+			glBindFramebuffer(GL_FRAMEBUFFER, renderer.framebuffer());
+			renderer.relight(gbuffer, lights, lighting, newView);
+		};
+		struct Case { const char* name; std::function<void(unsigned int)> draw; };
+		const Case cases[] = {
+			{ "lit pass", [&](unsigned int) { renderer.draw(gbuffer, lights, &condition, 1, settings.uberShader); } },
+			{ "new view", [&](unsigned int) { relight(condition, true); } },
+			{ "colors changed", [&](unsigned int i) { relight(i % 2 ? brighter : condition, false); } },
+			{ "one light moved", [&](unsigned int i) {
+				lights.sceneLights[0].position = start + glm::vec3(0.0f, 0.0f, 0.01f * (i % 2));
+				relight(condition, false);
+			} },
+			{ "unchanged", [&](unsigned int) { relight(condition, false); } },
+		};
+		if (result == 0) {
+			printf("%ux%u, %zu lights with shadows, %u frames per case\n", gbuffer.width, gbuffer.height, lights.sceneLights.size() + 2, frames);
+			printf("%-16s %10s %10s %12s\n", "case", "ms", "speedup", "terms/frame");
+		}
+		double lit = 0.0;
+		for (const Case &test : cases) {
+			if (result != 0)
+				break;
+			for (unsigned int i = 0; i < 3; i++)
+				test.draw(i);
+			glFinish();
+			size_t terms = relighter.stats().lightPasses;
+			auto begin = std::chrono::steady_clock::now();
+			for (unsigned int i = 0; i < frames; i++)
+				test.draw(i + 1);
+			glFinish();
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count() / max(frames, 1u);
+			if (lit == 0.0)
+				lit = ms;
+			printf("%-16s %10.3f %9.2fx %12.1f\n", test.name, ms, lit / ms, (double)(relighter.stats().lightPasses - terms) / max(frames, 1u));
+		}
+	}
+
+	destroyRenderContext(ctx);
+	return result;
 }
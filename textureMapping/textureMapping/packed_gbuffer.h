@@ -0,0 +1,404 @@
+#ifndef PACKED_GBUFFER_H
+#define PACKED_GBUFFER_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <filesystem>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "half.h"
+
+// Packed G-buffer files (.gbp) hold the datasets of an MPAS G-buffer file
+// in the texel formats they are uploaded to, so a file is mapped and its
+// channels go to glTexImage2D as they are:
+// - normal: unit vectors, octahedral-encoded as two int16 snorm (GL_RG16_SNORM)
+// - depth: binary16 (GL_R16F), the precision the shader always sampled, or
+//   the original float32
+// - mask: one byte (GL_R8), or one bit per pixel, expanded when loaded
+// The never sampled position dataset is dropped. A fixed header lists up to
+// PACKED_MAX_CHANNELS channels by dataset name; their data follows, each
+// aligned to PACKED_ALIGNMENT bytes. Rows are bottom-up like the HDF5
+// datasets and all values are little-endian.
+const char PACKED_MAGIC[4] = { 'G', 'B', 'P', '1' };
+const uint32_t PACKED_VERSION = 1;
+const unsigned int PACKED_MAX_CHANNELS = 8;
+const size_t PACKED_ALIGNMENT = 64;
+
+enum PackedEncoding : uint32_t
+{
+	PACKED_FLOAT32 = 0, // components float32 per pixel
+	PACKED_HALF = 1, // components binary16 per pixel
+	PACKED_OCT16 = 2, // a unit vector as two int16 snorm
+	PACKED_UNORM8 = 3, // components bytes per pixel, [0, 1] scaled to 255
+	PACKED_BITS = 4, // 0 or 1, one bit per pixel, rows padded to bytes
+};
+
+struct PackedChannel
+{
+	char name[16]; // dataset name, NUL-terminated
+	uint32_t encoding;
+	uint32_t components; // of the decoded dataset
+	uint64_t offset, size; // of the data from the start of the file
+};
+
+struct PackedHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t width, height;
+	uint32_t channelCount;
+	uint32_t reserved;
+	PackedChannel channels[PACKED_MAX_CHANNELS];
+};
+
+// bytes of a channel of width x height pixels
+// ------------------------------------------------------------------------
+inline uint64_t packedChannelSize(uint32_t encoding, uint32_t components, uint32_t width, uint32_t height)
+{
+	uint64_t pixels = (uint64_t)width * height;
+	switch (encoding) {
+	case PACKED_FLOAT32: return pixels * components * 4;
+	case PACKED_HALF: return pixels * components * 2;
+	case PACKED_OCT16: return components == 3 ? pixels * 4 : 0;
+	case PACKED_UNORM8: return pixels * components;
+	case PACKED_BITS: return components == 1 ? (uint64_t)(width + 7) / 8 * height : 0;
+	default: return 0;
+	}
+}
+
+// Octahedral mapping of a unit vector to two snorm16 values. Of the four
+// roundings around the exact position the one decoding closest to n is
+// kept. A zero or NaN vector, as in background pixels, maps to +z.
+// ------------------------------------------------------------------------
+inline void octahedralDecode(int16_t ex, int16_t ey, float n[3])
+{
+	// as the shader sees GL_RG16_SNORM texels
+	float x = std::max(ex / 32767.0f, -1.0f), y = std::max(ey / 32767.0f, -1.0f);
+	float z = 1.0f - std::fabs(x) - std::fabs(y);
+	float t = std::max(-z, 0.0f);
+	x += x >= 0.0f ? -t : t;
+	y += y >= 0.0f ? -t : t;
+	float length = std::sqrt(x * x + y * y + z * z);
+	n[0] = x / length;
+	n[1] = y / length;
+	n[2] = z / length;
+}
+
+inline void octahedralEncode(const float n[3], int16_t e[2])
+{
+	float l1 = std::fabs(n[0]) + std::fabs(n[1]) + std::fabs(n[2]);
+	if (!(l1 > 0.0f)) {
+		e[0] = e[1] = 0;
+		return;
+	}
+	float u = n[0] / l1, v = n[1] / l1;
+	if (n[2] < 0.0f) {
+		float fu = (1.0f - std::fabs(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+		float fv = (1.0f - std::fabs(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+		u = fu;
+		v = fv;
+	}
+	float su = std::floor(std::min(std::max(u, -1.0f), 1.0f) * 32767.0f);
+	float sv = std::floor(std::min(std::max(v, -1.0f), 1.0f) * 32767.0f);
+	float best = -2.0f;
+	for (int k = 0; k < 4; k++) {
+		int16_t cu = (int16_t)std::min(std::max(su + (k & 1), -32767.0f), 32767.0f);
+		int16_t cv = (int16_t)std::min(std::max(sv + (k >> 1), -32767.0f), 32767.0f);
+		float d[3];
+		octahedralDecode(cu, cv, d);
+		float similarity = (d[0] * n[0] + d[1] * n[1] + d[2] * n[2]) / l1;
+		if (similarity > best) {
+			best = similarity;
+			e[0] = cu;
+			e[1] = cv;
+		}
+	}
+}
+
+// Read-only mapping of a whole file; empty if it cannot be mapped.
+class MappedFile
+{
+public:
+	explicit MappedFile(const std::string &path)
+	{
+#ifdef _WIN32
+		HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			return;
+		LARGE_INTEGER fileSize;
+		if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0) {
+			HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (mapping) {
+				bytes = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+				if (bytes)
+					length = (size_t)fileSize.QuadPart;
+				CloseHandle(mapping);
+			}
+		}
+		CloseHandle(file);
+#else
+		int file = open(path.c_str(), O_RDONLY);
+		if (file < 0)
+			return;
+		struct stat status;
+		if (fstat(file, &status) == 0 && status.st_size > 0) {
+			void* view = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+			if (view != MAP_FAILED) {
+				bytes = (const unsigned char*)view;
+				length = (size_t)status.st_size;
+			}
+		}
+		close(file);
+#endif
+	}
+
+	~MappedFile()
+	{
+		if (!bytes)
+			return;
+#ifdef _WIN32
+		UnmapViewOfFile(bytes);
+#else
+		munmap((void*)bytes, length);
+#endif
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const unsigned char* data() const { return bytes; }
+	size_t size() const { return length; }
+
+private:
+	const unsigned char* bytes = nullptr;
+	size_t length = 0;
+};
+
+// check the header of a mapped packed file and return it; null if the file
+// is not a valid packed G-buffer
+// ------------------------------------------------------------------------
+inline const PackedHeader* packedHeader(const MappedFile &file, const std::string &path)
+{
+	const PackedHeader* header = (const PackedHeader*)file.data();
+	bool ok = file.size() >= sizeof(PackedHeader) && memcmp(header->magic, PACKED_MAGIC, 4) == 0
+		&& header->version == PACKED_VERSION && header->channelCount <= PACKED_MAX_CHANNELS;
+	for (uint32_t k = 0; ok && k < header->channelCount; k++) {
+		const PackedChannel &channel = header->channels[k];
+		uint64_t size = packedChannelSize(channel.encoding, channel.components, header->width, header->height);
+		ok = memchr(channel.name, '\0', sizeof(channel.name)) != NULL && size > 0 && channel.size == size
+			&& channel.offset % PACKED_ALIGNMENT == 0 && channel.offset <= file.size() && size <= file.size() - channel.offset;
+	}
+	if (!ok) {
+		std::cout << "ERROR::PACKED::INVALID_FILE " << path << std::endl;
+		return nullptr;
+	}
+	return header;
+}
+
+// the channel of a dataset in a valid packed file, null if there is none
+inline const PackedChannel* findPackedChannel(const PackedHeader &header, const char* name)
+{
+	for (uint32_t k = 0; k < header.channelCount; k++) {
+		if (strcmp(header.channels[k].name, name) == 0)
+			return &header.channels[k];
+	}
+	return nullptr;
+}
+
+// expand a channel to floats as the HDF5 dataset would read, up to the
+// precision of its encoding
+// ------------------------------------------------------------------------
+inline void decodePackedChannel(const PackedHeader &header, const PackedChannel &channel, const unsigned char* data, float* values)
+{
+	size_t pixels = (size_t)header.width * header.height;
+	switch (channel.encoding) {
+	case PACKED_FLOAT32:
+		memcpy(values, data, pixels * channel.components * 4);
+		break;
+	case PACKED_HALF:
+		for (size_t i = 0; i < pixels * channel.components; i++) {
+			uint16_t h;
+			memcpy(&h, data + i * 2, 2);
+			values[i] = halfToFloat(h);
+		}
+		break;
+	case PACKED_OCT16:
+		for (size_t i = 0; i < pixels; i++) {
+			int16_t e[2];
+			memcpy(e, data + i * 4, 4);
+			octahedralDecode(e[0], e[1], values + i * 3);
+		}
+		break;
+	case PACKED_UNORM8:
+		for (size_t i = 0; i < pixels * channel.components; i++)
+			values[i] = data[i] / 255.0f;
+		break;
+	case PACKED_BITS: {
+		size_t row = (header.width + 7) / 8;
+		for (uint32_t y = 0; y < header.height; y++)
+			for (uint32_t x = 0; x < header.width; x++)
+				values[(size_t)y * header.width + x] = (data[y * row + x / 8] >> (x % 8)) & 1 ? 1.0f : 0.0f;
+		break;
+	}
+	}
+}
+
+// Octahedral codes cannot hold NaN, which the sample data has in a few
+// pixels per view; such a normal becomes the normalized mean of its valid
+// neighbours, +z if it has none. The loaders of float normals fill theirs
+// the same way (fillNanNormals), so a view renders alike from its HDF5 and
+// its packed file.
+// ------------------------------------------------------------------------
+inline void fillNormal(const float* normal, unsigned int width, unsigned int height, size_t pixel, float n[3])
+{
+	n[0] = n[1] = n[2] = 0.0f;
+	int x = (int)(pixel % width), y = (int)(pixel / width);
+	for (int dy = -1; dy <= 1; dy++) {
+		for (int dx = -1; dx <= 1; dx++) {
+			if (x + dx < 0 || x + dx >= (int)width || y + dy < 0 || y + dy >= (int)height)
+				continue;
+			const float* m = normal + ((size_t)(y + dy) * width + x + dx) * 3;
+			if (std::isnan(m[0] + m[1] + m[2]))
+				continue;
+			n[0] += m[0];
+			n[1] += m[1];
+			n[2] += m[2];
+		}
+	}
+	float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+	if (!(length > 0.0f)) {
+		n[0] = n[1] = 0.0f;
+		n[2] = 1.0f;
+		return;
+	}
+	n[0] /= length;
+	n[1] /= length;
+	n[2] /= length;
+}
+
+// fill the NaN normals of width x height pixels in place, each from the
+// neighbours it had before any was filled; false if there were none
+// ------------------------------------------------------------------------
+inline bool fillNanNormals(float* normal, unsigned int width, unsigned int height)
+{
+	std::vector<size_t> missing;
+	for (size_t i = 0; i < (size_t)width * height; i++)
+		if (std::isnan(normal[i * 3] + normal[i * 3 + 1] + normal[i * 3 + 2]))
+			missing.push_back(i);
+	std::vector<float> filled(missing.size() * 3);
+	for (size_t k = 0; k < missing.size(); k++)
+		fillNormal(normal, width, height, missing[k], &filled[k * 3]);
+	for (size_t k = 0; k < missing.size(); k++)
+		memcpy(normal + missing[k] * 3, &filled[k * 3], 3 * sizeof(float));
+	return !missing.empty();
+}
+
+// encodings chosen when packing
+struct PackOptions
+{
+	uint32_t depthEncoding = PACKED_HALF; // or PACKED_FLOAT32
+	uint32_t maskEncoding = PACKED_UNORM8; // or PACKED_BITS
+};
+
+// Write a packed file from the float datasets of one view, each of width x
+// height pixels: normal with 3 components, depth and mask with one. A mask
+// that is not binary is stored as bytes even if bits were asked for.
+// ------------------------------------------------------------------------
+inline bool writePackedGBuffer(const std::string &path, unsigned int width, unsigned int height,
+	const float* normal, const float* depth, const float* mask, const PackOptions &options)
+{
+	size_t pixels = (size_t)width * height;
+	uint32_t maskEncoding = options.maskEncoding;
+	if (maskEncoding == PACKED_BITS && std::any_of(mask, mask + pixels, [](float m) { return m != 0.0f && m != 1.0f; }))
+		maskEncoding = PACKED_UNORM8;
+
+	PackedHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PACKED_MAGIC, 4);
+	header.version = PACKED_VERSION;
+	header.width = width;
+	header.height = height;
+
+	std::vector<unsigned char> data(sizeof(PackedHeader));
+	auto addChannel = [&](const char* name, uint32_t encoding, uint32_t components) {
+		PackedChannel &channel = header.channels[header.channelCount++];
+		strncpy(channel.name, name, sizeof(channel.name) - 1);
+		channel.encoding = encoding;
+		channel.components = components;
+		channel.offset = (data.size() + PACKED_ALIGNMENT - 1) / PACKED_ALIGNMENT * PACKED_ALIGNMENT;
+		channel.size = packedChannelSize(encoding, components, width, height);
+		data.resize(channel.offset + channel.size, 0);
+		return data.data() + channel.offset;
+	};
+
+	unsigned char* out = addChannel("normal", PACKED_OCT16, 3);
+	for (size_t i = 0; i < pixels; i++) {
+		float n[3] = { normal[i * 3], normal[i * 3 + 1], normal[i * 3 + 2] };
+		if (std::isnan(n[0] + n[1] + n[2]))
+			fillNormal(normal, width, height, i, n);
+		int16_t e[2];
+		octahedralEncode(n, e);
+		memcpy(out + i * 4, e, 4);
+	}
+	out = addChannel("depth", options.depthEncoding, 1);
+	for (size_t i = 0; i < pixels; i++) {
+		if (options.depthEncoding == PACKED_HALF) {
+			uint16_t h = floatToHalf(depth[i]);
+			memcpy(out + i * 2, &h, 2);
+		}
+		else
+			memcpy(out + i * 4, depth + i, 4);
+	}
+	out = addChannel("mask", maskEncoding, 1);
+	size_t row = (width + 7) / 8;
+	for (size_t i = 0; i < pixels; i++) {
+		if (maskEncoding == PACKED_BITS) {
+			if (mask[i] != 0.0f)
+				out[(i / width) * row + (i % width) / 8] |= (unsigned char)(1 << (i % width % 8));
+		}
+		else
+			out[i] = (unsigned char)std::floor(std::min(std::max(mask[i], 0.0f), 1.0f) * 255.0f + 0.5f);
+	}
+	memcpy(data.data(), &header, sizeof(header));
+
+	// write to a temporary name first so a concurrent reader never maps half
+	// a file
+	std::string temporary = path + ".tmp";
+	{
+		std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+		file.write((const char*)data.data(), data.size());
+		if (!file) {
+			std::cout << "ERROR::PACKED::FILE_NOT_SUCCESFULLY_WRITTEN " << path << std::endl;
+			return false;
+		}
+	}
+	std::error_code ec;
+	std::filesystem::rename(temporary, path, ec);
+	if (ec) {
+		std::cout << "ERROR::PACKED::FILE_NOT_SUCCESFULLY_WRITTEN " << path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <string>
+
+#include "profiler.h"
+
+// Fixed-capacity FIFO between pipeline stages. push() blocks while the
+// queue is full, pop() blocks until an item arrives or the queue is closed
+// and drained.
+template <typename T>
+class BoundedQueue
+{
+public:
+	explicit BoundedQueue(size_t capacity) : capacity(capacity > 0 ? capacity : 1) {}
+
+	void push(T item)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		notFull.wait(lock, [this] { return items.size() < capacity; });
+		items.push_back(std::move(item));
+		lock.unlock();
+		notEmpty.notify_one();
+	}
+
+	bool pop(T &item)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+		if (items.empty())
+			return false;
+		item = std::move(items.front());
+		items.pop_front();
+		lock.unlock();
+		notFull.notify_one();
+		return true;
+	}
+
+	// wake all consumers once the remaining items are taken
+	void close()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			closed = true;
+		}
+		notEmpty.notify_all();
+	}
+
+private:
+	size_t capacity;
+	std::deque<T> items;
+	std::mutex mutex;
+	std::condition_variable notFull, notEmpty;
+	bool closed = false;
+};
+
+struct PipelineOptions
+{
+	unsigned int loaders = 1; // threads running the load stage
+	unsigned int writers = 1; // threads running the write stage
+	unsigned int depth = 4; // frames buffered between two stages
+	unsigned int readbackDepth = 2; // GL readback ring size, 0 reads synchronously
+};
+
+// hands a rendered frame to the write stage
+template <typename Rendered>
+using EmitFrame = std::function<void(size_t, Rendered&)>;
+
+// Three-stage frame pipeline: load(i, loaded) runs on loader threads,
+// render(i, loaded, emit) on the calling thread (the one owning the GL
+// context) and write(i, rendered, writer) on writer threads, where writer
+// numbers the thread for per-thread state, so reading, shading and
+// encoding of different frames overlap. render may emit its frame later,
+// e.g. once an asynchronous readback finished; drain(emit) is called after
+// the last frame to emit whatever is still outstanding. Frames may reach
+// the render stage out of order when there is more than one loader. While
+// the profiler is enabled every stage is timed as load, render and write,
+// stages inside them belong to its frame. Images are written as part of the
+// frame that emitted them, so the images of one frame, e.g. under several
+// lighting conditions, are summed.
+// Returns the number of frames for which a stage failed.
+// ------------------------------------------------------------------------
+template <typename Loaded, typename Rendered>
+int runPipeline(size_t count, const PipelineOptions &options,
+	const std::function<bool(size_t, Loaded&)> &load,
+	const std::function<bool(size_t, Loaded&, const EmitFrame<Rendered>&)> &render,
+	const std::function<bool(size_t, Rendered&, unsigned int)> &write,
+	const std::function<void(const EmitFrame<Rendered>&)> &drain = nullptr)
+{
+	struct LoadedFrame { size_t index; bool ok; Loaded data; };
+	struct RenderedFrame { size_t index; size_t profiled; Rendered data; };
+
+	BoundedQueue<LoadedFrame> loadedQueue(options.depth);
+	BoundedQueue<RenderedFrame> renderedQueue(options.depth);
+	std::atomic<size_t> next{ 0 };
+	std::atomic<int> failed{ 0 };
+	size_t profiled = profiler().enabled() ? profiler().reserveFrames(count) : 0; // first frame in the profile
+
+	std::vector<std::thread> loaders;
+	for (unsigned int t = 0; t < (options.loaders > 0 ? options.loaders : 1); t++) {
+		loaders.emplace_back([&, t] {
+			if (profiler().enabled())
+				profiler().nameThread("loader " + std::to_string(t));
+			for (size_t i = next++; i < count; i = next++) {
+				LoadedFrame frame{ i, false, Loaded() };
+				{
+					ProfileScope scope("load", profiled + i);
+					frame.ok = load(i, frame.data);
+				}
+				loadedQueue.push(std::move(frame));
+			}
+		});
+	}
+
+	std::vector<std::thread> writers;
+	for (unsigned int t = 0; t < (options.writers > 0 ? options.writers : 1); t++) {
+		writers.emplace_back([&, t] {
+			if (profiler().enabled())
+				profiler().nameThread("writer " + std::to_string(t));
+			RenderedFrame frame;
+			while (renderedQueue.pop(frame)) {
+				ProfileScope scope("write", frame.profiled);
+				if (!write(frame.index, frame.data, t))
+					failed++;
+			}
+		});
+	}
+
+	EmitFrame<Rendered> emit = [&](size_t index, Rendered &data) {
+		// written as part of the frame being rendered, or read back
+		renderedQueue.push(RenderedFrame{ index, profileFrame(), std::move(data) });
+	};
+	if (profiler().enabled())
+		profiler().nameThread("render");
+	for (size_t received = 0; received < count; received++) {
+		LoadedFrame frame;
+		loadedQueue.pop(frame);
+		ProfileScope scope("render", profiled + frame.index);
+		if (!frame.ok || !render(frame.index, frame.data, emit))
+			failed++;
+	}
+	if (drain) {
+		ProfileScope scope("drain");
+		drain(emit);
+	}
+
+	renderedQueue.close();
+	for (std::thread &loader : loaders)
+		loader.join();
+	for (std::thread &writer : writers)
+		writer.join();
+	return failed;
+}
+
+#endif
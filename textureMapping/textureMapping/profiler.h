@@ -0,0 +1,268 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <cmath>
+
+#include "json.h"
+
+// frame of an event that belongs to no frame
+const size_t PROFILE_NO_FRAME = (size_t)-1;
+
+enum ProfileTrack { PROFILE_CPU, PROFILE_GPU };
+
+// One timed stage: where it ran, which frame it worked on and when, in
+// microseconds since the profiler was enabled.
+struct ProfileEvent
+{
+	const char* name; // a string literal, not copied
+	ProfileTrack track;
+	int thread; // 0 for the GPU
+	size_t frame;
+	double start, duration;
+};
+
+// the frame the stages of the calling thread work on
+inline size_t &profileFrame()
+{
+	thread_local size_t frame = PROFILE_NO_FRAME;
+	return frame;
+}
+
+// Collects the stages timed by ProfileScope and GpuTimers (gpu_timer.h)
+// while enabled. Disabled, which is the default, a scope costs one relaxed
+// atomic load, so the timers stay compiled in. Events are summed per stage
+// and frame for the summary table and written as Chrome trace events, one
+// track per named thread and one for the GPU, to be opened in
+// chrome://tracing or Perfetto.
+class Profiler
+{
+public:
+	static const size_t MAX_EVENTS = (size_t)1 << 22;
+
+	Profiler() : origin(std::chrono::steady_clock::now()), threadNames(1, "GPU") {}
+
+	Profiler(const Profiler&) = delete;
+	Profiler& operator=(const Profiler&) = delete;
+
+	// start collecting; call before the threads to profile are started
+	void enable()
+	{
+		origin = std::chrono::steady_clock::now();
+		on.store(true, std::memory_order_relaxed);
+	}
+
+	bool enabled() const { return on.load(std::memory_order_relaxed); }
+
+	// number count frames of a run after those of earlier runs, so that
+	// e.g. the batches of a server do not share frames; returns the first
+	size_t reserveFrames(size_t count) { return frameCount.fetch_add(count); }
+
+	// microseconds since enable()
+	double now() const
+	{
+		return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin).count();
+	}
+
+	// record a stage of the calling thread, or of the GPU
+	// ------------------------------------------------------------------------
+	void add(const char* name, ProfileTrack track, size_t frame, double start, double duration)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (events.size() >= MAX_EVENTS) {
+			dropped++;
+			return;
+		}
+		int thread = track == PROFILE_GPU ? 0 : threadId();
+		events.push_back(ProfileEvent{ name, track, thread, frame, start, duration });
+	}
+
+	// Name the track of the calling thread. Threads of the same name share a
+	// track, so the loaders and writers the pipeline starts for every batch
+	// of a server keep theirs.
+	// ------------------------------------------------------------------------
+	void nameThread(const std::string &name)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = std::find(threadNames.begin(), threadNames.end(), name);
+		if (it == threadNames.end())
+			it = threadNames.insert(threadNames.end(), name);
+		currentThread() = (int)(it - threadNames.begin());
+	}
+
+	// Print the time every stage took per frame: the stages of a frame are
+	// summed first, so e.g. the readbacks of several lighting conditions
+	// count as one.
+	// ------------------------------------------------------------------------
+	void report()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		// per stage in order of appearance, the time of each frame
+		std::vector<std::pair<ProfileTrack, const char*> > stages;
+		std::map<std::pair<ProfileTrack, std::string>, std::map<size_t, double> > frames;
+		for (const ProfileEvent &event : events) {
+			std::map<size_t, double> &stage = frames[std::make_pair(event.track, std::string(event.name))];
+			if (stage.empty())
+				stages.push_back(std::make_pair(event.track, event.name));
+			stage[event.frame] += event.duration / 1000.0;
+		}
+		printf("%-20s %8s %10s %9s %9s %9s %9s\n", "stage (ms/frame)", "frames", "total", "mean", "p50", "p95", "max");
+		for (const auto &stage : stages) {
+			const std::map<size_t, double> &times = frames[std::make_pair(stage.first, std::string(stage.second))];
+			std::vector<double> ms;
+			for (const auto &frame : times)
+				ms.push_back(frame.second);
+			std::sort(ms.begin(), ms.end());
+			double total = 0.0;
+			for (double t : ms)
+				total += t;
+			std::string name = std::string(stage.first == PROFILE_GPU ? "gpu " : "cpu ") + stage.second;
+			printf("%-20s %8zu %10.1f %9.3f %9.3f %9.3f %9.3f\n", name.c_str(), ms.size(), total, total / ms.size(),
+				percentile(ms, 0.5), percentile(ms, 0.95), ms.back());
+		}
+		if (dropped > 0)
+			std::cout << "Profiler: " << dropped << " events dropped beyond " << MAX_EVENTS << std::endl;
+	}
+
+	// write the events as a Chrome trace_event JSON file
+	// ------------------------------------------------------------------------
+	bool writeTrace(const std::string &path)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		std::ofstream out(path, std::ios::binary);
+		out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+		out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"textureMapping\"}}";
+		for (size_t t = 0; t < threadNames.size(); t++)
+			out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << t << ",\"args\":{\"name\":" << jsonQuote(threadNames[t]) << "}}";
+		char number[64];
+		for (const ProfileEvent &event : events) {
+			snprintf(number, sizeof(number), "\"ts\":%.3f,\"dur\":%.3f", event.start, event.duration);
+			out << ",\n{\"name\":" << jsonQuote(event.name) << ",\"cat\":\"" << (event.track == PROFILE_GPU ? "gpu" : "cpu")
+				<< "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread << "," << number;
+			if (event.frame != PROFILE_NO_FRAME)
+				out << ",\"args\":{\"frame\":" << event.frame << "}";
+			out << "}";
+		}
+		out << "\n]}\n";
+		out.close();
+		if (!out) {
+			std::cout << "ERROR::PROFILER::TRACE_NOT_SUCCESFULLY_WRITTEN " << path << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+private:
+	// nearest rank percentile of sorted values
+	static double percentile(const std::vector<double> &sorted, double p)
+	{
+		size_t rank = (size_t)std::ceil(p * sorted.size());
+		return sorted[std::min(std::max(rank, (size_t)1), sorted.size()) - 1];
+	}
+
+	static int &currentThread()
+	{
+		thread_local int thread = -1;
+		return thread;
+	}
+
+	// track of the calling thread, unnamed threads get one of their own;
+	// called with the mutex held
+	int threadId()
+	{
+		int &thread = currentThread();
+		if (thread < 0) {
+			thread = (int)threadNames.size();
+			threadNames.push_back("thread " + std::to_string(thread));
+		}
+		return thread;
+	}
+
+	std::atomic<bool> on{ false };
+	std::atomic<size_t> frameCount{ 0 };
+	std::chrono::steady_clock::time_point origin;
+	std::mutex mutex;
+	std::vector<ProfileEvent> events;
+	std::vector<std::string> threadNames; // per track, the GPU first
+	size_t dropped = 0;
+};
+
+// the process-wide profiler
+inline Profiler &profiler()
+{
+	static Profiler instance;
+	return instance;
+}
+
+// Times the enclosing block as a CPU stage of the calling thread. With a
+// frame given, stages inside the block belong to that frame as well.
+class ProfileScope
+{
+public:
+	explicit ProfileScope(const char* name, size_t frame = PROFILE_NO_FRAME) : name(name)
+	{
+		if (!profiler().enabled())
+			return;
+		active = true;
+		previous = profileFrame();
+		if (frame != PROFILE_NO_FRAME)
+			profileFrame() = frame;
+		start = profiler().now();
+	}
+
+	~ProfileScope()
+	{
+		if (!active)
+			return;
+		profiler().add(name, PROFILE_CPU, profileFrame(), start, profiler().now() - start);
+		profileFrame() = previous;
+	}
+
+	ProfileScope(const ProfileScope&) = delete;
+	ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+	const char* name;
+	bool active = false;
+	size_t previous = PROFILE_NO_FRAME;
+	double start = 0.0;
+};
+
+// Makes the enclosing block work on a frame without timing it, e.g. to
+// hand out a frame that was read back while another one is rendered.
+class ProfileFrame
+{
+public:
+	explicit ProfileFrame(size_t frame)
+	{
+		if (!profiler().enabled())
+			return;
+		active = true;
+		previous = profileFrame();
+		profileFrame() = frame;
+	}
+
+	~ProfileFrame()
+	{
+		if (active)
+			profileFrame() = previous;
+	}
+
+	ProfileFrame(const ProfileFrame&) = delete;
+	ProfileFrame& operator=(const ProfileFrame&) = delete;
+
+private:
+	bool active = false;
+	size_t previous = PROFILE_NO_FRAME;
+};
+
+#endif
@@ -0,0 +1,219 @@
+#ifndef PROGRAM_CACHE_H
+#define PROGRAM_CACHE_H
+
+#include <glad/glad.h>
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+
+// GL 4.1 / ARB_get_program_binary; the GL 3.3 loader does not provide them
+#ifndef GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#endif
+
+// the per-user cache directory for program binaries: %LOCALAPPDATA% on
+// Windows, else $XDG_CACHE_HOME or ~/.cache; empty, so programs are always
+// compiled, if none is set
+// ------------------------------------------------------------------------
+inline std::string defaultShaderCacheDirectory()
+{
+	std::filesystem::path base;
+#ifdef _WIN32
+	if (const char* local = std::getenv("LOCALAPPDATA"))
+		base = local;
+#else
+	const char* cache = std::getenv("XDG_CACHE_HOME");
+	const char* home = std::getenv("HOME");
+	if (cache && *cache)
+		base = cache;
+	else if (home && *home)
+		base = std::filesystem::path(home) / ".cache";
+#endif
+	if (base.empty())
+		return std::string();
+	return (base / "deferShader" / "shader_cache").string();
+}
+
+// On-disk cache of linked shader programs. A program is stored under a
+// hash of its final shader sources (so defines spliced into them count)
+// and of the vendor, renderer and version strings of the driver, so a
+// driver update or another GPU simply misses. Drivers may still reject a
+// binary they wrote themselves; the caller then compiles from source as if
+// the cache did not exist and the entry is overwritten. Nothing happens
+// when the context offers no binary formats.
+class ProgramBinaryCache
+{
+public:
+	// directory is created on the first store; call with a current context
+	ProgramBinaryCache(const std::string &directory, GLADloadproc getProcAddress) : directory(directory)
+	{
+		if (directory.empty() || !getProcAddress || !supported())
+			return;
+		getProgramBinary = (GetProgramBinaryProc)getProcAddress("glGetProgramBinary");
+		programBinary = (ProgramBinaryProc)getProcAddress("glProgramBinary");
+		programParameteri = (ProgramParameteriProc)getProcAddress("glProgramParameteri");
+		GLint formats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+		enabled = getProgramBinary && programBinary && programParameteri && formats > 0;
+		for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION }) {
+			const GLubyte* value = glGetString(name);
+			driver += value ? (const char*)value : "";
+			driver += '\n';
+		}
+	}
+
+	bool available() const { return enabled; }
+
+	// cache key of a program built from the given shader sources
+	// ------------------------------------------------------------------------
+	std::string key(const std::vector<std::string> &sources) const
+	{
+		// 64-bit FNV-1a
+		uint64_t hash = 14695981039346656037ull;
+		auto add = [&hash](const std::string &text) {
+			for (unsigned char c : text)
+				hash = (hash ^ c) * 1099511628211ull;
+			hash = (hash ^ 0xff) * 1099511628211ull; // separator
+		};
+		add(driver);
+		for (const std::string &source : sources)
+			add(source);
+		char name[17];
+		snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+		return name;
+	}
+
+	// a new program created from the binary stored under key, or 0 if there
+	// is none or the driver rejected it
+	// ------------------------------------------------------------------------
+	unsigned int load(const std::string &key)
+	{
+		if (!enabled)
+			return 0;
+		std::ifstream file(path(key), std::ios::binary);
+		Header header;
+		if (!file.read((char*)&header, sizeof(header)) || memcmp(header.magic, MAGIC, sizeof(header.magic)) != 0) {
+			misses++;
+			return 0;
+		}
+		std::vector<char> binary(header.length);
+		if (!file.read(binary.data(), binary.size())) {
+			misses++;
+			return 0;
+		}
+
+		unsigned int program = glCreateProgram();
+		programBinary(program, header.format, binary.data(), (GLsizei)binary.size());
+		GLint linked = GL_FALSE;
+		glGetProgramiv(program, GL_LINK_STATUS, &linked);
+		if (!linked) {
+			glDeleteProgram(program);
+			misses++;
+			return 0;
+		}
+		hits++;
+		return program;
+	}
+
+	// ask the driver to keep the binary of a program about to be linked
+	void prepare(unsigned int program)
+	{
+		if (enabled)
+			programParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
+
+	// write the binary of a successfully linked program under key
+	// ------------------------------------------------------------------------
+	void store(const std::string &key, unsigned int program)
+	{
+		if (!enabled)
+			return;
+		GLint length = 0;
+		glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (length <= 0)
+			return;
+		Header header;
+		memcpy(header.magic, MAGIC, sizeof(header.magic));
+		std::vector<char> binary(length);
+		GLsizei written = 0;
+		getProgramBinary(program, length, &written, &header.format, binary.data());
+		if (written <= 0)
+			return;
+		header.length = (uint32_t)written;
+
+		// write to a temporary name first so a concurrent reader never sees
+		// half a binary
+		std::error_code ec;
+		std::filesystem::create_directories(directory, ec);
+		std::string target = path(key), temporary = target + ".tmp";
+		{
+			std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+			file.write((const char*)&header, sizeof(header));
+			file.write(binary.data(), written);
+			if (!file) {
+				std::cout << "ERROR::PROGRAM_CACHE::FILE_NOT_SUCCESFULLY_WRITTEN " << temporary << std::endl;
+				return;
+			}
+		}
+		std::filesystem::rename(temporary, target, ec);
+	}
+
+	size_t hitCount() const { return hits; }
+	size_t missCount() const { return misses; }
+
+private:
+	typedef void (APIENTRYP GetProgramBinaryProc)(GLuint, GLsizei, GLsizei*, GLenum*, void*);
+	typedef void (APIENTRYP ProgramBinaryProc)(GLuint, GLenum, const void*, GLsizei);
+	typedef void (APIENTRYP ProgramParameteriProc)(GLuint, GLenum, GLint);
+
+	static constexpr const char* MAGIC = "GLPB";
+
+	struct Header
+	{
+		char magic[4];
+		GLenum format = 0;
+		uint32_t length = 0;
+	};
+
+	// GL 4.1 or the ARB extension
+	static bool supported()
+	{
+		GLint major = 0, minor = 0;
+		glGetIntegerv(GL_MAJOR_VERSION, &major);
+		glGetIntegerv(GL_MINOR_VERSION, &minor);
+		if (major > 4 || (major == 4 && minor >= 1))
+			return true;
+		GLint count = 0;
+		glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+		for (GLint i = 0; i < count; i++) {
+			const GLubyte* name = glGetStringi(GL_EXTENSIONS, i);
+			if (name && strcmp((const char*)name, "GL_ARB_get_program_binary") == 0)
+				return true;
+		}
+		return false;
+	}
+
+	std::string path(const std::string &key) const
+	{
+		return (std::filesystem::path(directory) / (key + ".bin")).string();
+	}
+
+	std::string directory;
+	std::string driver;
+	bool enabled = false;
+	size_t hits = 0, misses = 0;
+	GetProgramBinaryProc getProgramBinary = nullptr;
+	ProgramBinaryProc programBinary = nullptr;
+	ProgramParameteriProc programParameteri = nullptr;
+};
+
+#endif
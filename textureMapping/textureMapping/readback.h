@@ -0,0 +1,168 @@
+#ifndef READBACK_H
+#define READBACK_H
+
+#include <glad/glad.h>
+
+#include <vector>
+#include <functional>
+#include <cstring>
+#include <iostream>
+
+#include "image_writer.h"
+#include "profiler.h"
+
+// Reads finished frames back as 8-bit RGB. With a depth of 0 every read is
+// a blocking glReadPixels into client memory. Otherwise reads go into a
+// ring of depth pixel buffer objects guarded by fences: a frame is mapped
+// and handed out only once its transfer completed, so frame N is copied out
+// while frame N+1 is being shaded. Frames come out in the order they were
+// read. Frames may differ in size; a buffer is only reallocated when a
+// frame does not fit into it. Issuing a read is profiled as readback,
+// waiting for and copying out a transfer as readback map, both as part of
+// the frame that issued the read.
+class ReadbackRing
+{
+public:
+	typedef std::function<void(size_t, RgbImage&)> Sink;
+
+	explicit ReadbackRing(unsigned int depth) : slots(depth)
+	{
+		for (Slot &slot : slots)
+			glGenBuffers(1, &slot.pbo);
+	}
+
+	~ReadbackRing()
+	{
+		clear();
+	}
+
+	ReadbackRing(const ReadbackRing&) = delete;
+	ReadbackRing& operator=(const ReadbackRing&) = delete;
+
+	// start reading width x height pixels of the current read buffer as frame
+	// index; frames whose transfer is complete are passed to sink
+	// ------------------------------------------------------------------------
+	void read(size_t index, unsigned int width, unsigned int height, const Sink &sink)
+	{
+		// rows of width * 3 bytes are not 4-byte aligned in general
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		size_t size = (size_t)width * height * 3;
+		if (slots.empty()) {
+			RgbImage image;
+			image.width = width;
+			image.height = height;
+			image.pixels.resize(size);
+			{
+				ProfileScope scope("readback");
+				glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, image.pixels.data());
+			}
+			sink(index, image);
+			return;
+		}
+
+		// the ring is full when the next slot still holds the oldest frame
+		Slot &slot = slots[head];
+		if (slot.fence)
+			complete(slot, sink);
+
+		{
+			ProfileScope scope("readback");
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+			if (slot.capacity < size) {
+				glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+				slot.capacity = size;
+			}
+			glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, (void*)0);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		}
+		slot.index = index;
+		slot.frame = profileFrame();
+		slot.width = width;
+		slot.height = height;
+		head = (head + 1) % slots.size();
+
+		// hand out whatever finished meanwhile, without waiting
+		for (size_t k = 0; k < slots.size(); k++) {
+			Slot &oldest = slots[(head + k) % slots.size()];
+			if (!oldest.fence)
+				continue;
+			GLenum state = glClientWaitSync(oldest.fence, 0, 0);
+			if (state != GL_ALREADY_SIGNALED && state != GL_CONDITION_SATISFIED)
+				break;
+			complete(oldest, sink);
+		}
+	}
+
+	// wait for and hand out all outstanding frames
+	// ------------------------------------------------------------------------
+	void flush(const Sink &sink)
+	{
+		for (size_t k = 0; k < slots.size(); k++) {
+			Slot &oldest = slots[(head + k) % slots.size()];
+			if (oldest.fence)
+				complete(oldest, sink);
+		}
+	}
+
+	// frames whose transfer could not be mapped; they never reach a sink
+	size_t failures() const { return lost; }
+
+	// delete the buffers; call while the context is still current
+	void clear()
+	{
+		for (Slot &slot : slots) {
+			if (slot.fence)
+				glDeleteSync(slot.fence);
+			glDeleteBuffers(1, &slot.pbo);
+		}
+		slots.clear();
+	}
+
+private:
+	struct Slot
+	{
+		unsigned int pbo = 0;
+		GLsync fence = 0;
+		size_t index = 0;
+		size_t frame = PROFILE_NO_FRAME; // profiled frame the read belongs to
+		unsigned int width = 0, height = 0;
+		size_t capacity = 0; // bytes allocated for the buffer
+	};
+
+	void complete(Slot &slot, const Sink &sink)
+	{
+		ProfileFrame frame(slot.frame);
+		RgbImage image;
+		{
+			ProfileScope scope("readback map");
+			while (glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+				;
+			glDeleteSync(slot.fence);
+			slot.fence = 0;
+
+			image.width = slot.width;
+			image.height = slot.height;
+			image.pixels.resize((size_t)slot.width * slot.height * 3);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+			void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, image.pixels.size(), GL_MAP_READ_BIT);
+			if (pixels) {
+				memcpy(image.pixels.data(), pixels, image.pixels.size());
+				glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			}
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			if (!pixels) {
+				std::cout << "ERROR::READBACK::BUFFER_NOT_MAPPED frame " << slot.index << std::endl;
+				lost++;
+				return;
+			}
+		}
+		sink(slot.index, image);
+	}
+
+	std::vector<Slot> slots;
+	size_t head = 0;
+	size_t lost = 0;
+};
+
+#endif
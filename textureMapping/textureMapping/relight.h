@@ -0,0 +1,420 @@
+#ifndef RELIGHT_H
+#define RELIGHT_H
+
+#include <glad/glad.h>
+#include <GL/glm/glm.hpp>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <iostream>
+#include <algorithm>
+
+#include "shader.h"
+#include "shader_variants.h"
+#include "light_culling.h"
+
+// G-buffer textures, camera and shadow casters of the view being relit.
+// depth and mask are the arrays behind gDepth and gMask, used to cull the
+// lights per screen tile.
+struct RelightView
+{
+	unsigned int width = 0, height = 0;
+	unsigned int gNormal = 0, gMask = 0, gDepth = 0, gDiffuseColor = 0;
+	unsigned int gShadowMask = 0, gShadowDepth = 0, gShadowMask1 = 0, gShadowDepth1 = 0;
+	unsigned int shadowSampler = 0; // nearest filtering for the shadow depth maps
+	const float* depth = nullptr;
+	const float* mask = nullptr;
+	glm::mat4 invVMatrix, invPMatrix;
+	glm::mat4 lightSpaceMatrix, lightSpaceMatrix1; // world to clip space of lights 0 and 1
+	bool useShadow = false;
+	bool octahedralNormals = false; // gNormal is RG16_SNORM from a packed file
+};
+
+// Incremental relighting of one view with the lighting of
+// deferred_shading.fs. Three kinds of intermediate targets are kept:
+// - precompute: view-space position and mask, normalized normal and the
+//   visibility from the two shadow casting lights 0 and 1,
+// - one term per light: its attenuated diffuse and specular light at unit
+//   color, before shadowing,
+// - the tile lists of the lights.
+// render() then only adds up color times term over each tile's lights,
+// after redoing what the last changes invalidated:
+//   setView()                                  everything
+//   position of light 0 or 1                   precompute and its term
+//   position or radii of a light, new lights   its term and the tile lists
+//   colors, shadow casters, setAmbient()       nothing, only the sum
+// Light terms take 16 bytes per pixel each and are kept up to maxBytes;
+// render() fails beyond that. The GL context must be current for every
+// call.
+class Relighter
+{
+public:
+	struct Stats
+	{
+		size_t precomputePasses = 0, lightPasses = 0, combinePasses = 0;
+	};
+
+	// the shaders are read from shaderDirectory
+	Relighter(const std::string &shaderDirectory, ProgramBinaryCache* cache = nullptr, bool cull = true, size_t maxBytes = (size_t)256 << 20)
+		: precompute(shaderDirectory + "/deferred_shading.vs", shaderDirectory + "/relight_precompute.fs", cache, setupPrecompute), cull(cull), maxBytes(maxBytes)
+	{
+		std::string vertex = shaderDirectory + "/deferred_shading.vs";
+		lightPass.reset(new Shader(vertex.c_str(), (shaderDirectory + "/relight_light.fs").c_str(), nullptr, cache));
+		combine.reset(new Shader(vertex.c_str(), (shaderDirectory + "/relight_combine.fs").c_str(), nullptr, cache));
+
+		lightPass->use();
+		lightPass->setInt("gViewPosition", 0);
+		lightPass->setInt("gViewNormal", 1);
+		lightPass->setInt("gDiffuseColor", 2);
+		lightPass->setInt("gLights", 9);
+		combine->use();
+		combine->setInt("gViewPosition", 0);
+		combine->setInt("gVisibility", 1);
+		combine->setInt("gDiffuseColor", 2);
+		combine->setInt("gTerms", 3);
+		combine->setInt("gLights", 9);
+		combine->setInt("gTileRanges", 10);
+		combine->setInt("gTileLights", 11);
+
+		const GLenum formats[BUFFER_COUNT] = { GL_RGBA32F, GL_RG32UI, GL_R32UI };
+		glGenBuffers(BUFFER_COUNT, buffers);
+		glGenTextures(BUFFER_COUNT, bufferTextures);
+		for (int i = 0; i < BUFFER_COUNT; i++) {
+			glBindBuffer(GL_TEXTURE_BUFFER, buffers[i]);
+			glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+			glBindTexture(GL_TEXTURE_BUFFER, bufferTextures[i]);
+			glTexBuffer(GL_TEXTURE_BUFFER, formats[i], buffers[i]);
+		}
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+
+		glGenFramebuffers(1, &precomputeBuffer);
+		glGenFramebuffers(1, &termBuffer);
+		glGenTextures(TARGET_COUNT, targets);
+		glGenTextures(1, &terms);
+	}
+
+	~Relighter()
+	{
+		clear();
+	}
+
+	Relighter(const Relighter&) = delete;
+	Relighter& operator=(const Relighter&) = delete;
+
+	// relight another view, or the same one after its textures changed
+	// ------------------------------------------------------------------------
+	void setView(const RelightView &newView)
+	{
+		view = newView;
+		precomputeDirty = true;
+		gridDirty = true;
+		termDirty.assign(lights.size(), true);
+	}
+
+	// set the lights in view space; lights 0 and 1 are the shadow casters
+	// selected in the bits of shadowCasters
+	// ------------------------------------------------------------------------
+	void setLights(const std::vector<PointLight> &newLights, unsigned int newShadowCasters)
+	{
+		termDirty.resize(newLights.size(), true);
+		for (size_t k = 0; k < newLights.size(); k++) {
+			if (k >= lights.size()) {
+				gridDirty = true;
+				continue;
+			}
+			const PointLight &a = lights[k], &b = newLights[k];
+			if (a.position.x != b.position.x || a.position.y != b.position.y || a.position.z != b.position.z
+				|| a.outerRadius != b.outerRadius || a.innerRadius != b.innerRadius) {
+				termDirty[k] = true;
+				gridDirty = true;
+				// the shadow bias depends on the direction to the caster
+				if (k < 2)
+					precomputeDirty = true;
+			}
+		}
+		if (newLights.size() != lights.size())
+			gridDirty = true;
+		lights = newLights;
+		shadowCasters = newShadowCasters;
+	}
+
+	void setAmbient(const glm::vec3 &color)
+	{
+		ambientColor = color;
+	}
+
+	// draw the relit view into the bound framebuffer at (0, 0)
+	// ------------------------------------------------------------------------
+	bool render()
+	{
+		if (view.width == 0 || view.height == 0 || !lightPass->linked || !combine->linked)
+			return false;
+		GLint target = 0;
+		glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+		if (!allocate())
+			return false;
+
+		upload(LIGHT_LIST, lights.data(), lights.size() * sizeof(PointLight));
+		if (gridDirty) {
+			grid.build(lights, view.depth, view.mask, view.width, view.height, view.invPMatrix, cull);
+			upload(TILE_RANGES, grid.ranges.data(), grid.ranges.size() * sizeof(uint32_t));
+			upload(TILE_INDICES, grid.indices.data(), grid.indices.size() * sizeof(uint32_t));
+			gridDirty = false;
+		}
+		glDisable(GL_BLEND);
+		glViewport(0, 0, view.width, view.height);
+		if (precomputeDirty && !renderPrecompute())
+			return false;
+		renderTerms();
+
+		glBindFramebuffer(GL_FRAMEBUFFER, target);
+		combine->use();
+		combine->setVec3("uAmbientColor", ambientColor);
+		glUniform2i(combine->location("uLightGrid"), grid.tileSize, grid.tilesX);
+		combine->setInt("uShadowCasters", view.useShadow ? (int)shadowCasters : 0);
+		bindTexture(0, GL_TEXTURE_2D, targets[VIEW_POSITION]);
+		bindTexture(1, GL_TEXTURE_2D, targets[VISIBILITY]);
+		bindTexture(2, GL_TEXTURE_2D, view.gDiffuseColor);
+		bindTexture(3, GL_TEXTURE_2D_ARRAY, terms);
+		bindTexture(9, GL_TEXTURE_BUFFER, bufferTextures[LIGHT_LIST]);
+		bindTexture(10, GL_TEXTURE_BUFFER, bufferTextures[TILE_RANGES]);
+		bindTexture(11, GL_TEXTURE_BUFFER, bufferTextures[TILE_INDICES]);
+		drawQuad();
+		counts.combinePasses++;
+		return true;
+	}
+
+	const Stats &stats() const { return counts; }
+
+	// did the programs of both passes and of the precompute pass for float
+	// normals build? render() fails otherwise.
+	bool linked()
+	{
+		return lightPass->linked && combine->linked && precompute.get("").linked;
+	}
+
+	// delete all GL objects; call while the context is still current
+	void clear()
+	{
+		if (!lightPass)
+			return;
+		precompute.clear();
+		glDeleteProgram(lightPass->ID);
+		glDeleteProgram(combine->ID);
+		lightPass.reset();
+		combine.reset();
+		glDeleteFramebuffers(1, &precomputeBuffer);
+		glDeleteFramebuffers(1, &termBuffer);
+		glDeleteTextures(TARGET_COUNT, targets);
+		glDeleteTextures(1, &terms);
+		glDeleteTextures(BUFFER_COUNT, bufferTextures);
+		glDeleteBuffers(BUFFER_COUNT, buffers);
+		glDeleteVertexArrays(1, &quadVAO);
+		glDeleteBuffers(1, &quadVBO);
+	}
+
+private:
+	enum Target { VIEW_POSITION, VIEW_NORMAL, VISIBILITY, TARGET_COUNT };
+
+	// sampler units follow those of deferred_shading.fs
+	static void setupPrecompute(Shader &shader)
+	{
+		shader.setInt("gNormal", 1);
+		shader.setInt("gMask", 3);
+		shader.setInt("gDepth", 4);
+		shader.setInt("gShadowMask", 5);
+		shader.setInt("gShadowDepth", 6);
+		shader.setInt("gShadowMask1", 7);
+		shader.setInt("gShadowDepth1", 8);
+	}
+	enum Buffer { LIGHT_LIST, TILE_RANGES, TILE_INDICES, BUFFER_COUNT };
+
+	// (re)create the targets for the view size and enough light terms
+	bool allocate()
+	{
+		if (targetWidth != view.width || targetHeight != view.height) {
+			const GLint formats[TARGET_COUNT] = { GL_RGBA32F, GL_RGBA32F, GL_RG8 };
+			const GLenum layouts[TARGET_COUNT] = { GL_RGBA, GL_RGBA, GL_RG };
+			glBindFramebuffer(GL_FRAMEBUFFER, precomputeBuffer);
+			for (int i = 0; i < TARGET_COUNT; i++) {
+				glBindTexture(GL_TEXTURE_2D, targets[i]);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+				glTexImage2D(GL_TEXTURE_2D, 0, formats[i], view.width, view.height, 0, layouts[i], GL_FLOAT, NULL);
+				glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, targets[i], 0);
+			}
+			const GLenum attachments[TARGET_COUNT] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+			glDrawBuffers(TARGET_COUNT, attachments);
+			if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+				std::cout << "ERROR::RELIGHT::FRAMEBUFFER_NOT_COMPLETE" << std::endl;
+				targetWidth = targetHeight = 0;
+				return false;
+			}
+			targetWidth = view.width;
+			targetHeight = view.height;
+			termLayers = 0;
+			precomputeDirty = true;
+		}
+
+		size_t needed = std::max(lights.size(), (size_t)1);
+		if (termLayers < needed) {
+			size_t layers = std::max(needed, termLayers * 2);
+			size_t layerBytes = (size_t)view.width * view.height * 16;
+			if (layers * layerBytes > maxBytes)
+				layers = needed;
+			if (layers * layerBytes > maxBytes) {
+				std::cout << "ERROR::RELIGHT::TOO_MANY_LIGHTS " << lights.size() << std::endl;
+				return false;
+			}
+			glBindTexture(GL_TEXTURE_2D_ARRAY, terms);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA32F, view.width, view.height, (GLsizei)layers, 0, GL_RGBA, GL_FLOAT, NULL);
+			termLayers = layers;
+			termDirty.assign(lights.size(), true);
+		}
+		return true;
+	}
+
+	bool renderPrecompute()
+	{
+		Shader &shader = precompute.get(view.octahedralNormals ? "#define OCTAHEDRAL_NORMALS\n" : "");
+		if (!shader.linked)
+			return false;
+		glBindFramebuffer(GL_FRAMEBUFFER, precomputeBuffer);
+		shader.use();
+		shader.setMat4("uInvVMatrix", view.invVMatrix);
+		shader.setMat4("uInvPMatrix", view.invPMatrix);
+		shader.setMat4("lightSpaceMatrix", view.lightSpaceMatrix);
+		shader.setMat4("lightSpaceMatrix1", view.lightSpaceMatrix1);
+		shader.setVec3("uLightLocation", lights.size() > 0 ? lights[0].position : glm::vec3(0.0f));
+		shader.setVec3("uLightLocation1", lights.size() > 1 ? lights[1].position : glm::vec3(0.0f));
+		shader.setInt("uUseShadow", view.useShadow ? 1 : 0);
+		bindTexture(1, GL_TEXTURE_2D, view.gNormal);
+		bindTexture(3, GL_TEXTURE_2D, view.gMask);
+		bindTexture(4, GL_TEXTURE_2D, view.gDepth);
+		if (view.useShadow) {
+			bindTexture(5, GL_TEXTURE_2D, view.gShadowMask);
+			bindTexture(6, GL_TEXTURE_2D, view.gShadowDepth);
+			glBindSampler(6, view.shadowSampler);
+			bindTexture(7, GL_TEXTURE_2D, view.gShadowMask1);
+			bindTexture(8, GL_TEXTURE_2D, view.gShadowDepth1);
+			glBindSampler(8, view.shadowSampler);
+		}
+		drawQuad();
+		precomputeDirty = false;
+		counts.precomputePasses++;
+		return true;
+	}
+
+	// redraw the dirty light terms, each only over the tiles it reaches
+	void renderTerms()
+	{
+		std::vector<glm::ivec4> bounds(lights.size(), glm::ivec4(INT32_MAX, INT32_MAX, -1, -1));
+		for (unsigned int ty = 0; ty < grid.tilesY; ty++) {
+			for (unsigned int tx = 0; tx < grid.tilesX; tx++) {
+				unsigned int count;
+				const uint32_t* tileLights = grid.tileLights(tx * grid.tileSize, ty * grid.tileSize, count);
+				for (unsigned int k = 0; k < count; k++) {
+					glm::ivec4 &b = bounds[tileLights[k]];
+					b.x = std::min(b.x, (int)tx);
+					b.y = std::min(b.y, (int)ty);
+					b.z = std::max(b.z, (int)tx);
+					b.w = std::max(b.w, (int)ty);
+				}
+			}
+		}
+
+		glBindFramebuffer(GL_FRAMEBUFFER, termBuffer);
+		glDrawBuffer(GL_COLOR_ATTACHMENT0);
+		lightPass->use();
+		GLint lightLocation = lightPass->location("uLight");
+		bindTexture(0, GL_TEXTURE_2D, targets[VIEW_POSITION]);
+		bindTexture(1, GL_TEXTURE_2D, targets[VIEW_NORMAL]);
+		bindTexture(2, GL_TEXTURE_2D, view.gDiffuseColor);
+		bindTexture(9, GL_TEXTURE_BUFFER, bufferTextures[LIGHT_LIST]);
+		glEnable(GL_SCISSOR_TEST);
+		for (size_t k = 0; k < lights.size(); k++) {
+			// a light no tile keeps is never read
+			if (!termDirty[k] || bounds[k].z < 0)
+				continue;
+			glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, terms, 0, (GLint)k);
+			int x = bounds[k].x * grid.tileSize, y = bounds[k].y * grid.tileSize;
+			glScissor(x, y, (bounds[k].z + 1) * grid.tileSize - x, (bounds[k].w + 1) * grid.tileSize - y);
+			lightPass->setInt(lightLocation, (int)k);
+			drawQuad();
+			termDirty[k] = false;
+			counts.lightPasses++;
+		}
+		glDisable(GL_SCISSOR_TEST);
+	}
+
+	void upload(Buffer buffer, const void* data, size_t bytes)
+	{
+		// orphan the old storage; texture buffers must not be empty
+		glBindBuffer(GL_TEXTURE_BUFFER, buffers[buffer]);
+		glBufferData(GL_TEXTURE_BUFFER, std::max(bytes, (size_t)16), NULL, GL_STREAM_DRAW);
+		if (bytes > 0)
+			glBufferSubData(GL_TEXTURE_BUFFER, 0, bytes, data);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	}
+
+	static void bindTexture(unsigned int unit, GLenum type, unsigned int texture)
+	{
+		glActiveTexture(GL_TEXTURE0 + unit);
+		glBindTexture(type, texture);
+	}
+
+	// a fullscreen quad like DeferredRenderer::drawQuad()
+	void drawQuad()
+	{
+		if (quadVAO == 0) {
+			float quadVertices[] = {
+				// positions        // texture Coords
+				-1.0f,  1.0f, 0.0f, 0.0f, 1.0f,
+				-1.0f, -1.0f, 0.0f, 0.0f, 0.0f,
+				 1.0f,  1.0f, 0.0f, 1.0f, 1.0f,
+				 1.0f, -1.0f, 0.0f, 1.0f, 0.0f,
+			};
+			glGenVertexArrays(1, &quadVAO);
+			glGenBuffers(1, &quadVBO);
+			glBindVertexArray(quadVAO);
+			glBindBuffer(GL_ARRAY_BUFFER, quadVBO);
+			glBufferData(GL_ARRAY_BUFFER, sizeof(quadVertices), &quadVertices, GL_STATIC_DRAW);
+			glEnableVertexAttribArray(0);
+			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
+			glEnableVertexAttribArray(1);
+			glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
+		}
+		glBindVertexArray(quadVAO);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		glBindVertexArray(0);
+	}
+
+	ShaderVariants precompute;
+	std::unique_ptr<Shader> lightPass, combine;
+	bool cull;
+	size_t maxBytes;
+
+	RelightView view;
+	std::vector<PointLight> lights;
+	unsigned int shadowCasters = 0;
+	glm::vec3 ambientColor = glm::vec3(0.0f);
+	LightGrid grid;
+
+	bool precomputeDirty = true, gridDirty = true;
+	std::vector<bool> termDirty;
+
+	unsigned int precomputeBuffer = 0, termBuffer = 0;
+	unsigned int targets[TARGET_COUNT];
+	unsigned int terms = 0;
+	unsigned int targetWidth = 0, targetHeight = 0;
+	size_t termLayers = 0;
+	unsigned int buffers[BUFFER_COUNT], bufferTextures[BUFFER_COUNT];
+	unsigned int quadVAO = 0, quadVBO = 0;
+	Stats counts;
+};
+
+#endif
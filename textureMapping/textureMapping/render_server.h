@@ -0,0 +1,399 @@
+#ifndef RENDER_SERVER_H
+#define RENDER_SERVER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <afunix.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef SOCKET SocketHandle;
+const SocketHandle NO_SOCKET = INVALID_SOCKET;
+inline void closeSocket(SocketHandle socket) { closesocket(socket); }
+// Unix domain sockets are reparse points on Windows
+inline bool isSocketFile(const std::string &path)
+{
+	DWORD attributes = GetFileAttributesA(path.c_str());
+	return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_REPARSE_POINT);
+}
+#else
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <csignal>
+typedef int SocketHandle;
+const SocketHandle NO_SOCKET = -1;
+inline void closeSocket(SocketHandle socket) { close(socket); }
+inline bool isSocketFile(const std::string &path)
+{
+	struct stat status;
+	return lstat(path.c_str(), &status) == 0 && S_ISSOCK(status.st_mode);
+}
+#endif
+
+#include "json.h"
+
+// One client of the server. Replies come from the render and writer
+// threads, so sending is serialized; every reply is one JSON line,
+// optionally followed by a binary payload whose size the line gives.
+class ServerConnection
+{
+public:
+	explicit ServerConnection(SocketHandle socket) : socket(socket) {}
+
+	~ServerConnection()
+	{
+		closeSocket(socket);
+	}
+
+	ServerConnection(const ServerConnection&) = delete;
+	ServerConnection& operator=(const ServerConnection&) = delete;
+
+	// send a line and a payload; false once the client is gone
+	// ------------------------------------------------------------------------
+	bool send(const std::string &line, const std::vector<unsigned char>* payload = nullptr)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		std::string text = line + "\n";
+		return sendAll((const char*)text.data(), text.size()) && (!payload || sendAll((const char*)payload->data(), payload->size()));
+	}
+
+	// stop a blocked read, e.g. when the server shuts down
+	void interrupt()
+	{
+#ifdef _WIN32
+		shutdown(socket, SD_RECEIVE);
+#else
+		shutdown(socket, SHUT_RD);
+#endif
+	}
+
+	const SocketHandle socket;
+
+private:
+	bool sendAll(const char* data, size_t size)
+	{
+		while (size > 0) {
+			int sent = ::send(socket, data, (int)std::min<size_t>(size, 1 << 30), 0);
+			if (sent <= 0)
+				return false;
+			data += sent;
+			size -= (size_t)sent;
+		}
+		return true;
+	}
+
+	std::mutex mutex;
+};
+
+// a request line of a client, stamped when it arrived
+struct ServerRequest
+{
+	typedef std::chrono::steady_clock Clock;
+
+	std::shared_ptr<ServerConnection> connection;
+	JsonValue body;
+	std::string id; // the request's "id" as JSON, null if it had none
+	Clock::time_point received, started;
+};
+
+// what a server did so far; latencies in milliseconds from the arrival of
+// a request until its reply
+struct RenderServerStats
+{
+	size_t queueDepth, completed, failed, batches;
+	double meanLatency, maxLatency;
+};
+
+// Render server on a local (Unix domain) socket. Clients send one JSON
+// object per line. Render requests are queued and handed to the render
+// thread in batches by next(); {"command": "stats"} is answered at once
+// with the queue depth and latency figures, {"command": "shutdown"} stops
+// accepting and lets next() return false once the queue is drained.
+// Every reply carries the request's "id".
+class RenderServer
+{
+public:
+	RenderServer() = default;
+
+	~RenderServer()
+	{
+		stop();
+		if (acceptor.joinable())
+			acceptor.join();
+		std::vector<Reader> threads;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			threads.swap(readers);
+		}
+		for (Reader &reader : threads)
+			reader.thread.join();
+		if (listener != NO_SOCKET)
+			closeSocket(listener);
+		if (!path.empty() && isSocketFile(path))
+			remove(path.c_str());
+#ifdef _WIN32
+		WSACleanup();
+#endif
+	}
+
+	RenderServer(const RenderServer&) = delete;
+	RenderServer& operator=(const RenderServer&) = delete;
+
+	// Listen on a socket at path, replacing a stale one, and start accepting.
+	// Anything else at path is left alone and the server does not start.
+	// ------------------------------------------------------------------------
+	bool listen(const std::string &socketPath)
+	{
+#ifdef _WIN32
+		WSADATA data;
+		WSAStartup(MAKEWORD(2, 2), &data);
+#else
+		// a client that hangs up must not kill the server mid-reply
+		signal(SIGPIPE, SIG_IGN);
+#endif
+		sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if (socketPath.size() >= sizeof(address.sun_path)) {
+			std::cout << "ERROR::SERVER::SOCKET_PATH_TOO_LONG " << socketPath << std::endl;
+			return false;
+		}
+		strcpy(address.sun_path, socketPath.c_str());
+		if (isSocketFile(socketPath))
+			remove(socketPath.c_str());
+		listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listener == NO_SOCKET || bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || ::listen(listener, 16) != 0) {
+			std::cout << "ERROR::SERVER::CANNOT_LISTEN " << socketPath << std::endl;
+			return false;
+		}
+		path = socketPath;
+		acceptor = std::thread(&RenderServer::acceptLoop, this);
+		return true;
+	}
+
+	// Wait for render requests and take up to max of them; false once the
+	// server is stopped and nothing is left.
+	// ------------------------------------------------------------------------
+	bool next(std::vector<ServerRequest> &batch, size_t max)
+	{
+		batch.clear();
+		std::unique_lock<std::mutex> lock(mutex);
+		arrived.wait(lock, [this] { return stopping || !queue.empty(); });
+		ServerRequest::Clock::time_point now = ServerRequest::Clock::now();
+		while (!queue.empty() && batch.size() < std::max<size_t>(max, 1)) {
+			batch.push_back(std::move(queue.front()));
+			queue.pop_front();
+			batch.back().started = now;
+		}
+		if (!batch.empty())
+			batches++;
+		return !batch.empty();
+	}
+
+	// Answer a render request: fields are extra JSON members (without braces)
+	// and payload the image bytes, if it is returned inline. Adds the
+	// request's latency: queued until its batch started, total until now.
+	// ------------------------------------------------------------------------
+	void reply(const ServerRequest &request, bool ok, const std::string &fields, const std::vector<unsigned char>* payload = nullptr)
+	{
+		ServerRequest::Clock::time_point now = ServerRequest::Clock::now();
+		double queued = std::chrono::duration<double, std::milli>(request.started - request.received).count();
+		double latency = std::chrono::duration<double, std::milli>(now - request.received).count();
+		size_t depth;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			(ok ? completed : failed)++;
+			totalLatency += latency;
+			maxLatency = std::max(maxLatency, latency);
+			depth = queue.size();
+		}
+		std::ostringstream line;
+		line << "{\"id\":" << request.id << ",\"ok\":" << (ok ? "true" : "false");
+		if (!fields.empty())
+			line << "," << fields;
+		line << ",\"bytes\":" << (payload ? payload->size() : 0) << ",\"queue_ms\":" << queued << ",\"latency_ms\":" << latency
+			<< ",\"queue_depth\":" << depth << "}";
+		request.connection->send(line.str(), payload);
+	}
+
+	// the error reply to a request that cannot be rendered
+	void fail(const ServerRequest &request, const std::string &error)
+	{
+		reply(request, false, "\"error\":" + jsonQuote(error));
+	}
+
+	// stop accepting clients and requests; queued ones are still handed out
+	void stop()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (stopping)
+			return;
+		stopping = true;
+		if (listener != NO_SOCKET) {
+#ifdef _WIN32
+			shutdown(listener, SD_BOTH);
+#else
+			shutdown(listener, SHUT_RDWR);
+#endif
+		}
+		for (const std::weak_ptr<ServerConnection> &client : clients) {
+			if (std::shared_ptr<ServerConnection> connection = client.lock())
+				connection->interrupt();
+		}
+		arrived.notify_all();
+	}
+
+	RenderServerStats stats()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		size_t answered = completed + failed;
+		return RenderServerStats{ queue.size(), completed, failed, batches, answered ? totalLatency / answered : 0.0, maxLatency };
+	}
+
+private:
+	// the thread reading a client, done once the client hung up
+	struct Reader
+	{
+		std::thread thread;
+		std::shared_ptr<std::atomic<bool> > done;
+	};
+
+	void acceptLoop()
+	{
+		for (;;) {
+			SocketHandle client = accept(listener, nullptr, nullptr);
+			std::lock_guard<std::mutex> lock(mutex);
+			if (client == NO_SOCKET || stopping) {
+				if (client != NO_SOCKET)
+					closeSocket(client);
+				return;
+			}
+			std::shared_ptr<ServerConnection> connection = std::make_shared<ServerConnection>(client);
+			clients.erase(std::remove_if(clients.begin(), clients.end(),
+				[](const std::weak_ptr<ServerConnection> &c) { return c.expired(); }), clients.end());
+			clients.push_back(connection);
+
+			// join the readers of clients that left, so a server whose clients
+			// connect for every job does not collect their threads
+			for (size_t i = 0; i < readers.size();) {
+				if (readers[i].done->load()) {
+					readers[i].thread.join();
+					readers[i] = std::move(readers.back());
+					readers.pop_back();
+				}
+				else
+					i++;
+			}
+			Reader reader;
+			reader.done = std::make_shared<std::atomic<bool> >(false);
+			std::shared_ptr<std::atomic<bool> > done = reader.done;
+			reader.thread = std::thread([this, connection, done] {
+				readLoop(connection);
+				done->store(true);
+			});
+			readers.push_back(std::move(reader));
+		}
+	}
+
+	// split what a client sends into lines and handle each
+	void readLoop(std::shared_ptr<ServerConnection> connection)
+	{
+		std::string pending;
+		char buffer[4096];
+		for (;;) {
+			int received = recv(connection->socket, buffer, sizeof(buffer), 0);
+			if (received <= 0)
+				return;
+			pending.append(buffer, (size_t)received);
+			size_t end;
+			while ((end = pending.find('\n')) != std::string::npos) {
+				std::string line = pending.substr(0, end);
+				pending.erase(0, end + 1);
+				if (line.find_first_not_of(" \t\r") != std::string::npos)
+					handle(connection, line);
+			}
+		}
+	}
+
+	void handle(const std::shared_ptr<ServerConnection> &connection, const std::string &line)
+	{
+		ServerRequest request;
+		request.connection = connection;
+		request.received = request.started = ServerRequest::Clock::now();
+		request.id = "null";
+		if (!JsonParser(line).parse(request.body) || request.body.type != JsonValue::JSON_OBJECT) {
+			connection->send("{\"id\":null,\"ok\":false,\"error\":\"ERROR::SERVER::INVALID_REQUEST\"}");
+			return;
+		}
+		if (const JsonValue* id = request.body.find("id"))
+			request.id = id->type == JsonValue::JSON_STRING ? jsonQuote(id->text) : (id->type == JsonValue::JSON_NUMBER ? formatNumber(id->number) : "null");
+
+		std::string command = request.body.stringOr("command", "render");
+		std::unique_lock<std::mutex> lock(mutex);
+		if (command == "stats") {
+			lock.unlock();
+			RenderServerStats figures = stats();
+			std::ostringstream reply;
+			reply << "{\"id\":" << request.id << ",\"ok\":true,\"queue_depth\":" << figures.queueDepth << ",\"completed\":" << figures.completed
+				<< ",\"failed\":" << figures.failed << ",\"batches\":" << figures.batches << ",\"mean_latency_ms\":" << figures.meanLatency
+				<< ",\"max_latency_ms\":" << figures.maxLatency << "}";
+			connection->send(reply.str());
+		}
+		else if (command == "shutdown") {
+			lock.unlock();
+			connection->send("{\"id\":" + request.id + ",\"ok\":true}");
+			stop();
+		}
+		else if (command != "render" || stopping) {
+			lock.unlock();
+			connection->send("{\"id\":" + request.id + ",\"ok\":false,\"error\":\"" + (stopping ? "ERROR::SERVER::STOPPING" : "ERROR::SERVER::UNKNOWN_COMMAND") + "\"}");
+		}
+		else {
+			queue.push_back(std::move(request));
+			lock.unlock();
+			arrived.notify_one();
+		}
+	}
+
+	static std::string formatNumber(double number)
+	{
+		std::ostringstream out;
+		out.precision(17);
+		out << number;
+		return out.str();
+	}
+
+	std::string path;
+	SocketHandle listener = NO_SOCKET;
+	std::thread acceptor;
+	std::vector<Reader> readers;
+	std::vector<std::weak_ptr<ServerConnection> > clients;
+
+	std::mutex mutex;
+	std::condition_variable arrived;
+	std::deque<ServerRequest> queue;
+	bool stopping = false;
+	size_t completed = 0, failed = 0, batches = 0;
+	double totalLatency = 0.0, maxLatency = 0.0;
+};
+
+#endif
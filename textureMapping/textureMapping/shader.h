@@ -8,14 +8,24 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <vector>
+#include <unordered_map>
+
+#include "program_cache.h"
 
 class Shader
 {
 public:
 	unsigned int ID;
-	// constructor generates the shader on the fly
+	// false if a source could not be read or the program did not compile
+	// or link; such a program draws nothing
+	bool linked = false;
+	// constructor generates the shader on the fly, or takes the linked
+	// program from cache when it holds one for the same sources and driver.
+	// defines (e.g. "#define USE_SHADOW true\n") are inserted into every
+	// stage right after its #version line.
 	// ------------------------------------------------------------------------
-	Shader(const char* vertexPath, const char* fragmentPath, const char* geometryPath = nullptr)
+	Shader(const char* vertexPath, const char* fragmentPath, const char* geometryPath = nullptr, ProgramBinaryCache* cache = nullptr, const std::string &defines = "")
 	{
 		// 1. retrieve the vertex/fragment source code from filePath
 		std::string vertexCode;
@@ -28,6 +38,7 @@ public:
 		vShaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
 		fShaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
 		gShaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+		bool read = true;
 		try
 		{
 			// open files
@@ -56,6 +67,23 @@ public:
 		catch (std::ifstream::failure e)
 		{
 			std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ" << std::endl;
+			read = false;
+		}
+		vertexCode = insertDefines(vertexCode, defines);
+		fragmentCode = insertDefines(fragmentCode, defines);
+		if (geometryPath != nullptr)
+			geometryCode = insertDefines(geometryCode, defines);
+		std::string key;
+		if (cache != nullptr)
+		{
+			key = cache->key({ vertexCode, fragmentCode, geometryCode });
+			ID = cache->load(key);
+			if (ID != 0)
+			{
+				linked = true;
+				cacheUniformLocations();
+				return;
+			}
 		}
 		const char* vShaderCode = vertexCode.c_str();
 		const char * fShaderCode = fragmentCode.c_str();
@@ -83,12 +111,17 @@ public:
 		}
 		// shader Program
 		ID = glCreateProgram();
+		if (cache != nullptr)
+			cache->prepare(ID);
 		glAttachShader(ID, vertex);
 		glAttachShader(ID, fragment);
 		if (geometryPath != nullptr)
 			glAttachShader(ID, geometry);
 		glLinkProgram(ID);
-		checkCompileErrors(ID, "PROGRAM");
+		linked = checkCompileErrors(ID, "PROGRAM") && read;
+		if (linked && cache != nullptr)
+			cache->store(key, ID);
+		cacheUniformLocations();
 		// delete the shaders as they're linked into our program now and no longer necessery
 		glDeleteShader(vertex);
 		glDeleteShader(fragment);
@@ -102,69 +135,166 @@ public:
 	{
 		glUseProgram(ID);
 	}
-	// utility uniform functions
+	// location of a uniform, resolved once at link time; -1 if the program
+	// has no such active uniform, which the setters silently ignore like GL
+	// ------------------------------------------------------------------------
+	GLint location(const std::string &name) const
+	{
+		auto it = locations.find(name);
+		return it != locations.end() ? it->second : -1;
+	}
+	// attach a uniform block to a buffer binding point; false if the program
+	// has no such block
+	// ------------------------------------------------------------------------
+	bool bindUniformBlock(const char* name, GLuint binding) const
+	{
+		GLuint index = glGetUniformBlockIndex(ID, name);
+		if (index == GL_INVALID_INDEX)
+			return false;
+		glUniformBlockBinding(ID, index, binding);
+		return true;
+	}
+	// utility uniform functions; per-frame code should keep the location()
+	// of its uniforms and use the overloads taking it
 	// ------------------------------------------------------------------------
 	void setBool(const std::string &name, bool value) const
 	{
-		glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value);
+		setBool(location(name), value);
+	}
+	void setBool(GLint location, bool value) const
+	{
+		glUniform1i(location, (int)value);
 	}
 	// ------------------------------------------------------------------------
 	void setInt(const std::string &name, int value) const
 	{
-		glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+		setInt(location(name), value);
+	}
+	void setInt(GLint location, int value) const
+	{
+		glUniform1i(location, value);
 	}
 	// ------------------------------------------------------------------------
 	void setFloat(const std::string &name, float value) const
 	{
-		glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+		setFloat(location(name), value);
+	}
+	void setFloat(GLint location, float value) const
+	{
+		glUniform1f(location, value);
 	}
 	// ------------------------------------------------------------------------
 	void setVec2(const std::string &name, const glm::vec2 &value) const
 	{
-		glUniform2fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+		glUniform2fv(location(name), 1, &value[0]);
 	}
 	void setVec2(const std::string &name, float x, float y) const
 	{
-		glUniform2f(glGetUniformLocation(ID, name.c_str()), x, y);
+		glUniform2f(location(name), x, y);
+	}
+	void setVec2(GLint location, const glm::vec2 &value) const
+	{
+		glUniform2fv(location, 1, &value[0]);
 	}
 	// ------------------------------------------------------------------------
 	void setVec3(const std::string &name, const glm::vec3 &value) const
 	{
-		glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+		glUniform3fv(location(name), 1, &value[0]);
 	}
 	void setVec3(const std::string &name, float x, float y, float z) const
 	{
-		glUniform3f(glGetUniformLocation(ID, name.c_str()), x, y, z);
+		glUniform3f(location(name), x, y, z);
+	}
+	void setVec3(GLint location, const glm::vec3 &value) const
+	{
+		glUniform3fv(location, 1, &value[0]);
 	}
 	// ------------------------------------------------------------------------
 	void setVec4(const std::string &name, const glm::vec4 &value) const
 	{
-		glUniform4fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+		glUniform4fv(location(name), 1, &value[0]);
 	}
 	void setVec4(const std::string &name, float x, float y, float z, float w)
 	{
-		glUniform4f(glGetUniformLocation(ID, name.c_str()), x, y, z, w);
+		glUniform4f(location(name), x, y, z, w);
+	}
+	void setVec4(GLint location, const glm::vec4 &value) const
+	{
+		glUniform4fv(location, 1, &value[0]);
 	}
 	// ------------------------------------------------------------------------
 	void setMat2(const std::string &name, const glm::mat2 &mat) const
 	{
-		glUniformMatrix2fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+		glUniformMatrix2fv(location(name), 1, GL_FALSE, &mat[0][0]);
 	}
 	// ------------------------------------------------------------------------
 	void setMat3(const std::string &name, const glm::mat3 &mat) const
 	{
-		glUniformMatrix3fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+		glUniformMatrix3fv(location(name), 1, GL_FALSE, &mat[0][0]);
 	}
 	// ------------------------------------------------------------------------
 	void setMat4(const std::string &name, const glm::mat4 &mat) const
 	{
-		glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+		setMat4(location(name), mat);
+	}
+	void setMat4(GLint location, const glm::mat4 &mat) const
+	{
+		glUniformMatrix4fv(location, 1, GL_FALSE, &mat[0][0]);
 	}
 
 private:
+	std::unordered_map<std::string, GLint> locations;
+
+	// #version has to stay the first statement, so defines go after its line
+	// ------------------------------------------------------------------------
+	static std::string insertDefines(const std::string &source, const std::string &defines)
+	{
+		if (defines.empty())
+			return source;
+		size_t start = source.find_first_not_of(" \t\r\n");
+		size_t position = 0;
+		if (start != std::string::npos && source[start] == '#' && source.find("version", start) < source.find('\n', start))
+			position = source.find('\n', start) + 1;
+		return source.substr(0, position) + defines + source.substr(position);
+	}
+
+	// look up the location of every active uniform outside a block; arrays
+	// are listed as name[0], which is also stored under the bare name, and
+	// each further element gets its own name[i]
+	// ------------------------------------------------------------------------
+	void cacheUniformLocations()
+	{
+		GLint count = 0, maxLength = 0;
+		glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &count);
+		glGetProgramiv(ID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+		std::vector<GLchar> name(maxLength > 0 ? maxLength : 1);
+		for (GLint i = 0; i < count; i++)
+		{
+			GLsizei length = 0;
+			GLint size;
+			GLenum type;
+			glGetActiveUniform(ID, i, (GLsizei)name.size(), &length, &size, &type, name.data());
+			std::string uniform(name.data(), length);
+			GLint location = glGetUniformLocation(ID, uniform.c_str());
+			if (location < 0)
+				continue;
+			locations[uniform] = location;
+			if (uniform.size() < 3 || uniform.compare(uniform.size() - 3, 3, "[0]") != 0)
+				continue;
+			std::string base = uniform.substr(0, uniform.size() - 3);
+			locations[base] = location;
+			for (GLint element = 1; element < size; element++) {
+				std::string elementName = base + "[" + std::to_string(element) + "]";
+				GLint elementLocation = glGetUniformLocation(ID, elementName.c_str());
+				if (elementLocation >= 0)
+					locations[elementName] = elementLocation;
+			}
+		}
+	}
+
 	// utility function for checking shader compilation/linking errors.
 	// ------------------------------------------------------------------------
-	void checkCompileErrors(GLuint shader, std::string type)
+	bool checkCompileErrors(GLuint shader, std::string type)
 	{
 		GLint success;
 		GLchar infoLog[1024];
@@ -186,6 +316,7 @@ private:
 				std::cout << "ERROR::PROGRAM_LINKING_ERROR of type: " << type << "\n" << infoLog << "\n -- --------------------------------------------------- -- " << std::endl;
 			}
 		}
+		return success != 0;
 	}
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,64 @@
+#ifndef SHADER_VARIANTS_H
+#define SHADER_VARIANTS_H
+
+#include <string>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+
+#include "shader.h"
+
+// Permutations of one vertex/fragment pair, each compiled with its own set
+// of #defines on first use and kept by that set. setup runs once on every
+// new program, e.g. to assign sampler units.
+class ShaderVariants
+{
+public:
+	typedef std::function<void(Shader&)> Setup;
+
+	ShaderVariants(const std::string &vertexPath, const std::string &fragmentPath, ProgramBinaryCache* cache = nullptr, const Setup &setup = nullptr)
+		: vertexPath(vertexPath), fragmentPath(fragmentPath), cache(cache), setup(setup) {}
+
+	ShaderVariants(const ShaderVariants&) = delete;
+	ShaderVariants& operator=(const ShaderVariants&) = delete;
+
+	~ShaderVariants()
+	{
+		clear();
+	}
+
+	// the program built with defines; an empty string gives the plain sources.
+	// Callers check its linked: a permutation that failed is kept as it is,
+	// so it is reported once and not built again.
+	// ------------------------------------------------------------------------
+	Shader &get(const std::string &defines)
+	{
+		auto it = variants.find(defines);
+		if (it != variants.end())
+			return *it->second;
+		std::unique_ptr<Shader> shader(new Shader(vertexPath.c_str(), fragmentPath.c_str(), nullptr, cache, defines));
+		if (setup && shader->linked) {
+			shader->use();
+			setup(*shader);
+		}
+		return *(variants[defines] = std::move(shader));
+	}
+
+	size_t size() const { return variants.size(); }
+
+	// delete all programs; call while the context is still current
+	void clear()
+	{
+		for (auto &variant : variants)
+			glDeleteProgram(variant.second->ID);
+		variants.clear();
+	}
+
+private:
+	std::string vertexPath, fragmentPath;
+	ProgramBinaryCache* cache;
+	Setup setup;
+	std::unordered_map<std::string, std::unique_ptr<Shader> > variants;
+};
+
+#endif
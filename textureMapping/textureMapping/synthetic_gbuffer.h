@@ -0,0 +1,333 @@
+#ifndef SYNTHETIC_GBUFFER_H
+#define SYNTHETIC_GBUFFER_H
+
+#define _USE_MATH_DEFINES
+#include <cmath>
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <iostream>
+#include <algorithm>
+#include <cstdint>
+
+#include <GL/glm/glm.hpp>
+#include <GL/glm/gtc/matrix_transform.hpp>
+
+#include "hdf5.h"
+#include "camera.h"
+#include "hdf5_chunks.h"
+#include "thread_pool.h"
+
+// what a synthetic view shows
+enum SyntheticScene { SYNTHETIC_SPHERES, SYNTHETIC_ISOSURFACE };
+
+inline bool parseSyntheticScene(const std::string &name, SyntheticScene &scene)
+{
+	if (name == "spheres") scene = SYNTHETIC_SPHERES;
+	else if (name == "isosurface") scene = SYNTHETIC_ISOSURFACE;
+	else return false;
+	return true;
+}
+
+inline const char* syntheticSceneName(SyntheticScene scene)
+{
+	return scene == SYNTHETIC_SPHERES ? "spheres" : "isosurface";
+}
+
+// A synthetic view: a field of spheres or a single isosurface displaced by
+// value noise, seen from the angles of an MPAS view. The scene is scaled
+// until about coverage of the pixels see it, as far as it fits between the
+// near and far planes.
+struct SyntheticOptions
+{
+	SyntheticScene scene = SYNTHETIC_SPHERES;
+	unsigned int size = 1024; // width and height
+	float coverage = 0.3f;
+	unsigned int spheres = 64;
+	float roughness = 0.15f; // displacement of the isosurface, relative to its radius
+	unsigned int seed = 1;
+	float theta = 90.0f, phi = 90.0f; // degrees
+};
+
+// the channels of a synthetic view in the layout of the MPAS files: world
+// space positions, view space normals, window depth and a 0/1 mask, rows
+// bottom-up
+struct SyntheticGBuffer
+{
+	unsigned int width = 0, height = 0;
+	std::vector<float> position, normal, depth, mask;
+	float coverage = 0.0f; // fraction of pixels with mask 1
+};
+
+struct SyntheticSphere
+{
+	glm::vec3 center;
+	float radius;
+};
+
+// a random number in [0, 1) from a hashed integer, the same on every
+// platform unlike the standard distributions
+// ------------------------------------------------------------------------
+inline float syntheticHash(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+	return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+// value noise in [-1, 1] with two octaves
+// ------------------------------------------------------------------------
+inline float syntheticNoise(const glm::vec3 &p, uint32_t seed)
+{
+	float sum = 0.0f, amplitude = 0.65f, frequency = 3.0f;
+	for (int octave = 0; octave < 2; octave++) {
+		glm::vec3 q = p * frequency;
+		glm::vec3 cell(std::floor(q.x), std::floor(q.y), std::floor(q.z));
+		glm::vec3 f = q - cell;
+		f = f * f * (3.0f - 2.0f * f);
+		int x = (int)cell.x, y = (int)cell.y, z = (int)cell.z;
+		float corners[8];
+		for (int k = 0; k < 8; k++) {
+			uint32_t h = seed * 0x9e3779b9U + octave * 0x632be5abU;
+			h ^= (uint32_t)(x + (k & 1)) * 0x8da6b343U;
+			h ^= (uint32_t)(y + ((k >> 1) & 1)) * 0xd8163841U;
+			h ^= (uint32_t)(z + (k >> 2)) * 0xcb1ab31fU;
+			corners[k] = syntheticHash(h) * 2.0f - 1.0f;
+		}
+		float x0 = corners[0] + (corners[1] - corners[0]) * f.x, x1 = corners[2] + (corners[3] - corners[2]) * f.x;
+		float x2 = corners[4] + (corners[5] - corners[4]) * f.x, x3 = corners[6] + (corners[7] - corners[6]) * f.x;
+		float y0 = x0 + (x1 - x0) * f.y, y1 = x2 + (x3 - x2) * f.y;
+		sum += amplitude * (y0 + (y1 - y0) * f.z);
+		amplitude *= 0.5f;
+		frequency *= 2.1f;
+	}
+	return std::max(-1.0f, std::min(1.0f, sum / 0.975f));
+}
+
+// Ray caster of a synthetic scene at a given scale for one camera. Rays run
+// from the near plane (t = 0) to the far plane (t = 1) through the centers
+// of the pixels.
+class SyntheticRaycaster
+{
+public:
+	SyntheticRaycaster(const SyntheticOptions &options, unsigned int width, unsigned int height)
+		: options(options), width(width), height(height)
+	{
+		// the MPAS views were rendered with a field of view of 30 degrees;
+		// projectionMatrix() shares their depth range, not their extent
+		camera.orbit((float)(options.theta * M_PI / 180), (float)(options.phi * M_PI / 180), width, height);
+		glm::mat4 projection = glm::perspective((float)(30.0 * M_PI / 180), (float)width / (float)height, 1.79f, 2.81f);
+		viewProjection = projection * camera.mvMatrix;
+		viewRotation = glm::mat3(camera.view);
+		inverse = glm::inverse(viewProjection);
+
+		// sphere centers within 0.7 of the origin, radii 0.1 to 0.3, so the
+		// unscaled scene fits in the unit sphere
+		for (uint32_t i = 0; options.scene == SYNTHETIC_SPHERES && spheres.size() < options.spheres; i++) {
+			uint32_t h = options.seed * 0x9e3779b9U + i * 4;
+			glm::vec3 c(syntheticHash(h) * 2.0f - 1.0f, syntheticHash(h + 1) * 2.0f - 1.0f, syntheticHash(h + 2) * 2.0f - 1.0f);
+			if (glm::dot(c, c) <= 1.0f)
+				spheres.push_back(SyntheticSphere{ c * 0.7f, 0.1f + 0.2f * syntheticHash(h + 3) });
+		}
+	}
+
+	// the largest scale at which the scene stays between the near and far
+	// planes of the camera, 0.5 from the origin
+	float maxScale() const
+	{
+		return options.scene == SYNTHETIC_SPHERES ? 0.5f : 0.5f / (1.0f + options.roughness);
+	}
+
+	// cast the rays of rows [first, last) at scale; what a pixel sees goes
+	// to out, positions and normals only if out has room for them
+	// ------------------------------------------------------------------------
+	void cast(float scale, unsigned int first, unsigned int last, SyntheticGBuffer &out) const
+	{
+		bool full = !out.position.empty();
+		std::vector<SyntheticSphere> scaled;
+		for (const SyntheticSphere &s : spheres)
+			scaled.push_back(SyntheticSphere{ s.center * scale, s.radius * scale });
+		for (unsigned int y = first; y < last; y++) {
+			for (unsigned int x = 0; x < width; x++) {
+				glm::vec2 ndc(((float)x + 0.5f) / width * 2.0f - 1.0f, ((float)y + 0.5f) / height * 2.0f - 1.0f);
+				glm::vec4 nearPoint = inverse * glm::vec4(ndc.x, ndc.y, -1.0f, 1.0f), farPoint = inverse * glm::vec4(ndc.x, ndc.y, 1.0f, 1.0f);
+				glm::vec3 origin = glm::vec3(nearPoint) / nearPoint.w;
+				glm::vec3 direction = glm::vec3(farPoint) / farPoint.w - origin;
+				float t;
+				glm::vec3 normal;
+				bool hit = options.scene == SYNTHETIC_SPHERES ? hitSpheres(scaled, origin, direction, t, normal)
+					: hitIsosurface(scale, origin, direction, t, normal);
+				size_t i = (size_t)y * width + x;
+				out.mask[i] = hit ? 1.0f : 0.0f;
+				if (!hit || !full)
+					continue;
+				glm::vec3 p = origin + direction * t;
+				normal = viewRotation * normal;
+				glm::vec4 clip = viewProjection * glm::vec4(p, 1.0f);
+				out.depth[i] = clip.z / clip.w * 0.5f + 0.5f;
+				for (int k = 0; k < 3; k++) {
+					out.position[3 * i + k] = p[k];
+					out.normal[3 * i + k] = normal[k];
+				}
+			}
+		}
+	}
+
+private:
+	bool hitSpheres(const std::vector<SyntheticSphere> &scaled, const glm::vec3 &origin, const glm::vec3 &direction, float &t, glm::vec3 &normal) const
+	{
+		t = 2.0f;
+		float a = glm::dot(direction, direction);
+		for (const SyntheticSphere &s : scaled) {
+			glm::vec3 oc = origin - s.center;
+			float b = glm::dot(oc, direction), c = glm::dot(oc, oc) - s.radius * s.radius;
+			float discriminant = b * b - a * c;
+			if (discriminant < 0.0f)
+				continue;
+			float hit = (-b - std::sqrt(discriminant)) / a;
+			if (hit >= 0.0f && hit <= 1.0f && hit < t) {
+				t = hit;
+				normal = glm::normalize(oc + direction * hit);
+			}
+		}
+		return t <= 1.0f;
+	}
+
+	// signed distance-like function of the isosurface: negative inside
+	float isosurface(float scale, const glm::vec3 &p) const
+	{
+		float r = glm::length(p);
+		glm::vec3 d = r > 0.0f ? p / r : glm::vec3(0.0f, 0.0f, 1.0f);
+		return r - scale * (1.0f + options.roughness * syntheticNoise(d, options.seed));
+	}
+
+	// march between the spheres bounding the isosurface, then bisect
+	bool hitIsosurface(float scale, const glm::vec3 &origin, const glm::vec3 &direction, float &t, glm::vec3 &normal) const
+	{
+		float outer = scale * (1.0f + options.roughness);
+		float a = glm::dot(direction, direction), b = glm::dot(origin, direction), c = glm::dot(origin, origin) - outer * outer;
+		float discriminant = b * b - a * c;
+		if (discriminant < 0.0f)
+			return false;
+		float t0 = std::max((-b - std::sqrt(discriminant)) / a, 0.0f), t1 = std::min((-b + std::sqrt(discriminant)) / a, 1.0f);
+		const int steps = 48;
+		float previous = t0;
+		for (int i = 1; i <= steps && t0 < t1; i++) {
+			float next = t0 + (t1 - t0) * i / steps;
+			if (isosurface(scale, origin + direction * next) > 0.0f) {
+				previous = next;
+				continue;
+			}
+			float lo = previous, hi = next;
+			for (int k = 0; k < 12; k++) {
+				float mid = 0.5f * (lo + hi);
+				(isosurface(scale, origin + direction * mid) > 0.0f ? lo : hi) = mid;
+			}
+			t = hi;
+			glm::vec3 p = origin + direction * t;
+			float e = 1e-3f * scale;
+			normal = glm::vec3(isosurface(scale, p + glm::vec3(e, 0, 0)) - isosurface(scale, p - glm::vec3(e, 0, 0)),
+				isosurface(scale, p + glm::vec3(0, e, 0)) - isosurface(scale, p - glm::vec3(0, e, 0)),
+				isosurface(scale, p + glm::vec3(0, 0, e)) - isosurface(scale, p - glm::vec3(0, 0, e)));
+			normal = glm::normalize(normal);
+			return true;
+		}
+		return false;
+	}
+
+	SyntheticOptions options;
+	unsigned int width, height;
+	Camera camera;
+	glm::mat4 viewProjection, inverse;
+	glm::mat3 viewRotation;
+	std::vector<SyntheticSphere> spheres;
+};
+
+// Generate a synthetic view. The scale that gives the requested coverage is
+// searched on a 128x128 mask; gbuffer.coverage is what the full resolution
+// reaches.
+// ------------------------------------------------------------------------
+inline void generateSyntheticGBuffer(const SyntheticOptions &options, SyntheticGBuffer &gbuffer, ThreadPool &pool)
+{
+	unsigned int probeSize = std::min(options.size, 128u);
+	SyntheticRaycaster probe(options, probeSize, probeSize);
+	SyntheticGBuffer mask;
+	mask.mask.resize((size_t)probeSize * probeSize);
+	auto coverageAt = [&](float scale) {
+		pool.parallelFor(probeSize, [&](size_t y) { probe.cast(scale, (unsigned int)y, (unsigned int)y + 1, mask); });
+		size_t covered = std::count(mask.mask.begin(), mask.mask.end(), 1.0f);
+		return (float)covered / mask.mask.size();
+	};
+	float lo = 0.0f, hi = probe.maxScale();
+	if (coverageAt(hi) > options.coverage) {
+		for (int i = 0; i < 16; i++) {
+			float mid = 0.5f * (lo + hi);
+			(coverageAt(mid) < options.coverage ? lo : hi) = mid;
+		}
+	}
+
+	gbuffer.width = gbuffer.height = options.size;
+	size_t pixels = (size_t)options.size * options.size;
+	gbuffer.position.assign(3 * pixels, 0.0f);
+	gbuffer.normal.assign(3 * pixels, 0.0f);
+	gbuffer.depth.assign(pixels, 0.0f);
+	gbuffer.mask.assign(pixels, 0.0f);
+	SyntheticRaycaster raycaster(options, options.size, options.size);
+	const unsigned int band = 16;
+	pool.parallelFor((options.size + band - 1) / band, [&](size_t i) {
+		unsigned int first = (unsigned int)i * band;
+		raycaster.cast(hi, first, std::min(first + band, options.size), gbuffer);
+	});
+	gbuffer.coverage = (float)std::count(gbuffer.mask.begin(), gbuffer.mask.end(), 1.0f) / pixels;
+}
+
+// Write a synthetic view as an HDF5 file with the datasets of the MPAS
+// files, contiguous (height, width[, 3]) floats, and its angles as the
+// theta and phi attributes.
+// ------------------------------------------------------------------------
+inline bool writeSyntheticGBuffer(const std::string &path, const SyntheticGBuffer &gbuffer, float theta, float phi)
+{
+	std::lock_guard<std::mutex> lock(hdf5Mutex());
+	hid_t file = H5Fcreate(path.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+	bool ok = file >= 0;
+	struct Channel { const char* name; const std::vector<float> &values; int components; };
+	const Channel channels[] = {
+		{ "position", gbuffer.position, 3 },
+		{ "normal", gbuffer.normal, 3 },
+		{ "depth", gbuffer.depth, 1 },
+		{ "mask", gbuffer.mask, 1 },
+	};
+	for (const Channel &channel : channels) {
+		if (!ok)
+			break;
+		hsize_t dims[3] = { gbuffer.height, gbuffer.width, 3 };
+		hid_t space = H5Screate_simple(channel.components == 3 ? 3 : 2, dims, NULL);
+		hid_t dataset = H5Dcreate2(file, channel.name, H5T_NATIVE_FLOAT, space, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+		ok = dataset >= 0 && H5Dwrite(dataset, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, channel.values.data()) >= 0;
+		if (dataset >= 0)
+			H5Dclose(dataset);
+		H5Sclose(space);
+	}
+	const std::pair<const char*, double> angles[] = { { "theta", theta }, { "phi", phi } };
+	for (const auto &angle : angles) {
+		if (!ok)
+			break;
+		hid_t space = H5Screate(H5S_SCALAR);
+		hid_t attribute = H5Acreate2(file, angle.first, H5T_NATIVE_DOUBLE, space, H5P_DEFAULT, H5P_DEFAULT);
+		ok = attribute >= 0 && H5Awrite(attribute, H5T_NATIVE_DOUBLE, &angle.second) >= 0;
+		if (attribute >= 0)
+			H5Aclose(attribute);
+		H5Sclose(space);
+	}
+	if (file >= 0)
+		ok = H5Fclose(file) >= 0 && ok;
+	if (!ok)
+		std::cout << "ERROR::HDF5::FILE_NOT_SUCCESFULLY_WRITTEN " << path << std::endl;
+	return ok;
+}
+
+#endif
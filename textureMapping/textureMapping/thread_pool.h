@@ -0,0 +1,113 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <vector>
+
+// Fixed set of worker threads running parallel loops. parallelFor() hands
+// out indices through an atomic counter and returns once all are done; the
+// calling thread takes part in the work. Loops started from several
+// threads at once run one after the other.
+class ThreadPool
+{
+public:
+	explicit ThreadPool(unsigned int threads = 0)
+	{
+		if (threads == 0)
+			threads = std::thread::hardware_concurrency();
+		if (threads == 0)
+			threads = 1;
+		for (unsigned int i = 1; i < threads; i++)
+			workers.emplace_back(&ThreadPool::workerLoop, this);
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (std::thread &worker : workers)
+			worker.join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	unsigned int size() const
+	{
+		return (unsigned int)workers.size() + 1;
+	}
+
+	// run body(i) for every i in [0, count)
+	// ------------------------------------------------------------------------
+	void parallelFor(size_t count, const std::function<void(size_t)> &body)
+	{
+		if (count == 0)
+			return;
+		if (workers.empty() || count == 1) {
+			for (size_t i = 0; i < count; i++)
+				body(i);
+			return;
+		}
+		std::lock_guard<std::mutex> turn(callers);
+		std::unique_lock<std::mutex> lock(mutex);
+		task = &body;
+		taskCount = count;
+		next = 0;
+		pending = workers.size();
+		generation++;
+		lock.unlock();
+		wake.notify_all();
+
+		runTasks();
+
+		lock.lock();
+		done.wait(lock, [this] { return pending == 0; });
+		task = nullptr;
+	}
+
+private:
+	void runTasks()
+	{
+		for (size_t i = next++; i < taskCount; i = next++)
+			(*task)(i);
+	}
+
+	void workerLoop()
+	{
+		unsigned long long seen = 0;
+		for (;;) {
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return stopping || generation != seen; });
+			if (stopping)
+				return;
+			seen = generation;
+			lock.unlock();
+
+			runTasks();
+
+			lock.lock();
+			if (--pending == 0)
+				done.notify_one();
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::mutex callers; // held by the thread whose loop runs
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	const std::function<void(size_t)>* task = nullptr;
+	size_t taskCount = 0;
+	std::atomic<size_t> next{ 0 };
+	size_t pending = 0;
+	unsigned long long generation = 0;
+	bool stopping = false;
+};
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef VIEW_METADATA_H
+#define VIEW_METADATA_H
+
+#define _USE_MATH_DEFINES
+#include <cmath>
+
+#include <string>
+#include <mutex>
+#include <iostream>
+#include <exception>
+#include <filesystem>
+
+#include "gbuffer_cache.h"
+
+// What is known about a view besides its datasets: the angles it was
+// rendered from and the iso value and BwsA of its isosurface, NaN if
+// unknown.
+struct ViewMetadata
+{
+	float theta = 0.0f, phi = 0.0f; // radians
+	float isoValue = NAN, BwsA = NAN;
+};
+
+// a view angle given in degrees, in radians; rounded to float first like
+// the angles of file names
+// ------------------------------------------------------------------------
+inline float viewAngle(double degrees)
+{
+	float angle = (float)degrees;
+	return angle * M_PI / 180;
+}
+
+// recover the view angles (radians), iso value and BwsA from a file name
+// of the form MPAS_<step>_<BwsA>_<isoValue>_<theta>_<phi>.h5
+// ------------------------------------------------------------------------
+inline bool parseViewName(const std::string &path, float &theta, float &phi, float &isoValue, float &BwsA)
+{
+	std::string filename_s = std::filesystem::path(path).filename().string();
+	try {
+		int last_dot = filename_s.rfind(".");
+		int last_dash = filename_s.rfind("_");
+		phi = std::stof(filename_s.substr(last_dash + 1, last_dot - last_dash - 1));
+		phi = phi * M_PI / 180;
+		int second_last_dash = filename_s.rfind("_", last_dash - 1);
+		theta = std::stof(filename_s.substr(second_last_dash + 1, last_dash - second_last_dash - 1));
+		theta = theta * M_PI / 180;
+		int third_last_dash = filename_s.rfind("_", second_last_dash - 1);
+		isoValue = std::stof(filename_s.substr(third_last_dash + 1, second_last_dash - third_last_dash - 1));
+		int fourth_last_dash = filename_s.rfind("_", third_last_dash - 1);
+		BwsA = std::stof(filename_s.substr(fourth_last_dash + 1, third_last_dash - fourth_last_dash - 1));
+	}
+	catch (std::exception &) {
+		return false;
+	}
+	return true;
+}
+
+// Read the metadata of a view from the scalar attributes "theta" and "phi"
+// (degrees), and if present "isoValue" and "BwsA", of the root group of an
+// HDF5 file. Files without them, and packed files, fall back to the file
+// name convention of parseViewName().
+// ------------------------------------------------------------------------
+inline bool readViewMetadata(const std::string &path, ViewMetadata &view)
+{
+	double theta = 0.0, phi = 0.0, isoValue = NAN, BwsA = NAN;
+	bool attributes = false;
+	std::error_code ec;
+	if (std::filesystem::is_regular_file(path, ec)) {
+		CachedFile file(path);
+		std::lock_guard<std::mutex> lock(hdf5Mutex());
+		Hdf5Handles &handles = hdf5Handles();
+		attributes = file.attribute(handles, "theta", theta) && file.attribute(handles, "phi", phi);
+		if (attributes) {
+			file.attribute(handles, "isoValue", isoValue);
+			file.attribute(handles, "BwsA", BwsA);
+		}
+	}
+	if (attributes) {
+		view.theta = viewAngle(theta);
+		view.phi = viewAngle(phi);
+		view.isoValue = (float)isoValue;
+		view.BwsA = (float)BwsA;
+		return true;
+	}
+	if (parseViewName(path, view.theta, view.phi, view.isoValue, view.BwsA))
+		return true;
+	std::cout << "ERROR::BATCH::CANNOT_PARSE_VIEW_ANGLES " << path << std::endl;
+	return false;
+}
+
+#endif